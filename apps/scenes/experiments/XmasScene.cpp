@@ -63,8 +63,10 @@ void XmasScene::createTree(int iteration, int boxId, int maxIterations, vec3f ce
                 ((i == 0) ? 0.5f : 2.f) * (rand() % 100 / 100.f - 0.5f));
             const vec3f cosAngles = make_vec3f(cosf(angles.x), cosf(angles.y), cosf(angles.z));
             const vec3f sinAngles = make_vec3f(sinf(angles.x), sinf(angles.y), sinf(angles.z));
-            solr::CPUPrimitive* p = m_gpuKernel->getPrimitive(m_nbPrimitives);
-            m_gpuKernel->rotatePrimitive(*p, a, cosAngles, sinAngles);
+            solr::CPUPrimitive p;
+            m_gpuKernel->getPrimitive(m_nbPrimitives, p);
+            m_gpuKernel->rotatePrimitive(p, a, cosAngles, sinAngles);
+            m_gpuKernel->setPrimitive(m_nbPrimitives, p);
             b.y += interval;
             m_gpuKernel->getPrimitiveOtherCenter(m_nbPrimitives, b);
 
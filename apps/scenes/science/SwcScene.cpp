@@ -77,11 +77,7 @@ void SwcScene::doAnimate()
     const int light = m_gpuKernel->getLight(0);
     if (light != -1)
     {
-        solr::CPUPrimitive *lamp = m_gpuKernel->getPrimitive(light);
-        lamp->p0.x = m.x;
-        lamp->p0.y = m.y;
-        lamp->p0.z = m.z - 50.f;
-        m_gpuKernel->setPrimitiveCenter(light, lamp->p0);
+        m_gpuKernel->setPrimitiveCenter(light, make_vec3f(m.x, m.y, m.z - 50.f));
     }
 
     m_gpuKernel->compactBoxes(false);
@@ -36,6 +36,7 @@
 
 // SolR
 #include <solr/images/jpge.h>
+#include <solr/images/PixelConverter.h>
 
 // Project
 #include <scenes/animation/AnimationScene.h>
@@ -97,6 +98,9 @@ int gTickCount = 0;
 #endif // WIN32
 bool gBenchmarking(false);
 
+// 32 bit frame buffer
+bool gFrameBufferRGBA(false);
+
 // Oculus
 float gDistortion = 0.1f;
 
@@ -247,6 +251,12 @@ void readParameters(const std::vector<std::string> &parameters)
                 gKernel->setDeviceId(atoi(value.c_str()));
             if (key.find("-opencl-kernel") != std::string::npos)
                 gKernel->setKernelFilename(value);
+            if (key.find("-wavefront") != std::string::npos)
+                gKernel->setWavefrontRendering(atoi(value.c_str()) == 1);
+            if (key.find("-asyncReadback") != std::string::npos)
+                gKernel->setAsynchronousReadback(atoi(value.c_str()) == 1);
+            if (key.find("-compressTextures") != std::string::npos)
+                gKernel->setTextureCompression(atoi(value.c_str()) == 1);
 #endif // USE_OPENCL
             if (key.find("-objFile") != std::string::npos)
                 gFilename = value.c_str();
@@ -256,6 +266,10 @@ void readParameters(const std::vector<std::string> &parameters)
                 gWindowHeight = atoi(value.c_str());
             if (key.find("-benchmark") != std::string::npos)
                 gBenchmarking = (atoi(value.c_str()) == 1);
+            if (key.find("-rgbaFrameBuffer") != std::string::npos)
+                gFrameBufferRGBA = (atoi(value.c_str()) == 1);
+            if (key.find("-rgbaTextures") != std::string::npos)
+                gKernel->setRGBATextures(atoi(value.c_str()) == 1);
             if (key.find("-scene") != std::string::npos)
                 gSceneId = atoi(value.c_str());
             if (key.find("-cornellBox") != std::string::npos)
@@ -279,6 +293,10 @@ void initgl(int argc, char **argv)
 #ifdef USE_OPENCL
     caption += " (Powered by OpenCL)";
     glutInitWindowSize(gWindowWidth, gWindowHeight);
+#endif
+#ifdef USE_CPU
+    caption += " (Powered by CPU)";
+    glutInitWindowSize(gWindowWidth, gWindowHeight);
 #endif
     glutCreateWindow(caption.c_str());
     glutDisplayFunc(display);
@@ -396,18 +414,17 @@ void display()
             if (!gSavedToDisk)
             {
                 int margin = 32;
-                size_t size = (si.size.x - margin) * (si.size.y - margin) * gColorDepth;
-                GLubyte *buffer = new GLubyte[size];
-                glReadPixels(0, 0, si.size.x - margin, si.size.y - margin, GL_RGB, GL_UNSIGNED_BYTE, buffer);
-                GLubyte *dst = new GLubyte[size];
-                int X = (si.size.x - margin) * gColorDepth;
-
-                // Vertical flip
-                for (int y(0); y < (si.size.y - margin); ++y)
-                {
-                    int idxSrc = y * X;
-                    memcpy(dst + idxSrc, buffer + (size - idxSrc), X);
-                }
+                const int width = si.size.x - margin;
+                const int height = si.size.y - margin;
+                // RGBA rows are read back without padding
+                GLubyte *buffer = new GLubyte[width * height * gMaxColorDepth];
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+                GLubyte *dst = new GLubyte[width * height * gColorDepth];
+
+                // Vertical flip, to RGB
+                for (int y(0); y < height; ++y)
+                    solr::convertPixels(buffer + (height - 1 - y) * width * gMaxColorDepth, gMaxColorDepth,
+                                        dst + y * width * gColorDepth, gColorDepth, width, false);
 
                 // Save to disc
                 std::string filename("./SolR");
@@ -841,8 +858,7 @@ void keyboard(unsigned char key, int x, int y)
     case 'Y':
     {
         int light = gScene->getKernel()->getLight(gLampId);
-        solr::CPUPrimitive *p = gScene->getKernel()->getPrimitive(light);
-        Material *m = gScene->getKernel()->getMaterial(p->materialId);
+        Material *m = gScene->getKernel()->getMaterial(gScene->getKernel()->getPrimitiveMaterial(light));
         if (m)
         {
             if (key == 'Y')
@@ -936,8 +952,7 @@ void keyboard(unsigned char key, int x, int y)
         if (gControlType == ctLightSource)
         {
             int light = gScene->getKernel()->getLight(gLampId);
-            solr::CPUPrimitive *p = gScene->getKernel()->getPrimitive(light);
-            Material *m = gScene->getKernel()->getMaterial(p->materialId);
+            Material *m = gScene->getKernel()->getMaterial(gScene->getKernel()->getPrimitiveMaterial(light));
             if (m)
             {
                 if (m->innerIllumination.x < 1.f)
@@ -965,8 +980,7 @@ void keyboard(unsigned char key, int x, int y)
         if (gControlType == ctLightSource)
         {
             int light = gScene->getKernel()->getLight(gLampId);
-            solr::CPUPrimitive *p = gScene->getKernel()->getPrimitive(light);
-            Material *m = gScene->getKernel()->getMaterial(p->materialId);
+            Material *m = gScene->getKernel()->getMaterial(gScene->getKernel()->getPrimitiveMaterial(light));
             if (m)
             {
                 if (m->innerIllumination.x > 0.f)
@@ -1062,10 +1076,10 @@ void motion(int x, int y)
             LOG_INFO(3, "Lamp " << gLampId << "[" << light << "] selected");
             if (light != -1)
             {
-                solr::CPUPrimitive *lamp = gKernel->getPrimitive(light);
-                lamp->p0.x -= 20 * (mouse_old_x - x);
-                lamp->p0.z += 20 * (mouse_old_y - y);
-                gKernel->setPrimitiveCenter(light, lamp->p0);
+                vec4f center = gKernel->getPrimitiveCenter(light);
+                center.x -= 20 * (mouse_old_x - x);
+                center.z += 20 * (mouse_old_y - y);
+                gKernel->setPrimitiveCenter(light, make_vec3f(center.x, center.y, center.z));
                 gKernel->compactBoxes(false);
             }
             else
@@ -1116,10 +1130,10 @@ void motion(int x, int y)
             LOG_INFO(3, "Lamp " << gLampId << "[" << light << "] selected");
             if (light != -1)
             {
-                solr::CPUPrimitive *lamp = gKernel->getPrimitive(light);
-                lamp->p0.x -= 20 * (mouse_old_x - x);
-                lamp->p0.y += 20 * (mouse_old_y - y);
-                gKernel->setPrimitiveCenter(light, lamp->p0);
+                vec4f center = gKernel->getPrimitiveCenter(light);
+                center.x -= 20 * (mouse_old_x - x);
+                center.y += 20 * (mouse_old_y - y);
+                gKernel->setPrimitiveCenter(light, make_vec3f(center.x, center.y, center.z));
                 gKernel->compactBoxes(false);
             }
             else
@@ -1170,8 +1184,9 @@ void motion(int x, int y)
         int index = gKernel->getPrimitiveAt(gKernel->getSceneInfo().size.x / 2, gKernel->getSceneInfo().size.y / 2);
         if (index != -1)
         {
-            solr::CPUPrimitive *p = gKernel->getPrimitive(index);
-            gViewDir.z = (p->p0.z + p->p1.z + p->p2.z) / 3.f;
+            solr::CPUPrimitive p;
+            gKernel->getPrimitive(index, p);
+            gViewDir.z = (p.p0.z + p.p1.z + p.p2.z) / 3.f;
         }
         else
             gViewDir.z = gViewPos.z + 8000.f;
@@ -1330,6 +1345,8 @@ void createScene()
     gScene->setCornellBoxType(gCornellBoxType);
     gScene->setCurrentModel(m_counter);
     gScene->initialize(gKernel, gWindowWidth, gWindowHeight);
+    if (gFrameBufferRGBA)
+        gScene->getSceneInfo().frameBufferType = ftRGBA;
     gKernel->setCamera(gViewPos, gViewDir, gViewAngles);
 }
 
@@ -29,6 +29,9 @@
 #define NB_MAX_ITERATIONS 10
 
 const unsigned int BOUNDING_BOXES_TREE_DEPTH = 64;
+const unsigned int QUANTIZED_BVH_DEPTH = 16; // Depth of the frames of reference of quantized boxes
+// Boxes and primitives grow with the scene. These only bound managed CUDA
+// memory, allocated once
 const unsigned int NB_MAX_BOXES = 2500000;
 const unsigned int NB_MAX_PRIMITIVES = 2500000;
 const unsigned int NB_MAX_LAMPS = 512;
@@ -36,9 +39,16 @@ const unsigned int NB_MAX_MATERIALS = 65506 + 30; // Last 30 materials are reser
 const unsigned int NB_MAX_TEXTURES = 512;
 const unsigned int NB_MAX_FRAMES = 512;
 const unsigned int NB_MAX_LIGHTINFORMATIONS = 512;
+// Size of the pool of randoms, indexed modulo MAX_BITMAP_SIZE by the kernels.
+// Frame buffers have the size of the frame
 const unsigned int MAX_BITMAP_WIDTH = 1920;
 const unsigned int MAX_BITMAP_HEIGHT = 1080;
 const unsigned int MAX_BITMAP_SIZE = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT;
+// Device memory budget of the frame buffers of a frame rendered at once by
+// screenshots, a bit more than the ones of a MAX_BITMAP_WIDTH x
+// MAX_BITMAP_HEIGHT frame (see frameBuffersPixelSize). Larger frames are
+// rendered in strips of rows fitting in it
+const unsigned int FRAME_BUFFERS_MEMORY_BUDGET = 128 * 1024 * 1024;
 
 // Constants
 const int MATERIAL_NONE = -1;
@@ -46,6 +56,7 @@ const int TEXTURE_NONE = -1;
 const int TEXTURE_MANDELBROT = -2;
 const int TEXTURE_JULIA = -3;
 const int gColorDepth = 3;
+const int gMaxColorDepth = 4; // 32 bit frame buffers
 
 // Globals
 #define PI 3.14159265358979323846f
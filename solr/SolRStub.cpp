@@ -24,6 +24,7 @@
 #include "Logging.h"
 #include "SolRStub.h"
 #include "engines/GPUKernel.h"
+#include "images/PixelConverter.h"
 #include "io/FileMarshaller.h"
 #include "io/OBJReader.h"
 #include "io/PDBReader.h"
@@ -159,7 +160,7 @@ int SolR_RunKernel(double timer, BitmapBuffer *image)
     solr::SingletonKernel::kernel()->render_begin(static_cast<float>(timer));
     solr::SingletonKernel::kernel()->render_end();
     memcpy(image, solr::SingletonKernel::kernel()->getBitmap(),
-           gSceneInfoStub.size.x * gSceneInfoStub.size.y * gColorDepth);
+           gSceneInfoStub.size.x * gSceneInfoStub.size.y * frameBufferDepth(gSceneInfoStub.frameBufferType));
     return 0;
 }
 
@@ -192,22 +193,22 @@ int SolR_GetPrimitive(int index, double &p0_x, double &p0_y, double &p0_z, doubl
                       int &materialId)
 {
     LOG_INFO(3, "SolR_GetPrimitive");
-    solr::CPUPrimitive *primitive = solr::SingletonKernel::kernel()->getPrimitive(index);
-    if (primitive != NULL)
+    solr::CPUPrimitive primitive;
+    if (solr::SingletonKernel::kernel()->getPrimitive(index, primitive))
     {
-        p0_x = primitive->p0.x;
-        p0_y = primitive->p0.y;
-        p0_z = primitive->p0.z;
-        p1_x = primitive->p1.x;
-        p1_y = primitive->p1.y;
-        p1_z = primitive->p1.z;
-        p2_x = primitive->p2.x;
-        p2_y = primitive->p2.y;
-        p2_z = primitive->p2.z;
-        size_x = primitive->size.x;
-        size_y = primitive->size.y;
-        size_z = primitive->size.z;
-        materialId = primitive->materialId;
+        p0_x = primitive.p0.x;
+        p0_y = primitive.p0.y;
+        p0_z = primitive.p0.z;
+        p1_x = primitive.p1.x;
+        p1_y = primitive.p1.y;
+        p1_z = primitive.p1.z;
+        p2_x = primitive.p2.x;
+        p2_y = primitive.p2.y;
+        p2_z = primitive.p2.z;
+        size_x = primitive.size.x;
+        size_y = primitive.size.y;
+        size_z = primitive.size.z;
+        materialId = primitive.materialId;
         return 0;
     }
     return -1;
@@ -291,6 +292,35 @@ int SolR_SetPrimitiveTextureCoordinates(int index, double t0_x, double t0_y, dou
     return 0;
 }
 
+// --------------------------------------------------------------------------------
+int SolR_AddSpheres(int count, const float *centers, const float *radii, const int *materialIds, int materialId)
+{
+    LOG_INFO(3, "SolR_AddSpheres");
+    if (count <= 0)
+        return -1;
+    return solr::SingletonKernel::kernel()->addSpheres(count, centers, radii, materialIds, materialId);
+}
+
+// --------------------------------------------------------------------------------
+int SolR_AddCylinders(int count, const float *ends, const float *radii, const int *materialIds, int materialId)
+{
+    LOG_INFO(3, "SolR_AddCylinders");
+    if (count <= 0)
+        return -1;
+    return solr::SingletonKernel::kernel()->addCylinders(count, ends, radii, materialIds, materialId);
+}
+
+// --------------------------------------------------------------------------------
+int SolR_AddTriangles(int count, const float *vertices, const float *normals, const float *textureCoordinates,
+                      const int *materialIds, int materialId)
+{
+    LOG_INFO(3, "SolR_AddTriangles");
+    if (count <= 0)
+        return -1;
+    return solr::SingletonKernel::kernel()->addTriangles(count, vertices, normals, textureCoordinates, materialIds,
+                                                         materialId);
+}
+
 // --------------------------------------------------------------------------------
 int SolR_UpdateSkeletons(int index, double p0_x, double p0_y, double p0_z, double size, double radius, int materialId,
                          double head_radius, int head_materialId, double hands_radius, int hands_materialId,
@@ -356,15 +386,10 @@ int SolR_GetTexture(int index, BitmapBuffer *image)
         TextureInfo texInfo;
         memset(&texInfo, 0, sizeof(TextureInfo));
         solr::SingletonKernel::kernel()->getTexture(index, texInfo);
-        if (texInfo.buffer)
+        if (texInfo.buffer && texInfo.compression == tc_none)
         {
-            int len(texInfo.size.x * texInfo.size.y * texInfo.size.z);
-            for (int i(0); i < len; i += texInfo.size.z)
-            {
-                image[i] = texInfo.buffer[i + 2];
-                image[i + 1] = texInfo.buffer[i + 1];
-                image[i + 2] = texInfo.buffer[i];
-            }
+            solr::convertPixels(texInfo.buffer, texInfo.size.z, image, texInfo.size.z, texInfo.size.x * texInfo.size.y,
+                                true);
             // memcpy(image,texInfo.buffer,texInfo.size.x*texInfo.size.y*texInfo.size.z);
         }
         return 0;
@@ -99,6 +99,18 @@ extern "C" SOLR_API int SolR_SetPrimitiveNormals(int index, double n0_x, double
 extern "C" SOLR_API int SolR_SetPrimitiveTextureCoordinates(int index, double t0_x, double t0_y, double t1_x,
                                                             double t1_y, double t2_x, double t2_y);
 
+// Bulk primitives, returning the index of the first added primitive. Arrays
+// are packed as described in GPUKernel::addSpheres, addCylinders and
+// addTriangles, optional arrays can be NULL
+extern "C" SOLR_API int SolR_AddSpheres(int count, const float *centers, const float *radii, const int *materialIds,
+                                        int materialId);
+
+extern "C" SOLR_API int SolR_AddCylinders(int count, const float *ends, const float *radii, const int *materialIds,
+                                          int materialId);
+
+extern "C" SOLR_API int SolR_AddTriangles(int count, const float *vertices, const float *normals,
+                                          const float *textureCoordinates, const int *materialIds, int materialId);
+
 // ---------- Materials ----------
 extern "C" SOLR_API int SolR_AddMaterial();
 extern "C" SOLR_API int SolR_SetMaterial(int index, double color_r, double color_g, double color_b, double gloss,
@@ -0,0 +1,831 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "BVHBuilder.h"
+#include "Logging.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif // _OPENMP
+
+namespace
+{
+const int BVH_MAX_BINS = 64;
+
+// Number of primitives processed by each iteration of the data parallel loops
+const size_t BVH_CHUNK_SIZE = 16384;
+
+// Nodes with less primitives are built as a single task
+const size_t BVH_MIN_SUBTREE_SIZE = 4096;
+
+struct BVHBins
+{
+    size_t counts[3][BVH_MAX_BINS];
+    vec3f bounds[3][BVH_MAX_BINS][2];
+};
+
+inline float component(const vec3f &v, const int axis)
+{
+    return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+inline void resetBounds(vec3f &corner0, vec3f &corner1)
+{
+    const float m = std::numeric_limits<float>::max();
+    corner0 = make_vec3f(m, m, m);
+    corner1 = make_vec3f(-m, -m, -m);
+}
+
+inline void growBounds(vec3f &corner0, vec3f &corner1, const vec3f &p0, const vec3f &p1)
+{
+    corner0.x = std::min(corner0.x, p0.x);
+    corner0.y = std::min(corner0.y, p0.y);
+    corner0.z = std::min(corner0.z, p0.z);
+    corner1.x = std::max(corner1.x, p1.x);
+    corner1.y = std::max(corner1.y, p1.y);
+    corner1.z = std::max(corner1.z, p1.z);
+}
+
+inline int binIndex(const vec3f &center, const int axis, const float origin, const float scale, const int nbBins)
+{
+    return std::min(nbBins - 1, static_cast<int>((component(center, axis) - origin) * scale));
+}
+
+inline int nbChunks(const size_t begin, const size_t end)
+{
+    return static_cast<int>((end - begin + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE);
+}
+
+void resetBins(BVHBins &bins, const int nbBins)
+{
+    for (int axis(0); axis < 3; ++axis)
+        for (int b(0); b < nbBins; ++b)
+        {
+            bins.counts[axis][b] = 0;
+            resetBounds(bins.bounds[axis][b][0], bins.bounds[axis][b][1]);
+        }
+}
+
+// Frame of reference of quantized boxes: lower corner and size of the cells
+// of the grid on which the corners are stored
+struct QuantizationFrame
+{
+    float lower[3];
+    float scale[3];
+};
+
+// Cells are the smallest powers of two covering the range with the levels of
+// the grid. Products of levels and cells are then exact, and corners decode to
+// the same values on the host and on devices that contract them with an FMA.
+// Kernels compute the frames of descendants the same way (see RayTracer.cl)
+float quantizationScale(const float range, const int bits)
+{
+    int exponent;
+    std::frexp(range, &exponent);
+    const float scale = std::ldexp(1.f, exponent - bits);
+    const float levels = static_cast<float>((1 << bits) - 1);
+    return (scale * (levels - 1.f) < range) ? 2.f * scale : scale;
+}
+
+QuantizationFrame quantizationFrame(const float *lower, const float *upper, const int bits)
+{
+    // The grid is one cell larger than the box so that its upper corner is
+    // always covered
+    QuantizationFrame frame;
+    for (int axis(0); axis < 3; ++axis)
+    {
+        frame.lower[axis] = lower[axis];
+        frame.scale[axis] = quantizationScale(upper[axis] - lower[axis], bits);
+    }
+    return frame;
+}
+
+template <typename T>
+bool quantizeCorners(const QuantizationFrame &frame, const float *lower, const float *upper, const int levels,
+                     T *quantizedLower, T *quantizedUpper, float *decodedLower, float *decodedUpper)
+{
+    bool contained = true;
+    for (int axis(0); axis < 3; ++axis)
+    {
+        const float origin = frame.lower[axis];
+        const float scale = frame.scale[axis];
+        int q0 = 0;
+        int q1 = 0;
+        if (scale > 0.f)
+        {
+            const float maxLevel = static_cast<float>(levels);
+            q0 = static_cast<int>(std::max(0.f, std::min(maxLevel, std::floor((lower[axis] - origin) / scale))));
+            q1 = static_cast<int>(std::max(0.f, std::min(maxLevel, std::ceil((upper[axis] - origin) / scale))));
+
+            // Conservative rounding, as seen by the decoder
+            while (q0 > 0 && std::fma(static_cast<float>(q0), scale, origin) > lower[axis])
+                --q0;
+            while (q1 < levels && std::fma(static_cast<float>(q1), scale, origin) < upper[axis])
+                ++q1;
+        }
+        decodedLower[axis] = std::fma(static_cast<float>(q0), scale, origin);
+        decodedUpper[axis] = std::fma(static_cast<float>(q1), scale, origin);
+        contained = contained && decodedLower[axis] <= lower[axis] && decodedUpper[axis] >= upper[axis];
+        quantizedLower[axis] = static_cast<T>(q0);
+        quantizedUpper[axis] = static_cast<T>(q1);
+    }
+    return contained;
+}
+
+// Quantizes a box in the frame of its closest ancestor. Returns false when the
+// decoded corners do not contain the box
+template <typename N, typename T>
+bool quantizeNode(const std::vector<QuantizationFrame> &frames, const BoundingBox &box, const int depth,
+                  const int maxDepth, N &node, float *decodedLower, float *decodedUpper)
+{
+    const int levels = std::numeric_limits<T>::max();
+    const float boxLower[3] = {box.parameters[0].x, box.parameters[0].y, box.parameters[0].z};
+    const float boxUpper[3] = {box.parameters[1].x, box.parameters[1].y, box.parameters[1].z};
+    int reference = std::min(depth, maxDepth);
+    bool contained = quantizeCorners(frames[reference], boxLower, boxUpper, levels, node.lower, node.upper,
+                                     decodedLower, decodedUpper);
+    if (!contained)
+    {
+        // The box overlaps the frame of its ancestor, fall back to the one of the roots
+        reference = 0;
+        contained = quantizeCorners(frames[0], boxLower, boxUpper, levels, node.lower, node.upper, decodedLower,
+                                    decodedUpper);
+    }
+    node.lower[3] = static_cast<T>(reference);
+    node.upper[3] = static_cast<T>(depth < maxDepth ? depth + 1 : levels);
+    return contained;
+}
+
+template <typename N, typename T>
+void quantizeBoxes(const BoundingBox *boxes, const int nbBoxes, const int maxDepth,
+                   std::vector<unsigned char> &buffer)
+{
+    const int bits = std::numeric_limits<T>::digits;
+    const size_t headerSize = 2 * sizeof(vec4f);
+    buffer.resize(headerSize + nbBoxes * sizeof(N));
+
+    // Roots are quantized relative to the bounds of the whole forest
+    vec3f corner0, corner1;
+    resetBounds(corner0, corner1);
+    for (int i(0); i < nbBoxes; ++i)
+        growBounds(corner0, corner1, boxes[i].parameters[0], boxes[i].parameters[1]);
+    if (nbBoxes == 0)
+        corner0 = corner1 = make_vec3f();
+    const float lower[3] = {corner0.x, corner0.y, corner0.z};
+    const float upper[3] = {corner1.x, corner1.y, corner1.z};
+
+    // Frames of reference, by depth. The first one is the one of the roots
+    std::vector<QuantizationFrame> frames(maxDepth + 1);
+    frames[0] = quantizationFrame(lower, upper, bits);
+    vec4f *header = reinterpret_cast<vec4f *>(&buffer[0]);
+    header[0] = make_vec4f(frames[0].lower[0], frames[0].lower[1], frames[0].lower[2]);
+    header[1] = make_vec4f(frames[0].scale[0], frames[0].scale[1], frames[0].scale[2]);
+
+    N *nodes = reinterpret_cast<N *>(&buffer[headerSize]);
+    std::vector<int> parents;
+    int nbUncontained(0);
+    for (int i(0); i < nbBoxes; ++i)
+    {
+        const BoundingBox &box = boxes[i];
+        while (!parents.empty() && parents.back() <= i)
+            parents.pop_back();
+        const int depth = static_cast<int>(parents.size());
+
+        float decodedLower[3];
+        float decodedUpper[3];
+        N &node = nodes[i];
+        if (!quantizeNode<N, T>(frames, box, depth, maxDepth, node, decodedLower, decodedUpper))
+            ++nbUncontained;
+        if (depth < maxDepth)
+            frames[depth + 1] = quantizationFrame(decodedLower, decodedUpper, bits);
+
+        node.nbPrimitives = box.nbPrimitives;
+        node.startIndex = box.startIndex;
+        node.indexForNextBox = box.indexForNextBox;
+        if (box.indexForNextBox.x > 1)
+            parents.push_back(i + box.indexForNextBox.x);
+    }
+    if (nbUncontained != 0)
+        LOG_ERROR(nbUncontained << " boxes could not be quantized conservatively");
+}
+
+template <typename N, typename T>
+bool requantizeBoxes(const BoundingBox *boxes, const int nbBoxes, const int maxDepth, const std::vector<int> &dirty,
+                     std::vector<unsigned char> &buffer, std::vector<int> &modified)
+{
+    const int bits = std::numeric_limits<T>::digits;
+    const size_t headerSize = 2 * sizeof(vec4f);
+    if (buffer.size() != headerSize + nbBoxes * sizeof(N))
+        return false;
+
+    // Frames of reference, by depth, as decoded by the kernels, and whether
+    // they differ from the ones the boxes were quantized in
+    std::vector<QuantizationFrame> frames(maxDepth + 1);
+    std::vector<bool> changed(maxDepth + 1, false);
+    const vec4f *header = reinterpret_cast<const vec4f *>(&buffer[0]);
+    const QuantizationFrame roots = {{header[0].x, header[0].y, header[0].z}, {header[1].x, header[1].y, header[1].z}};
+    frames[0] = roots;
+
+    N *nodes = reinterpret_cast<N *>(&buffer[headerSize]);
+    std::vector<int> parents;
+    std::vector<int>::const_iterator next = dirty.begin();
+    int i(0);
+    while (i < nbBoxes)
+    {
+        const BoundingBox &box = boxes[i];
+        while (!parents.empty() && parents.back() <= i)
+            parents.pop_back();
+        const int depth = static_cast<int>(parents.size());
+        const int size = std::max(1, box.indexForNextBox.x);
+        N &node = nodes[i];
+        const int reference = static_cast<int>(node.lower[3]);
+
+        // Subtrees without refitted boxes, quantized in unchanged frames, are kept as they are
+        next = std::lower_bound(next, dirty.end(), i);
+        if (!changed[reference] && (next == dirty.end() || *next >= i + size))
+        {
+            i += size;
+            continue;
+        }
+
+        const float boxLower[3] = {box.parameters[0].x, box.parameters[0].y, box.parameters[0].z};
+        const float boxUpper[3] = {box.parameters[1].x, box.parameters[1].y, box.parameters[1].z};
+        float decodedLower[3];
+        float decodedUpper[3];
+        bool contained = true;
+        for (int axis(0); axis < 3; ++axis)
+        {
+            const QuantizationFrame &frame = frames[reference];
+            decodedLower[axis] = std::fma(static_cast<float>(node.lower[axis]), frame.scale[axis], frame.lower[axis]);
+            decodedUpper[axis] = std::fma(static_cast<float>(node.upper[axis]), frame.scale[axis], frame.lower[axis]);
+            contained = contained && decodedLower[axis] <= boxLower[axis] && decodedUpper[axis] >= boxUpper[axis];
+        }
+
+        // Boxes still contained by their corners keep them, and so does the
+        // frame they define for their descendants
+        bool frameChanged = false;
+        if (changed[reference] || !contained)
+        {
+            float previousLower[3];
+            float previousUpper[3];
+            std::copy(decodedLower, decodedLower + 3, previousLower);
+            std::copy(decodedUpper, decodedUpper + 3, previousUpper);
+            if (!quantizeNode<N, T>(frames, box, depth, maxDepth, node, decodedLower, decodedUpper))
+                return false;
+            modified.push_back(i);
+            frameChanged = !std::equal(decodedLower, decodedLower + 3, previousLower) ||
+                           !std::equal(decodedUpper, decodedUpper + 3, previousUpper);
+        }
+        if (depth < maxDepth)
+        {
+            frames[depth + 1] = quantizationFrame(decodedLower, decodedUpper, bits);
+            changed[depth + 1] = frameChanged;
+        }
+        if (box.indexForNextBox.x > 1)
+            parents.push_back(i + box.indexForNextBox.x);
+        ++i;
+    }
+    return true;
+}
+
+void binRange(const solr::BVHPrimitive *primitives, const size_t nbPrimitives, const float *origins,
+              const float *scales, const int nbBins, BVHBins &bins)
+{
+    for (size_t i(0); i < nbPrimitives; ++i)
+    {
+        const solr::BVHPrimitive &primitive = primitives[i];
+        for (int axis(0); axis < 3; ++axis)
+        {
+            const int b = binIndex(primitive.center, axis, origins[axis], scales[axis], nbBins);
+            ++bins.counts[axis][b];
+            growBounds(bins.bounds[axis][b][0], bins.bounds[axis][b][1], primitive.parameters[0],
+                       primitive.parameters[1]);
+        }
+    }
+}
+}
+
+namespace solr
+{
+BVHBuilder::BVHBuilder()
+    : m_nbBins(16)
+    , m_maxPrimitivesPerLeaf(8)
+    , m_subtreeSize(BVH_MIN_SUBTREE_SIZE)
+    , m_deterministic(false)
+    , m_traversalCost(1.f)
+    , m_intersectionCost(1.f)
+    , m_rootArea(1.f)
+    , m_expectedCost(0.f)
+    , m_depth(0)
+    , m_buildTime(0.f)
+{
+}
+
+void BVHBuilder::setCosts(const float traversalCost, const float intersectionCost)
+{
+    m_traversalCost = traversalCost;
+    m_intersectionCost = intersectionCost;
+}
+
+float BVHBuilder::surfaceArea(const vec3f &corner0, const vec3f &corner1)
+{
+    const float dx = std::max(0.f, corner1.x - corner0.x);
+    const float dy = std::max(0.f, corner1.y - corner0.y);
+    const float dz = std::max(0.f, corner1.z - corner0.z);
+    return 2.f * (dx * dy + dy * dz + dz * dx);
+}
+
+float BVHBuilder::build(const BVHPrimitives &primitives)
+{
+    LOG_INFO(3, "BVHBuilder::build(" << primitives.size() << ")");
+    const auto start = std::chrono::steady_clock::now();
+    m_primitives = primitives;
+    m_nodes.clear();
+    m_order.clear();
+    m_topNodes.clear();
+    m_subtrees.clear();
+    m_expectedCost = 0.f;
+    m_depth = 0;
+    m_buildTime = 0.f;
+    m_nbBins = std::max(2, std::min(m_nbBins, BVH_MAX_BINS));
+    m_maxPrimitivesPerLeaf = std::max(1, m_maxPrimitivesPerLeaf);
+
+    if (m_primitives.empty())
+        return m_expectedCost;
+
+    vec3f corner0, corner1, center0, center1;
+    computeBounds(0, m_primitives.size(), true, corner0, corner1, center0, center1);
+    m_rootArea = surfaceArea(corner0, corner1);
+    if (m_rootArea <= 0.f)
+        m_rootArea = 1.f;
+
+    // Enough sub-trees are created to keep all threads busy
+    int nbThreads(1);
+#ifdef _OPENMP
+    nbThreads = omp_get_max_threads();
+#endif // _OPENMP
+    m_subtreeSize = (nbThreads == 1) ? m_primitives.size()
+                                     : std::max(BVH_MIN_SUBTREE_SIZE, m_primitives.size() / (8 * nbThreads));
+
+    // The root is always tested
+    m_expectedCost = m_traversalCost;
+    const int root = buildTopNode(0, m_primitives.size(), 0);
+
+    // Largest sub-trees first for a better load balancing. The result does
+    // not depend on the scheduling since every task has its own nodes
+    std::vector<std::pair<size_t, int>> schedule(m_subtrees.size());
+    for (size_t i(0); i < m_subtrees.size(); ++i)
+        schedule[i] = std::make_pair(m_subtrees[i].end - m_subtrees[i].begin, static_cast<int>(i));
+    std::sort(schedule.begin(), schedule.end(),
+              [](const std::pair<size_t, int> &a, const std::pair<size_t, int> &b) {
+                  return a.first > b.first || (a.first == b.first && a.second < b.second);
+              });
+
+    const int nbSubtrees = static_cast<int>(schedule.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < nbSubtrees; ++i)
+    {
+        Subtree &subtree = m_subtrees[schedule[i].second];
+        subtree.maxDepth = subtree.depth;
+        subtree.cost = buildNode(subtree.begin, subtree.end, subtree.depth, subtree.nodes, subtree.maxDepth);
+    }
+
+    for (const auto &subtree : m_subtrees)
+    {
+        m_expectedCost += subtree.cost;
+        m_depth = std::max(m_depth, subtree.maxDepth);
+    }
+
+    // Nodes are stored depth first, which is the order expected by the
+    // stackless traversal of the ray-tracers
+    m_nodes.reserve(2 * m_primitives.size());
+    emitTopNode(root);
+    m_topNodes.clear();
+    m_subtrees.clear();
+
+    const int nbPrimitives = static_cast<int>(m_primitives.size());
+    m_order.resize(m_primitives.size());
+#pragma omp parallel for
+    for (int i = 0; i < nbPrimitives; ++i)
+        m_order[i] = m_primitives[i].index;
+    m_primitives.clear();
+    m_scratch.clear();
+
+    m_buildTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO(3, "BVH: " << m_nodes.size() << " nodes, depth " << m_depth << ", expected cost " << m_expectedCost
+                        << ", built in " << m_buildTime << "ms using " << nbThreads << " threads");
+    return m_expectedCost;
+}
+
+int BVHBuilder::buildTopNode(const size_t begin, const size_t end, const int depth)
+{
+    const int index = static_cast<int>(m_topNodes.size());
+    m_topNodes.push_back(TopNode());
+    m_depth = std::max(m_depth, depth);
+
+    TopNode top;
+    top.left = -1;
+    top.right = -1;
+    top.subtree = -1;
+
+    size_t split(begin);
+    if (end - begin > m_subtreeSize)
+    {
+        vec3f center0, center1;
+        computeBounds(begin, end, true, top.node.parameters[0], top.node.parameters[1], center0, center1);
+        const float area = surfaceArea(top.node.parameters[0], top.node.parameters[1]);
+        split = splitNode(begin, end, center0, center1, area, true);
+        if (split != begin && split != end)
+        {
+            m_expectedCost += 2.f * m_traversalCost * area / m_rootArea;
+            top.node.nbPrimitives = 0;
+            top.node.startIndex = depth;
+            top.node.indexForNextBox = 0;
+            top.left = buildTopNode(begin, split, depth + 1);
+            top.right = buildTopNode(split, end, depth + 1);
+        }
+    }
+
+    if (top.left == -1)
+    {
+        Subtree subtree;
+        subtree.begin = begin;
+        subtree.end = end;
+        subtree.depth = depth;
+        subtree.maxDepth = depth;
+        subtree.cost = 0.f;
+        top.subtree = static_cast<int>(m_subtrees.size());
+        m_subtrees.push_back(subtree);
+    }
+    m_topNodes[index] = top;
+    return index;
+}
+
+void BVHBuilder::emitTopNode(const int index)
+{
+    const TopNode &top = m_topNodes[index];
+    if (top.subtree != -1)
+    {
+        BVHNodes &nodes = m_subtrees[top.subtree].nodes;
+        m_nodes.insert(m_nodes.end(), nodes.begin(), nodes.end());
+        BVHNodes().swap(nodes);
+        return;
+    }
+
+    const size_t nodeIndex = m_nodes.size();
+    m_nodes.push_back(top.node);
+    emitTopNode(top.left);
+    emitTopNode(top.right);
+    m_nodes[nodeIndex].indexForNextBox = static_cast<int>(m_nodes.size() - nodeIndex);
+}
+
+float BVHBuilder::buildNode(const size_t begin, const size_t end, const int depth, BVHNodes &nodes, int &maxDepth)
+{
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back(BVHNode());
+    maxDepth = std::max(maxDepth, depth);
+
+    BVHNode node;
+    vec3f center0, center1;
+    computeBounds(begin, end, false, node.parameters[0], node.parameters[1], center0, center1);
+
+    float cost(0.f);
+    const float area = surfaceArea(node.parameters[0], node.parameters[1]);
+    const size_t split = splitNode(begin, end, center0, center1, area, false);
+    if (split == begin || split == end)
+    {
+        node.nbPrimitives = static_cast<int>(end - begin);
+        node.startIndex = static_cast<int>(begin);
+        node.indexForNextBox = 1;
+        cost = m_intersectionCost * node.nbPrimitives * area / m_rootArea;
+    }
+    else
+    {
+        // Both children are tested when the node is hit
+        cost = 2.f * m_traversalCost * area / m_rootArea;
+        cost += buildNode(begin, split, depth + 1, nodes, maxDepth);
+        cost += buildNode(split, end, depth + 1, nodes, maxDepth);
+        node.nbPrimitives = 0;
+        node.startIndex = depth;
+        node.indexForNextBox = static_cast<int>(nodes.size() - nodeIndex);
+    }
+    nodes[nodeIndex] = node;
+    return cost;
+}
+
+void BVHBuilder::computeBounds(const size_t begin, const size_t end, const bool parallel, vec3f &corner0,
+                               vec3f &corner1, vec3f &center0, vec3f &center1)
+{
+    resetBounds(corner0, corner1);
+    resetBounds(center0, center1);
+    const int chunks = nbChunks(begin, end);
+    if (!parallel || chunks == 1)
+    {
+        for (size_t i(begin); i < end; ++i)
+        {
+            growBounds(corner0, corner1, m_primitives[i].parameters[0], m_primitives[i].parameters[1]);
+            growBounds(center0, center1, m_primitives[i].center, m_primitives[i].center);
+        }
+        return;
+    }
+
+    std::vector<vec3f> bounds(4 * chunks);
+#pragma omp parallel for
+    for (int c = 0; c < chunks; ++c)
+    {
+        vec3f *b = &bounds[4 * c];
+        resetBounds(b[0], b[1]);
+        resetBounds(b[2], b[3]);
+        const size_t first = begin + c * BVH_CHUNK_SIZE;
+        const size_t last = std::min(end, first + BVH_CHUNK_SIZE);
+        for (size_t i(first); i < last; ++i)
+        {
+            growBounds(b[0], b[1], m_primitives[i].parameters[0], m_primitives[i].parameters[1]);
+            growBounds(b[2], b[3], m_primitives[i].center, m_primitives[i].center);
+        }
+    }
+
+    for (int c(0); c < chunks; ++c)
+    {
+        growBounds(corner0, corner1, bounds[4 * c], bounds[4 * c + 1]);
+        growBounds(center0, center1, bounds[4 * c + 2], bounds[4 * c + 3]);
+    }
+}
+
+size_t BVHBuilder::splitNode(const size_t begin, const size_t end, const vec3f &center0, const vec3f &center1,
+                             const float area, const bool parallel)
+{
+    const size_t nbPrimitives = end - begin;
+    if (nbPrimitives <= 1)
+        return end;
+
+    // Bins are distributed over the bounds of the centroids
+    float origins[3];
+    float scales[3];
+    for (int axis(0); axis < 3; ++axis)
+    {
+        origins[axis] = component(center0, axis);
+        const float extent = component(center1, axis) - origins[axis];
+        scales[axis] = (extent > 0.f) ? m_nbBins * (1.f - 1e-5f) / extent : 0.f;
+    }
+
+    BVHBins bins;
+    resetBins(bins, m_nbBins);
+    const int chunks = nbChunks(begin, end);
+    if (!parallel || chunks == 1)
+        binRange(&m_primitives[begin], nbPrimitives, origins, scales, m_nbBins, bins);
+    else
+    {
+        std::vector<BVHBins> chunkBins(chunks);
+#pragma omp parallel for
+        for (int c = 0; c < chunks; ++c)
+        {
+            const size_t first = begin + c * BVH_CHUNK_SIZE;
+            const size_t last = std::min(end, first + BVH_CHUNK_SIZE);
+            resetBins(chunkBins[c], m_nbBins);
+            binRange(&m_primitives[first], last - first, origins, scales, m_nbBins, chunkBins[c]);
+        }
+
+        // Counts and bounds are merged exactly, whatever the order
+        for (int c(0); c < chunks; ++c)
+            for (int axis(0); axis < 3; ++axis)
+                for (int b(0); b < m_nbBins; ++b)
+                {
+                    bins.counts[axis][b] += chunkBins[c].counts[axis][b];
+                    growBounds(bins.bounds[axis][b][0], bins.bounds[axis][b][1], chunkBins[c].bounds[axis][b][0],
+                               chunkBins[c].bounds[axis][b][1]);
+                }
+    }
+
+    const float leafCost = m_intersectionCost * nbPrimitives;
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    int bestBin = 0;
+    for (int axis(0); axis < 3; ++axis)
+    {
+        if (scales[axis] == 0.f)
+            continue;
+
+        // Sweep from the right to get the area and count of every right hand
+        // side, then from the left to evaluate each split plane
+        float rightAreas[BVH_MAX_BINS];
+        size_t rightCounts[BVH_MAX_BINS];
+        vec3f r0, r1;
+        resetBounds(r0, r1);
+        size_t rightCount(0);
+        for (int b(m_nbBins - 1); b > 0; --b)
+        {
+            growBounds(r0, r1, bins.bounds[axis][b][0], bins.bounds[axis][b][1]);
+            rightCount += bins.counts[axis][b];
+            rightAreas[b] = surfaceArea(r0, r1);
+            rightCounts[b] = rightCount;
+        }
+
+        vec3f l0, l1;
+        resetBounds(l0, l1);
+        size_t leftCount(0);
+        for (int b(0); b < m_nbBins - 1; ++b)
+        {
+            growBounds(l0, l1, bins.bounds[axis][b][0], bins.bounds[axis][b][1]);
+            leftCount += bins.counts[axis][b];
+            if (leftCount == 0 || rightCounts[b + 1] == 0)
+                continue;
+            const float cost =
+                m_traversalCost +
+                m_intersectionCost * (surfaceArea(l0, l1) * leftCount + rightAreas[b + 1] * rightCounts[b + 1]) /
+                    area;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    if (bestAxis == -1 || bestCost >= leafCost)
+    {
+        if (nbPrimitives <= static_cast<size_t>(m_maxPrimitivesPerLeaf))
+            return end;
+
+        if (bestAxis == -1)
+        {
+            // All centroids are at the same location, the SAH cannot help.
+            // Split in the middle to keep leaves small
+            return begin + nbPrimitives / 2;
+        }
+    }
+
+    const size_t split = partition(begin, end, bestAxis, bestBin, origins[bestAxis], scales[bestAxis], parallel);
+    if (split == begin || split == end)
+        return begin + nbPrimitives / 2;
+    return split;
+}
+
+size_t BVHBuilder::partition(const size_t begin, const size_t end, const int axis, const int bin,
+                             const float origin, const float scale, const bool parallel)
+{
+    const int nbBins = m_nbBins;
+    const auto isLeft = [axis, bin, origin, scale, nbBins](const BVHPrimitive &primitive) {
+        return binIndex(primitive.center, axis, origin, scale, nbBins) <= bin;
+    };
+
+    const int chunks = nbChunks(begin, end);
+    if (!parallel || chunks == 1)
+        return static_cast<size_t>(std::partition(m_primitives.begin() + begin, m_primitives.begin() + end, isLeft) -
+                                   m_primitives.begin());
+
+    // Primitives are scattered to a scratch buffer, left hand side first.
+    // In deterministic mode, chunks are written in order using prefix sums.
+    // Otherwise every chunk reserves its output range as soon as it has been
+    // counted, left hand sides from the front and right hand sides from the
+    // back, which saves a pass but depends on the scheduling of the threads
+    const size_t nbPrimitives = end - begin;
+    if (m_scratch.size() < nbPrimitives)
+        m_scratch.resize(nbPrimitives);
+
+    std::vector<size_t> leftCounts(chunks);
+    std::vector<size_t> leftOffsets(chunks);
+    std::vector<size_t> rightOffsets(chunks);
+    size_t nbLeft(0);
+    if (m_deterministic)
+    {
+#pragma omp parallel for
+        for (int c = 0; c < chunks; ++c)
+        {
+            const size_t first = begin + c * BVH_CHUNK_SIZE;
+            const size_t last = std::min(end, first + BVH_CHUNK_SIZE);
+            leftCounts[c] = static_cast<size_t>(
+                std::count_if(m_primitives.begin() + first, m_primitives.begin() + last, isLeft));
+        }
+
+        for (int c(0); c < chunks; ++c)
+        {
+            leftOffsets[c] = nbLeft;
+            nbLeft += leftCounts[c];
+        }
+        size_t rightOffset(nbLeft);
+        for (int c(0); c < chunks; ++c)
+        {
+            const size_t first = begin + c * BVH_CHUNK_SIZE;
+            const size_t last = std::min(end, first + BVH_CHUNK_SIZE);
+            rightOffsets[c] = rightOffset;
+            rightOffset += (last - first) - leftCounts[c];
+        }
+
+#pragma omp parallel for
+        for (int c = 0; c < chunks; ++c)
+        {
+            const size_t first = begin + c * BVH_CHUNK_SIZE;
+            const size_t last = std::min(end, first + BVH_CHUNK_SIZE);
+            size_t left(leftOffsets[c]);
+            size_t right(rightOffsets[c]);
+            for (size_t i(first); i < last; ++i)
+                m_scratch[isLeft(m_primitives[i]) ? left++ : right++] = m_primitives[i];
+        }
+    }
+    else
+    {
+        size_t leftCursor(0);
+        size_t rightCursor(nbPrimitives);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int c = 0; c < chunks; ++c)
+        {
+            const size_t first = begin + c * BVH_CHUNK_SIZE;
+            const size_t last = std::min(end, first + BVH_CHUNK_SIZE);
+            const size_t count = static_cast<size_t>(
+                std::count_if(m_primitives.begin() + first, m_primitives.begin() + last, isLeft));
+            size_t left, right;
+#pragma omp critical(bvhPartition)
+            {
+                left = leftCursor;
+                leftCursor += count;
+                rightCursor -= (last - first) - count;
+                right = rightCursor;
+            }
+            for (size_t i(first); i < last; ++i)
+                m_scratch[isLeft(m_primitives[i]) ? left++ : right++] = m_primitives[i];
+        }
+        nbLeft = leftCursor;
+    }
+
+    const int nbPrimitivesToCopy = static_cast<int>(nbPrimitives);
+#pragma omp parallel for
+    for (int i = 0; i < nbPrimitivesToCopy; ++i)
+        m_primitives[begin + i] = m_scratch[i];
+    return begin + nbLeft;
+}
+
+float BVHBuilder::expectedCost(const BoundingBox *boxes, const int nbBoxes, const float traversalCost,
+                               const float intersectionCost)
+{
+    if (nbBoxes <= 0)
+        return 0.f;
+
+    vec3f corner0, corner1;
+    resetBounds(corner0, corner1);
+    for (int i(0); i < nbBoxes; ++i)
+        growBounds(corner0, corner1, boxes[i].parameters[0], boxes[i].parameters[1]);
+    float sceneArea = surfaceArea(corner0, corner1);
+    if (sceneArea <= 0.f)
+        sceneArea = 1.f;
+
+    // Stack of the inner nodes containing the current box: index of the first
+    // box after the node, and probability for the node to be hit
+    std::vector<std::pair<int, float>> parents;
+    float cost(0.f);
+    for (int i(0); i < nbBoxes; ++i)
+    {
+        while (!parents.empty() && parents.back().first <= i)
+            parents.pop_back();
+
+        const float probability = surfaceArea(boxes[i].parameters[0], boxes[i].parameters[1]) / sceneArea;
+        cost += traversalCost * (parents.empty() ? 1.f : parents.back().second);
+        cost += intersectionCost * boxes[i].nbPrimitives * probability;
+        if (boxes[i].indexForNextBox.x > 1)
+            parents.push_back(std::make_pair(i + boxes[i].indexForNextBox.x, probability));
+    }
+    return cost;
+}
+
+void BVHBuilder::quantize(const BoundingBox *boxes, const int nbBoxes, const int bits, const int maxDepth,
+                          std::vector<unsigned char> &buffer)
+{
+    if (bits == 16)
+        quantizeBoxes<QuantizedBoundingBox16, unsigned short>(boxes, nbBoxes, maxDepth, buffer);
+    else
+        quantizeBoxes<QuantizedBoundingBox8, unsigned char>(boxes, nbBoxes, maxDepth, buffer);
+}
+
+bool BVHBuilder::requantize(const BoundingBox *boxes, const int nbBoxes, const int bits, const int maxDepth,
+                            const std::vector<int> &dirty, std::vector<unsigned char> &buffer,
+                            std::vector<int> &modified)
+{
+    if (bits == 16)
+        return requantizeBoxes<QuantizedBoundingBox16, unsigned short>(boxes, nbBoxes, maxDepth, dirty, buffer,
+                                                                       modified);
+    return requantizeBoxes<QuantizedBoundingBox8, unsigned char>(boxes, nbBoxes, maxDepth, dirty, buffer, modified);
+}
+}
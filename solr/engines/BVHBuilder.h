@@ -0,0 +1,170 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include <vector>
+
+namespace solr
+{
+/*
+________________________________________________________________________________
+
+Axis aligned bounding box of a primitive, as seen by the BVH builder
+________________________________________________________________________________
+*/
+struct BVHPrimitive
+{
+    vec3f parameters[2]; // Bounds
+    vec3f center;        // Centroid of the bounds
+    long index;          // Index of the primitive in the CPU container
+};
+
+/*
+________________________________________________________________________________
+
+Node of the BVH, stored in depth-first order so that it can be flattened as is
+into the BoundingBox array used by the ray-tracers:
+- Leaves reference nbPrimitives primitives starting at startIndex in the
+  primitive order returned by the builder
+- Inner nodes have no primitive, startIndex is the depth of the node
+- indexForNextBox is the number of nodes in the sub-tree, the node included
+________________________________________________________________________________
+*/
+struct BVHNode
+{
+    vec3f parameters[2];
+    int nbPrimitives;
+    int startIndex;
+    int indexForNextBox;
+};
+
+typedef std::vector<BVHPrimitive> BVHPrimitives;
+typedef std::vector<BVHNode> BVHNodes;
+
+/*
+________________________________________________________________________________
+
+Binned surface area heuristic (SAH) BVH builder
+
+Large nodes at the top of the tree are split using data parallel bounds,
+binning and partitioning passes. The remaining sub-trees are then built
+concurrently, one task per sub-tree, and spliced in depth first order.
+________________________________________________________________________________
+*/
+class BVHBuilder
+{
+public:
+    BVHBuilder();
+
+    // Builds the tree and returns its expected traversal cost
+    float build(const BVHPrimitives &primitives);
+
+    const BVHNodes &getNodes() const { return m_nodes; }
+    const std::vector<long> &getPrimitiveOrder() const { return m_order; }
+    float getExpectedCost() const { return m_expectedCost; }
+    int getDepth() const { return m_depth; }
+    float getBuildTime() const { return m_buildTime; } // Milliseconds
+
+    void setNbBins(const int nbBins) { m_nbBins = nbBins; }
+    void setMaxPrimitivesPerLeaf(const int maxPrimitivesPerLeaf) { m_maxPrimitivesPerLeaf = maxPrimitivesPerLeaf; }
+    void setCosts(const float traversalCost, const float intersectionCost);
+
+    // When set, primitives are partitioned in the same order whatever the
+    // scheduling of the threads, and trees are identical from run to run
+    void setDeterministic(const bool deterministic) { m_deterministic = deterministic; }
+
+    static float surfaceArea(const vec3f &corner0, const vec3f &corner1);
+
+    // Expected cost of a flattened tree, whatever the builder that produced
+    // it. Every box is tested with the probability of its parent being hit
+    static float expectedCost(const BoundingBox *boxes, const int nbBoxes, const float traversalCost,
+                              const float intersectionCost);
+
+    // Quantizes a flattened tree on 8 or 16 bits. The buffer starts with the
+    // frame of reference of the roots (lower corner and cell size, as two
+    // vec4f) followed by the QuantizedBoundingBox8/16 boxes. Boxes are
+    // quantized relative to their ancestors down to maxDepth, and corners are
+    // rounded outwards so that decoded boxes always contain the original ones
+    static void quantize(const BoundingBox *boxes, const int nbBoxes, const int bits, const int maxDepth,
+                         std::vector<unsigned char> &buffer);
+
+    // Updates a buffer produced by quantize after the boxes listed in dirty
+    // (sorted indices) were refitted. Boxes still contained by their decoded
+    // corners keep them, and so does the frame they define: only the boxes
+    // that outgrew their corners are quantized again, with the descendants
+    // that depend on their frame. Indices of the modified boxes are appended
+    // to modified. Returns false when a box does not fit in the frame of the
+    // roots anymore, and the whole tree must be quantized again
+    static bool requantize(const BoundingBox *boxes, const int nbBoxes, const int bits, const int maxDepth,
+                           const std::vector<int> &dirty, std::vector<unsigned char> &buffer,
+                           std::vector<int> &modified);
+
+private:
+    struct Subtree
+    {
+        size_t begin;
+        size_t end;
+        int depth;
+        int maxDepth;
+        float cost;
+        BVHNodes nodes;
+    };
+
+    struct TopNode
+    {
+        BVHNode node;
+        int left;
+        int right;
+        int subtree; // Index of the sub-tree task, -1 for inner nodes
+    };
+
+    int buildTopNode(const size_t begin, const size_t end, const int depth);
+    void emitTopNode(const int index);
+    float buildNode(const size_t begin, const size_t end, const int depth, BVHNodes &nodes, int &maxDepth);
+
+    void computeBounds(const size_t begin, const size_t end, const bool parallel, vec3f &corner0, vec3f &corner1,
+                       vec3f &center0, vec3f &center1);
+    size_t splitNode(const size_t begin, const size_t end, const vec3f &center0, const vec3f &center1,
+                     const float area, const bool parallel);
+    size_t partition(const size_t begin, const size_t end, const int axis, const int bin, const float origin,
+                     const float scale, const bool parallel);
+
+    BVHPrimitives m_primitives;
+    BVHPrimitives m_scratch;
+    BVHNodes m_nodes;
+    std::vector<long> m_order;
+    std::vector<TopNode> m_topNodes;
+    std::vector<Subtree> m_subtrees;
+
+    int m_nbBins;
+    int m_maxPrimitivesPerLeaf;
+    size_t m_subtreeSize;
+    bool m_deterministic;
+    float m_traversalCost;
+    float m_intersectionCost;
+    float m_rootArea;
+    float m_expectedCost;
+    int m_depth;
+    float m_buildTime;
+};
+}
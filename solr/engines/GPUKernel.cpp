@@ -30,9 +30,13 @@
 #endif
 
 #include <algorithm>
+#include <chrono>
+#include <map>
+#include <tuple>
 
 // JPeg
 #include <images/ImageLoader.h>
+#include <images/PixelConverter.h>
 #include <images/jpge.h>
 
 // Raytracing
@@ -68,6 +72,32 @@ extern "C" FILE *__cdecl __iob_func(void)
 
 const unsigned int AABB_MAGIC_NUMBER = 6400;
 
+// ----------
+// JPEG output stream writing the compressed data to a file as it is produced
+// by the encoder
+// ----------
+class JpegFileStream : public jpge::output_stream
+{
+public:
+    JpegFileStream(const std::string &filename)
+        : m_file(fopen(filename.c_str(), "wb"))
+    {
+    }
+    ~JpegFileStream()
+    {
+        if (m_file)
+            fclose(m_file);
+    }
+    bool isOpen() const { return m_file != 0; }
+    virtual bool put_buf(const void *buffer, int len)
+    {
+        return fwrite(buffer, len, 1, m_file) == 1;
+    }
+
+private:
+    FILE *m_file;
+};
+
 vec3f min2(const vec3f a, const vec3f b)
 {
     vec3f r;
@@ -125,6 +155,129 @@ GPUKernel *SingletonKernel::kernel()
     return m_kernel;
 }
 
+void BoxContainer::clear()
+{
+    m_boxes.clear();
+    m_indices.clear();
+}
+
+CPUBoundingBox &BoxContainer::operator[](const unsigned int key)
+{
+    const auto it = m_indices.find(key);
+    if (it != m_indices.end())
+        return m_boxes[it->second].second;
+
+    m_indices[key] = m_boxes.size();
+    m_boxes.push_back(std::make_pair(key, CPUBoundingBox()));
+    return m_boxes.back().second;
+}
+
+BoxContainer::iterator BoxContainer::find(const unsigned int key)
+{
+    const auto it = m_indices.find(key);
+    return (it == m_indices.end()) ? m_boxes.end() : m_boxes.begin() + it->second;
+}
+
+BoxContainer::const_iterator BoxContainer::find(const unsigned int key) const
+{
+    const auto it = m_indices.find(key);
+    return (it == m_indices.end()) ? m_boxes.end() : m_boxes.begin() + it->second;
+}
+
+void BoxContainer::insert(const value_type &box)
+{
+    if (m_indices.find(box.first) != m_indices.end())
+        return;
+    m_indices[box.first] = m_boxes.size();
+    m_boxes.push_back(box);
+}
+
+void PrimitiveContainer::reserve(const size_t count)
+{
+    types.reserve(count);
+    materialIds.reserve(count);
+    belongsToModel.reserve(count);
+    movable.reserve(count);
+    p0s.reserve(count);
+    p1s.reserve(count);
+    p2s.reserve(count);
+    sizes.reserve(count);
+    attributes.reserve(count);
+}
+
+void PrimitiveContainer::clear()
+{
+    types.clear();
+    materialIds.clear();
+    belongsToModel.clear();
+    movable.clear();
+    p0s.clear();
+    p1s.clear();
+    p2s.clear();
+    sizes.clear();
+    attributes.clear();
+}
+
+void PrimitiveContainer::push_back(const CPUPrimitive &primitive)
+{
+    types.push_back(0);
+    materialIds.push_back(0);
+    belongsToModel.push_back(0);
+    movable.push_back(0);
+    p0s.push_back(primitive.p0);
+    p1s.push_back(primitive.p1);
+    p2s.push_back(primitive.p2);
+    sizes.push_back(primitive.size);
+    attributes.push_back(PrimitiveAttributes());
+    set(types.size() - 1, primitive);
+}
+
+CPUPrimitive PrimitiveContainer::get(const size_t index) const
+{
+    CPUPrimitive primitive;
+    primitive.belongsToModel = (belongsToModel[index] != 0);
+    primitive.movable = (movable[index] != 0);
+    primitive.p0 = p0s[index];
+    primitive.p1 = p1s[index];
+    primitive.p2 = p2s[index];
+    primitive.size = sizes[index];
+    primitive.type = types[index];
+    primitive.materialId = materialIds[index];
+    const PrimitiveAttributes &attribute = attributes[index];
+    primitive.n0 = attribute.n0;
+    primitive.n1 = attribute.n1;
+    primitive.n2 = attribute.n2;
+    primitive.vt0 = attribute.vt0;
+    primitive.vt1 = attribute.vt1;
+    primitive.vt2 = attribute.vt2;
+    primitive.speed0 = attribute.speed0;
+    primitive.speed1 = attribute.speed1;
+    primitive.speed2 = attribute.speed2;
+    return primitive;
+}
+
+void PrimitiveContainer::set(const size_t index, const CPUPrimitive &primitive)
+{
+    belongsToModel[index] = primitive.belongsToModel ? 1 : 0;
+    movable[index] = primitive.movable ? 1 : 0;
+    p0s[index] = primitive.p0;
+    p1s[index] = primitive.p1;
+    p2s[index] = primitive.p2;
+    sizes[index] = primitive.size;
+    types[index] = primitive.type;
+    materialIds[index] = primitive.materialId;
+    PrimitiveAttributes &attribute = attributes[index];
+    attribute.n0 = primitive.n0;
+    attribute.n1 = primitive.n1;
+    attribute.n2 = primitive.n2;
+    attribute.vt0 = primitive.vt0;
+    attribute.vt1 = primitive.vt1;
+    attribute.vt2 = primitive.vt2;
+    attribute.speed0 = primitive.speed0;
+    attribute.speed1 = primitive.speed1;
+    attribute.speed2 = primitive.speed2;
+}
+
 float GPUKernel::dotProduct(const vec3f &a, const vec3f &b)
 {
     return a.x * b.x + a.y * b.y + a.z * b.z;
@@ -179,8 +332,13 @@ GPUKernel::GPUKernel()
     : m_oculus(false)
     , m_hBoundingBoxes(0)
     , m_hPrimitives(0)
+    , m_hCompactPrimitives(0)
+    , m_hShadingPrimitives(0)
     , m_hLamps(0)
     , m_hMaterials(0)
+    , m_boxesCapacity(0)
+    , m_primitivesCapacity(0)
+    , m_memoryBudget(0)
     , m_hRandoms(0)
     , m_hPrimitivesXYIds(0)
     , m_nbActiveMaterials(-1)
@@ -195,6 +353,7 @@ GPUKernel::GPUKernel()
     , m_morph(0.f)
     , m_treeDepth(2)
     , m_bitmap(0)
+    , m_frameBufferSize(0)
     , m_primitivesTransfered(false)
     , m_materialsTransfered(false)
     , m_texturesTransfered(false)
@@ -203,6 +362,21 @@ GPUKernel::GPUKernel()
     , m_activeLogging(false)
     , m_lightInformation(0)
     , m_optimalNbOfBoxes(NB_MAX_BOXES)
+    , m_bvhBuilderType(bvhSAH)
+    , m_bvhExpectedCost(0.f)
+    , m_bvhDeterministic(false)
+    , m_bvhBuildTime(0.f)
+    , m_bvhBuildCost(0.f)
+    , m_bvhRefitThreshold(1.5f)
+    , m_bvhRefitFrame(-1)
+    , m_bvhCostSum(0.0)
+    , m_importedBVHFrame(-1)
+    , m_indexedMeshes(false)
+    , m_quantizedBVH(0)
+    , m_wavefrontRendering(false)
+    , m_asynchronousReadback(false)
+    , m_textureCompression(false)
+    , m_rgbaTextures(false)
     , m_GLMode(-1)
     , m_currentMaterial(0)
     , m_pointSize(1.f)
@@ -237,9 +411,11 @@ GPUKernel::GPUKernel()
     for (int i(0); i < NB_MAX_FRAMES; ++i)
     {
         m_nbActiveBoxes[i] = 0;
+        m_nbActiveMeshBoxes[i] = 0;
         m_nbActivePrimitives[i] = 0;
         m_nbActiveLamps[i] = 0;
     }
+    allocateFrames(0);
 
     LOG_INFO(3, "----------++++++++++  GPU Kernel created  ++++++++++----------");
     LOG_INFO(3, "CPU: SceneInfo         : " << sizeof(SceneInfo));
@@ -248,6 +424,8 @@ GPUKernel::GPUKernel()
     LOG_INFO(3, "CPU: Material          : " << sizeof(Material));
     LOG_INFO(3, "CPU: BoundingBox       : " << sizeof(BoundingBox));
     LOG_INFO(3, "CPU: Primitive         : " << sizeof(Primitive));
+    LOG_INFO(3, "CPU: CompactPrimitive  : " << sizeof(CompactPrimitive));
+    LOG_INFO(3, "CPU: ShadingPrimitive  : " << sizeof(ShadingPrimitive));
     LOG_INFO(3, "CPU: PostProcessingType: " << sizeof(PostProcessingType));
     LOG_INFO(3, "CPU: PostProcessingInfo: " << sizeof(PostProcessingInfo));
     LOG_INFO(3, "Textures " << NB_MAX_TEXTURES);
@@ -324,12 +502,19 @@ void GPUKernel::initBuffers()
     m_hMaterials = new Material[NB_MAX_MATERIALS + 1];
     memset(m_hMaterials, 0, NB_MAX_MATERIALS * sizeof(Material));
 
-#ifndef USE_MANAGED_MEMORY
-    m_hBoundingBoxes = new BoundingBox[NB_MAX_BOXES];
-    memset(m_hBoundingBoxes, 0, NB_MAX_BOXES * sizeof(BoundingBox));
-
-    m_hPrimitives = new Primitive[NB_MAX_PRIMITIVES];
-    memset(m_hPrimitives, 0, NB_MAX_PRIMITIVES * sizeof(Primitive));
+#ifdef USE_MANAGED_MEMORY
+    // Managed boxes and primitives are allocated once by the CUDA engine
+    m_boxesCapacity = NB_MAX_BOXES;
+    m_primitivesCapacity = NB_MAX_PRIMITIVES;
+    m_hCompactPrimitives = new CompactPrimitive[NB_MAX_PRIMITIVES];
+    memset(m_hCompactPrimitives, 0, NB_MAX_PRIMITIVES * sizeof(CompactPrimitive));
+    m_hShadingPrimitives = new ShadingPrimitive[NB_MAX_PRIMITIVES];
+    memset(m_hShadingPrimitives, 0, NB_MAX_PRIMITIVES * sizeof(ShadingPrimitive));
+#else
+    // Boxes and primitives are allocated by reserveSceneBuffers, when the
+    // scene is streamed
+    m_boxesCapacity = 0;
+    m_primitivesCapacity = 0;
 #endif
 
     m_hLamps = new Lamp[NB_MAX_LAMPS];
@@ -338,25 +523,13 @@ void GPUKernel::initBuffers()
     // Textures
     memset(m_hTextures, 0, NB_MAX_TEXTURES * sizeof(TextureInfo));
 
-    // Randoms
-    size_t size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT;
+    // Randoms, a pool shared by all pixels whatever the size of the frame
     if (m_hRandoms)
-        delete m_hRandoms;
-    m_hRandoms = new RandomBuffer[size];
+        delete[] m_hRandoms;
+    m_hRandoms = new RandomBuffer[MAX_BITMAP_SIZE];
 
-    // Primitive IDs
-    if (m_hPrimitivesXYIds)
-        delete m_hPrimitivesXYIds;
-    m_hPrimitivesXYIds = new PrimitiveXYIdBuffer[size];
-    memset(m_hPrimitivesXYIds, 0, size * sizeof(PrimitiveXYIdBuffer));
-
-    // Bitmap
-    if (m_bitmap)
-        delete m_bitmap;
-    size *= gColorDepth;
-    m_bitmap = new BitmapBuffer[size];
-    memset(m_bitmap, 0, size * sizeof(BitmapBuffer));
-    LOG_INFO(3, m_bitmap << " - Bitmap Size=" << size);
+    // Bitmap and primitive IDs are allocated by reshape, for the size of the
+    // frame
 
 #ifdef USE_OCULUS
     LOG_INFO(1, "Initializing Oculus DK1");
@@ -375,18 +548,21 @@ void GPUKernel::cleanup()
 
     LOG_INFO(3, "Cleaning up resources");
 
+    m_boundingBoxes.clear();
+    m_bvhNodes.clear();
+    m_importedBVHNodes.clear();
+    m_importedBVHOrder.clear();
+    m_importedBVHFrame = -1;
+    m_meshes.clear();
+    m_primitiveLeaves.clear();
+    m_primitives.clear();
+    m_lamps.clear();
+    allocateFrames(m_frame);
     for (int i(0); i < NB_MAX_FRAMES; ++i)
     {
-        for (int j(0); j < BOUNDING_BOXES_TREE_DEPTH; ++j)
-        {
-            m_boundingBoxes[i][j].clear();
-        }
         m_nbActiveBoxes[i] = 0;
-
-        m_primitives[i].clear();
+        m_nbActiveMeshBoxes[i] = 0;
         m_nbActivePrimitives[i] = 0;
-
-        m_lamps[i].clear();
         m_nbActiveLamps[i] = 0;
 
         m_minPos[i].x = -m_sceneInfo.viewDistance;
@@ -418,19 +594,28 @@ void GPUKernel::cleanup()
     m_textCoords.clear();
 
     if (m_hRandoms)
-        delete m_hRandoms;
+        delete[] m_hRandoms;
     m_hRandoms = 0;
     if (m_bitmap)
         delete[] m_bitmap;
     m_bitmap = 0;
+    m_frameBufferSize = 0;
 #ifndef USE_MANAGED_MEMORY
     if (m_hBoundingBoxes)
-        delete m_hBoundingBoxes;
+        delete[] m_hBoundingBoxes;
     m_hBoundingBoxes = 0;
     if (m_hPrimitives)
-        delete m_hPrimitives;
+        delete[] m_hPrimitives;
     m_hPrimitives = nullptr;
 #endif
+    if (m_hCompactPrimitives)
+        delete[] m_hCompactPrimitives;
+    m_hCompactPrimitives = nullptr;
+    if (m_hShadingPrimitives)
+        delete[] m_hShadingPrimitives;
+    m_hShadingPrimitives = nullptr;
+    m_boxesCapacity = 0;
+    m_primitivesCapacity = 0;
     if (m_hLamps)
         delete m_hLamps;
     m_hLamps = 0;
@@ -438,7 +623,7 @@ void GPUKernel::cleanup()
         delete m_hMaterials;
     m_hMaterials = 0;
     if (m_hPrimitivesXYIds)
-        delete m_hPrimitivesXYIds;
+        delete[] m_hPrimitivesXYIds;
     m_hPrimitivesXYIds = 0;
     if (m_lightInformation)
         delete m_lightInformation;
@@ -448,7 +633,13 @@ void GPUKernel::cleanup()
     m_nbActiveTextures = 0;
     m_materialsTransfered = false;
     m_primitivesTransfered = false;
+    m_bvhRefitFrame = -1;
+    m_dirtyPrimitives.clear();
+    m_dirtyBoxes.clear();
+    m_dirtyMaterials.clear();
     m_texturesTransfered = false;
+    m_texturePool.clear();
+    m_dirtyTextures.clear();
     m_randomsTransfered = false;
 
     // Morphing
@@ -470,7 +661,17 @@ void GPUKernel::cleanup()
 
 void GPUKernel::reshape()
 {
-    // m_randomsTransfered=false;
+    // Frame buffers have the size of the frame, they are reallocated when it
+    // changes
+    const size_t size = static_cast<size_t>(std::max(1, m_sceneInfo.size.x)) * std::max(1, m_sceneInfo.size.y);
+    LOG_INFO(3, "GPUKernel::reshape: " << size << " pixels");
+    delete[] m_bitmap;
+    m_bitmap = new BitmapBuffer[size * gMaxColorDepth];
+    memset(m_bitmap, 0, size * gMaxColorDepth * sizeof(BitmapBuffer));
+    delete[] m_hPrimitivesXYIds;
+    m_hPrimitivesXYIds = new PrimitiveXYIdBuffer[size];
+    memset(m_hPrimitivesXYIds, 0, size * sizeof(PrimitiveXYIdBuffer));
+    m_frameBufferSize = size;
 }
 
 /*
@@ -506,21 +707,35 @@ int GPUKernel::addPrimitive(PrimitiveType type, bool belongsToModel)
         primitive.belongsToModel = belongsToModel;
         primitive.type = type;
         int index = static_cast<int>(m_primitives[m_frame].size());
-        m_primitives[m_frame][index] = primitive;
+        m_primitives[m_frame].push_back(primitive);
+        invalidateBVHRefit();
         LOG_INFO(3, "m_primitives.size() = " << m_primitives[m_frame].size());
         returnValue = index;
     }
     return returnValue;
 }
 
-CPUPrimitive *GPUKernel::getPrimitive(const unsigned int index)
+bool GPUKernel::getPrimitive(const unsigned int index, CPUPrimitive &primitive) const
 {
-    CPUPrimitive *returnValue(NULL);
-    if (index <= m_primitives[m_frame].size())
+    if (index >= m_primitives[m_frame].size())
+        return false;
+    primitive = m_primitives[m_frame].get(index);
+    return true;
+}
+
+void GPUKernel::setPrimitive(const unsigned int index, const CPUPrimitive &primitive)
+{
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    if (index < primitives.size())
     {
-        returnValue = &(m_primitives[m_frame])[index];
+        const int previousMaterialId = primitives.materialIds[index];
+        primitives.set(index, primitive);
+        markPrimitiveModified(index, previousMaterialId);
+    }
+    else
+    {
+        LOG_ERROR("GPUKernel::setPrimitive: Out of bounds (" << index << "/" << primitives.size() << ")");
     }
-    return returnValue;
 }
 
 void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, float w, float h, float d, int materialId)
@@ -538,44 +753,45 @@ void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, flo
                              float y2, float z2, float w, float h, float d, int materialId)
 {
     float scale = 1.f;
-    m_primitivesTransfered = false;
-    if (index >= 0 && index <= m_primitives[m_frame].size())
-    {
-        (m_primitives[m_frame])[index].movable = true;
-        (m_primitives[m_frame])[index].p0.x = x0 * scale;
-        (m_primitives[m_frame])[index].p0.y = y0 * scale;
-        (m_primitives[m_frame])[index].p0.z = z0 * scale;
-        (m_primitives[m_frame])[index].p1.x = x1 * scale;
-        (m_primitives[m_frame])[index].p1.y = y1 * scale;
-        (m_primitives[m_frame])[index].p1.z = z1 * scale;
-        (m_primitives[m_frame])[index].p2.x = x2 * scale;
-        (m_primitives[m_frame])[index].p2.y = y2 * scale;
-        (m_primitives[m_frame])[index].p2.z = z2 * scale;
-        (m_primitives[m_frame])[index].size.x = w * scale;
-        (m_primitives[m_frame])[index].size.y = h * scale;
-        (m_primitives[m_frame])[index].size.z = d * scale;
-        (m_primitives[m_frame])[index].n0 = make_vec3f();
-        (m_primitives[m_frame])[index].n1 = make_vec3f();
-        (m_primitives[m_frame])[index].n2 = make_vec3f();
-        (m_primitives[m_frame])[index].vt0 = make_vec2f();
-        (m_primitives[m_frame])[index].vt1 = make_vec2f();
-        (m_primitives[m_frame])[index].vt2 = make_vec2f();
-        (m_primitives[m_frame])[index].materialId = materialId;
-
-        switch ((m_primitives[m_frame])[index].type)
+    if (index >= 0 && index < static_cast<int>(m_primitives[m_frame].size()))
+    {
+        CPUPrimitive primitive = m_primitives[m_frame].get(index);
+        const int previousMaterialId = primitive.materialId;
+        primitive.movable = true;
+        primitive.p0.x = x0 * scale;
+        primitive.p0.y = y0 * scale;
+        primitive.p0.z = z0 * scale;
+        primitive.p1.x = x1 * scale;
+        primitive.p1.y = y1 * scale;
+        primitive.p1.z = z1 * scale;
+        primitive.p2.x = x2 * scale;
+        primitive.p2.y = y2 * scale;
+        primitive.p2.z = z2 * scale;
+        primitive.size.x = w * scale;
+        primitive.size.y = h * scale;
+        primitive.size.z = d * scale;
+        primitive.n0 = make_vec3f();
+        primitive.n1 = make_vec3f();
+        primitive.n2 = make_vec3f();
+        primitive.vt0 = make_vec2f();
+        primitive.vt1 = make_vec2f();
+        primitive.vt2 = make_vec2f();
+        primitive.materialId = materialId;
+
+        switch (primitive.type)
         {
         case ptSphere:
         {
-            (m_primitives[m_frame])[index].size.x = w * scale;
-            (m_primitives[m_frame])[index].size.y = w * scale;
-            (m_primitives[m_frame])[index].size.z = w * scale;
+            primitive.size.x = w * scale;
+            primitive.size.y = w * scale;
+            primitive.size.z = w * scale;
             break;
         }
         case ptEllipsoid:
         {
-            (m_primitives[m_frame])[index].size.x = w * scale;
-            (m_primitives[m_frame])[index].size.y = h * scale;
-            (m_primitives[m_frame])[index].size.z = d * scale;
+            primitive.size.x = w * scale;
+            primitive.size.y = h * scale;
+            primitive.size.z = d * scale;
             break;
         }
         case ptCylinder:
@@ -593,75 +809,75 @@ void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, flo
                 axis.y /= len;
                 axis.z /= len;
             }
-            (m_primitives[m_frame])[index].n1.x = axis.x;
-            (m_primitives[m_frame])[index].n1.y = axis.y;
-            (m_primitives[m_frame])[index].n1.z = axis.z;
+            primitive.n1.x = axis.x;
+            primitive.n1.y = axis.y;
+            primitive.n1.z = axis.z;
 
             // Center
-            (m_primitives[m_frame])[index].p2.x = (x0 * scale + x1 * scale) / 2.f;
-            (m_primitives[m_frame])[index].p2.y = (y0 * scale + y1 * scale) / 2.f;
-            (m_primitives[m_frame])[index].p2.z = (z0 * scale + z1 * scale) / 2.f;
+            primitive.p2.x = (x0 * scale + x1 * scale) / 2.f;
+            primitive.p2.y = (y0 * scale + y1 * scale) / 2.f;
+            primitive.p2.z = (z0 * scale + z1 * scale) / 2.f;
 
             // Length
-            (m_primitives[m_frame])[index].size.x = w * scale;
-            (m_primitives[m_frame])[index].size.y = w * scale;
-            (m_primitives[m_frame])[index].size.z = w * scale;
+            primitive.size.x = w * scale;
+            primitive.size.y = w * scale;
+            primitive.size.z = w * scale;
             break;
         }
 #ifdef USE_KINECT
         case ptCamera:
         {
-            (m_primitives[m_frame])[index].n0.x = 0.f;
-            (m_primitives[m_frame])[index].n0.y = 0.f;
-            (m_primitives[m_frame])[index].n0.z = -1.f;
+            primitive.n0.x = 0.f;
+            primitive.n0.y = 0.f;
+            primitive.n0.z = -1.f;
             break;
         }
 #endif // USE_KINECT
         case ptXYPlane:
         {
-            (m_primitives[m_frame])[index].n0.x = 0.f;
-            (m_primitives[m_frame])[index].n0.y = 0.f;
-            (m_primitives[m_frame])[index].n0.z = 1.f;
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            primitive.n0.x = 0.f;
+            primitive.n0.y = 0.f;
+            primitive.n0.z = 1.f;
+            primitive.n1 = primitive.n0;
+            primitive.n2 = primitive.n0;
             break;
         }
         case ptYZPlane:
         {
-            (m_primitives[m_frame])[index].n0.x = 1.f;
-            (m_primitives[m_frame])[index].n0.y = 0.f;
-            (m_primitives[m_frame])[index].n0.z = 0.f;
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            primitive.n0.x = 1.f;
+            primitive.n0.y = 0.f;
+            primitive.n0.z = 0.f;
+            primitive.n1 = primitive.n0;
+            primitive.n2 = primitive.n0;
             break;
         }
         case ptXZPlane:
         case ptCheckboard:
         {
-            (m_primitives[m_frame])[index].n0.x = 0.f;
-            (m_primitives[m_frame])[index].n0.y = 1.f;
-            (m_primitives[m_frame])[index].n0.z = 0.f;
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            primitive.n0.x = 0.f;
+            primitive.n0.y = 1.f;
+            primitive.n0.z = 0.f;
+            primitive.n1 = primitive.n0;
+            primitive.n2 = primitive.n0;
             break;
         }
         case ptTriangle:
         {
             vec3f v0, v1;
-            v0.x = (m_primitives[m_frame])[index].p1.x - (m_primitives[m_frame])[index].p0.x;
-            v0.y = (m_primitives[m_frame])[index].p1.y - (m_primitives[m_frame])[index].p0.y;
-            v0.z = (m_primitives[m_frame])[index].p1.z - (m_primitives[m_frame])[index].p0.z;
+            v0.x = primitive.p1.x - primitive.p0.x;
+            v0.y = primitive.p1.y - primitive.p0.y;
+            v0.z = primitive.p1.z - primitive.p0.z;
             normalizeVector(v0);
 
-            v1.x = (m_primitives[m_frame])[index].p2.x - (m_primitives[m_frame])[index].p0.x;
-            v1.y = (m_primitives[m_frame])[index].p2.y - (m_primitives[m_frame])[index].p0.y;
-            v1.z = (m_primitives[m_frame])[index].p2.z - (m_primitives[m_frame])[index].p0.z;
+            v1.x = primitive.p2.x - primitive.p0.x;
+            v1.y = primitive.p2.y - primitive.p0.y;
+            v1.z = primitive.p2.z - primitive.p0.z;
             normalizeVector(v1);
 
-            (m_primitives[m_frame])[index].n0 = crossProduct(v0, v1);
-            normalizeVector((m_primitives[m_frame])[index].n0);
-            (m_primitives[m_frame])[index].n1 = (m_primitives[m_frame])[index].n0;
-            (m_primitives[m_frame])[index].n2 = (m_primitives[m_frame])[index].n0;
+            primitive.n0 = crossProduct(v0, v1);
+            normalizeVector(primitive.n0);
+            primitive.n1 = primitive.n0;
+            primitive.n2 = primitive.n0;
             break;
         }
         }
@@ -674,29 +890,25 @@ void GPUKernel::setPrimitive(const int &index, float x0, float y0, float z0, flo
         m_maxPos[m_frame].x = std::max(x0 * scale, m_maxPos[m_frame].x);
         m_maxPos[m_frame].y = std::max(y0 * scale, m_maxPos[m_frame].y);
         m_maxPos[m_frame].z = std::max(z0 * scale, m_maxPos[m_frame].z);
+        m_primitives[m_frame].set(index, primitive);
+        markPrimitiveModified(index, previousMaterialId);
     }
     else
     {
-        LOG_ERROR("GPUKernel::setPrimitive: Out of bounds (" << index << "/" << NB_MAX_PRIMITIVES << ")");
+        LOG_ERROR("GPUKernel::setPrimitive: Out of bounds (" << index << "/" << m_primitives[m_frame].size() << ")");
     }
 }
 
 void GPUKernel::setPrimitiveIsMovable(const int &index, bool movable)
 {
-    if (index >= 0 && index < m_primitives[m_frame].size())
-    {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
-        primitive.movable = movable;
-    }
+    if (index >= 0 && index < static_cast<int>(m_primitives[m_frame].size()))
+        m_primitives[m_frame].movable[index] = movable ? 1 : 0;
 }
 
 void GPUKernel::setPrimitiveBellongsToModel(const int &index, bool bellongsToModel)
 {
-    if (index >= 0 && index < m_primitives[m_frame].size())
-    {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
-        primitive.belongsToModel = bellongsToModel;
-    }
+    if (index >= 0 && index < static_cast<int>(m_primitives[m_frame].size()))
+        m_primitives[m_frame].belongsToModel[index] = bellongsToModel ? 1 : 0;
 }
 
 void GPUKernel::setPrimitiveTextureCoordinates(const unsigned int index, const vec2f &vt0, const vec2f &vt1,
@@ -704,10 +916,11 @@ void GPUKernel::setPrimitiveTextureCoordinates(const unsigned int index, const v
 {
     if (index < m_primitives[m_frame].size())
     {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
+        PrimitiveAttributes &primitive = m_primitives[m_frame].attributes[index];
         primitive.vt0 = vt0;
         primitive.vt1 = vt1;
         primitive.vt2 = vt2;
+        markPrimitiveModified(index);
     }
 }
 
@@ -715,14 +928,189 @@ void GPUKernel::setPrimitiveNormals(int unsigned index, vec3f n0, vec3f n1, vec3
 {
     if (index < m_primitives[m_frame].size())
     {
-        CPUPrimitive &primitive((m_primitives[m_frame])[index]);
+        PrimitiveAttributes &primitive = m_primitives[m_frame].attributes[index];
         normalizeVector(n0);
         primitive.n0 = n0;
         normalizeVector(n1);
         primitive.n1 = n1;
         normalizeVector(n2);
         primitive.n2 = n2;
+        markPrimitiveModified(index);
+    }
+}
+
+// ----------
+// Primitive with cleared attributes, as initialized by addPrimitive and
+// setPrimitive
+// ----------
+static CPUPrimitive makePrimitive(const PrimitiveType type, const bool belongsToModel, const int materialId)
+{
+    CPUPrimitive primitive;
+    memset(&primitive, 0, sizeof(CPUPrimitive));
+    primitive.belongsToModel = belongsToModel;
+    primitive.movable = true;
+    primitive.type = type;
+    primitive.materialId = materialId;
+    return primitive;
+}
+
+size_t GPUKernel::beginPrimitives(const size_t count)
+{
+    // Like addPrimitive, existing primitives are overwritten once done with
+    // adding. Overwritten primitives are then refitted one by one by
+    // storePrimitive, as setPrimitive does
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    if (m_doneWithAdding)
+    {
+        const size_t first = m_addingIndex;
+        m_addingIndex += static_cast<int>(count);
+        return first;
+    }
+
+    const size_t first = primitives.size();
+    if (first + count > primitives.capacity())
+        primitives.reserve(std::max(first + count, primitives.capacity() * 3 / 2));
+    m_primitivesTransfered = false;
+    invalidateBVHRefit();
+    return first;
+}
+
+void GPUKernel::storePrimitive(const size_t index, const CPUPrimitive &primitive)
+{
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    int previousMaterialId = -1;
+    if (m_doneWithAdding && index < primitives.size())
+    {
+        previousMaterialId = primitives.materialIds[index];
+        primitives.set(index, primitive);
+    }
+    else if (!m_doneWithAdding && index == primitives.size())
+        primitives.push_back(primitive);
+    else
+    {
+        LOG_ERROR("GPUKernel::storePrimitive: Out of bounds (" << index << "/" << primitives.size() << ")");
+        return;
+    }
+
+    m_minPos[m_frame].x = std::min(primitive.p0.x, m_minPos[m_frame].x);
+    m_minPos[m_frame].y = std::min(primitive.p0.y, m_minPos[m_frame].y);
+    m_minPos[m_frame].z = std::min(primitive.p0.z, m_minPos[m_frame].z);
+    m_maxPos[m_frame].x = std::max(primitive.p0.x, m_maxPos[m_frame].x);
+    m_maxPos[m_frame].y = std::max(primitive.p0.y, m_maxPos[m_frame].y);
+    m_maxPos[m_frame].z = std::max(primitive.p0.z, m_maxPos[m_frame].z);
+    if (m_doneWithAdding)
+        markPrimitiveModified(static_cast<long>(index), previousMaterialId);
+}
+
+int GPUKernel::addSpheres(const size_t count, const float *centers, const float *radii, const int *materialIds,
+                          const int materialId, const bool belongsToModel)
+{
+    if (count == 0 || !centers || !radii)
+        return -1;
+
+    LOG_INFO(3, "GPUKernel::addSpheres(" << count << ")");
+    const size_t first = beginPrimitives(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        CPUPrimitive primitive =
+            makePrimitive(ptSphere, belongsToModel, materialIds ? materialIds[i] : materialId);
+        const float *c = centers + i * 3;
+        primitive.p0 = make_vec3f(c[0], c[1], c[2]);
+        primitive.size = make_vec3f(radii[i], radii[i], radii[i]);
+        storePrimitive(first + i, primitive);
+    }
+    return static_cast<int>(first);
+}
+
+int GPUKernel::addCylinders(const size_t count, const float *ends, const float *radii, const int *materialIds,
+                            const int materialId, const bool belongsToModel)
+{
+    if (count == 0 || !ends || !radii)
+        return -1;
+
+    LOG_INFO(3, "GPUKernel::addCylinders(" << count << ")");
+    const size_t first = beginPrimitives(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        CPUPrimitive primitive =
+            makePrimitive(ptCylinder, belongsToModel, materialIds ? materialIds[i] : materialId);
+        const float *e = ends + i * 6;
+        primitive.p0 = make_vec3f(e[0], e[1], e[2]);
+        primitive.p1 = make_vec3f(e[3], e[4], e[5]);
+
+        // Axis and center
+        primitive.n1 = make_vec3f(e[3] - e[0], e[4] - e[1], e[5] - e[2]);
+        normalizeVector(primitive.n1);
+        primitive.p2 = make_vec3f((e[0] + e[3]) / 2.f, (e[1] + e[4]) / 2.f, (e[2] + e[5]) / 2.f);
+        primitive.size = make_vec3f(radii[i], radii[i], radii[i]);
+        storePrimitive(first + i, primitive);
     }
+    return static_cast<int>(first);
+}
+
+int GPUKernel::addTriangles(const size_t count, const float *vertices, const float *normals,
+                            const float *textureCoordinates, const int *materialIds, const int materialId,
+                            const bool belongsToModel)
+{
+    if (count == 0 || !vertices)
+        return -1;
+
+    LOG_INFO(3, "GPUKernel::addTriangles(" << count << ")");
+    const size_t first = beginPrimitives(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        CPUPrimitive primitive =
+            makePrimitive(ptTriangle, belongsToModel, materialIds ? materialIds[i] : materialId);
+        const float *v = vertices + i * 9;
+        primitive.p0 = make_vec3f(v[0], v[1], v[2]);
+        primitive.p1 = make_vec3f(v[3], v[4], v[5]);
+        primitive.p2 = make_vec3f(v[6], v[7], v[8]);
+
+        if (normals)
+        {
+            const float *n = normals + i * 9;
+            primitive.n0 = make_vec3f(n[0], n[1], n[2]);
+            primitive.n1 = make_vec3f(n[3], n[4], n[5]);
+            primitive.n2 = make_vec3f(n[6], n[7], n[8]);
+            normalizeVector(primitive.n0);
+            normalizeVector(primitive.n1);
+            normalizeVector(primitive.n2);
+        }
+        else
+        {
+            // Face normal, as computed by setPrimitive
+            vec3f v0 = make_vec3f(v[3] - v[0], v[4] - v[1], v[5] - v[2]);
+            vec3f v1 = make_vec3f(v[6] - v[0], v[7] - v[1], v[8] - v[2]);
+            normalizeVector(v0);
+            normalizeVector(v1);
+            primitive.n0 = crossProduct(v0, v1);
+            normalizeVector(primitive.n0);
+            primitive.n1 = primitive.n0;
+            primitive.n2 = primitive.n0;
+        }
+
+        if (textureCoordinates)
+        {
+            const float *t = textureCoordinates + i * 6;
+            primitive.vt0 = make_vec2f(t[0], t[1]);
+            primitive.vt1 = make_vec2f(t[2], t[3]);
+            primitive.vt2 = make_vec2f(t[4], t[5]);
+        }
+        storePrimitive(first + i, primitive);
+    }
+    return static_cast<int>(first);
+}
+
+int GPUKernel::addPrimitives(const size_t count, const CPUPrimitive *primitives)
+{
+    if (count == 0 || !primitives)
+        return -1;
+
+    LOG_INFO(3, "GPUKernel::addPrimitives(" << count << ")");
+    const size_t first = beginPrimitives(count);
+    for (size_t i = 0; i < count; ++i)
+        storePrimitive(first + i, primitives[i]);
+    return static_cast<int>(first);
 }
 
 unsigned int GPUKernel::getPrimitiveAt(int x, int y)
@@ -730,13 +1118,108 @@ unsigned int GPUKernel::getPrimitiveAt(int x, int y)
     LOG_INFO(3, "GPUKernel::getPrimitiveAt(" << x << "," << y << ")");
     unsigned int returnValue = -1;
     unsigned int index = y * m_sceneInfo.size.x + x;
-    if (index < static_cast<unsigned int>(m_sceneInfo.size.x * m_sceneInfo.size.y))
+    if (index < static_cast<unsigned int>(m_sceneInfo.size.x * m_sceneInfo.size.y) && index < m_frameBufferSize)
     {
         returnValue = m_hPrimitivesXYIds[index].x;
     }
     return returnValue;
 }
 
+// Transforms a point from the space of a mesh into world space. The rows of the
+// rotation that transforms world space into mesh space are stored in p0, p1
+// and p2, the translation in n0 and the scale in size.x
+static vec3f instanceToWorld(const CPUPrimitive &instance, const vec3f &v)
+{
+    const float scale = instance.size.x;
+    vec3f r;
+    r.x = instance.n0.x + scale * (v.x * instance.p0.x + v.y * instance.p1.x + v.z * instance.p2.x);
+    r.y = instance.n0.y + scale * (v.x * instance.p0.y + v.y * instance.p1.y + v.z * instance.p2.y);
+    r.z = instance.n0.z + scale * (v.x * instance.p0.z + v.y * instance.p1.z + v.z * instance.p2.z);
+    return r;
+}
+
+void GPUKernel::getPrimitiveBounds(const PrimitiveContainer &primitives, const size_t index, vec3f &p0, vec3f &p1)
+{
+    const int type = primitives.types[index];
+    if (type == ptInstance)
+    {
+        const CPUPrimitive primitive = primitives.get(index);
+        // Bounds of the transformed corners of the mesh
+        const CPUMesh &mesh = m_meshes[m_frame][static_cast<size_t>(primitive.size.y)];
+        for (int i(0); i < 8; ++i)
+        {
+            const vec3f corner = instanceToWorld(primitive, make_vec3f(mesh.parameters[i & 1].x,
+                                                                       mesh.parameters[(i >> 1) & 1].y,
+                                                                       mesh.parameters[(i >> 2) & 1].z));
+            p0 = (i == 0) ? corner : min2(p0, corner);
+            p1 = (i == 0) ? corner : max2(p1, corner);
+        }
+        return;
+    }
+
+    const vec3f &v0 = primitives.p0s[index];
+    const vec3f &v1 = primitives.p1s[index];
+    const vec3f &v2 = primitives.p2s[index];
+    const vec3f &size = primitives.sizes[index];
+    vec3f corner0;
+    vec3f corner1;
+    switch (type)
+    {
+    case ptTriangle:
+    {
+        corner0 = min3(v0, v1, v2);
+        corner1 = max3(v0, v1, v2);
+        break;
+    }
+    case ptCylinder:
+    {
+        corner0 = min2(v0, v1);
+        corner1 = max2(v0, v1);
+        break;
+    }
+    default:
+    {
+        corner0 = v0;
+        corner1 = v0;
+        break;
+    }
+    }
+
+    p0.x = (corner0.x <= corner1.x) ? corner0.x : corner1.x;
+    p0.y = (corner0.y <= corner1.y) ? corner0.y : corner1.y;
+    p0.z = (corner0.z <= corner1.z) ? corner0.z : corner1.z;
+    p1.x = (corner0.x > corner1.x) ? corner0.x : corner1.x;
+    p1.y = (corner0.y > corner1.y) ? corner0.y : corner1.y;
+    p1.z = (corner0.z > corner1.z) ? corner0.z : corner1.z;
+
+    switch (type)
+    {
+    case ptCylinder:
+    case ptSphere:
+    case ptCone:
+    {
+        p0.x -= size.x;
+        p0.y -= size.x;
+        p0.z -= size.x;
+
+        p1.x += size.x;
+        p1.y += size.x;
+        p1.z += size.x;
+        break;
+    }
+    default:
+    {
+        p0.x -= size.x;
+        p0.y -= size.y;
+        p0.z -= size.z;
+        p1.x += size.x;
+        p1.y += size.y;
+        p1.z += size.z;
+        break;
+    }
+    }
+}
+
 bool GPUKernel::updateBoundingBox(CPUBoundingBox &box)
 {
     LOG_INFO(3, "GPUKernel::updateBoundingBox()");
@@ -744,9 +1227,6 @@ bool GPUKernel::updateBoundingBox(CPUBoundingBox &box)
     bool result(false);
 
     // Process box size
-    vec3f corner0;
-    vec3f corner1;
-
     box.parameters[0].x = 1000000;
     box.parameters[0].y = 1000000;
     box.parameters[0].z = 1000000;
@@ -756,64 +1236,11 @@ bool GPUKernel::updateBoundingBox(CPUBoundingBox &box)
 
     for (const auto &p : box.primitives)
     {
-        CPUPrimitive &primitive = (m_primitives[m_frame])[p];
-        result = (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f);
-        switch (primitive.type)
-        {
-        case ptTriangle:
-        {
-            corner0 = min3(primitive.p0, primitive.p1, primitive.p2);
-            corner1 = max3(primitive.p0, primitive.p1, primitive.p2);
-            break;
-        }
-        case ptCylinder:
-        {
-            corner0 = min2(primitive.p0, primitive.p1);
-            corner1 = max2(primitive.p0, primitive.p1);
-            break;
-        }
-        default:
-        {
-            corner0 = primitive.p0;
-            corner1 = primitive.p0;
-            break;
-        }
-        }
+        const PrimitiveContainer &primitives = m_primitives[m_frame];
+        result = (m_hMaterials[primitives.materialIds[p]].innerIllumination.x != 0.f);
 
-        vec4f p0, p1;
-        p0.x = (corner0.x <= corner1.x) ? corner0.x : corner1.x;
-        p0.y = (corner0.y <= corner1.y) ? corner0.y : corner1.y;
-        p0.z = (corner0.z <= corner1.z) ? corner0.z : corner1.z;
-        p1.x = (corner0.x > corner1.x) ? corner0.x : corner1.x;
-        p1.y = (corner0.y > corner1.y) ? corner0.y : corner1.y;
-        p1.z = (corner0.z > corner1.z) ? corner0.z : corner1.z;
-
-        switch (primitive.type)
-        {
-        case ptCylinder:
-        case ptSphere:
-        case ptCone:
-        {
-            p0.x -= primitive.size.x;
-            p0.y -= primitive.size.x;
-            p0.z -= primitive.size.x;
-
-            p1.x += primitive.size.x;
-            p1.y += primitive.size.x;
-            p1.z += primitive.size.x;
-            break;
-        }
-        default:
-        {
-            p0.x -= primitive.size.x;
-            p0.y -= primitive.size.y;
-            p0.z -= primitive.size.z;
-            p1.x += primitive.size.x;
-            p1.y += primitive.size.y;
-            p1.z += primitive.size.z;
-            break;
-        }
-        }
+        vec3f p0, p1;
+        getPrimitiveBounds(primitives, p, p0, p1);
 
         if (p0.x < box.parameters[0].x)
             box.parameters[0].x = p0.x;
@@ -891,8 +1318,8 @@ bool GPUKernel::updateOutterBoundingBox(CPUBoundingBox &outterBox, const int dep
 void GPUKernel::resetBoxes(bool resetPrimitives)
 {
     if (resetPrimitives)
-        for (int i(0); i < m_boundingBoxes[m_frame][0].size(); ++i)
-            resetBox(m_boundingBoxes[m_frame][0][i], resetPrimitives);
+        for (auto &box : m_boundingBoxes[m_frame][0])
+            resetBox(box.second, resetPrimitives);
     else
         m_boundingBoxes[m_frame][0].clear();
 }
@@ -927,13 +1354,11 @@ int GPUKernel::processBoxes(const int boxSize, bool simulate)
     std::map<unsigned int, unsigned int> primitivesPerBox;
 
     // Add primitives to boxes
-    unsigned int p = 0;
+    const PrimitiveContainer &primitives = m_primitives[m_frame];
     size_t maxPrimitivesPerBox = 0;
-    for (const auto &prim : m_primitives[m_frame])
+    for (unsigned int p = 0; p < primitives.size(); ++p)
     {
-        auto &primitive = prim.second;
-
-        const auto &center = primitive.p0;
+        const auto &center = primitives.p0s[p];
         unsigned int X = static_cast<int>((center.x - m_minPos[m_frame].x) / boxSteps.x);
         unsigned int Y = static_cast<int>((center.y - m_minPos[m_frame].y) / boxSteps.y);
         unsigned int Z = static_cast<int>((center.z - m_minPos[m_frame].z) / boxSteps.z);
@@ -962,23 +1387,22 @@ int GPUKernel::processBoxes(const int boxSize, bool simulate)
             }
 
             // Lights
-            if (m_hMaterials[primitive.materialId].innerIllumination.x != 0.f)
+            if (m_hMaterials[primitives.materialIds[p]].innerIllumination.x != 0.f)
             {
                 // Lights are added to first box of higher level
                 m_boundingBoxes[m_frame][m_treeDepth][0].primitives.push_back(p);
-                LOG_INFO(3, "[" << m_treeDepth << "] Lamp " << p << " added (" << primitive.p0.x << ","
-                                << primitive.p0.y << "," << primitive.p0.z << " " << m_nbActiveLamps[m_frame] << "/"
-                                << NB_MAX_LAMPS << "), Material ID=" << primitive.materialId);
+                LOG_INFO(3, "[" << m_treeDepth << "] Lamp " << p << " added (" << center.x << "," << center.y << ","
+                                << center.z << " " << m_nbActiveLamps[m_frame] << "/" << NB_MAX_LAMPS
+                                << "), Material ID=" << primitives.materialIds[p]);
             }
             else
             {
                 // LOG_INFO(3, "Adding primitive to box " << B);
-                m_boundingBoxes[m_frame][0][B].primitives.push_back(p);
-                if (m_boundingBoxes[m_frame][0][B].primitives.size() > maxPrimitivesPerBox)
-                    maxPrimitivesPerBox = m_boundingBoxes[m_frame][0][B].primitives.size();
+                std::vector<long> &boxPrimitives = m_boundingBoxes[m_frame][0][B].primitives;
+                boxPrimitives.push_back(p);
+                maxPrimitivesPerBox = std::max(maxPrimitivesPerBox, boxPrimitives.size());
             }
         }
-        ++p;
     }
 
     // Now update box sizes
@@ -1037,14 +1461,39 @@ int GPUKernel::processOutterBoxes(const int boxSize, const int boundingBoxesDept
     return static_cast<int>(maxPrimitivesPerBox);
 }
 
+void GPUKernel::setQuantizedBVH(const int bits)
+{
+    if (bits != 0 && bits != 8 && bits != 16)
+    {
+        LOG_ERROR("Boxes can only be quantized on 8 or 16 bits, not " << bits);
+        return;
+    }
+    m_quantizedBVH = bits;
+    m_primitivesTransfered = false;
+}
+
 int GPUKernel::compactBoxes(bool reconstructBoxes)
 {
     LOG_INFO(3, "GPUKernel::compactBoxes (" << (reconstructBoxes ? "true" : "false") << ")");
 
+    // Transformed primitives only require the existing tree to be refitted,
+    // as long as its quality does not degrade too much
+    if (!reconstructBoxes && useSAHBuilder() && m_bvhRefitFrame == static_cast<int>(m_frame))
+    {
+        if (refitBVH())
+            return static_cast<int>(m_nbActiveBoxes[m_frame]);
+        reconstructBoxes = true;
+    }
+
     // First box of highest level is dedicated to light sources
     m_primitivesTransfered = false;
-    if (reconstructBoxes)
+    if (reconstructBoxes && m_bvhBuilderType != bvhSAH && useSAHBuilder())
+        LOG_INFO(1, "The scene contains meshes, it is built by the SAH builder instead of the grid");
+    if (reconstructBoxes && useSAHBuilder())
+        buildBVH();
+    else if (reconstructBoxes)
     {
+        m_bvhNodes[m_frame].clear();
         resetBox(m_boundingBoxes[m_frame][m_treeDepth][0], true);
         int gridGranularity(2);
         int gridDivider(4);
@@ -1077,10 +1526,397 @@ int GPUKernel::compactBoxes(bool reconstructBoxes)
     }
 
     LOG_INFO(3, "Streaming data to GPU");
-    streamDataToGPU();
+    if (!streamDataToGPU())
+        return -1;
+    if (reconstructBoxes)
+    {
+        // Box 0 contains the lights, it is always tested whatever the builder
+        m_bvhExpectedCost = BVHBuilder::expectedCost(m_hBoundingBoxes + 1, m_nbActiveBoxes[m_frame] - 1, 1.f, 1.f);
+        m_bvhBuildCost = m_bvhExpectedCost;
+        LOG_INFO(1, "Expected traversal cost: " << m_bvhExpectedCost << " (" << m_nbActiveBoxes[m_frame] << " boxes)");
+    }
     return static_cast<int>(m_nbActiveBoxes[m_frame]);
 }
 
+// ----------
+// Places two hierarchies under a common root. Leaves of the second one
+// reference primitives appended to the order of the first one
+// ----------
+static void mergeBVH(BVHNodes &nodes, std::vector<long> &order, const BVHNodes &otherNodes,
+                     const std::vector<long> &otherOrder)
+{
+    BVHNode root;
+    memset(&root, 0, sizeof(BVHNode));
+    root.parameters[0] = min2(nodes[0].parameters[0], otherNodes[0].parameters[0]);
+    root.parameters[1] = max2(nodes[0].parameters[1], otherNodes[0].parameters[1]);
+    root.indexForNextBox = static_cast<int>(1 + nodes.size() + otherNodes.size());
+
+    BVHNodes merged;
+    merged.reserve(root.indexForNextBox);
+    merged.push_back(root);
+    for (BVHNode node : nodes)
+    {
+        if (node.nbPrimitives == 0)
+            ++node.startIndex;
+        merged.push_back(node);
+    }
+    const int offset = static_cast<int>(order.size());
+    for (BVHNode node : otherNodes)
+    {
+        if (node.nbPrimitives == 0)
+            ++node.startIndex;
+        else
+            node.startIndex += offset;
+        merged.push_back(node);
+    }
+    nodes.swap(merged);
+    order.insert(order.end(), otherOrder.begin(), otherOrder.end());
+}
+
+void GPUKernel::buildBVH()
+{
+    LOG_INFO(3, "GPUKernel::buildBVH");
+    const auto start = std::chrono::steady_clock::now();
+    for (int i(0); i < BOUNDING_BOXES_TREE_DEPTH; ++i)
+        m_boundingBoxes[m_frame][i].clear();
+
+    // Lights are not part of the hierarchy, they are stored in the first box
+    // of level 1, in the same way as the grid builder does
+    m_treeDepth = 1;
+    CPUBoundingBox &lights = m_boundingBoxes[m_frame][m_treeDepth][0];
+    resetBox(lights, true);
+
+    // Primitives of meshes only belong to the bottom level hierarchies
+    buildMeshes();
+    const PrimitiveContainer &sourcePrimitives = m_primitives[m_frame];
+    std::vector<bool> instanced(sourcePrimitives.size());
+    for (const auto &mesh : m_meshes[m_frame])
+        for (const auto &p : mesh.primitives)
+            instanced[p] = true;
+
+    std::vector<long> items;
+    items.reserve(sourcePrimitives.size());
+    for (long i(0); i < static_cast<long>(sourcePrimitives.size()); ++i)
+    {
+        if (instanced[i])
+            continue;
+        if (m_hMaterials[sourcePrimitives.materialIds[i]].innerIllumination.x != 0.f)
+            lights.primitives.push_back(i);
+        else
+            items.push_back(i);
+    }
+
+    std::vector<long> order;
+    std::vector<long> remainingItems;
+    const bool imported = importBVH(items, remainingItems);
+    if (imported)
+    {
+        m_bvhNodes[m_frame].swap(m_importedBVHNodes);
+        order.swap(m_importedBVHOrder);
+        LOG_INFO(1, "Using imported BVH of " << m_bvhNodes[m_frame].size() << " nodes");
+
+        // Primitives that are not part of the imported model get their own
+        // hierarchy, next to the imported one
+        if (!remainingItems.empty())
+        {
+            BVHNodes remainingNodes;
+            std::vector<long> remainingOrder;
+            buildBVH(remainingItems, remainingNodes, remainingOrder);
+            mergeBVH(m_bvhNodes[m_frame], order, remainingNodes, remainingOrder);
+            LOG_INFO(1, "BVH of " << remainingNodes.size() << " nodes built for " << remainingItems.size()
+                                  << " other primitives");
+        }
+    }
+    else
+    {
+        const int depth = buildBVH(items, m_bvhNodes[m_frame], order);
+        LOG_INFO(2, "Scene depth........: " << depth);
+    }
+    m_importedBVHNodes.clear();
+    m_importedBVHOrder.clear();
+    m_importedBVHFrame = -1;
+
+    m_primitiveLeaves[m_frame].assign(m_primitives[m_frame].size(), -1);
+    for (size_t i(0); i < m_bvhNodes[m_frame].size(); ++i)
+    {
+        const BVHNode &node = m_bvhNodes[m_frame][i];
+        if (node.nbPrimitives == 0)
+            continue;
+
+        CPUBoundingBox &box = m_boundingBoxes[m_frame][0][static_cast<unsigned int>(i)];
+        box.primitives.assign(order.begin() + node.startIndex, order.begin() + node.startIndex + node.nbPrimitives);
+        for (const auto &p : box.primitives)
+            m_primitiveLeaves[m_frame][p] = static_cast<int>(i);
+        box.parameters[0] = node.parameters[0];
+        box.parameters[1] = node.parameters[1];
+        box.center.x = (node.parameters[0].x + node.parameters[1].x) / 2.f;
+        box.center.y = (node.parameters[0].y + node.parameters[1].y) / 2.f;
+        box.center.z = (node.parameters[0].z + node.parameters[1].z) / 2.f;
+        box.indexForNextBox = 1;
+    }
+
+    // Imported hierarchies only define the topology, inner nodes are fitted to
+    // the leaves when streamed. Level 0 only holds the leaves
+    if (imported)
+    {
+        BoxContainer &leaves = m_boundingBoxes[m_frame][0];
+        const int nbLeaves = static_cast<int>(leaves.size());
+#pragma omp parallel for
+        for (int i = 0; i < nbLeaves; ++i)
+        {
+            CPUBoundingBox &box = (leaves.begin() + i)->second;
+            updateBoundingBox(box);
+            box.center.x = (box.parameters[0].x + box.parameters[1].x) / 2.f;
+            box.center.y = (box.parameters[0].y + box.parameters[1].y) / 2.f;
+            box.center.z = (box.parameters[0].z + box.parameters[1].z) / 2.f;
+        }
+    }
+    LOG_INFO(2, "Primitives.........: " << m_primitives[m_frame].size());
+    LOG_INFO(2, "BVH nodes..........: " << m_bvhNodes[m_frame].size());
+    LOG_INFO(2, "BVH leaves.........: " << m_boundingBoxes[m_frame][0].size());
+
+    const float buildTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (imported)
+    {
+        LOG_INFO(1, "BVH imported in " << buildTime << "ms");
+        return;
+    }
+    const float nbMillions = static_cast<float>(m_primitives[m_frame].size()) / 1000000.f;
+    m_bvhBuildTime = (nbMillions > 0.f) ? buildTime / nbMillions : 0.f;
+    LOG_INFO(1, "BVH built in " << buildTime << "ms (" << m_bvhBuildTime << "ms per million primitives)");
+}
+
+int GPUKernel::buildBVH(const std::vector<long> &items, BVHNodes &nodes, std::vector<long> &order)
+{
+    // Bounds and centroids are computed in parallel
+    const PrimitiveContainer &sourcePrimitives = m_primitives[m_frame];
+    const int nbItems = static_cast<int>(items.size());
+    BVHPrimitives primitives(items.size());
+#pragma omp parallel for
+    for (int i = 0; i < nbItems; ++i)
+    {
+        BVHPrimitive &bvhPrimitive = primitives[i];
+        getPrimitiveBounds(sourcePrimitives, items[i], bvhPrimitive.parameters[0], bvhPrimitive.parameters[1]);
+        bvhPrimitive.center.x = (bvhPrimitive.parameters[0].x + bvhPrimitive.parameters[1].x) / 2.f;
+        bvhPrimitive.center.y = (bvhPrimitive.parameters[0].y + bvhPrimitive.parameters[1].y) / 2.f;
+        bvhPrimitive.center.z = (bvhPrimitive.parameters[0].z + bvhPrimitive.parameters[1].z) / 2.f;
+        bvhPrimitive.index = items[i];
+    }
+
+    BVHBuilder builder;
+    builder.setDeterministic(m_bvhDeterministic);
+    builder.build(primitives);
+    nodes = builder.getNodes();
+    order = builder.getPrimitiveOrder();
+    return builder.getDepth();
+}
+
+bool GPUKernel::importBVH(const std::vector<long> &items, std::vector<long> &remainingItems)
+{
+    if (m_importedBVHFrame != static_cast<int>(m_frame))
+        return false;
+
+    // Nodes must form a binary tree in depth first order, in which every
+    // sub-tree size is the sum of the sizes of its children and inner nodes
+    // hold their depth
+    const BVHNodes &nodes = m_importedBVHNodes;
+    const std::vector<long> &order = m_importedBVHOrder;
+    const int nbNodes = static_cast<int>(nodes.size());
+    bool valid = (nbNodes != 0 && nodes[0].indexForNextBox == nbNodes);
+    std::vector<int> depths(nbNodes, 0);
+    std::vector<char> covered(order.size(), 0);
+    for (int i = 0; valid && i < nbNodes; ++i)
+    {
+        const BVHNode &node = nodes[i];
+        if (node.nbPrimitives > 0)
+        {
+            // Leaf ranges must cover the order exactly once
+            valid = (node.indexForNextBox == 1 && node.startIndex >= 0 &&
+                     static_cast<size_t>(node.startIndex) + node.nbPrimitives <= order.size());
+            for (int j = 0; valid && j < node.nbPrimitives; ++j)
+                valid = (covered[node.startIndex + j]++ == 0);
+        }
+        else if (node.nbPrimitives == 0 && i + 1 < nbNodes && nodes[i + 1].indexForNextBox > 0)
+        {
+            const int right = i + 1 + nodes[i + 1].indexForNextBox;
+            valid = (node.startIndex == depths[i] && right < nbNodes && nodes[right].indexForNextBox > 0 &&
+                     node.indexForNextBox == 1 + nodes[i + 1].indexForNextBox + nodes[right].indexForNextBox);
+            if (valid)
+                depths[i + 1] = depths[right] = depths[i] + 1;
+        }
+        else
+            valid = false;
+    }
+    valid = valid && std::find(covered.begin(), covered.end(), 0) == covered.end();
+
+    // The hierarchy must reference primitives of the top level hierarchy, each
+    // one once. The others are returned
+    std::vector<char> referenced(m_primitives[m_frame].size(), 0);
+    for (const auto &i : items)
+        referenced[i] = 1;
+    for (size_t i = 0; valid && i < order.size(); ++i)
+    {
+        const long p = order[i];
+        valid = (p >= 0 && p < static_cast<long>(referenced.size()) && referenced[p] == 1);
+        if (valid)
+            referenced[p] = 2;
+    }
+
+    if (!valid)
+    {
+        LOG_ERROR("Imported BVH does not match the primitives of the scene, building it");
+        return false;
+    }
+    remainingItems.clear();
+    for (const auto &i : items)
+        if (referenced[i] == 1)
+            remainingItems.push_back(i);
+    return true;
+}
+
+bool GPUKernel::getBVH(BVHNodes &nodes, std::vector<long> &order)
+{
+    const BVHNodes &frameNodes = m_bvhNodes[m_frame];
+    if (!useSAHBuilder() || frameNodes.empty())
+        return false;
+
+    // Leaves hold their primitives in the order of the hierarchy
+    size_t nbPrimitives = 0;
+    for (const auto &node : frameNodes)
+        if (node.nbPrimitives > 0)
+            nbPrimitives = std::max(nbPrimitives, static_cast<size_t>(node.startIndex + node.nbPrimitives));
+    order.assign(nbPrimitives, -1);
+    for (size_t i(0); i < frameNodes.size(); ++i)
+    {
+        const BVHNode &node = frameNodes[i];
+        if (node.nbPrimitives == 0)
+            continue;
+        const BoxContainer::const_iterator it = m_boundingBoxes[m_frame][0].find(static_cast<unsigned int>(i));
+        if (it == m_boundingBoxes[m_frame][0].end() ||
+            it->second.primitives.size() != static_cast<size_t>(node.nbPrimitives))
+            return false;
+        std::copy(it->second.primitives.begin(), it->second.primitives.end(), order.begin() + node.startIndex);
+    }
+
+    // Instances are not part of the model, their meshes are not saved
+    const PrimitiveContainer &primitives = m_primitives[m_frame];
+    std::vector<long> modelItems;
+    modelItems.reserve(order.size());
+    for (const auto &p : order)
+        if (p >= 0 && primitives.belongsToModel[p] && primitives.types[p] != ptInstance)
+            modelItems.push_back(p);
+    if (modelItems.empty())
+        return false;
+    if (modelItems.size() == order.size())
+    {
+        nodes = frameNodes;
+        return true;
+    }
+    buildBVH(modelItems, nodes, order);
+    return true;
+}
+
+void GPUKernel::setBVH(BVHNodes nodes, std::vector<long> order)
+{
+    m_importedBVHNodes.swap(nodes);
+    m_importedBVHOrder.swap(order);
+    m_importedBVHFrame = static_cast<int>(m_frame);
+}
+
+void GPUKernel::buildMeshes()
+{
+    // Each mesh is built once, whatever its number of instances
+    for (auto &mesh : m_meshes[m_frame])
+    {
+        const bool indexed = !mesh.triangles.empty();
+        const size_t nbPrimitives = indexed ? mesh.triangles.size() : mesh.primitives.size();
+        BVHPrimitives primitives(nbPrimitives);
+        for (size_t i(0); i < nbPrimitives; ++i)
+        {
+            BVHPrimitive &bvhPrimitive = primitives[i];
+            if (indexed)
+            {
+                const vec4i &triangle = mesh.triangles[i];
+                const vec3f &v0 = mesh.vertices[triangle.x];
+                const vec3f &v1 = mesh.vertices[triangle.y];
+                const vec3f &v2 = mesh.vertices[triangle.z];
+                bvhPrimitive.parameters[0] = min2(v0, min2(v1, v2));
+                bvhPrimitive.parameters[1] = max2(v0, max2(v1, v2));
+                bvhPrimitive.index = static_cast<long>(i);
+            }
+            else
+            {
+                getPrimitiveBounds(m_primitives[m_frame], mesh.primitives[i], bvhPrimitive.parameters[0],
+                                   bvhPrimitive.parameters[1]);
+                bvhPrimitive.index = mesh.primitives[i];
+            }
+            bvhPrimitive.center.x = (bvhPrimitive.parameters[0].x + bvhPrimitive.parameters[1].x) / 2.f;
+            bvhPrimitive.center.y = (bvhPrimitive.parameters[0].y + bvhPrimitive.parameters[1].y) / 2.f;
+            bvhPrimitive.center.z = (bvhPrimitive.parameters[0].z + bvhPrimitive.parameters[1].z) / 2.f;
+        }
+
+        BVHBuilder builder;
+        builder.setDeterministic(m_bvhDeterministic);
+        builder.build(primitives);
+        mesh.nodes = builder.getNodes();
+        mesh.order = builder.getPrimitiveOrder();
+        mesh.parameters[0] = mesh.nodes[0].parameters[0];
+        mesh.parameters[1] = mesh.nodes[0].parameters[1];
+    }
+    LOG_INFO(2, "Meshes.............: " << m_meshes[m_frame].size());
+}
+
+void GPUKernel::streamMeshesToGPU()
+{
+    // Bottom level hierarchies are flattened after the top level one. Their
+    // location is already known by the instances
+    int boxIndex = m_nbActiveBoxes[m_frame];
+    for (const auto &mesh : m_meshes[m_frame])
+    {
+        // Leaves of indexed meshes reference their triangles, stored in the
+        // order of the hierarchy
+        const bool indexed = !mesh.triangles.empty();
+        const int startTriangle = static_cast<int>(m_hMeshTriangles.size());
+        if (indexed)
+        {
+            const int startVertex = static_cast<int>(m_hMeshVertices.size());
+            m_hMeshVertices.insert(m_hMeshVertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+            m_hMeshNormals.insert(m_hMeshNormals.end(), mesh.normals.begin(), mesh.normals.end());
+            m_hMeshTextureCoordinates.insert(m_hMeshTextureCoordinates.end(), mesh.textureCoordinates.begin(),
+                                             mesh.textureCoordinates.end());
+            for (const auto &t : mesh.order)
+            {
+                const vec4i &triangle = mesh.triangles[t];
+                m_hMeshTriangles.push_back(make_vec4i(startVertex + triangle.x, startVertex + triangle.y,
+                                                      startVertex + triangle.z, triangle.w));
+            }
+        }
+
+        for (const auto &node : mesh.nodes)
+        {
+            BoundingBox &box = m_hBoundingBoxes[boxIndex];
+            box.parameters[0] = node.parameters[0];
+            box.parameters[1] = node.parameters[1];
+            box.nbPrimitives = node.nbPrimitives;
+            if (node.nbPrimitives == 0)
+                box.startIndex = node.startIndex;
+            else
+                box.startIndex = indexed ? startTriangle + node.startIndex : m_nbActivePrimitives[m_frame];
+            box.indexForNextBox.x = node.indexForNextBox;
+            ++boxIndex;
+
+            if (!indexed)
+                for (int i(0); i < node.nbPrimitives; ++i)
+                    streamPrimitiveToGPU(mesh.order[node.startIndex + i]);
+            m_maxPrimitivesPerBox = std::max(m_maxPrimitivesPerBox, static_cast<size_t>(node.nbPrimitives));
+        }
+    }
+    m_nbActiveMeshBoxes[m_frame] = boxIndex - m_nbActiveBoxes[m_frame];
+    if (!m_hMeshTriangles.empty())
+        LOG_INFO(1, "Indexed meshes.....: " << m_hMeshTriangles.size() << " triangles, " << m_hMeshVertices.size()
+                                            << " vertices");
+}
+
 void GPUKernel::recursiveDataStreamToGPU(const int depth, std::vector<long> &elements)
 {
     LOG_INFO(3, "RecursiveDataStreamToGPU(" << depth << ")");
@@ -1092,7 +1928,7 @@ void GPUKernel::recursiveDataStreamToGPU(const int depth, std::vector<long> &ele
         // Create Box
         CPUBoundingBox &box = m_boundingBoxes[m_frame][depth][element];
 
-        if (box.primitives.size() != 0 && m_nbActiveBoxes[m_frame] < NB_MAX_BOXES)
+        if (box.primitives.size() != 0)
         {
             int boxIndex = m_nbActiveBoxes[m_frame];
             m_hBoundingBoxes[boxIndex].parameters[0] = box.parameters[0];
@@ -1103,51 +1939,458 @@ void GPUKernel::recursiveDataStreamToGPU(const int depth, std::vector<long> &ele
             ++m_nbActiveBoxes[m_frame];
             ++c;
 
-            if (depth == 0)
-            {
-                LOG_INFO(3, "=== Box " << boxIndex << " Depth [" << depth << "] ... adding " << box.primitives.size()
-                                       << " primitives");
-                m_maxPrimitivesPerBox =
-                    (box.primitives.size() > m_maxPrimitivesPerBox) ? box.primitives.size() : m_maxPrimitivesPerBox;
-                // Add primitive for Nodes
-                std::vector<long>::const_iterator itp = box.primitives.begin();
-                while (itp != box.primitives.end())
-                {
-                    // Prepare primitives for GPU
-                    if ((*itp) < NB_MAX_PRIMITIVES)
-                    {
-                        CPUPrimitive &primitive = (m_primitives[m_frame])[*itp];
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].index = (*itp);
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].type = primitive.type;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].p0 = primitive.p0;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].p1 = primitive.p1;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].p2 = primitive.p2;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].n0 = primitive.n0;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].n1 = primitive.n1;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].n2 = primitive.n2;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].size = primitive.size;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].materialId = primitive.materialId;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].vt0 = primitive.vt0;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].vt1 = primitive.vt1;
-                        m_hPrimitives[m_nbActivePrimitives[m_frame]].vt2 = primitive.vt2;
-                        ++m_nbActivePrimitives[m_frame];
-                    }
-                    ++itp;
-                }
-            }
-            else
-                // Resursively continue to build the tree
-                recursiveDataStreamToGPU(depth - 1, box.primitives);
+            if (depth == 0)
+            {
+                LOG_INFO(3, "=== Box " << boxIndex << " Depth [" << depth << "] ... adding " << box.primitives.size()
+                                       << " primitives");
+                m_maxPrimitivesPerBox =
+                    (box.primitives.size() > m_maxPrimitivesPerBox) ? box.primitives.size() : m_maxPrimitivesPerBox;
+                // Add primitive for Nodes
+                std::vector<long>::const_iterator itp = box.primitives.begin();
+                while (itp != box.primitives.end())
+                {
+                    // Prepare primitives for GPU
+                    streamPrimitiveToGPU(*itp);
+                    ++itp;
+                }
+            }
+            else
+                // Resursively continue to build the tree
+                recursiveDataStreamToGPU(depth - 1, box.primitives);
+
+            m_hBoundingBoxes[boxIndex].indexForNextBox.x = (depth == 0) ? 1 : m_nbActiveBoxes[m_frame] - boxIndex;
+            LOG_INFO(3, "<== Box " << boxIndex << " Depth [" << depth << "] --> "
+                                   << m_hBoundingBoxes[boxIndex].indexForNextBox.x << " = box "
+                                   << boxIndex + m_hBoundingBoxes[boxIndex].indexForNextBox.x);
+        }
+    }
+}
+
+void GPUKernel::streamPrimitiveToGPU(const long index)
+{
+    copyPrimitiveToGPU(index, m_nbActivePrimitives[m_frame]);
+    ++m_nbActivePrimitives[m_frame];
+}
+
+void GPUKernel::copyPrimitiveToGPU(const long index, const int gpuIndex)
+{
+    const CPUPrimitive primitive = m_primitives[m_frame].get(index);
+    Primitive &gpuPrimitive = m_hPrimitives[gpuIndex];
+    gpuPrimitive.index = index;
+    gpuPrimitive.type = primitive.type;
+    gpuPrimitive.p0 = primitive.p0;
+    gpuPrimitive.p1 = primitive.p1;
+    gpuPrimitive.p2 = primitive.p2;
+    gpuPrimitive.n0 = primitive.n0;
+    gpuPrimitive.n1 = primitive.n1;
+    gpuPrimitive.n2 = primitive.n2;
+    gpuPrimitive.size = primitive.size;
+    gpuPrimitive.materialId = primitive.materialId;
+    gpuPrimitive.vt0 = primitive.vt0;
+    gpuPrimitive.vt1 = primitive.vt1;
+    gpuPrimitive.vt2 = primitive.vt2;
+    if (primitive.type == ptInstance)
+    {
+        // Location of the bottom level hierarchy of the mesh
+        const CPUMesh &mesh = m_meshes[m_frame][static_cast<size_t>(primitive.size.y)];
+        gpuPrimitive.size.y = static_cast<float>(mesh.startBox);
+        gpuPrimitive.size.z = static_cast<float>(mesh.nodes.size());
+        gpuPrimitive.n1 = make_vec3f(mesh.triangles.empty() ? 0.f : 1.f);
+    }
+
+    // Intersection data
+    CompactPrimitive &compactPrimitive = m_hCompactPrimitives[gpuIndex];
+    compactPrimitive.type = gpuPrimitive.type;
+    compactPrimitive.index = gpuPrimitive.index;
+    compactPrimitive.materialId = gpuPrimitive.materialId;
+    compactPrimitive.p0 = gpuPrimitive.p0;
+    if (gpuPrimitive.type == ptInstance)
+    {
+        // Instances are not intersected as triangles, the rows of their
+        // rotation are kept as they are
+        compactPrimitive.e1 = gpuPrimitive.p1;
+        compactPrimitive.e2 = gpuPrimitive.p2;
+    }
+    else
+    {
+        compactPrimitive.e1 = make_vec3f(gpuPrimitive.p1.x - gpuPrimitive.p0.x, gpuPrimitive.p1.y - gpuPrimitive.p0.y,
+                                         gpuPrimitive.p1.z - gpuPrimitive.p0.z);
+        compactPrimitive.e2 = make_vec3f(gpuPrimitive.p2.x - gpuPrimitive.p0.x, gpuPrimitive.p2.y - gpuPrimitive.p0.y,
+                                         gpuPrimitive.p2.z - gpuPrimitive.p0.z);
+    }
+    compactPrimitive.size = gpuPrimitive.size;
+
+    // Shading data
+    ShadingPrimitive &shadingPrimitive = m_hShadingPrimitives[gpuIndex];
+    shadingPrimitive.n0 = gpuPrimitive.n0;
+    shadingPrimitive.n1 = gpuPrimitive.n1;
+    shadingPrimitive.n2 = gpuPrimitive.n2;
+    shadingPrimitive.vt0 = gpuPrimitive.vt0;
+    shadingPrimitive.vt1 = gpuPrimitive.vt1;
+    shadingPrimitive.vt2 = gpuPrimitive.vt2;
+}
+
+void GPUKernel::streamLampsToGPU(const CPUBoundingBox &box)
+{
+    const int boxIndex = m_nbActiveBoxes[m_frame];
+    LOG_INFO(3, "Box " << boxIndex << " contains ligths");
+    m_lightInformationSize = 0;
+    m_hBoundingBoxes[boxIndex].parameters[0].x = -m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[0].y = -m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[0].z = -m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[1].x = m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[1].y = m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].parameters[1].z = m_sceneInfo.viewDistance;
+    m_hBoundingBoxes[boxIndex].nbPrimitives = static_cast<int>(box.primitives.size());
+    m_hBoundingBoxes[boxIndex].startIndex = m_nbActivePrimitives[m_frame];
+    m_hBoundingBoxes[boxIndex].indexForNextBox.x = 1;
+    std::vector<long>::const_iterator itp = box.primitives.begin();
+    while (itp != box.primitives.end())
+    {
+        // Add the primitive
+        const PrimitiveContainer &primitives = m_primitives[m_frame];
+        streamPrimitiveToGPU(*itp);
+
+        // Add light information related to primitive
+        const int materialId = primitives.materialIds[*itp];
+        Material &material = m_hMaterials[materialId];
+        LightInformation lightInformation;
+        LOG_INFO(3, "LightInformation " << (*itp) << ", MaterialId=" << materialId);
+        lightInformation.primitiveId = (*itp);
+        lightInformation.materialId = materialId;
+
+        lightInformation.location.x = primitives.p0s[*itp].x;
+        lightInformation.location.y = primitives.p0s[*itp].y;
+        lightInformation.location.z = primitives.p0s[*itp].z;
+
+        lightInformation.color.x = material.color.x;
+        lightInformation.color.y = material.color.y;
+        lightInformation.color.z = material.color.z;
+        lightInformation.color.w = material.innerIllumination.x;
+
+        m_lightInformation[m_lightInformationSize] = lightInformation;
+
+        LOG_INFO(3, "Adding Light Information: " << m_lightInformation[m_lightInformationSize].primitiveId << ","
+                                                 << m_lightInformation[m_lightInformationSize].materialId << ":"
+                                                 << m_lightInformation[m_lightInformationSize].location.x << ","
+                                                 << m_lightInformation[m_lightInformationSize].location.y << ","
+                                                 << m_lightInformation[m_lightInformationSize].location.z << " "
+                                                 << m_lightInformation[m_lightInformationSize].color.x << ","
+                                                 << m_lightInformation[m_lightInformationSize].color.y << ","
+                                                 << m_lightInformation[m_lightInformationSize].color.z << " "
+                                                 << m_lightInformation[m_lightInformationSize].color.w);
+
+        m_hLamps[m_nbActiveLamps[m_frame]] = *itp;
+        ++m_nbActiveLamps[m_frame];
+        ++m_lightInformationSize;
+        ++itp;
+    }
+    ++m_nbActiveBoxes[m_frame];
+}
+
+// ----------
+// Contribution of a node to the expected traversal cost of a tree, as computed
+// by BVHBuilder::expectedCost, before being divided by the area of the scene
+// ----------
+static double nodeCost(const BVHNode &node)
+{
+    const double area = BVHBuilder::surfaceArea(node.parameters[0], node.parameters[1]);
+    // Leaves intersect their primitives, inner nodes test their two children
+    return area * ((node.nbPrimitives != 0) ? node.nbPrimitives : 2);
+}
+
+void GPUKernel::streamBVHToGPU()
+{
+    LOG_INFO(3, "GPUKernel::streamBVHToGPU");
+    streamLampsToGPU(m_boundingBoxes[m_frame][m_treeDepth][0]);
+
+    BVHNodes &nodes = m_bvhNodes[m_frame];
+    size_t nbBoxes = m_nbActiveBoxes[m_frame] + nodes.size();
+    for (auto &mesh : m_meshes[m_frame])
+    {
+        mesh.startBox = static_cast<int>(nbBoxes);
+        nbBoxes += mesh.nodes.size();
+    }
+
+    // Leaves may have been transformed since the tree was built, inner nodes
+    // are updated accordingly. Children always come after their parent.
+    for (int i(static_cast<int>(nodes.size()) - 1); i >= 0; --i)
+    {
+        BVHNode &node = nodes[i];
+        if (node.nbPrimitives != 0)
+        {
+            const CPUBoundingBox &box = m_boundingBoxes[m_frame][0][i];
+            node.parameters[0] = box.parameters[0];
+            node.parameters[1] = box.parameters[1];
+        }
+        else
+        {
+            const BVHNode &left = nodes[i + 1];
+            const BVHNode &right = nodes[i + 1 + left.indexForNextBox];
+            node.parameters[0] = min2(left.parameters[0], right.parameters[0]);
+            node.parameters[1] = max2(left.parameters[1], right.parameters[1]);
+        }
+    }
+
+    for (size_t i(0); i < nodes.size(); ++i)
+    {
+        const BVHNode &node = nodes[i];
+        BoundingBox &box = m_hBoundingBoxes[m_nbActiveBoxes[m_frame]];
+        box.parameters[0] = node.parameters[0];
+        box.parameters[1] = node.parameters[1];
+        box.nbPrimitives = node.nbPrimitives;
+        box.startIndex = (node.nbPrimitives != 0) ? m_nbActivePrimitives[m_frame] : node.startIndex;
+        box.indexForNextBox.x = node.indexForNextBox;
+        ++m_nbActiveBoxes[m_frame];
+
+        if (node.nbPrimitives != 0)
+        {
+            CPUBoundingBox &leaf = m_boundingBoxes[m_frame][0][static_cast<unsigned int>(i)];
+            for (const auto &p : leaf.primitives)
+                streamPrimitiveToGPU(p);
+            m_maxPrimitivesPerBox = std::max(m_maxPrimitivesPerBox, leaf.primitives.size());
+            leaf.modified = false;
+        }
+    }
+    streamMeshesToGPU();
+
+    // Parents and costs let refitBVH only visit the modified leaves and their
+    // ancestors
+    m_bvhParents.assign(nodes.size(), -1);
+    m_bvhCostSum = 0.0;
+    for (size_t i(0); i < nodes.size(); ++i)
+    {
+        if (nodes[i].nbPrimitives == 0)
+        {
+            const size_t left = i + 1;
+            m_bvhParents[left] = static_cast<int>(i);
+            m_bvhParents[left + nodes[left].indexForNextBox] = static_cast<int>(i);
+        }
+        m_bvhCostSum += nodeCost(nodes[i]);
+    }
+    m_refitLeaves.clear();
+    m_refitNodes.assign(nodes.size(), 0);
+    m_bvhRefitFrame = m_frame;
+}
+
+bool GPUKernel::refitBVH()
+{
+    LOG_INFO(3, "GPUKernel::refitBVH");
+    BVHNodes &nodes = m_bvhNodes[m_frame];
+    // Box 0 contains the lights, nodes are flattened right after it
+    const int offset = m_nbActiveBoxes[m_frame] - static_cast<int>(nodes.size());
+
+    // Leaves holding transformed primitives. Their primitives are copied in
+    // place, the primitive order of the flattened tree does not change
+    std::vector<int> leaves;
+    leaves.swap(m_refitLeaves);
+    if (leaves.empty())
+        return true;
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+    // Ancestors of the modified leaves, visited once each. Their start index
+    // is their depth in the tree
+    std::vector<int> ancestors;
+    for (const auto leaf : leaves)
+        for (int parent = m_bvhParents[leaf]; parent != -1 && !m_refitNodes[parent]; parent = m_bvhParents[parent])
+        {
+            m_refitNodes[parent] = 1;
+            ancestors.push_back(parent);
+        }
+    std::sort(ancestors.begin(), ancestors.end(), [&nodes](const int a, const int b) {
+        return nodes[a].startIndex > nodes[b].startIndex || (nodes[a].startIndex == nodes[b].startIndex && a < b);
+    });
+
+    double cost = 0.0;
+    for (const auto leaf : leaves)
+        cost -= nodeCost(nodes[leaf]);
+    for (const auto ancestor : ancestors)
+        cost -= nodeCost(nodes[ancestor]);
+
+    std::vector<CPUBoundingBox *> boxes;
+    for (const auto leaf : leaves)
+        boxes.push_back(&m_boundingBoxes[m_frame][0][leaf]);
+    const int nbLeaves = static_cast<int>(leaves.size());
+#pragma omp parallel for
+    for (int i = 0; i < nbLeaves; ++i)
+    {
+        CPUBoundingBox &leaf = *boxes[i];
+        BVHNode &node = nodes[leaves[i]];
+        BoundingBox &box = m_hBoundingBoxes[offset + leaves[i]];
+        node.parameters[0] = box.parameters[0] = leaf.parameters[0];
+        node.parameters[1] = box.parameters[1] = leaf.parameters[1];
+        for (size_t p(0); p < leaf.primitives.size(); ++p)
+            copyPrimitiveToGPU(leaf.primitives[p], box.startIndex + static_cast<int>(p));
+        leaf.modified = false;
+    }
+
+    // Ancestors are refitted bottom-up, one level at a time
+    size_t first(0);
+    while (first < ancestors.size())
+    {
+        size_t last(first);
+        while (last < ancestors.size() && nodes[ancestors[last]].startIndex == nodes[ancestors[first]].startIndex)
+            ++last;
+        const int nbLevelNodes = static_cast<int>(last - first);
+#pragma omp parallel for
+        for (int i = 0; i < nbLevelNodes; ++i)
+        {
+            const int index = ancestors[first + i];
+            const int left = index + 1;
+            const int right = left + nodes[left].indexForNextBox;
+            BVHNode &node = nodes[index];
+            BoundingBox &box = m_hBoundingBoxes[offset + index];
+            node.parameters[0] = box.parameters[0] = min2(nodes[left].parameters[0], nodes[right].parameters[0]);
+            node.parameters[1] = box.parameters[1] = max2(nodes[left].parameters[1], nodes[right].parameters[1]);
+        }
+        first = last;
+    }
+
+    for (const auto leaf : leaves)
+        cost += nodeCost(nodes[leaf]);
+    for (const auto ancestor : ancestors)
+    {
+        cost += nodeCost(nodes[ancestor]);
+        m_refitNodes[ancestor] = 0;
+    }
+    m_bvhCostSum += cost;
+
+    // Rebuild the tree when refitting made it too expensive to traverse. The
+    // cost is the one of BVHBuilder::expectedCost, updated with the modified
+    // nodes only: the root is always tested, other nodes are tested with the
+    // probability of their parent being hit
+    float rootArea = BVHBuilder::surfaceArea(nodes[0].parameters[0], nodes[0].parameters[1]);
+    if (rootArea <= 0.f)
+        rootArea = 1.f;
+    m_bvhExpectedCost = static_cast<float>(1.0 + m_bvhCostSum / rootArea);
+    if (m_bvhRefitThreshold > 0.f && m_bvhExpectedCost > m_bvhBuildCost * m_bvhRefitThreshold)
+    {
+        LOG_INFO(1, "Expected traversal cost went from " << m_bvhBuildCost << " to " << m_bvhExpectedCost
+                                                         << ", rebuilding BVH");
+        return false;
+    }
+
+    // Only modified ranges need to be uploaded. Close ranges are merged to
+    // limit the number of transfers
+    for (const auto leaf : leaves)
+    {
+        const BoundingBox &box = m_hBoundingBoxes[offset + leaf];
+        addDirtyRange(m_dirtyPrimitives, box.startIndex, box.startIndex + box.nbPrimitives);
+    }
+    ancestors.insert(ancestors.end(), leaves.begin(), leaves.end());
+    std::sort(ancestors.begin(), ancestors.end());
+    for (const auto index : ancestors)
+        addDirtyRange(m_dirtyBoxes, offset + index, offset + index + 1);
+    LOG_INFO(3, "Refitted " << nbLeaves << " leaves, " << m_dirtyPrimitives.size() << " primitive ranges and "
+                            << m_dirtyBoxes.size() << " box ranges to upload");
+    return true;
+}
+
+void GPUKernel::markPrimitiveModified(const long index, const int previousMaterialId)
+{
+    // Only the leaf of the top level hierarchy containing the primitive needs
+    // to be refitted. Emitting primitives also define lamps, in which case the
+    // tree is built again. This is also true for primitives that were emitting
+    // before being modified
+    const std::vector<int> &leaves = m_primitiveLeaves[m_frame];
+    if (m_bvhRefitFrame == static_cast<int>(m_frame) && index >= 0 && index < static_cast<long>(leaves.size()) &&
+        leaves[index] != -1 && m_hMaterials[m_primitives[m_frame].materialIds[index]].innerIllumination.x == 0.f &&
+        (previousMaterialId < 0 || m_hMaterials[previousMaterialId].innerIllumination.x == 0.f))
+    {
+        CPUBoundingBox &box = m_boundingBoxes[m_frame][0][leaves[index]];
+        updateBoundingBox(box);
+        if (!box.modified)
+            m_refitLeaves.push_back(leaves[index]);
+        box.modified = true;
+    }
+    else
+    {
+        m_primitivesTransfered = false;
+        invalidateBVHRefit();
+    }
+}
+
+void GPUKernel::addDirtyRange(DirtyRanges &ranges, const size_t begin, const size_t end)
+{
+    const size_t gap = 64;
+    if (!ranges.empty() && begin >= ranges.back().begin && begin <= ranges.back().end + gap)
+        ranges.back().end = std::max(ranges.back().end, end);
+    else
+    {
+        DirtyRange range = {begin, end};
+        ranges.push_back(range);
+    }
+}
+
+// ----------
+// Host buffers of boxes and primitives grow geometrically with the scene. The
+// existing content is kept since refitted trees update it in place
+// ----------
+template <typename T>
+static void growBuffer(T *&buffer, const size_t size, const size_t capacity)
+{
+    T *newBuffer = new T[capacity];
+    if (buffer)
+        memcpy(newBuffer, buffer, size * sizeof(T));
+    memset(newBuffer + size, 0, (capacity - size) * sizeof(T));
+    delete[] buffer;
+    buffer = newBuffer;
+}
+
+bool GPUKernel::reserveSceneBuffers(const size_t nbBoxes, const size_t nbPrimitives)
+{
+    if (nbBoxes <= m_boxesCapacity && nbPrimitives <= m_primitivesCapacity)
+        return true;
+
+#ifdef USE_MANAGED_MEMORY
+    LOG_ERROR("Scene of " << nbBoxes << " boxes and " << nbPrimitives << " primitives does not fit in managed memory ("
+                          << NB_MAX_BOXES << " boxes and " << NB_MAX_PRIMITIVES << " primitives)");
+    return false;
+#else
+    const size_t minCapacity = 1024;
+    const size_t boxSize = sizeof(BoundingBox);
+    const size_t primitiveSize = sizeof(Primitive) + sizeof(CompactPrimitive) + sizeof(ShadingPrimitive);
+    size_t boxesCapacity = std::max(nbBoxes, m_boxesCapacity);
+    size_t primitivesCapacity = std::max(nbPrimitives, m_primitivesCapacity);
+    if (m_memoryBudget != 0 && boxesCapacity * boxSize + primitivesCapacity * primitiveSize > m_memoryBudget)
+    {
+        LOG_ERROR("Scene of " << nbBoxes << " boxes and " << nbPrimitives << " primitives exceeds the memory budget of "
+                              << m_memoryBudget << " bytes");
+        return false;
+    }
 
-            m_hBoundingBoxes[boxIndex].indexForNextBox.x = (depth == 0) ? 1 : m_nbActiveBoxes[m_frame] - boxIndex;
-            LOG_INFO(3, "<== Box " << boxIndex << " Depth [" << depth << "] --> "
-                                   << m_hBoundingBoxes[boxIndex].indexForNextBox.x << " = box "
-                                   << boxIndex + m_hBoundingBoxes[boxIndex].indexForNextBox.x);
-        }
+    // Buffers grow by half of their capacity at least, unless the budget
+    // does not allow it
+    if (nbBoxes > m_boxesCapacity)
+        boxesCapacity = std::max(nbBoxes, std::max(minCapacity, m_boxesCapacity * 3 / 2));
+    if (nbPrimitives > m_primitivesCapacity)
+        primitivesCapacity = std::max(nbPrimitives, std::max(minCapacity, m_primitivesCapacity * 3 / 2));
+    if (m_memoryBudget != 0 && boxesCapacity * boxSize + primitivesCapacity * primitiveSize > m_memoryBudget)
+    {
+        boxesCapacity = std::max(nbBoxes, m_boxesCapacity);
+        primitivesCapacity = std::max(nbPrimitives, m_primitivesCapacity);
+    }
+
+    if (boxesCapacity != m_boxesCapacity)
+        growBuffer(m_hBoundingBoxes, m_boxesCapacity, boxesCapacity);
+    if (primitivesCapacity != m_primitivesCapacity)
+    {
+        growBuffer(m_hPrimitives, m_primitivesCapacity, primitivesCapacity);
+        growBuffer(m_hCompactPrimitives, m_primitivesCapacity, primitivesCapacity);
+        growBuffer(m_hShadingPrimitives, m_primitivesCapacity, primitivesCapacity);
     }
+    m_boxesCapacity = boxesCapacity;
+    m_primitivesCapacity = primitivesCapacity;
+    LOG_INFO(1, "Scene buffers allocated for " << m_boxesCapacity << " boxes and " << m_primitivesCapacity
+                                               << " primitives: "
+                                               << m_boxesCapacity * boxSize + m_primitivesCapacity * primitiveSize
+                                               << " bytes");
+    return true;
+#endif // USE_MANAGED_MEMORY
 }
 
-void GPUKernel::streamDataToGPU()
+bool GPUKernel::streamDataToGPU()
 {
     LOG_INFO(3, "GPUKernel::streamDataToGPU");
     // --------------------------------------------------------------------------------
@@ -1155,105 +2398,77 @@ void GPUKernel::streamDataToGPU()
     // CPU -> GPU
     // --------------------------------------------------------------------------------
     m_primitivesTransfered = false;
+    m_bvhRefitFrame = -1;
+    m_dirtyPrimitives.clear();
+    m_dirtyBoxes.clear();
     m_nbActiveBoxes[m_frame] = 0;
+    m_nbActiveMeshBoxes[m_frame] = 0;
+    m_hMeshTriangles.clear();
+    m_hMeshVertices.clear();
+    m_hMeshNormals.clear();
+    m_hMeshTextureCoordinates.clear();
     m_nbActivePrimitives[m_frame] = 0;
     m_nbActiveLamps[m_frame] = 0;
     m_maxPrimitivesPerBox = 0;
 
-    // Build boxes tree recursively
-    int maxDepth(m_treeDepth);
-    LOG_INFO(3, "Processing " << m_boundingBoxes[m_frame][maxDepth].size() << " master boxes");
-    BoxContainer::iterator itob = m_boundingBoxes[m_frame][maxDepth].begin();
-    while (itob != m_boundingBoxes[m_frame][maxDepth].end())
+    // Box 0 contains the lights, then come the boxes of the top level
+    // hierarchy and the bottom level ones of the meshes. The grid streams the
+    // primitives of the light box and of every level 0 box, which may overlap
+    size_t nbBoxes = 1;
+    size_t nbPrimitives = m_primitives[m_frame].size();
+    if (useSAHBuilder())
     {
-        // Create Box
-        CPUBoundingBox &box = (*itob).second;
-        int boxIndex = m_nbActiveBoxes[m_frame];
-        LOG_INFO(3, "==> Box " << boxIndex << " Depth [" << maxDepth << "] ++");
-        m_hBoundingBoxes[boxIndex].parameters[0] = box.parameters[0];
-        m_hBoundingBoxes[boxIndex].parameters[1] = box.parameters[1];
-        m_hBoundingBoxes[boxIndex].nbPrimitives = 0;
-        m_hBoundingBoxes[boxIndex].startIndex = maxDepth;
-
-        if (itob == m_boundingBoxes[m_frame][maxDepth].begin())
-        {
-            LOG_INFO(3, "Box 0 of higher level (" << 0 << ") contains ligths");
-            m_lightInformationSize = 0;
-            m_hBoundingBoxes[boxIndex].parameters[0].x = -m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[0].y = -m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[0].z = -m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[1].x = m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[1].y = m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].parameters[1].z = m_sceneInfo.viewDistance;
-            m_hBoundingBoxes[boxIndex].nbPrimitives = static_cast<int>(box.primitives.size());
-            m_hBoundingBoxes[boxIndex].startIndex = 0;
-            std::vector<long>::const_iterator itp = box.primitives.begin();
-            while (itp != box.primitives.end())
+        nbBoxes += m_bvhNodes[m_frame].size();
+        for (const auto &mesh : m_meshes[m_frame])
+            nbBoxes += mesh.nodes.size();
+    }
+    else
+    {
+        for (unsigned int depth(0); depth <= m_treeDepth; ++depth)
+            nbBoxes += m_boundingBoxes[m_frame][depth].size();
+        nbPrimitives = m_boundingBoxes[m_frame][m_treeDepth][0].primitives.size();
+        for (const auto &box : m_boundingBoxes[m_frame][0])
+            nbPrimitives += box.second.primitives.size();
+    }
+    if (!reserveSceneBuffers(nbBoxes, nbPrimitives))
+        return false;
+
+    if (useSAHBuilder())
+        streamBVHToGPU();
+    else
+    {
+        // Build boxes tree recursively
+        int maxDepth(m_treeDepth);
+        LOG_INFO(3, "Processing " << m_boundingBoxes[m_frame][maxDepth].size() << " master boxes");
+        BoxContainer::iterator itob = m_boundingBoxes[m_frame][maxDepth].begin();
+        while (itob != m_boundingBoxes[m_frame][maxDepth].end())
+        {
+            // Create Box
+            CPUBoundingBox &box = (*itob).second;
+            int boxIndex = m_nbActiveBoxes[m_frame];
+            LOG_INFO(3, "==> Box " << boxIndex << " Depth [" << maxDepth << "] ++");
+            if (itob == m_boundingBoxes[m_frame][maxDepth].begin())
+                streamLampsToGPU(box);
+            else
             {
-                // Add the primitive
-                CPUPrimitive &primitive = (m_primitives[m_frame])[*itp];
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].index = (*itp);
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].type = primitive.type;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].p0 = primitive.p0;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].p1 = primitive.p1;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].p2 = primitive.p2;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].n0 = primitive.n0;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].n1 = primitive.n1;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].n2 = primitive.n2;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].size = primitive.size;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].materialId = primitive.materialId;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].vt0 = primitive.vt0;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].vt1 = primitive.vt1;
-                m_hPrimitives[m_nbActivePrimitives[m_frame]].vt2 = primitive.vt2;
-                ++m_nbActivePrimitives[m_frame];
-
-                // Add light information related to primitive
-                Material &material = m_hMaterials[primitive.materialId];
-                LightInformation lightInformation;
-                LOG_INFO(3, "LightInformation " << (*itp) << ", MaterialId=" << primitive.materialId);
-                lightInformation.primitiveId = (*itp);
-                lightInformation.materialId = primitive.materialId;
-
-                lightInformation.location.x = primitive.p0.x;
-                lightInformation.location.y = primitive.p0.y;
-                lightInformation.location.z = primitive.p0.z;
-
-                lightInformation.color.x = material.color.x;
-                lightInformation.color.y = material.color.y;
-                lightInformation.color.z = material.color.z;
-                lightInformation.color.w = material.innerIllumination.x;
-
-                m_lightInformation[m_lightInformationSize] = lightInformation;
-
-                LOG_INFO(3, "Adding Light Information: " << m_lightInformation[m_lightInformationSize].primitiveId
-                                                         << "," << m_lightInformation[m_lightInformationSize].materialId
-                                                         << ":" << m_lightInformation[m_lightInformationSize].location.x
-                                                         << "," << m_lightInformation[m_lightInformationSize].location.y
-                                                         << "," << m_lightInformation[m_lightInformationSize].location.z
-                                                         << " " << m_lightInformation[m_lightInformationSize].color.x
-                                                         << "," << m_lightInformation[m_lightInformationSize].color.y
-                                                         << "," << m_lightInformation[m_lightInformationSize].color.z
-                                                         << " " << m_lightInformation[m_lightInformationSize].color.w);
-
-                m_hLamps[m_nbActiveLamps[m_frame]] = *itp;
-                ++m_nbActiveLamps[m_frame];
-                ++m_lightInformationSize;
-                ++itp;
+                m_hBoundingBoxes[boxIndex].parameters[0] = box.parameters[0];
+                m_hBoundingBoxes[boxIndex].parameters[1] = box.parameters[1];
+                m_hBoundingBoxes[boxIndex].nbPrimitives = 0;
+                m_hBoundingBoxes[boxIndex].startIndex = maxDepth;
+                ++m_nbActiveBoxes[m_frame];
             }
-        }
-
-        ++m_nbActiveBoxes[m_frame];
 
-        // Recursively populate flattened tree representation
-        if (maxDepth > 0)
-            recursiveDataStreamToGPU(maxDepth - 1, box.primitives);
+            // Recursively populate flattened tree representation
+            if (maxDepth > 0)
+                recursiveDataStreamToGPU(maxDepth - 1, box.primitives);
 
-        m_hBoundingBoxes[boxIndex].indexForNextBox.x = m_nbActiveBoxes[m_frame] - boxIndex;
-        LOG_INFO(3, "Master Primitive (" << box.parameters[0].x << "," << box.parameters[0].y << ","
-                                         << box.parameters[0].z << "),(" << box.parameters[1].x << ","
-                                         << box.parameters[1].y << "," << box.parameters[1].z << "),"
-                                         << m_hBoundingBoxes[boxIndex].indexForNextBox.x);
-        ++itob;
+            m_hBoundingBoxes[boxIndex].indexForNextBox.x = m_nbActiveBoxes[m_frame] - boxIndex;
+            LOG_INFO(3, "Master Primitive (" << box.parameters[0].x << "," << box.parameters[0].y << ","
+                                             << box.parameters[0].z << "),(" << box.parameters[1].x << ","
+                                             << box.parameters[1].y << "," << box.parameters[1].z << "),"
+                                             << m_hBoundingBoxes[boxIndex].indexForNextBox.x);
+            ++itob;
+        }
     }
 
     LOG_INFO(3, "Max primitives per box: " << m_maxPrimitivesPerBox);
@@ -1277,6 +2492,7 @@ void GPUKernel::streamDataToGPU()
             LOG_ERROR("Box " << i << " --> " << i + m_hBoundingBoxes[i].indexForNextBox.x);
         }
     }
+    return true;
 }
 
 void GPUKernel::resetFrame()
@@ -1291,7 +2507,12 @@ void GPUKernel::resetFrame()
         m_boundingBoxes[m_frame][i].clear();
 
     m_boundingBoxes[m_frame][0].clear();
+    m_bvhNodes[m_frame].clear();
+    m_meshes[m_frame].clear();
+    m_primitiveLeaves[m_frame].clear();
+    invalidateBVHRefit();
     m_nbActiveBoxes[m_frame] = 0;
+    m_nbActiveMeshBoxes[m_frame] = 0;
     LOG_INFO(3, "Nb Boxes: " << m_boundingBoxes[m_frame][0].size());
 
     m_primitives[m_frame].clear();
@@ -1313,7 +2534,7 @@ void GPUKernel::resetAll()
 #endif // USE_OCULUS
 
     int oldFrame(m_frame);
-    for (int frame(0); frame < NB_MAX_FRAMES; ++frame)
+    for (int frame(0); frame < static_cast<int>(m_primitives.size()); ++frame)
     {
         m_frame = frame;
         resetFrame();
@@ -1342,6 +2563,8 @@ void GPUKernel::resetAll()
     memset(&m_hTextures[0], 0, NB_MAX_TEXTURES * sizeof(TextureInfo));
     m_nbActiveTextures = 0;
     m_texturesTransfered = false;
+    m_texturePool.clear();
+    m_dirtyTextures.clear();
 #ifdef USE_KINECT
     initializeKinectTextures();
 #endif // USE_KINECT
@@ -1349,10 +2572,10 @@ void GPUKernel::resetAll()
 
 void GPUKernel::displayBoxesInfo()
 {
-    for (unsigned int i(0); i <= m_boundingBoxes[m_frame][0].size(); ++i)
+    for (auto &b : m_boundingBoxes[m_frame][0])
     {
-        CPUBoundingBox &box = m_boundingBoxes[m_frame][0][i];
-        LOG_INFO(3, "Box " << i);
+        CPUBoundingBox &box = b.second;
+        LOG_INFO(3, "Box " << b.first);
         LOG_INFO(3, "- # of primitives: " << box.primitives.size());
         LOG_INFO(3, "- Corners 1      : " << box.parameters[0].x << "," << box.parameters[0].y << ","
                                           << box.parameters[0].z);
@@ -1362,7 +2585,7 @@ void GPUKernel::displayBoxesInfo()
         std::vector<long>::const_iterator it = box.primitives.begin();
         while (it != box.primitives.end())
         {
-            CPUPrimitive &primitive((m_primitives[m_frame])[*it]);
+            const CPUPrimitive primitive = m_primitives[m_frame].get(*it);
             LOG_INFO(3, "- - " << p << ":"
                                << "type = " << primitive.type << ", "
                                << "center = (" << primitive.p0.x << "," << primitive.p0.y << "," << primitive.p0.z
@@ -1378,7 +2601,6 @@ void GPUKernel::rotatePrimitives(const vec3f &rotationCenter, const vec4f &angle
 {
     LOG_INFO(3, "GPUKernel::rotatePrimitives");
 
-    m_primitivesTransfered = false;
     vec3f cosAngles, sinAngles;
 
     cosAngles.x = cos(angles.x);
@@ -1389,6 +2611,8 @@ void GPUKernel::rotatePrimitives(const vec3f &rotationCenter, const vec4f &angle
     sinAngles.y = sin(angles.y);
     sinAngles.z = sin(angles.z);
 
+    // Transformed leaves are only recorded when refitBVH refits them
+    const bool refitLeaves = useSAHBuilder() && m_bvhRefitFrame == static_cast<int>(m_frame);
 #pragma omp parallel
     for (BoxContainer::iterator itb = m_boundingBoxes[m_frame][0].begin(); itb != m_boundingBoxes[m_frame][0].end();
          ++itb)
@@ -1396,14 +2620,16 @@ void GPUKernel::rotatePrimitives(const vec3f &rotationCenter, const vec4f &angle
 #pragma omp single nowait
         {
             CPUBoundingBox &box = (*itb).second;
+            const bool wasModified = box.modified;
             resetBox(box, false);
 
             for (std::vector<long>::iterator it = box.primitives.begin(); it != box.primitives.end(); ++it)
             {
                 //#pragma single nowait
-                CPUPrimitive &primitive((m_primitives[m_frame])[*it]);
-                if (primitive.movable && primitive.type != ptCamera)
+                PrimitiveContainer &primitives = m_primitives[m_frame];
+                if (primitives.movable[*it] && primitives.types[*it] != ptCamera)
                 {
+                    CPUPrimitive primitive = primitives.get(*it);
 #if 0
                     float limit = -3000.f;
                     if( primitive.speed0.y != 0.f && (primitive.p0.y > limit || primitive.p1.y > limit || primitive.p2.y > limit) )
@@ -1436,14 +2662,23 @@ void GPUKernel::rotatePrimitives(const vec3f &rotationCenter, const vec4f &angle
 #else
                     rotatePrimitive(primitive, rotationCenter, cosAngles, sinAngles);
 #endif // 0
+                    primitives.set(*it, primitive);
+                    box.modified = true;
                 }
                 updateBoundingBox(box);
             }
+            // Transformed leaves, for refitBVH
+            if (refitLeaves && !wasModified && box.modified)
+            {
+#pragma omp critical
+                m_refitLeaves.push_back(static_cast<int>((*itb).first));
+            }
         }
     }
 
-    // Update bounding boxes
-    for (int b(1); b < BOUNDING_BOXES_TREE_DEPTH; ++b)
+    // Update bounding boxes. The inner nodes of the SAH hierarchy are
+    // refitted by refitBVH, its level 0 is indexed by leaf and not by primitive
+    for (int b(1); !useSAHBuilder() && b < BOUNDING_BOXES_TREE_DEPTH; ++b)
     {
 #pragma omp parallel
         for (BoxContainer::iterator itb = m_boundingBoxes[m_frame][b].begin(); itb != m_boundingBoxes[m_frame][b].end();
@@ -1461,40 +2696,59 @@ void GPUKernel::rotatePrimitives(const vec3f &rotationCenter, const vec4f &angle
 void GPUKernel::translatePrimitives(const vec3f &translation)
 {
     LOG_INFO(3, "GPUKernel::translatePrimitives (" << m_boundingBoxes[m_frame][0].size() << ")");
-    m_primitivesTransfered = false;
+    // Transformed leaves are only recorded when refitBVH refits them
+    const bool refitLeaves = useSAHBuilder() && m_bvhRefitFrame == static_cast<int>(m_frame);
     for (BoxContainer::iterator itb = m_boundingBoxes[m_frame][0].begin(); itb != m_boundingBoxes[m_frame][0].end();
          ++itb)
     {
 #pragma omp single nowait
         {
             CPUBoundingBox &box = (*itb).second;
+            const bool wasModified = box.modified;
             resetBox(box, false);
 
             for (std::vector<long>::iterator it = box.primitives.begin(); it != box.primitives.end(); ++it)
             {
                 //#pragma single nowait
-                CPUPrimitive &primitive((m_primitives[m_frame])[*it]);
-                if (primitive.movable && primitive.type != ptCamera)
+                PrimitiveContainer &primitives = m_primitives[m_frame];
+                const long p = *it;
+                if (primitives.movable[p] && primitives.types[p] == ptInstance)
                 {
-                    primitive.p0.x += translation.x;
-                    primitive.p0.y += translation.y;
-                    primitive.p0.z += translation.z;
-
-                    primitive.p1.x += translation.x;
-                    primitive.p1.y += translation.y;
-                    primitive.p1.z += translation.z;
-
-                    primitive.p2.x += translation.x;
-                    primitive.p2.y += translation.y;
-                    primitive.p2.z += translation.z;
+                    vec3f &instanceTranslation = primitives.attributes[p].n0;
+                    instanceTranslation.x += translation.x;
+                    instanceTranslation.y += translation.y;
+                    instanceTranslation.z += translation.z;
+                    box.modified = true;
+                }
+                else if (primitives.movable[p] && primitives.types[p] != ptCamera)
+                {
+                    primitives.p0s[p].x += translation.x;
+                    primitives.p0s[p].y += translation.y;
+                    primitives.p0s[p].z += translation.z;
+
+                    primitives.p1s[p].x += translation.x;
+                    primitives.p1s[p].y += translation.y;
+                    primitives.p1s[p].z += translation.z;
+
+                    primitives.p2s[p].x += translation.x;
+                    primitives.p2s[p].y += translation.y;
+                    primitives.p2s[p].z += translation.z;
+                    box.modified = true;
                 }
                 updateBoundingBox(box);
             }
+            // Transformed leaves, for refitBVH
+            if (refitLeaves && !wasModified && box.modified)
+            {
+#pragma omp critical
+                m_refitLeaves.push_back(static_cast<int>((*itb).first));
+            }
         }
     }
 
-    // Update bounding boxes
-    for (int b(1); b < BOUNDING_BOXES_TREE_DEPTH; ++b)
+    // Update bounding boxes. The inner nodes of the SAH hierarchy are
+    // refitted by refitBVH, its level 0 is indexed by leaf and not by primitive
+    for (int b(1); !useSAHBuilder() && b < BOUNDING_BOXES_TREE_DEPTH; ++b)
     {
 #pragma omp parallel
         for (BoxContainer::iterator itb = m_boundingBoxes[m_frame][b].begin(); itb != m_boundingBoxes[m_frame][b].end();
@@ -1517,12 +2771,13 @@ void GPUKernel::morphPrimitives()
         LOG_INFO(3, "Morphing frame " << frame << ", " << m_primitives[0].size() << " primitives");
         setFrame(frame);
         resetFrame();
-        PrimitiveContainer::iterator it2 = m_primitives[m_nbFrames - 1].begin();
-        for (PrimitiveContainer::iterator it1 = m_primitives[0].begin();
-             it1 != m_primitives[0].end() && it2 != m_primitives[m_nbFrames - 1].end(); ++it1)
+        const size_t nbPrimitives = std::min(m_primitives[0].size(), m_primitives[m_nbFrames - 1].size());
+        for (size_t p(0); p < nbPrimitives; ++p)
         {
-            CPUPrimitive &primitive1((*it1).second);
-            CPUPrimitive &primitive2((*it2).second);
+            // Primitives are added to the current frame, references to the
+            // others stay valid
+            const CPUPrimitive primitive1 = m_primitives[0].get(p);
+            const CPUPrimitive primitive2 = m_primitives[m_nbFrames - 1].get(p);
             vec3f p0, p1, p2;
             vec3f n0, n1, n2;
             vec3f size;
@@ -1563,8 +2818,6 @@ void GPUKernel::morphPrimitives()
             setPrimitiveTextureCoordinates(i, primitive1.vt0, primitive1.vt1, primitive1.vt2);
 
             setPrimitiveIsMovable(i, primitive1.movable);
-
-            ++it2;
         }
         compactBoxes(true);
     }
@@ -1574,27 +2827,35 @@ void GPUKernel::scalePrimitives(float scale, unsigned int from, unsigned int to)
 {
     LOG_INFO(3, "GPUKernel::scalePrimitives(" << from << "->" << to << ")");
     m_primitivesTransfered = false;
+    invalidateBVHRefit();
 
-    PrimitiveContainer::iterator it = (m_primitives[m_frame]).begin();
-    while (it != (m_primitives[m_frame]).end())
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    for (size_t p(0); p < primitives.size(); ++p)
     {
-        CPUPrimitive &primitive((*it).second);
-        primitive.p0.x *= scale;
-        primitive.p0.y *= scale;
-        primitive.p0.z *= scale;
+        if (primitives.types[p] == ptInstance)
+        {
+            // Meshes are scaled with the rest of the scene
+            vec3f &translation = primitives.attributes[p].n0;
+            translation.x *= scale;
+            translation.y *= scale;
+            translation.z *= scale;
+            continue;
+        }
+        primitives.p0s[p].x *= scale;
+        primitives.p0s[p].y *= scale;
+        primitives.p0s[p].z *= scale;
 
-        primitive.p1.x *= scale;
-        primitive.p1.y *= scale;
-        primitive.p1.z *= scale;
+        primitives.p1s[p].x *= scale;
+        primitives.p1s[p].y *= scale;
+        primitives.p1s[p].z *= scale;
 
-        primitive.p2.x *= scale;
-        primitive.p2.y *= scale;
-        primitive.p2.z *= scale;
+        primitives.p2s[p].x *= scale;
+        primitives.p2s[p].y *= scale;
+        primitives.p2s[p].z *= scale;
 
-        primitive.size.x *= scale;
-        primitive.size.y *= scale;
-        primitive.size.z *= scale;
-        ++it;
+        primitives.sizes[p].x *= scale;
+        primitives.sizes[p].y *= scale;
+        primitives.sizes[p].z *= scale;
     }
 }
 
@@ -1639,6 +2900,16 @@ void GPUKernel::rotatePrimitive(CPUPrimitive &primitive, const vec3f &rotationCe
                                 const vec3f &sinAngles)
 {
     LOG_INFO(3, "GPUKernel::rotatePrimitive");
+    if (primitive.type == ptInstance)
+    {
+        // The rotation of the instance is combined with the new one
+        vec3f zeroCenter = make_vec3f();
+        rotateVector(primitive.p0, zeroCenter, cosAngles, sinAngles);
+        rotateVector(primitive.p1, zeroCenter, cosAngles, sinAngles);
+        rotateVector(primitive.p2, zeroCenter, cosAngles, sinAngles);
+        rotateVector(primitive.n0, rotationCenter, cosAngles, sinAngles);
+        return;
+    }
     rotateVector(primitive.p0, rotationCenter, cosAngles, sinAngles);
     if (primitive.type == ptCylinder || primitive.type == ptTriangle)
     {
@@ -1673,31 +2944,180 @@ void GPUKernel::rotatePrimitive(CPUPrimitive &primitive, const vec3f &rotationCe
 vec4f GPUKernel::getPrimitiveCenter(unsigned int index)
 {
     vec4f center = make_vec4f();
-    if (index <= m_primitives[m_frame].size())
+    if (index < m_primitives[m_frame].size())
     {
-        center.x = (m_primitives[m_frame])[index].p0.x;
-        center.y = (m_primitives[m_frame])[index].p0.y;
-        center.z = (m_primitives[m_frame])[index].p0.z;
+        const vec3f &p0 = m_primitives[m_frame].p0s[index];
+        center.x = p0.x;
+        center.y = p0.y;
+        center.z = p0.z;
     }
     return center;
 }
 
 void GPUKernel::getPrimitiveOtherCenter(unsigned int index, vec3f &center)
 {
-    if (index <= m_primitives[m_frame].size())
-        center = (m_primitives[m_frame])[index].p1;
+    if (index < m_primitives[m_frame].size())
+        center = m_primitives[m_frame].p1s[index];
 }
 
 void GPUKernel::setPrimitiveCenter(unsigned int index, const vec3f &center)
 {
-    m_primitivesTransfered = false;
+    if (index < m_primitives[m_frame].size())
+    {
+        vec3f &p0 = m_primitives[m_frame].p0s[index];
+        p0.x = center.x;
+        p0.y = center.y;
+        p0.z = center.z;
+        markPrimitiveModified(index);
+    }
+}
+
+int GPUKernel::addMesh(const int from, const int to)
+{
+    LOG_INFO(3, "GPUKernel::addMesh(" << from << "," << to << ")");
+    CPUMesh mesh;
+    mesh.startBox = 0;
+    for (int i(from); i <= to; ++i)
+    {
+        if (i < 0 || i >= static_cast<int>(m_primitives[m_frame].size()) || m_primitives[m_frame].types[i] == ptInstance)
+        {
+            LOG_ERROR("Primitive " << i << " cannot be part of a mesh");
+            continue;
+        }
+
+        vec3f p0, p1;
+        getPrimitiveBounds(m_primitives[m_frame], i, p0, p1);
+        mesh.parameters[0] = mesh.primitives.empty() ? p0 : min2(mesh.parameters[0], p0);
+        mesh.parameters[1] = mesh.primitives.empty() ? p1 : max2(mesh.parameters[1], p1);
+        mesh.primitives.push_back(i);
+    }
+
+    if (mesh.primitives.empty())
+        return -1;
+    invalidateBVHRefit();
+    m_meshes[m_frame].push_back(mesh);
+    return static_cast<int>(m_meshes[m_frame].size() - 1);
+}
+
+int GPUKernel::getNbMeshes()
+{
+    return static_cast<int>(m_meshes[m_frame].size());
+}
+
+void GPUKernel::setMeshName(const int meshId, const std::string &name)
+{
+    if (meshId >= 0 && meshId < static_cast<int>(m_meshes[m_frame].size()))
+        m_meshes[m_frame][meshId].name = name;
+}
+
+int GPUKernel::getMeshId(const std::string &name)
+{
+    for (size_t i(0); i < m_meshes[m_frame].size(); ++i)
+        if (m_meshes[m_frame][i].name == name)
+            return static_cast<int>(i);
+    return -1;
+}
+
+void GPUKernel::getMeshBounds(const int meshId, vec3f &minimum, vec3f &maximum)
+{
+    if (meshId < 0 || meshId >= static_cast<int>(m_meshes[m_frame].size()))
+        return;
+    minimum = m_meshes[m_frame][meshId].parameters[0];
+    maximum = m_meshes[m_frame][meshId].parameters[1];
+}
+
+int GPUKernel::addIndexedMesh(const vec3fs &vertices, const vec3fs &normals, const vec2fs &textureCoordinates,
+                              const vec4is &triangles)
+{
+    LOG_INFO(3, "GPUKernel::addIndexedMesh(" << vertices.size() << "," << triangles.size() << ")");
+    CPUMesh mesh;
+    mesh.startBox = 0;
+    mesh.vertices = vertices;
+    mesh.normals = normals;
+    mesh.textureCoordinates = textureCoordinates;
+    mesh.normals.resize(vertices.size(), make_vec3f());
+    mesh.textureCoordinates.resize(vertices.size(), make_vec2f());
+    const int nbVertices = static_cast<int>(vertices.size());
+    for (const auto &triangle : triangles)
+    {
+        if (triangle.x < 0 || triangle.x >= nbVertices || triangle.y < 0 || triangle.y >= nbVertices ||
+            triangle.z < 0 || triangle.z >= nbVertices)
+        {
+            LOG_ERROR("Invalid triangle " << triangle.x << "," << triangle.y << "," << triangle.z);
+            continue;
+        }
+        mesh.triangles.push_back(triangle);
+    }
+
+    if (mesh.triangles.empty())
+        return -1;
+    mesh.parameters[0] = mesh.parameters[1] = vertices[mesh.triangles[0].x];
+    for (const auto &triangle : mesh.triangles)
+    {
+        const vec3f &v0 = vertices[triangle.x];
+        const vec3f &v1 = vertices[triangle.y];
+        const vec3f &v2 = vertices[triangle.z];
+        mesh.parameters[0] = min2(mesh.parameters[0], min2(v0, min2(v1, v2)));
+        mesh.parameters[1] = max2(mesh.parameters[1], max2(v0, max2(v1, v2)));
+    }
+    invalidateBVHRefit();
+    m_meshes[m_frame].push_back(mesh);
+    return static_cast<int>(m_meshes[m_frame].size() - 1);
+}
+
+int GPUKernel::addInstance(const int meshId, const vec3f &translation, const vec4f &angles, const float scale)
+{
+    LOG_INFO(3, "GPUKernel::addInstance(" << meshId << ")");
+    if (meshId < 0 || meshId >= static_cast<int>(m_meshes[m_frame].size()))
+    {
+        LOG_ERROR("Invalid mesh " << meshId);
+        return -1;
+    }
+
+    const int index = addPrimitive(ptInstance);
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    primitives.movable[index] = true;
+    primitives.sizes[index].y = static_cast<float>(meshId);
+    const CPUMesh &mesh = m_meshes[m_frame][meshId];
+    primitives.materialIds[index] =
+        mesh.triangles.empty() ? primitives.materialIds[mesh.primitives[0]] : mesh.triangles[0].w;
+    setInstanceTransformation(index, translation, angles, scale);
+    return index;
+}
+
+void GPUKernel::setInstanceTransformation(const int index, const vec3f &translation, const vec4f &angles,
+                                          const float scale)
+{
+    if (index < 0 || index >= static_cast<int>(m_primitives[m_frame].size()) ||
+        m_primitives[m_frame].types[index] != ptInstance)
+    {
+        LOG_ERROR("Primitive " << index << " is not an instance");
+        return;
+    }
 
-    // TODO, Box needs to be updated
-    if (index <= m_primitives[m_frame].size())
+    // Rows of the rotation from world space to mesh space are the rotated axes
+    PrimitiveContainer &primitives = m_primitives[m_frame];
+    const vec3f cosAngles = make_vec3f(cosf(angles.x), cosf(angles.y), cosf(angles.z));
+    const vec3f sinAngles = make_vec3f(sinf(angles.x), sinf(angles.y), sinf(angles.z));
+    const vec3f zeroCenter = make_vec3f();
+    primitives.p0s[index] = make_vec3f(1.f, 0.f, 0.f);
+    primitives.p1s[index] = make_vec3f(0.f, 1.f, 0.f);
+    primitives.p2s[index] = make_vec3f(0.f, 0.f, 1.f);
+    rotateVector(primitives.p0s[index], zeroCenter, cosAngles, sinAngles);
+    rotateVector(primitives.p1s[index], zeroCenter, cosAngles, sinAngles);
+    rotateVector(primitives.p2s[index], zeroCenter, cosAngles, sinAngles);
+    primitives.attributes[index].n0 = make_vec3f(translation.x, translation.y, translation.z);
+    primitives.sizes[index].x = scale;
+
+    // Only the leaf of the top level hierarchy containing the instance needs
+    // to be refitted
+    if (index < static_cast<int>(m_primitiveLeaves[m_frame].size()) && m_primitiveLeaves[m_frame][index] != -1)
     {
-        (m_primitives[m_frame])[index].p0.x = center.x;
-        (m_primitives[m_frame])[index].p0.y = center.y;
-        (m_primitives[m_frame])[index].p0.z = center.z;
+        CPUBoundingBox &box = m_boundingBoxes[m_frame][0][m_primitiveLeaves[m_frame][index]];
+        updateBoundingBox(box);
+        if (!box.modified)
+            m_refitLeaves.push_back(m_primitiveLeaves[m_frame][index]);
+        box.modified = true;
     }
 }
 
@@ -1740,9 +3160,10 @@ int GPUKernel::addRectangle(float x, float y, float z, float w, float h, float d
 void GPUKernel::setPrimitiveMaterial(unsigned int index, int materialId)
 {
     LOG_INFO(3, "GPUKernel::setPrimitiveMaterial(" << index << "," << materialId << ")");
-    if (index <= m_primitives[m_frame].size())
+    invalidateBVHRefit();
+    if (index < m_primitives[m_frame].size())
     {
-        (m_primitives[m_frame])[index].materialId = materialId;
+        m_primitives[m_frame].materialIds[index] = materialId;
         // TODO: updateLight( index );
     }
 }
@@ -1751,9 +3172,9 @@ int GPUKernel::getPrimitiveMaterial(unsigned int index)
 {
     LOG_INFO(3, "GPUKernel::getPrimitiveMaterial(" << index << ")");
     unsigned int returnValue(-1);
-    if (index <= m_primitives[m_frame].size())
+    if (index < m_primitives[m_frame].size())
     {
-        returnValue = (m_primitives[m_frame])[index].materialId;
+        returnValue = m_primitives[m_frame].materialIds[index];
     }
     return returnValue;
 }
@@ -1772,7 +3193,7 @@ void GPUKernel::setMaterial(unsigned int index, const Material &material)
     if (index < NB_MAX_MATERIALS)
     {
         m_hMaterials[index] = material;
-        m_materialsTransfered = false;
+        addDirtyRange(m_dirtyMaterials, index, index + 1);
     }
 }
 
@@ -1881,6 +3302,8 @@ void GPUKernel::setMaterial(unsigned int index, float r, float g, float b, float
                 (transparentTextureId == TEXTURE_NONE) ? 0 : m_hTextures[transparentTextureId].offset;
             m_hMaterials[index].advancedTextureOffset.z =
                 (ambientOcclusionTextureId == TEXTURE_NONE) ? 0 : m_hTextures[ambientOcclusionTextureId].offset;
+            m_hMaterials[index].advancedTextureOffset.w = getMaterialTextureCompression(index);
+            m_hMaterials[index].advancedTextureIds.w = getMaterialTextureDepths(index);
         }
         else
         {
@@ -1899,7 +3322,7 @@ void GPUKernel::setMaterial(unsigned int index, float r, float g, float b, float
             m_hMaterials[index].textureOffset.w = 0;
         }
 
-        m_materialsTransfered = false;
+        addDirtyRange(m_dirtyMaterials, index, index + 1);
     }
     else
     {
@@ -1919,7 +3342,7 @@ void GPUKernel::setMaterialColor(unsigned int index, float r, float g, float b)
             m_hMaterials[index].color.x = r;
             m_hMaterials[index].color.y = g;
             m_hMaterials[index].color.z = b;
-            m_materialsTransfered = false;
+            addDirtyRange(m_dirtyMaterials, index, index + 1);
         }
     }
     else
@@ -1947,7 +3370,9 @@ void GPUKernel::setMaterialTextureId(unsigned int textureId)
         m_hMaterials[m_currentMaterial].textureIds.y = TEXTURE_NONE;
         m_hMaterials[m_currentMaterial].textureIds.z = TEXTURE_NONE;
         m_hMaterials[m_currentMaterial].textureIds.w = TEXTURE_NONE;
-        m_materialsTransfered = false;
+        m_hMaterials[m_currentMaterial].advancedTextureOffset.w = getMaterialTextureCompression(m_currentMaterial);
+        m_hMaterials[m_currentMaterial].advancedTextureIds.w = getMaterialTextureDepths(m_currentMaterial);
+        addDirtyRange(m_dirtyMaterials, m_currentMaterial, m_currentMaterial + 1);
     }
 }
 
@@ -2020,15 +3445,16 @@ void GPUKernel::setTexture(const int index, const TextureInfo &textureInfo)
         ++m_nbActiveTextures;
     if (m_hTextures[index].buffer != 0)
         delete[] m_hTextures[index].buffer;
-    int size = textureInfo.size.x * textureInfo.size.y * textureInfo.size.z;
+    const size_t size = textureBufferSize(textureInfo);
     m_hTextures[index].buffer = new BitmapBuffer[size];
-    m_hTextures[index].offset = 0;
     m_hTextures[index].size.x = textureInfo.size.x;
     m_hTextures[index].size.y = textureInfo.size.y;
     m_hTextures[index].size.z = textureInfo.size.z;
+    m_hTextures[index].levels = textureInfo.levels;
+    m_hTextures[index].compression = textureInfo.compression;
     memcpy(m_hTextures[index].buffer, textureInfo.buffer, size);
-    realignTexturesAndMaterials();
-    m_texturesTransfered = false;
+    m_dirtyTextures.insert(index);
+    processTextureOffsets();
 }
 
 void GPUKernel::getTexture(const int index, TextureInfo &textureInfo)
@@ -2113,7 +3539,6 @@ bool GPUKernel::loadTextureFromFile(const int index, const std::string &filename
 
     if (filename.length() != 0)
     {
-        m_texturesTransfered = false;
         ImageLoader imageLoader;
 
         if (filename.find(".bmp") != std::string::npos)
@@ -2132,6 +3557,16 @@ bool GPUKernel::loadTextureFromFile(const int index, const std::string &filename
         if (result)
         {
             m_textureFilenames[index] = filename;
+            if (m_rgbaTextures && !m_textureCompression)
+                imageLoader.expandToRGBA(m_hTextures[index]);
+            buildMipmaps(index);
+#ifdef USE_OPENCL
+            if (m_textureCompression)
+                imageLoader.compress(m_hTextures[index]);
+#endif
+            m_dirtyTextures.insert(index);
+            // Materials hold the number of mip levels of their maps
+            m_materialsTransfered = false;
             m_hTextures[index].type = tex_diffuse; // Default texture type is 'diffused'
             if (filename.find("b.") != std::string::npos)
                 m_hTextures[index].type = tex_bump;
@@ -2159,6 +3594,62 @@ bool GPUKernel::loadTextureFromFile(const int index, const std::string &filename
     return result;
 }
 
+void GPUKernel::buildMipmaps(const int index)
+{
+    TextureInfo &texture = m_hTextures[index];
+    const int depth = texture.size.z;
+    int width = texture.size.x;
+    int height = texture.size.y;
+
+    // Levels go down to a single texel
+    texture.levels = 1;
+    while (width > 1 || height > 1)
+    {
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        ++texture.levels;
+    }
+
+    // The chain is stored after the full resolution texture, in the same buffer
+    BitmapBuffer *buffer = new BitmapBuffer[textureBufferSize(texture)];
+    memcpy(buffer, texture.buffer, texture.size.x * texture.size.y * depth);
+    delete[] texture.buffer;
+    texture.buffer = buffer;
+
+    // Each texel is the average of the 2x2 texels of the previous level
+    const BitmapBuffer *source = buffer;
+    BitmapBuffer *destination = buffer;
+    width = texture.size.x;
+    height = texture.size.y;
+    for (int level = 1; level < texture.levels; ++level)
+    {
+        destination += width * height * depth;
+        const int levelWidth = std::max(1, width / 2);
+        const int levelHeight = std::max(1, height / 2);
+        for (int y = 0; y < levelHeight; ++y)
+        {
+            const int y0 = std::min(y * 2, height - 1) * width;
+            const int y1 = std::min(y * 2 + 1, height - 1) * width;
+            for (int x = 0; x < levelWidth; ++x)
+            {
+                const int x0 = std::min(x * 2, width - 1);
+                const int x1 = std::min(x * 2 + 1, width - 1);
+                for (int c = 0; c < depth; ++c)
+                {
+                    const int sum = source[(y0 + x0) * depth + c] + source[(y0 + x1) * depth + c] +
+                                    source[(y1 + x0) * depth + c] + source[(y1 + x1) * depth + c];
+                    destination[(y * levelWidth + x) * depth + c] = static_cast<BitmapBuffer>((sum + 2) / 4);
+                }
+            }
+        }
+        source = destination;
+        width = levelWidth;
+        height = levelHeight;
+    }
+    LOG_INFO(3, "Texture " << index << ": " << texture.levels << " mip levels, " << textureBufferSize(texture)
+                           << " bytes");
+}
+
 void GPUKernel::reorganizeLights()
 {
     LOG_INFO(1, "GPUKernel::reorganizeLights()");
@@ -2243,107 +3734,176 @@ void GPUKernel::realignTexturesAndMaterials()
 
     // Materials
     for (int i(0); i < m_nbActiveMaterials; ++i)
-    {
-        int diffuseTextureId = m_hMaterials[i].textureIds.x;
-        int normalTextureId = m_hMaterials[i].textureIds.y;
-        int bumpTextureId = m_hMaterials[i].textureIds.z;
-        int specularTextureId = m_hMaterials[i].textureIds.w;
-        int reflectionTextureId = m_hMaterials[i].advancedTextureIds.x;
-        int transparencyTextureId = m_hMaterials[i].advancedTextureIds.y;
+        realignMaterial(i);
+}
 
-        if (diffuseTextureId != TEXTURE_NONE)
-            LOG_INFO(3, "Material " << i << ": ids=" << diffuseTextureId);
+void GPUKernel::realignDirtyMaterials()
+{
+    // Texture offsets are unchanged, only modified materials are realigned
+    for (const auto &range : m_dirtyMaterials)
+        for (size_t i = range.begin; i < range.end; ++i)
+            realignMaterial(static_cast<int>(i));
+}
 
-        switch (diffuseTextureId)
+int GPUKernel::getMaterialMipLevels(const int index)
+{
+    // All maps of a material are sampled at the same texel coordinates, mipmapping
+    // is only possible when they all share the size of the diffuse map
+    const int diffuseTextureId = m_hMaterials[index].textureIds.x;
+    if (diffuseTextureId < 0 || diffuseTextureId >= static_cast<int>(NB_MAX_TEXTURES))
+        return 0;
+    const TextureInfo &diffuse = m_hTextures[diffuseTextureId];
+    int levels = diffuse.levels;
+    const int maps[] = {m_hMaterials[index].textureIds.y,         m_hMaterials[index].textureIds.z,
+                        m_hMaterials[index].textureIds.w,         m_hMaterials[index].advancedTextureIds.x,
+                        m_hMaterials[index].advancedTextureIds.y, m_hMaterials[index].advancedTextureIds.z};
+    for (const int map : maps)
+        if (map >= 0 && map < static_cast<int>(NB_MAX_TEXTURES))
         {
-        case TEXTURE_MANDELBROT:
-        case TEXTURE_JULIA:
-            m_hMaterials[i].textureMapping.x = 40000;
-            m_hMaterials[i].textureMapping.y = 40000;
-            m_hMaterials[i].textureMapping.z = TEXTURE_NONE; // Deprecated
-            m_hMaterials[i].textureMapping.w = 3;
-            m_hMaterials[i].textureIds.x = diffuseTextureId;
-            m_hMaterials[i].textureIds.y = TEXTURE_NONE;
-            m_hMaterials[i].textureIds.z = TEXTURE_NONE;
-            m_hMaterials[i].textureIds.w = TEXTURE_NONE;
-            m_hMaterials[i].textureOffset.x = 0;
-            m_hMaterials[i].textureOffset.y = 0;
-            m_hMaterials[i].textureOffset.z = 0;
-            m_hMaterials[i].textureOffset.w = 0;
-            m_hMaterials[i].advancedTextureIds.x = TEXTURE_NONE;
-            m_hMaterials[i].advancedTextureIds.y = TEXTURE_NONE;
-            m_hMaterials[i].advancedTextureIds.z = TEXTURE_NONE;
-            m_hMaterials[i].advancedTextureIds.w = TEXTURE_NONE;
-            m_hMaterials[i].advancedTextureOffset.x = 0;
-            m_hMaterials[i].advancedTextureOffset.y = 0;
-            m_hMaterials[i].advancedTextureOffset.z = 0;
-            m_hMaterials[i].advancedTextureOffset.w = 0;
-            break;
-        default:
-            if (diffuseTextureId < m_nbActiveTextures)
-            {
-                m_hMaterials[i].textureMapping.x = m_hTextures[diffuseTextureId].size.x;
-                m_hMaterials[i].textureMapping.y = m_hTextures[diffuseTextureId].size.y;
-                m_hMaterials[i].textureMapping.z = TEXTURE_NONE; // Deprecated
-                m_hMaterials[i].textureMapping.w = m_hTextures[diffuseTextureId].size.z;
-                m_hMaterials[i].textureIds.x = diffuseTextureId;
-                m_hMaterials[i].textureIds.y = normalTextureId;
-                m_hMaterials[i].textureIds.z = bumpTextureId;
-                m_hMaterials[i].textureIds.w = specularTextureId;
-                m_hMaterials[i].textureOffset.x =
-                    (diffuseTextureId == TEXTURE_NONE) ? 0 : m_hTextures[diffuseTextureId].offset;
-                m_hMaterials[i].textureOffset.y =
-                    (normalTextureId == TEXTURE_NONE) ? 0 : m_hTextures[normalTextureId].offset;
-                m_hMaterials[i].textureOffset.z =
-                    (bumpTextureId == TEXTURE_NONE) ? 0 : m_hTextures[bumpTextureId].offset;
-                m_hMaterials[i].textureOffset.w =
-                    (specularTextureId == TEXTURE_NONE) ? 0 : m_hTextures[specularTextureId].offset;
-                m_hMaterials[i].advancedTextureIds.x = reflectionTextureId;
-                m_hMaterials[i].advancedTextureIds.y = transparencyTextureId;
-                m_hMaterials[i].advancedTextureOffset.x =
-                    (reflectionTextureId == TEXTURE_NONE) ? 0 : m_hTextures[reflectionTextureId].offset;
-                m_hMaterials[i].advancedTextureOffset.y =
-                    (transparencyTextureId == TEXTURE_NONE) ? 0 : m_hTextures[transparencyTextureId].offset;
-                m_hMaterials[i].mappingOffset.x = 1.f;
-                m_hMaterials[i].mappingOffset.y = 0.f;
-            }
-            else
-            {
-                m_hMaterials[i].textureMapping.x = 1;
-                m_hMaterials[i].textureMapping.y = 1;
-                m_hMaterials[i].textureMapping.z = TEXTURE_NONE; // Deprecated
-                m_hMaterials[i].textureMapping.w = 1;
-                m_hMaterials[i].textureIds.x = diffuseTextureId;
-                m_hMaterials[i].textureIds.y = normalTextureId;
-                m_hMaterials[i].textureIds.z = bumpTextureId;
-                m_hMaterials[i].textureIds.w = specularTextureId;
-                m_hMaterials[i].textureOffset.x = 0;
-                m_hMaterials[i].textureOffset.y = 0;
-                m_hMaterials[i].textureOffset.z = 0;
-                m_hMaterials[i].textureOffset.w = 0;
-                m_hMaterials[i].advancedTextureIds.x = reflectionTextureId;
-                m_hMaterials[i].advancedTextureIds.y = transparencyTextureId;
-                m_hMaterials[i].advancedTextureIds.z = TEXTURE_NONE;
-                m_hMaterials[i].advancedTextureIds.w = TEXTURE_NONE;
-                m_hMaterials[i].advancedTextureOffset.x = 0;
-                m_hMaterials[i].advancedTextureOffset.y = 0;
-                m_hMaterials[i].advancedTextureOffset.z = 0;
-                m_hMaterials[i].advancedTextureOffset.w = 0;
-                m_hMaterials[i].mappingOffset.x = 1.f;
-                m_hMaterials[i].mappingOffset.y = 1.f;
-            }
+            const TextureInfo &texture = m_hTextures[map];
+            const bool sameSize = texture.size.x == diffuse.size.x && texture.size.y == diffuse.size.y;
+            levels = sameSize ? std::min(levels, texture.levels) : 0;
         }
+    return levels;
+}
+
+int GPUKernel::getMaterialTextureCompression(const int index)
+{
+    // 2 bits per map, indexed by the type of texture the map is used as
+    const int maps[][2] = {{m_hMaterials[index].textureIds.x, tex_diffuse},
+                           {m_hMaterials[index].textureIds.y, tex_normal},
+                           {m_hMaterials[index].textureIds.z, tex_bump},
+                           {m_hMaterials[index].textureIds.w, tex_specular},
+                           {m_hMaterials[index].advancedTextureIds.x, tex_reflective},
+                           {m_hMaterials[index].advancedTextureIds.y, tex_transparent},
+                           {m_hMaterials[index].advancedTextureIds.z, tex_ambient_occlusion}};
+    int compression = 0;
+    for (const auto &map : maps)
+        if (map[0] >= 0 && map[0] < static_cast<int>(NB_MAX_TEXTURES))
+            compression |= m_hTextures[map[0]].compression << (2 * map[1]);
+    return compression;
+}
+
+int GPUKernel::getMaterialTextureDepths(const int index)
+{
+    // 4 bits per map, indexed by the type of texture the map is used as
+    const int maps[][2] = {{m_hMaterials[index].textureIds.x, tex_diffuse},
+                           {m_hMaterials[index].textureIds.y, tex_normal},
+                           {m_hMaterials[index].textureIds.z, tex_bump},
+                           {m_hMaterials[index].textureIds.w, tex_specular},
+                           {m_hMaterials[index].advancedTextureIds.x, tex_reflective},
+                           {m_hMaterials[index].advancedTextureIds.y, tex_transparent},
+                           {m_hMaterials[index].advancedTextureIds.z, tex_ambient_occlusion}};
+    int depths = 0;
+    for (const auto &map : maps)
+        if (map[0] >= 0 && map[0] < static_cast<int>(NB_MAX_TEXTURES))
+            depths |= (m_hTextures[map[0]].size.z & 15) << (4 * map[1]);
+    return depths;
+}
 
-        if (diffuseTextureId != TEXTURE_NONE)
+void GPUKernel::realignMaterial(const int index)
+{
+    int diffuseTextureId = m_hMaterials[index].textureIds.x;
+    int normalTextureId = m_hMaterials[index].textureIds.y;
+    int bumpTextureId = m_hMaterials[index].textureIds.z;
+    int specularTextureId = m_hMaterials[index].textureIds.w;
+    int reflectionTextureId = m_hMaterials[index].advancedTextureIds.x;
+    int transparencyTextureId = m_hMaterials[index].advancedTextureIds.y;
+
+    if (diffuseTextureId != TEXTURE_NONE)
+        LOG_INFO(3, "Material " << index << ": ids=" << diffuseTextureId);
+
+    switch (diffuseTextureId)
+    {
+    case TEXTURE_MANDELBROT:
+    case TEXTURE_JULIA:
+        m_hMaterials[index].textureMapping.x = 40000;
+        m_hMaterials[index].textureMapping.y = 40000;
+        m_hMaterials[index].textureMapping.z = TEXTURE_NONE; // Deprecated
+        m_hMaterials[index].textureMapping.w = 3;
+        m_hMaterials[index].textureIds.x = diffuseTextureId;
+        m_hMaterials[index].textureIds.y = TEXTURE_NONE;
+        m_hMaterials[index].textureIds.z = TEXTURE_NONE;
+        m_hMaterials[index].textureIds.w = TEXTURE_NONE;
+        m_hMaterials[index].textureOffset.x = 0;
+        m_hMaterials[index].textureOffset.y = 0;
+        m_hMaterials[index].textureOffset.z = 0;
+        m_hMaterials[index].textureOffset.w = 0;
+        m_hMaterials[index].advancedTextureIds.x = TEXTURE_NONE;
+        m_hMaterials[index].advancedTextureIds.y = TEXTURE_NONE;
+        m_hMaterials[index].advancedTextureIds.z = TEXTURE_NONE;
+        m_hMaterials[index].advancedTextureIds.w = TEXTURE_NONE;
+        m_hMaterials[index].advancedTextureOffset.x = 0;
+        m_hMaterials[index].advancedTextureOffset.y = 0;
+        m_hMaterials[index].advancedTextureOffset.z = 0;
+        m_hMaterials[index].advancedTextureOffset.w = 0;
+        break;
+    default:
+        if (diffuseTextureId < m_nbActiveTextures)
+        {
+            m_hMaterials[index].textureMapping.x = m_hTextures[diffuseTextureId].size.x;
+            m_hMaterials[index].textureMapping.y = m_hTextures[diffuseTextureId].size.y;
+            m_hMaterials[index].textureMapping.z = getMaterialMipLevels(index);
+            m_hMaterials[index].textureMapping.w = m_hTextures[diffuseTextureId].size.z;
+            m_hMaterials[index].textureIds.x = diffuseTextureId;
+            m_hMaterials[index].textureIds.y = normalTextureId;
+            m_hMaterials[index].textureIds.z = bumpTextureId;
+            m_hMaterials[index].textureIds.w = specularTextureId;
+            m_hMaterials[index].textureOffset.x =
+                (diffuseTextureId == TEXTURE_NONE) ? 0 : m_hTextures[diffuseTextureId].offset;
+            m_hMaterials[index].textureOffset.y =
+                (normalTextureId == TEXTURE_NONE) ? 0 : m_hTextures[normalTextureId].offset;
+            m_hMaterials[index].textureOffset.z =
+                (bumpTextureId == TEXTURE_NONE) ? 0 : m_hTextures[bumpTextureId].offset;
+            m_hMaterials[index].textureOffset.w =
+                (specularTextureId == TEXTURE_NONE) ? 0 : m_hTextures[specularTextureId].offset;
+            m_hMaterials[index].advancedTextureIds.x = reflectionTextureId;
+            m_hMaterials[index].advancedTextureIds.y = transparencyTextureId;
+            m_hMaterials[index].advancedTextureOffset.x =
+                (reflectionTextureId == TEXTURE_NONE) ? 0 : m_hTextures[reflectionTextureId].offset;
+            m_hMaterials[index].advancedTextureOffset.y =
+                (transparencyTextureId == TEXTURE_NONE) ? 0 : m_hTextures[transparencyTextureId].offset;
+            m_hMaterials[index].advancedTextureOffset.w = getMaterialTextureCompression(index);
+            m_hMaterials[index].advancedTextureIds.w = getMaterialTextureDepths(index);
+            m_hMaterials[index].mappingOffset.x = 1.f;
+            m_hMaterials[index].mappingOffset.y = 0.f;
+        }
+        else
         {
-            LOG_INFO(3, "Material " << i << ": " << m_hMaterials[i].textureMapping.x << "x"
-                                    << m_hMaterials[i].textureMapping.y << "x" << m_hMaterials[i].textureMapping.w
-                                    << ", Wireframe: " << m_hMaterials[i].attributes.z << ", diffuseTextureId ["
-                                    << diffuseTextureId << "] offset=" << m_hMaterials[i].textureOffset.x
-                                    << ", bumpTextureId [" << bumpTextureId
-                                    << "] offset=" << m_hMaterials[i].textureOffset.y);
+            m_hMaterials[index].textureMapping.x = 1;
+            m_hMaterials[index].textureMapping.y = 1;
+            m_hMaterials[index].textureMapping.z = TEXTURE_NONE; // Deprecated
+            m_hMaterials[index].textureMapping.w = 1;
+            m_hMaterials[index].textureIds.x = diffuseTextureId;
+            m_hMaterials[index].textureIds.y = normalTextureId;
+            m_hMaterials[index].textureIds.z = bumpTextureId;
+            m_hMaterials[index].textureIds.w = specularTextureId;
+            m_hMaterials[index].textureOffset.x = 0;
+            m_hMaterials[index].textureOffset.y = 0;
+            m_hMaterials[index].textureOffset.z = 0;
+            m_hMaterials[index].textureOffset.w = 0;
+            m_hMaterials[index].advancedTextureIds.x = reflectionTextureId;
+            m_hMaterials[index].advancedTextureIds.y = transparencyTextureId;
+            m_hMaterials[index].advancedTextureIds.z = TEXTURE_NONE;
+            m_hMaterials[index].advancedTextureIds.w = TEXTURE_NONE;
+            m_hMaterials[index].advancedTextureOffset.x = 0;
+            m_hMaterials[index].advancedTextureOffset.y = 0;
+            m_hMaterials[index].advancedTextureOffset.z = 0;
+            m_hMaterials[index].advancedTextureOffset.w = 0;
+            m_hMaterials[index].mappingOffset.x = 1.f;
+            m_hMaterials[index].mappingOffset.y = 1.f;
         }
     }
+
+    if (diffuseTextureId != TEXTURE_NONE)
+    {
+        LOG_INFO(3, "Material " << index << ": " << m_hMaterials[index].textureMapping.x << "x"
+                                << m_hMaterials[index].textureMapping.y << "x" << m_hMaterials[index].textureMapping.w
+                                << ", Wireframe: " << m_hMaterials[index].attributes.z << ", diffuseTextureId ["
+                                << diffuseTextureId << "] offset=" << m_hMaterials[index].textureOffset.x
+                                << ", bumpTextureId [" << bumpTextureId
+                                << "] offset=" << m_hMaterials[index].textureOffset.y);
+    }
 }
 
 void GPUKernel::buildLightInformationFromTexture(unsigned int index)
@@ -2538,6 +4098,46 @@ int GPUKernel::setGLMode(const int &glMode)
         {
             // Vertices
             int nbTriangles = static_cast<int>(m_vertices.size() / 3);
+            if (m_indexedMeshes && nbTriangles != 0)
+            {
+                // Identical vertices are welded and the triangles are added as a single indexed mesh
+                typedef std::tuple<float, float, float, float, float, float, float, float> GLVertex;
+                std::map<GLVertex, int> welded;
+                vec3fs vertices;
+                vec3fs normals;
+                vec2fs textureCoordinates;
+                vec4is triangles;
+                for (int i(0); i < nbTriangles; ++i)
+                {
+                    int corners[3];
+                    for (int c(0); c < 3; ++c)
+                    {
+                        const size_t index = i * 3 + c;
+                        const vec3f &v = m_vertices[index];
+                        const vec3f n = (index < m_normals.size()) ? m_normals[index] : make_vec3f();
+                        const vec2f t = (index < m_textCoords.size()) ? m_textCoords[index] : make_vec2f();
+                        const GLVertex key(v.x, v.y, v.z, n.x, n.y, n.z, t.x, t.y);
+                        std::map<GLVertex, int>::const_iterator it = welded.find(key);
+                        if (it == welded.end())
+                        {
+                            corners[c] = static_cast<int>(vertices.size());
+                            welded[key] = corners[c];
+                            vertices.push_back(v);
+                            normals.push_back(n);
+                            textureCoordinates.push_back(t);
+                        }
+                        else
+                            corners[c] = it->second;
+                    }
+                    triangles.push_back(make_vec4i(corners[0], corners[1], corners[2], m_currentMaterial));
+                }
+                const int meshId = addIndexedMesh(vertices, normals, textureCoordinates, triangles);
+                if (meshId != -1)
+                    p = addInstance(meshId, make_vec3f(), make_vec4f(), 1.f);
+                LOG_INFO(3, "[OpenGL] Added " << nbTriangles << " indexed triangles sharing " << vertices.size()
+                                              << " vertices with material ID " << m_currentMaterial);
+                break;
+            }
             for (int i(0); i < nbTriangles; ++i)
             {
                 int index = i * 3;
@@ -2689,18 +4289,40 @@ std::string GPUKernel::getTextureFilename(const int index)
 
 void GPUKernel::processTextureOffsets()
 {
-    // Reprocess offset
-    int totalSize = 0;
+    // Textures keep their range while their size does not change. New and
+    // resized textures are given a new range and need to be uploaded. Ranges
+    // are 4 byte aligned so that RGBA texels are read with 32 bit loads
+    bool offsetsChanged = false;
     for (int i(0); i < NB_MAX_TEXTURES; ++i)
     {
-        if (m_hTextures[i].buffer != 0)
+        const size_t size = (m_hTextures[i].buffer != 0) ? (textureBufferSize(m_hTextures[i]) + 3) & ~size_t(3) : 0;
+        if (size == 0)
+            m_texturePool.release(i);
+        else if (m_texturePool.getAllocatedSize(i) != size)
         {
-            m_hTextures[i].offset = totalSize;
-            totalSize += m_hTextures[i].size.x * m_hTextures[i].size.y * m_hTextures[i].size.z;
+            m_texturePool.allocate(i, size);
+            m_dirtyTextures.insert(i);
         }
-        else
-            m_hTextures[i].offset = 0;
+        const int offset = static_cast<int>(m_texturePool.getOffset(i));
+        offsetsChanged = offsetsChanged || (offset != m_hTextures[i].offset);
+        m_hTextures[i].offset = offset;
+    }
+
+    // Released ranges are reclaimed when they waste more than half of the
+    // buffer, in which case all textures are uploaded again
+    if (m_texturePool.getFragmentation() > 0.5f)
+    {
+        LOG_INFO(1, "Compacting textures: " << m_texturePool.getSize() << " bytes");
+        m_texturePool.compact();
+        for (int i(0); i < NB_MAX_TEXTURES; ++i)
+            m_hTextures[i].offset = static_cast<int>(m_texturePool.getOffset(i));
+        m_texturesTransfered = false;
+        offsetsChanged = true;
     }
+
+    // Materials hold the offsets of their textures
+    if (offsetsChanged)
+        m_materialsTransfered = false;
 }
 
 void GPUKernel::setPointSize(const float pointSize)
@@ -2713,15 +4335,21 @@ void GPUKernel::render_begin(const float timer)
     LOG_INFO(3, "GPUKernel::render_begin");
     LOG_INFO(3, "Scene size: " << m_sceneInfo.size.x << "x" << m_sceneInfo.size.y);
 
+    // Frame buffers follow the size of the frame
+    if (static_cast<size_t>(std::max(1, m_sceneInfo.size.x)) * std::max(1, m_sceneInfo.size.y) != m_frameBufferSize)
+        reshape();
+
+    // Ranges of new textures
+    processTextureOffsets();
+
     // Random
-    const size_t size = m_sceneInfo.size.x * m_sceneInfo.size.y;
     m_sceneInfo.timestamp = rand() % 10000;
     if (!m_randomsTransfered || m_sceneInfo.pathTracingIteration % 50 == 1)
     {
         m_randomsTransfered = false;
         srand(static_cast<int>(time(0)));
 #pragma omp parallel for
-        for (int i = 0; i < size; ++i)
+        for (int i = 0; i < static_cast<int>(MAX_BITMAP_SIZE); ++i)
             m_hRandoms[i] = 0.000005f * (rand() % 2000 - 1000);
     }
 
@@ -2740,14 +4368,31 @@ void GPUKernel::render_begin(const float timer)
 #endif // USE_OCULUS
 }
 
+void GPUKernel::allocateFrames(const unsigned int frame)
+{
+    // Containers of a frame are allocated the first time it is used
+    if (frame < m_primitives.size())
+        return;
+    const size_t nbFrames = frame + 1;
+    m_boundingBoxes.resize(nbFrames, BoxLevels(BOUNDING_BOXES_TREE_DEPTH));
+    m_primitives.resize(nbFrames);
+    m_lamps.resize(nbFrames);
+    m_bvhNodes.resize(nbFrames);
+    m_meshes.resize(nbFrames);
+    m_primitiveLeaves.resize(nbFrames);
+}
+
 void GPUKernel::setNbFrames(const int nbFrames)
 {
     m_nbFrames = nbFrames;
+    if (nbFrames > 0)
+        allocateFrames(nbFrames - 1);
 }
 
 void GPUKernel::setFrame(const int frame)
 {
     m_frame = frame;
+    allocateFrames(m_frame);
 }
 
 int GPUKernel::getNbFrames()
@@ -2764,7 +4409,7 @@ void GPUKernel::nextFrame()
 {
     m_frame++;
     if (m_frame >= m_nbFrames)
-        m_frame = m_nbFrames - 1;
+        m_frame = (m_nbFrames > 0) ? m_nbFrames - 1 : 0;
 }
 
 void GPUKernel::previousFrame()
@@ -2795,9 +4440,20 @@ void GPUKernel::generateScreenshot(const std::string &filename, const unsigned i
                                          << ")");
     SceneInfo sceneInfo = m_sceneInfo;
     SceneInfo bakSceneInfo = m_sceneInfo;
-    sceneInfo.size.x = std::min(width, MAX_BITMAP_WIDTH);
-    sceneInfo.size.y = std::min(height, MAX_BITMAP_HEIGHT);
+    // Every frame must be read back before it is saved
+    const bool asynchronousReadback = m_asynchronousReadback;
+    m_asynchronousReadback = false;
+    sceneInfo.size.x = width;
+    sceneInfo.size.y = height;
     sceneInfo.maxPathTracingIterations = quality;
+    if (static_cast<size_t>(width) * height * frameBuffersPixelSize() > FRAME_BUFFERS_MEMORY_BUDGET)
+    {
+        // Too large to be rendered at once
+        generateStripScreenshot(filename, sceneInfo);
+        m_sceneInfo = bakSceneInfo;
+        m_asynchronousReadback = asynchronousReadback;
+        return;
+    }
     for (unsigned int i = 0; i < quality; ++i)
     {
 #ifdef WIN32
@@ -2814,42 +4470,85 @@ void GPUKernel::generateScreenshot(const std::string &filename, const unsigned i
         LOG_INFO(1, "Frame " << i << " generated in " << avg << "ms (" << left << " seconds left...)");
 #endif
         LOG_INFO(1, "Saving bitmap to disk");
-        size_t size = sceneInfo.size.x * sceneInfo.size.y * gColorDepth;
-        switch (sceneInfo.frameBufferType)
-        {
-        case ftRGB:
-        {
-            BitmapBuffer *dst = new BitmapBuffer[size];
-            for (int i(0); i < size; i += gColorDepth)
-            {
-                dst[i] = m_bitmap[size - i];
-                dst[i + 1] = m_bitmap[size - i + 1];
-                dst[i + 2] = m_bitmap[size - i + 2];
-            }
-            jpge::compress_image_to_jpeg_file(filename.c_str(), sceneInfo.size.x, sceneInfo.size.y, gColorDepth, dst);
-            delete[] dst;
-            break;
-        }
-        default:
-        {
-            BitmapBuffer *dst = new BitmapBuffer[size];
-            for (int i(0); i < size; i += gColorDepth)
-            {
-                dst[i] = m_bitmap[size - i + 2];
-                dst[i + 1] = m_bitmap[size - i + 1];
-                dst[i + 2] = m_bitmap[size - i];
-            }
-            jpge::compress_image_to_jpeg_file(filename.c_str(), sceneInfo.size.x, sceneInfo.size.y, gColorDepth, dst);
-            delete[] dst;
-            break;
-        }
-        break;
-        }
+        // Pixels are saved in reverse order, as RGB
+        const size_t nbPixels = sceneInfo.size.x * sceneInfo.size.y;
+        const bool bgr = sceneInfo.frameBufferType == ftBGR || sceneInfo.frameBufferType == ftBGRA;
+        BitmapBuffer *dst = new BitmapBuffer[nbPixels * gColorDepth];
+        convertPixels(m_bitmap, frameBufferDepth(sceneInfo.frameBufferType), dst, gColorDepth, nbPixels, bgr, true);
+        jpge::compress_image_to_jpeg_file(filename.c_str(), sceneInfo.size.x, sceneInfo.size.y, gColorDepth, dst);
+        delete[] dst;
     }
     m_sceneInfo = bakSceneInfo;
+    m_asynchronousReadback = asynchronousReadback;
     LOG_INFO(1, "Screenshot successfully generated!");
 }
 
+void GPUKernel::generateStripScreenshot(const std::string &filename, const SceneInfo &sceneInfo)
+{
+    // The frame is rendered in strips of full rows, from the top of the
+    // image. Every strip is a frame of its own whose camera covers the rows of
+    // the strip, and its rows are handed to the JPEG encoder as soon as the
+    // strip is rendered, so that the whole image never lives in memory
+    const int width = sceneInfo.size.x;
+    const int height = sceneInfo.size.y;
+    const size_t budgetRows = FRAME_BUFFERS_MEMORY_BUDGET / (static_cast<size_t>(width) * frameBuffersPixelSize());
+    const int stripHeight = static_cast<int>(std::max<size_t>(1, std::min<size_t>(height, budgetRows)));
+    LOG_INFO(1, "Rendering " << width << "x" << height << " in strips of " << stripHeight << " rows");
+
+    JpegFileStream stream(filename);
+    jpge::jpeg_encoder encoder;
+    if (!stream.isOpen() || !encoder.init(&stream, width, height, gColorDepth))
+    {
+        LOG_ERROR("Failed to create " << filename);
+        return;
+    }
+
+    const vec3f viewDir = m_viewDir;
+    const vec4f angles = m_angles;
+    const float step = angles.w / static_cast<float>(height);
+    const bool bgr = sceneInfo.frameBufferType == ftBGR || sceneInfo.frameBufferType == ftBGRA;
+    BitmapBuffer *strip = new BitmapBuffer[static_cast<size_t>(width) * stripHeight * gColorDepth];
+    bool succeeded = true;
+    for (int top = height; succeeded && top > 0;)
+    {
+        const int y0 = std::max(0, top - stripHeight);
+        const int h = top - y0;
+        SceneInfo stripSceneInfo = sceneInfo;
+        stripSceneInfo.size.y = h;
+        m_angles.w = step * static_cast<float>(h);
+        m_viewDir.y = viewDir.y + step * static_cast<float>(y0 + h / 2 - height / 2);
+        for (unsigned int i = 0; i < static_cast<unsigned int>(sceneInfo.maxPathTracingIterations); ++i)
+        {
+            stripSceneInfo.pathTracingIteration = i;
+            m_sceneInfo = stripSceneInfo;
+            render_begin(0);
+            render_end();
+        }
+        LOG_INFO(1, "Rows " << y0 << " to " << top << " rendered!");
+
+        // Pixels are saved in reverse order, as RGB
+        convertPixels(m_bitmap, frameBufferDepth(sceneInfo.frameBufferType), strip, gColorDepth,
+                      static_cast<size_t>(width) * h, bgr, true);
+        for (int y = 0; succeeded && y < h; ++y)
+            succeeded = encoder.process_scanline(strip + static_cast<size_t>(y) * width * gColorDepth);
+        top = y0;
+    }
+    if (succeeded)
+        succeeded = encoder.process_scanline(0);
+    encoder.deinit();
+    delete[] strip;
+    m_viewDir = viewDir;
+    m_angles = angles;
+    if (succeeded)
+    {
+        LOG_INFO(1, "Screenshot successfully generated!");
+    }
+    else
+    {
+        LOG_ERROR("Failed to write " << filename);
+    }
+}
+
 #ifdef USE_OCULUS
 void GPUKernel::initializeOVR()
 {
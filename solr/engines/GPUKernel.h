@@ -22,7 +22,9 @@
 
 #include "types.h"
 
+#include "BVHBuilder.h"
 #include "DLL_API.h"
+#include "TexturePool.h"
 
 #ifdef WIN32
 #ifdef USE_KINECT
@@ -39,6 +41,8 @@
 #endif // USE_OCULUS
 
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 
 namespace solr
@@ -70,11 +74,114 @@ struct CPUBoundingBox
     vec3f center;
     std::vector<long> primitives;
     long indexForNextBox;
+    bool modified; // Primitives were transformed since the last refit
 };
 
-typedef std::map<unsigned int, CPUBoundingBox> BoxContainer;
-typedef std::map<unsigned int, CPUPrimitive> PrimitiveContainer;
-typedef std::map<unsigned int, Lamp> LampContainer;
+// Range of elements [begin, end) modified on the host since the last upload to
+// the device
+struct DirtyRange
+{
+    size_t begin;
+    size_t end;
+};
+typedef std::vector<DirtyRange> DirtyRanges;
+
+// Primitives shared by the instances of a mesh. They are defined in the space
+// the mesh was loaded in, and are not rendered on their own. Indexed meshes
+// have no primitives, their triangles reference shared vertices, normals and
+// texture coordinates, and hold their material in w
+struct CPUMesh
+{
+    std::string name; // Set by the loader of the model, see GPUKernel::setMeshName
+    std::vector<long> primitives;
+    vec3fs vertices;
+    vec3fs normals;
+    vec2fs textureCoordinates;
+    vec4is triangles;
+    vec3f parameters[2];     // Bounds
+    BVHNodes nodes;          // Bottom level hierarchy
+    std::vector<long> order; // Primitives, or triangles, in the order of the hierarchy
+    int startBox;            // First box of the flattened hierarchy
+};
+
+typedef std::vector<CPUMesh> MeshContainer;
+// Boxes of a level of the tree, stored contiguously in the order they were
+// created and looked up by key: cell of the grid, or node of the hierarchy
+class BoxContainer
+{
+public:
+    typedef std::pair<unsigned int, CPUBoundingBox> value_type;
+    typedef std::vector<value_type>::iterator iterator;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() { return m_boxes.begin(); }
+    iterator end() { return m_boxes.end(); }
+    const_iterator begin() const { return m_boxes.begin(); }
+    const_iterator end() const { return m_boxes.end(); }
+    size_t size() const { return m_boxes.size(); }
+    bool empty() const { return m_boxes.empty(); }
+    void clear();
+
+    // Box of the given key, created if it does not exist yet
+    CPUBoundingBox &operator[](const unsigned int key);
+    iterator find(const unsigned int key);
+    const_iterator find(const unsigned int key) const;
+    // Does nothing if a box already exists for the key
+    void insert(const value_type &box);
+
+private:
+    std::vector<value_type> m_boxes;
+    std::unordered_map<unsigned int, size_t> m_indices;
+};
+typedef std::vector<BoxContainer> BoxLevels; // Boxes of each level of the tree
+
+// Attributes of a primitive that are only needed to shade it, and are only
+// read when the primitive is streamed to the device
+struct PrimitiveAttributes
+{
+    vec3f n0;
+    vec3f n1;
+    vec3f n2;
+    vec2f vt0;
+    vec2f vt1;
+    vec2f vt2;
+    vec3f speed0;
+    vec3f speed1;
+    vec3f speed2;
+};
+
+// Primitives of a frame, indexed by primitive handle. Fields read by the scans
+// over the whole scene (dispatching primitives in boxes, computing their
+// bounds, finding lights, transforming them) have their own arrays, shading
+// attributes are kept together. Complete records are assembled on demand
+struct PrimitiveContainer
+{
+    size_t size() const { return types.size(); }
+    bool empty() const { return types.empty(); }
+    size_t capacity() const { return types.capacity(); }
+    void reserve(const size_t count);
+    void clear();
+    void push_back(const CPUPrimitive &primitive);
+    CPUPrimitive get(const size_t index) const;
+    void set(const size_t index, const CPUPrimitive &primitive);
+
+    std::vector<int> types;
+    std::vector<int> materialIds;
+    std::vector<char> belongsToModel;
+    std::vector<char> movable;
+    std::vector<vec3f> p0s;
+    std::vector<vec3f> p1s;
+    std::vector<vec3f> p2s;
+    std::vector<vec3f> sizes;
+    std::vector<PrimitiveAttributes> attributes;
+};
+typedef std::vector<Lamp> LampContainer;
+
+enum BVHBuilderType
+{
+    bvhGrid = 0, // Primitives dispatched in a regular grid of boxes
+    bvhSAH = 1   // Binned surface area heuristic
+};
 
 class SOLR_API GPUKernel
 {
@@ -103,6 +210,12 @@ public:
     void generateScreenshot(const std::string &filename, const unsigned int width, const unsigned int height,
                             const unsigned int quality);
 
+protected:
+    // Renders frames whose frame buffers exceed FRAME_BUFFERS_MEMORY_BUDGET in
+    // strips of rows streamed to the JPEG file. Only perspective cameras are
+    // supported
+    void generateStripScreenshot(const std::string &filename, const SceneInfo &sceneInfo);
+
 public:
     // ---------- Primitives ----------
     int addPrimitive(PrimitiveType type, bool belongsToModel = false);
@@ -143,10 +256,28 @@ public:
     // Normals
     void setPrimitiveNormals(unsigned int index, vec3f n0, vec3f n1, vec3f n2);
 
+    // Bulk ingestion. Appends count primitives to the current frame in a
+    // single pass and returns the index of the first one, or -1 if nothing was
+    // added. Points are packed as x,y,z, normals (x,y,z) and texture coordinates
+    // (u,v) are given per vertex and are optional. materialIds holds one
+    // material per primitive, or is NULL to use materialId for all of them
+    int addSpheres(const size_t count, const float *centers, const float *radii, const int *materialIds,
+                   const int materialId, const bool belongsToModel = false);
+    int addCylinders(const size_t count, const float *ends, const float *radii, const int *materialIds,
+                     const int materialId, const bool belongsToModel = false);
+    int addTriangles(const size_t count, const float *vertices, const float *normals,
+                     const float *textureCoordinates, const int *materialIds, const int materialId,
+                     const bool belongsToModel = false);
+    // Appends copies of complete primitive records, as stored in scene files
+    int addPrimitives(const size_t count, const CPUPrimitive *primitives);
+
     // Lights
     int getLight(int index);
     void reorganizeLights();
-    CPUPrimitive *getPrimitive(const unsigned int index);
+    // Copy of a primitive, false if the index is out of bounds. Modified
+    // copies are written back with setPrimitive
+    bool getPrimitive(const unsigned int index, CPUPrimitive &primitive) const;
+    void setPrimitive(const unsigned int index, const CPUPrimitive &primitive);
 
 public:
     // OpenGL
@@ -163,6 +294,39 @@ public:
 
     int addRectangle(float x, float y, float z, float w, float h, float d, int materialId);
 
+public:
+    // ---------- Instancing ----------
+    // Primitives [from, to] become a mesh that is only rendered through its
+    // instances. Scenes with meshes are built by the SAH builder, whatever the
+    // builder type
+    int addMesh(const int from, const int to);
+    int getNbMeshes();
+
+    // Loaders name the meshes of the models they load, so that a model loaded
+    // several times is only stored once. getMeshId returns -1 for unknown names
+    void setMeshName(const int meshId, const std::string &name);
+    int getMeshId(const std::string &name);
+    void getMeshBounds(const int meshId, vec3f &minimum, vec3f &maximum);
+
+    // Indexed meshes share their vertices between triangles. Normals and
+    // texture coordinates are per vertex, triangles hold the indices of their
+    // vertices and their material in w. Rendered by the OpenCL engine, and by
+    // the CPU engine that runs the same kernel. The CUDA engine ignores them
+    int addIndexedMesh(const vec3fs &vertices, const vec3fs &normals, const vec2fs &textureCoordinates,
+                       const vec4is &triangles);
+
+    // When set, triangles loaded from OBJ files or OpenGL are stored in an
+    // indexed mesh, and added to the scene as a single instance
+    void setIndexedMeshes(const bool indexedMeshes) { m_indexedMeshes = indexedMeshes; }
+    bool getIndexedMeshes() const { return m_indexedMeshes; }
+
+    // Instances are primitives of type ptInstance placing a mesh in the scene.
+    // The mesh is scaled, rotated and then translated. Returns the index of the
+    // primitive
+    int addInstance(const int meshId, const vec3f &translation, const vec4f &angles, const float scale);
+    void setInstanceTransformation(const int index, const vec3f &translation, const vec4f &angles,
+                                   const float scale);
+
 public:
     // ---------- Materials ----------
     int addMaterial();
@@ -199,8 +363,14 @@ public:
     void getTexture(const int index, TextureInfo &textureInfo);
     void setTexturesTransfered(const bool transfered) { m_texturesTransfered = transfered; }
     void realignTexturesAndMaterials();
+    void realignMaterial(const int index);
+    int getMaterialMipLevels(const int index);
+    int getMaterialTextureCompression(const int index);
+    int getMaterialTextureDepths(const int index);
+    void realignDirtyMaterials();
 
     bool loadTextureFromFile(const int index, const std::string &filename);
+    void buildMipmaps(const int index);
     void buildLightInformationFromTexture(unsigned int index);
     void processTextureOffsets();
 
@@ -301,11 +471,72 @@ public:
     void rotateVector(vec3f &v, const vec3f &rotationCenter, const vec3f &cosAngles, const vec3f &sinAngles);
 
 public:
+    // Returns the number of boxes streamed to the device, or -1 when the scene
+    // does not fit in the memory budget
     int compactBoxes(bool reconstructBoxes);
-    void streamDataToGPU();
+    bool streamDataToGPU();
     void displayBoxesInfo();
     void resetBoxes(bool resetPrimitives);
 
+    // Acceleration structure
+    void setBVHBuilderType(const BVHBuilderType type) { m_bvhBuilderType = type; }
+    BVHBuilderType getBVHBuilderType() const { return m_bvhBuilderType; }
+    float getBVHExpectedCost() const { return m_bvhExpectedCost; }
+    void setBVHDeterministic(const bool deterministic) { m_bvhDeterministic = deterministic; }
+    float getBVHBuildTimePerMillionPrimitives() const { return m_bvhBuildTime; } // Milliseconds
+
+    // The hierarchy of the primitives of the model can be exported with the
+    // primitives of its leaves in the order of the hierarchy, and imported
+    // again for the same primitives, for instance from a scene file. It is the
+    // top level hierarchy of the current frame when the model is all the tree
+    // contains, and is built otherwise. The next build of the SAH builder then
+    // uses the imported hierarchy, and places it under a common root with a
+    // hierarchy built for the other primitives (a floor, the walls of a room).
+    // Leaf bounds are computed from the primitives
+    bool getBVH(BVHNodes &nodes, std::vector<long> &order);
+    void setBVH(BVHNodes nodes, std::vector<long> order);
+
+    // Once primitives have been transformed, compactBoxes(false) refits the
+    // existing tree instead of rebuilding it. The tree is rebuilt when its
+    // expected cost exceeds the cost it had when built by the given factor.
+    // A threshold of 0 disables rebuilds
+    void setBVHRefitThreshold(const float threshold) { m_bvhRefitThreshold = threshold; }
+    float getBVHRefitThreshold() const { return m_bvhRefitThreshold; }
+
+    // Boxes can be quantized on 8 or 16 bits (0 disables quantization) to
+    // reduce the memory traffic of the traversal. Only supported by the OpenCL
+    // engine, and taken into account when kernels are compiled
+    void setQuantizedBVH(const int bits);
+    int getQuantizedBVH() const { return m_quantizedBVH; }
+
+    // The wavefront pipeline renders the standard camera types with one kernel
+    // per stage (ray generation, extension, shading and shadows) instead of a
+    // single kernel per pixel. Only supported by the OpenCL engine
+    void setWavefrontRendering(const bool value) { m_wavefrontRendering = value; }
+    bool getWavefrontRendering() const { return m_wavefrontRendering; }
+
+    // With asynchronous readback, render_end hands the previous frame to the
+    // caller while the current one is still being rendered, at the cost of one
+    // frame of latency. Only supported by the OpenCL engine
+    void setAsynchronousReadback(const bool value) { m_asynchronousReadback = value; }
+    bool getAsynchronousReadback() const { return m_asynchronousReadback; }
+
+    // Textures loaded from files are block compressed (BC1 for RGB, BC3 for
+    // RGBA) once their mip chain is built. Only supported by the OpenCL engine
+    void setTextureCompression(const bool value) { m_textureCompression = value; }
+    bool getTextureCompression() const { return m_textureCompression; }
+
+    // RGB textures loaded from files are stored as RGBA, so that texels are
+    // read with a single aligned 32 bit load. Not applied to compressed ones
+    void setRGBATextures(const bool value) { m_rgbaTextures = value; }
+    bool getRGBATextures() const { return m_rgbaTextures; }
+
+    // Buffers of boxes and primitives grow with the scene, as long as they fit
+    // in the budget, in bytes. Scenes that do not fit are not streamed, and
+    // compactBoxes returns -1. 0 for no limit
+    void setMemoryBudget(const size_t value) { m_memoryBudget = value; }
+    size_t getMemoryBudget() const { return m_memoryBudget; }
+
     void setPrimitivesTransfered(const bool value) { m_primitivesTransfered = value; }
 
 public:
@@ -323,12 +554,39 @@ protected:
 
     void recursiveDataStreamToGPU(const int depth, std::vector<long> &elements);
 
+    // SAH bounding volume hierarchy
+    void getPrimitiveBounds(const PrimitiveContainer &primitives, const size_t index, vec3f &p0, vec3f &p1);
+    void buildBVH();
+    int buildBVH(const std::vector<long> &items, BVHNodes &nodes, std::vector<long> &order);
+    bool importBVH(const std::vector<long> &items, std::vector<long> &remainingItems);
+    void streamBVHToGPU();
+    void streamLampsToGPU(const CPUBoundingBox &box);
+    void streamPrimitiveToGPU(const long index);
+    void copyPrimitiveToGPU(const long index, const int gpuIndex);
+    bool refitBVH();
+    void addDirtyRange(DirtyRanges &ranges, const size_t begin, const size_t end);
+    bool reserveSceneBuffers(const size_t nbBoxes, const size_t nbPrimitives);
+    void allocateFrames(const unsigned int frame);
+    size_t beginPrimitives(const size_t count);
+    void storePrimitive(const size_t index, const CPUPrimitive &primitive);
+    void invalidateBVHRefit() { m_bvhRefitFrame = -1; }
+    void markPrimitiveModified(const long index, const int previousMaterialId = -1);
+    void buildMeshes();
+    void streamMeshesToGPU();
+    // The grid has no bottom level, meshes require the SAH builder
+    bool useSAHBuilder() const { return m_bvhBuilderType == bvhSAH || !m_meshes[m_frame].empty(); }
+
 protected:
     // GPU
     BoundingBox *m_hBoundingBoxes;
     Primitive *m_hPrimitives;
+    CompactPrimitive *m_hCompactPrimitives;
+    ShadingPrimitive *m_hShadingPrimitives;
     int *m_hLamps;
     Material *m_hMaterials;
+    size_t m_boxesCapacity;      // Boxes the host buffers can hold
+    size_t m_primitivesCapacity; // Primitives the host buffers can hold
+    size_t m_memoryBudget;       // Bytes the boxes and primitives may use, 0 for no limit
 
     // Textures
     TextureInfo m_hTextures[NB_MAX_TEXTURES];
@@ -366,12 +624,18 @@ protected:
 protected:
     // Rendering
     BitmapBuffer *m_bitmap;
+    size_t m_frameBufferSize; // Pixels of the bitmap and primitive IDs
 
 protected:
     bool m_primitivesTransfered;
     bool m_materialsTransfered;
     bool m_texturesTransfered;
     bool m_randomsTransfered;
+
+    // Ranges of the textures in the device buffer. When the whole buffer does
+    // not need to be transfered, only the textures in m_dirtyTextures are
+    TexturePool m_texturePool;
+    std::set<int> m_dirtyTextures;
     // Scene Size
     vec3f m_minPos[NB_MAX_FRAMES];
     vec3f m_maxPos[NB_MAX_FRAMES];
@@ -397,15 +661,69 @@ protected:
     vec2i m_occupancyParameters;
 
 protected:
-    // CPU
-    BoxContainer m_boundingBoxes[NB_MAX_FRAMES][BOUNDING_BOXES_TREE_DEPTH];
-    PrimitiveContainer m_primitives[NB_MAX_FRAMES];
-    LampContainer m_lamps[NB_MAX_FRAMES];
+    // CPU. Scene containers are only allocated for the frames that are used,
+    // see allocateFrames
+    std::vector<BoxLevels> m_boundingBoxes;
+    std::vector<PrimitiveContainer> m_primitives;
+    std::vector<LampContainer> m_lamps;
     LightInformation *m_lightInformation;
 
 protected:
     int m_optimalNbOfBoxes;
 
+    // SAH bounding volume hierarchy. Leaves are also stored as level 0 boxes,
+    // indexed by node, so that primitive transformations keep working on them
+    BVHBuilderType m_bvhBuilderType;
+    std::vector<BVHNodes> m_bvhNodes;
+    float m_bvhExpectedCost;
+    bool m_bvhDeterministic;
+    float m_bvhBuildTime;
+    float m_bvhBuildCost;
+    float m_bvhRefitThreshold;
+    int m_bvhRefitFrame; // Frame for which the flattened tree can be refitted
+    double m_bvhCostSum; // Sum of the node costs of the flattened tree, see refitBVH
+    std::vector<int> m_bvhParents; // Parent of each node of the flattened tree, -1 for the root
+    std::vector<int> m_refitLeaves; // Leaves modified since the last refit, possibly more than once
+    std::vector<char> m_refitNodes; // Nodes visited by the current refit
+    BVHNodes m_importedBVHNodes;
+    std::vector<long> m_importedBVHOrder;
+    int m_importedBVHFrame; // Frame the imported hierarchy was set for
+
+    // Primitives and boxes updated by a refit, and modified materials, uploaded
+    // by the device specific kernels when the whole scene does not need to be
+    // transfered
+    DirtyRanges m_dirtyPrimitives;
+    DirtyRanges m_dirtyBoxes;
+    DirtyRanges m_dirtyMaterials;
+
+    // Two-level hierarchy. The top level one contains instances, meshes have
+    // their own hierarchy, flattened after the top level one. Only top level
+    // boxes are counted in m_nbActiveBoxes
+    std::vector<MeshContainer> m_meshes;
+    std::vector<std::vector<int>> m_primitiveLeaves; // Top level leaf of each primitive, -1 if none
+    int m_nbActiveMeshBoxes[NB_MAX_FRAMES];
+
+    // Geometry of the indexed meshes of the current frame, as uploaded to the
+    // device. Vertex indices of the triangles are global
+    vec4is m_hMeshTriangles;
+    vec3fs m_hMeshVertices;
+    vec3fs m_hMeshNormals;
+    vec2fs m_hMeshTextureCoordinates;
+    bool m_indexedMeshes;
+
+    // Number of bits of quantized boxes, 0 when boxes are not quantized
+    int m_quantizedBVH;
+
+    // Wavefront rendering instead of the single rendering kernel
+    bool m_wavefrontRendering;
+    bool m_asynchronousReadback;
+
+    // Block compression of the textures loaded from files
+    bool m_textureCompression;
+
+    // 32 bit texels for the textures loaded from files
+    bool m_rgbaTextures;
+
 protected:
     // OpenGL
     int m_GLMode;
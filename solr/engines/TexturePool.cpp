@@ -0,0 +1,133 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "TexturePool.h"
+
+namespace solr
+{
+TexturePool::TexturePool()
+    : m_size(0)
+    , m_allocatedSize(0)
+{
+}
+
+void TexturePool::clear()
+{
+    m_textures.clear();
+    m_holes.clear();
+    m_size = 0;
+    m_allocatedSize = 0;
+}
+
+size_t TexturePool::allocate(const int texture, const size_t size)
+{
+    release(texture);
+
+    Range range = {m_size, size};
+    for (std::map<size_t, size_t>::iterator it = m_holes.begin(); it != m_holes.end(); ++it)
+        if ((*it).second >= size)
+        {
+            // First fit, the remainder of the hole stays available
+            range.offset = (*it).first;
+            const size_t remainder = (*it).second - size;
+            m_holes.erase(it);
+            if (remainder != 0)
+                m_holes[range.offset + size] = remainder;
+            break;
+        }
+
+    if (range.offset == m_size)
+        m_size += size;
+    m_allocatedSize += size;
+    m_textures[texture] = range;
+    return range.offset;
+}
+
+void TexturePool::release(const int texture)
+{
+    std::map<int, Range>::iterator it = m_textures.find(texture);
+    if (it == m_textures.end())
+        return;
+
+    size_t offset = (*it).second.offset;
+    size_t size = (*it).second.size;
+    m_allocatedSize -= size;
+    m_textures.erase(it);
+
+    // Merge with the adjacent holes
+    std::map<size_t, size_t>::iterator next = m_holes.lower_bound(offset);
+    if (next != m_holes.end() && (*next).first == offset + size)
+    {
+        size += (*next).second;
+        next = m_holes.erase(next);
+    }
+    if (next != m_holes.begin())
+    {
+        std::map<size_t, size_t>::iterator previous = next;
+        --previous;
+        if ((*previous).first + (*previous).second == offset)
+        {
+            offset = (*previous).first;
+            size += (*previous).second;
+            m_holes.erase(previous);
+        }
+    }
+
+    // A hole at the end of the buffer is given back
+    if (offset + size == m_size)
+        m_size = offset;
+    else
+        m_holes[offset] = size;
+}
+
+bool TexturePool::isAllocated(const int texture) const
+{
+    return m_textures.find(texture) != m_textures.end();
+}
+
+size_t TexturePool::getOffset(const int texture) const
+{
+    std::map<int, Range>::const_iterator it = m_textures.find(texture);
+    return (it == m_textures.end()) ? 0 : (*it).second.offset;
+}
+
+size_t TexturePool::getAllocatedSize(const int texture) const
+{
+    std::map<int, Range>::const_iterator it = m_textures.find(texture);
+    return (it == m_textures.end()) ? 0 : (*it).second.size;
+}
+
+float TexturePool::getFragmentation() const
+{
+    return (m_size == 0) ? 0.f : 1.f - static_cast<float>(m_allocatedSize) / static_cast<float>(m_size);
+}
+
+void TexturePool::compact()
+{
+    size_t offset = 0;
+    for (std::map<int, Range>::iterator it = m_textures.begin(); it != m_textures.end(); ++it)
+    {
+        (*it).second.offset = offset;
+        offset += (*it).second.size;
+    }
+    m_holes.clear();
+    m_size = offset;
+}
+}
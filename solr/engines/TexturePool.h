@@ -0,0 +1,76 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <map>
+#include <stddef.h>
+
+namespace solr
+{
+/*
+________________________________________________________________________________
+
+Sub-allocator of the buffer holding the textures on the device
+
+Textures keep their offset while their size does not change, so that adding or
+modifying one texture only uploads that texture. Released ranges are reused by
+the first texture that fits in them, and are only removed when the pool is
+compacted.
+________________________________________________________________________________
+*/
+class TexturePool
+{
+public:
+    TexturePool();
+
+    void clear();
+
+    // Allocates a range for the texture, after releasing its current one.
+    // Returns the offset of the range
+    size_t allocate(const int texture, const size_t size);
+    void release(const int texture);
+
+    bool isAllocated(const int texture) const;
+    size_t getOffset(const int texture) const;
+    size_t getAllocatedSize(const int texture) const;
+
+    // Size of the buffer holding every range, released ones included
+    size_t getSize() const { return m_size; }
+
+    // Proportion of the buffer lost in released ranges
+    float getFragmentation() const;
+
+    // Packs the ranges in texture order. Offsets of the textures change
+    void compact();
+
+private:
+    struct Range
+    {
+        size_t offset;
+        size_t size;
+    };
+
+    std::map<int, Range> m_textures;
+    std::map<size_t, size_t> m_holes; // Released ranges, by offset
+    size_t m_size;
+    size_t m_allocatedSize;
+};
+}
@@ -0,0 +1,413 @@
+/* Copyright (c) 2011-2014, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+// CPU engine. The kernels are the ones of the OpenCL engine
+// (engines/opencl/RayTracer.cl), compiled as C++ and run pixel by pixel. Buffers
+// have the same layout as the ones uploaded to the OpenCL device, top level
+// boxes are traversed through the wide bounding volume hierarchy, by packets
+// of rays when they are coherent enough
+
+#include "CPURayTracer.h"
+#include "VectorUtils.h"
+
+#include <algorithm>
+#include <math.h>
+
+namespace solr
+{
+// Size, in pixels, of the square blocks whose primary and shadow rays are
+// traced as packets
+const int CPU_PACKET_SIZE = 8;
+
+// Packet of rays, with the leaves of the wide tree they may hit
+struct CPUPacket
+{
+    RayPacket bounds;
+    std::vector<PacketLeaf> leaves;
+    bool valid;
+};
+
+/*
+________________________________________________________________________________
+
+Traversal of the top level boxes. Rays covered by a packet of the current block
+of pixels only test the leaves of that packet, the other ones (secondary rays,
+incoherent packets) traverse the wide tree one by one
+________________________________________________________________________________
+*/
+class CPUTraversal
+{
+public:
+    explicit CPUTraversal(const CPUBVH &bvh)
+        : m_bvh(bvh)
+        , m_nbPackets(0)
+    {
+    }
+
+    void setPackets(const CPUPacket *primary, const CPUPacket *shadows)
+    {
+        m_nbPackets = 0;
+        if (primary && primary->valid)
+            m_packets[m_nbPackets++] = primary;
+        if (shadows && shadows->valid)
+            m_packets[m_nbPackets++] = shadows;
+    }
+
+    template <typename LeafFunctor>
+    bool traverse(const Ray &ray, const float t0, const float t1, LeafFunctor &leaf) const
+    {
+        for (int i = 0; i < m_nbPackets; ++i)
+            if (m_packets[i]->bounds.covers(ray))
+                return traverseLeaves(m_packets[i]->leaves, ray, t0, t1, leaf);
+        return m_bvh.traverse(ray, t0, t1, leaf);
+    }
+
+private:
+    const CPUBVH &m_bvh;
+    const CPUPacket *m_packets[2];
+    int m_nbPackets;
+};
+
+// Traversal and pixel of the current thread
+static thread_local const CPUTraversal *gTraversal = 0;
+static thread_local int gGlobalId[2] = {0, 0};
+
+namespace kernel
+{
+/*
+________________________________________________________________________________
+
+OpenCL C qualifiers, types and built-in functions used by the kernels. Vector
+types are the ones of the host (see VectorUtils.h)
+________________________________________________________________________________
+*/
+#define __kernel
+#define __global
+#define __local
+#define __constant
+#define __private
+
+typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef unsigned int uint;
+typedef vec2f float2;
+typedef vec3f float3;
+typedef vec4f float4;
+typedef vec2i int2;
+typedef vec3i int3;
+typedef vec4i int4;
+
+struct uchar4
+{
+    uchar x, y, z, w;
+};
+
+static int4 convert_int4(const uchar4 &a)
+{
+    return make_vec4i(a.x, a.y, a.z, a.w);
+}
+
+static float min(const float a, const float b)
+{
+    return std::min(a, b);
+}
+
+static float max(const float a, const float b)
+{
+    return std::max(a, b);
+}
+
+static int min(const int a, const int b)
+{
+    return std::min(a, b);
+}
+
+static int max(const int a, const int b)
+{
+    return std::max(a, b);
+}
+
+static float half_sin(const float a)
+{
+    return sinf(a);
+}
+
+static float half_cos(const float a)
+{
+    return cosf(a);
+}
+
+static size_t get_global_id(const uint dimension)
+{
+    return gGlobalId[dimension];
+}
+
+static int atomic_inc(int *counter)
+{
+#ifdef _MSC_VER
+    return _InterlockedIncrement(reinterpret_cast<volatile long *>(counter)) - 1;
+#else
+    return __sync_fetch_and_add(counter, 1);
+#endif
+}
+
+// Top level boxes are traversed through the wide tree of the thread, the
+// statements of the kernel are run by the leaf functor
+#define BVH_LEAVES_BEGIN(__boxes, __nbBoxes, __ray, __t0, __t1, __condition, __start, __count) \
+    {                                                                                          \
+        (void)(__boxes);                                                                       \
+        (void)(__nbBoxes);                                                                     \
+        const Ray *leavesRay = (__ray);                                                        \
+        const float leavesT0 = (__t0);                                                         \
+        auto leaf = [&](const int __start, const int __count, float &leafT1) -> bool           \
+        {
+#define BVH_LEAVES_END(__t1, __condition)                                                     \
+            leafT1 = (__t1);                                                                   \
+            return !(__condition);                                                             \
+        };                                                                                     \
+        (*gTraversal).traverse(*reinterpret_cast<const ::Ray *>(leavesRay), leavesT0, (__t1), leaf); \
+    }
+
+// Host constants redefined by the kernels
+#undef STANDARD_LUNINANCE_STRENGTH
+#undef SKYBOX_LUNINANCE_STRENGTH
+
+#include "../opencl/RayTracer.cl"
+}
+
+/*
+________________________________________________________________________________
+
+Host buffers, as read by the kernels
+________________________________________________________________________________
+*/
+template <typename T, typename U>
+static T *kernelBuffer(const U *buffer)
+{
+    static_assert(sizeof(T) == sizeof(U), "Kernel and host structures must have the same layout");
+    return reinterpret_cast<T *>(const_cast<U *>(buffer));
+}
+
+/*
+________________________________________________________________________________
+
+Kernel launchers
+________________________________________________________________________________
+*/
+#define RENDERER_ARGUMENTS                                                                                       \
+    occupancyParameters, 0, 0, kernelBuffer<kernel::BoundingBox>(scene.boundingBoxes), scene.nbActiveBoxes,     \
+        kernelBuffer<kernel::CompactPrimitive>(scene.primitives), scene.nbActivePrimitives,                     \
+        kernelBuffer<kernel::LightInformation>(scene.lightInformation), scene.lightInformationSize,             \
+        scene.nbActiveLamps, kernelBuffer<kernel::Material>(scene.materials),                                   \
+        kernelBuffer<BitmapBuffer>(scene.textures), kernelBuffer<RandomBuffer>(scene.randoms), origin,          \
+        direction, angles, *kernelBuffer<kernel::SceneInfo>(&sceneInfo),                                        \
+        *kernelBuffer<kernel::PostProcessingInfo>(&postProcessingInfo),                                         \
+        kernelBuffer<kernel::PostProcessingBuffer>(scene.postProcessingBuffer), scene.primitiveXYIds
+
+/*
+________________________________________________________________________________
+
+Packet of the primary rays of a block of pixels. Only the perspective cameras
+of the standard renderer share the origin of their rays
+________________________________________________________________________________
+*/
+static bool primaryPacket(const CPUTile &block, const CPUScene &scene, const SceneInfo &sceneInfo,
+                          const PostProcessingInfo &postProcessingInfo, const vec4f &origin, const vec4f &direction,
+                          const vec4f &angles, CPUPacket &packet)
+{
+    if (sceneInfo.cameraType != ctPerspective && sceneInfo.cameraType != ctAntialiazed)
+        return false;
+
+    // Origins are randomized for natural depth of field
+    if (postProcessingInfo.type != ppe_depthOfField && sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS)
+        return false;
+
+    vec4f rayOrigin = origin;
+    kernel::vectorRotation(&rayOrigin, angles);
+
+    // Directions are linear in the pixel coordinates, their bounds are the ones
+    // of the corners of the block, shifted by the antialiasing grid
+    const float ratio = (float)sceneInfo.size.x / (float)sceneInfo.size.y;
+    vec2f step;
+    step.x = ratio * angles.w / (float)sceneInfo.size.x;
+    step.y = angles.w / (float)sceneInfo.size.y;
+    const float antialiasing = 5.f;
+    vec4f lower, upper;
+    for (int corner = 0; corner < 4; ++corner)
+    {
+        const int x = (corner & 1) ? block.x + block.z - 1 : block.x;
+        const int y = (corner & 2) ? block.y + block.w - 1 : block.y;
+        vec4f target = direction;
+        target.x = direction.x - step.x * (float)(x - (sceneInfo.size.x / 2));
+        target.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
+        kernel::vectorRotation(&target, angles);
+        const vec4f d = target - rayOrigin;
+        if (corner == 0)
+        {
+            lower = d;
+            upper = d;
+        }
+        lower.x = std::min(lower.x, d.x);
+        lower.y = std::min(lower.y, d.y);
+        lower.z = std::min(lower.z, d.z);
+        upper.x = std::max(upper.x, d.x);
+        upper.y = std::max(upper.y, d.y);
+        upper.z = std::max(upper.z, d.z);
+    }
+
+    // Rounding errors of the per pixel computations are absorbed by a margin
+    const float margin = 1e-4f * (fabs(lower.z) + fabs(upper.z));
+    packet.bounds.origin[0] = rayOrigin;
+    packet.bounds.origin[1] = rayOrigin;
+    packet.bounds.direction[0] = make_vec3f(lower.x - antialiasing - margin, lower.y - antialiasing - margin,
+                                            lower.z - margin);
+    packet.bounds.direction[1] = make_vec3f(upper.x + antialiasing + margin, upper.y + antialiasing + margin,
+                                            upper.z + margin);
+    return (*scene.bvh).collectLeaves(packet.bounds, 0.f, sceneInfo.viewDistance, packet.leaves);
+}
+
+/*
+________________________________________________________________________________
+
+Packet of the shadow rays cast from the primary intersections of a block of
+pixels. Intersections lie in the leaves of the primary packet, and all the
+rays are cast towards the first lamp
+________________________________________________________________________________
+*/
+static bool shadowPacket(const CPUScene &scene, const SceneInfo &sceneInfo, const CPUPacket &primary,
+                         CPUPacket &packet)
+{
+    if (sceneInfo.graphicsLevel <= glReflectionsAndRefractions || scene.lightInformationSize == 0 ||
+        sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS || primary.leaves.empty())
+        return false;
+
+    float lower[3], upper[3];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        lower[axis] = primary.leaves[0].lower[axis];
+        upper[axis] = primary.leaves[0].upper[axis];
+        for (const PacketLeaf &leaf : primary.leaves)
+        {
+            lower[axis] = std::min(lower[axis], leaf.lower[axis]);
+            upper[axis] = std::max(upper[axis], leaf.upper[axis]);
+        }
+
+        // Origins are moved towards the lamp by the ray epsilon
+        const float margin = sceneInfo.rayEpsilon + 1e-3f * (upper[axis] - lower[axis]);
+        lower[axis] -= margin;
+        upper[axis] += margin;
+    }
+
+    const vec4f lamp = scene.lightInformation[0].location;
+    packet.bounds.origin[0] = make_vec3f(lower[0], lower[1], lower[2]);
+    packet.bounds.origin[1] = make_vec3f(upper[0], upper[1], upper[2]);
+    packet.bounds.direction[0] = make_vec3f(lamp.x - upper[0], lamp.y - upper[1], lamp.z - upper[2]);
+    packet.bounds.direction[1] = make_vec3f(lamp.x - lower[0], lamp.y - lower[1], lamp.z - lower[2]);
+    return (*scene.bvh).collectLeaves(packet.bounds, 0.f, sceneInfo.viewDistance, packet.leaves);
+}
+
+void cpuRender(const CPUTile &tile, const CPUScene &scene, const SceneInfo &sceneInfo,
+               const PostProcessingInfo &postProcessingInfo, const vec3f &origin, const vec3f &direction,
+               const vec4f &angles)
+{
+    CPUTraversal traversal(*scene.bvh);
+    gTraversal = &traversal;
+    const vec2i occupancyParameters = make_vec2i(1, 1);
+    CPUPacket primary;
+    CPUPacket shadows;
+    primary.leaves.reserve(WIDE_BVH_PACKET_MAX_LEAVES);
+    shadows.leaves.reserve(WIDE_BVH_PACKET_MAX_LEAVES);
+    for (int blockY = tile.y; blockY < tile.y + tile.w; blockY += CPU_PACKET_SIZE)
+        for (int blockX = tile.x; blockX < tile.x + tile.z; blockX += CPU_PACKET_SIZE)
+        {
+            const CPUTile block = {blockX, blockY, std::min(CPU_PACKET_SIZE, tile.x + tile.z - blockX),
+                                   std::min(CPU_PACKET_SIZE, tile.y + tile.w - blockY)};
+            primary.valid =
+                primaryPacket(block, scene, sceneInfo, postProcessingInfo, origin, direction, angles, primary);
+            shadows.valid = primary.valid && shadowPacket(scene, sceneInfo, primary, shadows);
+            traversal.setPackets(&primary, &shadows);
+
+            for (int y = block.y; y < block.y + block.w; ++y)
+                for (int x = block.x; x < block.x + block.z; ++x)
+                {
+                    gGlobalId[0] = x;
+                    gGlobalId[1] = y;
+                    switch (sceneInfo.cameraType)
+                    {
+                    case ctAnaglyph:
+                        kernel::k_anaglyphRenderer(RENDERER_ARGUMENTS);
+                        break;
+                    case ctVR:
+                        kernel::k_3DVisionRenderer(RENDERER_ARGUMENTS);
+                        break;
+                    case ctPanoramic:
+                        kernel::k_fishEyeRenderer(RENDERER_ARGUMENTS);
+                        break;
+                    case ctVolumeRendering:
+                        kernel::k_volumeRenderer(RENDERER_ARGUMENTS);
+                        break;
+                    default:
+                        kernel::k_standardRenderer(RENDERER_ARGUMENTS);
+                        break;
+                    }
+                }
+        }
+    gTraversal = 0;
+}
+
+void cpuPostProcessing(const CPUTile &tile, const CPUScene &scene, const SceneInfo &sceneInfo,
+                       const PostProcessingInfo &postProcessingInfo)
+{
+    const vec2i occupancyParameters = make_vec2i(1, 1);
+    const kernel::SceneInfo &info = *kernelBuffer<kernel::SceneInfo>(&sceneInfo);
+    const kernel::PostProcessingInfo &postProcessing = *kernelBuffer<kernel::PostProcessingInfo>(&postProcessingInfo);
+    kernel::PostProcessingBuffer *postProcessingBuffer =
+        kernelBuffer<kernel::PostProcessingBuffer>(scene.postProcessingBuffer);
+    RandomBuffer *randoms = kernelBuffer<RandomBuffer>(scene.randoms);
+    for (int y = tile.y; y < tile.y + tile.w; ++y)
+        for (int x = tile.x; x < tile.x + tile.z; ++x)
+        {
+            gGlobalId[0] = x;
+            gGlobalId[1] = y;
+            switch (postProcessingInfo.type)
+            {
+            case ppe_depthOfField:
+                kernel::k_depthOfField(occupancyParameters, info, postProcessing, postProcessingBuffer, randoms,
+                                       scene.bitmap);
+                break;
+            case ppe_ambientOcclusion:
+                kernel::k_ambientOcclusion(occupancyParameters, info, postProcessing, postProcessingBuffer, randoms,
+                                           scene.bitmap);
+                break;
+            case ppe_radiosity:
+                kernel::k_radiosity(occupancyParameters, info, postProcessing, scene.primitiveXYIds,
+                                    postProcessingBuffer, randoms, scene.bitmap);
+                break;
+            case ppe_filter:
+                kernel::k_filter(occupancyParameters, info, postProcessing, postProcessingBuffer, scene.bitmap);
+                break;
+            default:
+                kernel::k_default(occupancyParameters, info, postProcessingBuffer, scene.bitmap);
+                break;
+            }
+        }
+}
+}
@@ -0,0 +1,62 @@
+/* Copyright (c) 2011-2014, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "WideBVH.h"
+
+namespace solr
+{
+// Buffers read and written by the CPU kernels. They have the layout of the
+// ones uploaded to the OpenCL device: the intersection data of the primitives
+// is followed by their shading data, and by the geometry of the indexed meshes
+struct CPUScene
+{
+    const CPUBVH *bvh; // Top level boxes
+    const BoundingBox *boundingBoxes;
+    int nbActiveBoxes;
+    const CompactPrimitive *primitives;
+    int nbActivePrimitives;
+    const LightInformation *lightInformation;
+    int lightInformationSize;
+    int nbActiveLamps;
+    const Material *materials;
+    const BitmapBuffer *textures;
+    const RandomBuffer *randoms;
+    PostProcessingBuffer *postProcessingBuffer;
+    PrimitiveXYIdBuffer *primitiveXYIds;
+    BitmapBuffer *bitmap;
+};
+
+// Rectangle of pixels processed by a thread. x and y are the first pixel, z
+// and w the width and height
+typedef vec4i CPUTile;
+
+// Renders the pixels of the tile with the renderer of the camera type
+void cpuRender(const CPUTile &tile, const CPUScene &scene, const SceneInfo &sceneInfo,
+               const PostProcessingInfo &postProcessingInfo, const vec3f &origin, const vec3f &direction,
+               const vec4f &angles);
+
+// Applies the post processing effect to the pixels of the tile, and writes
+// them to the bitmap. Effects read neighbouring pixels, the whole image must
+// have been rendered first
+void cpuPostProcessing(const CPUTile &tile, const CPUScene &scene, const SceneInfo &sceneInfo,
+                       const PostProcessingInfo &postProcessingInfo);
+}
@@ -0,0 +1,198 @@
+/* Copyright (c) 2011-2014, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "TileScheduler.h"
+
+#include <algorithm>
+
+namespace solr
+{
+// Interleaves the bits of x and y
+static unsigned int mortonCode(const unsigned int x, const unsigned int y)
+{
+    unsigned int code = 0;
+    for (unsigned int i = 0; i < 16; ++i)
+        code |= ((x >> i) & 1u) << (2 * i) | ((y >> i) & 1u) << (2 * i + 1);
+    return code;
+}
+
+TileScheduler::TileScheduler()
+    : m_kernel(0)
+    , m_generation(0)
+    , m_nbBusyThreads(0)
+    , m_quit(false)
+{
+    m_size.x = 0;
+    m_size.y = 0;
+    const int nbThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    m_queues.reset(new TileQueue[nbThreads]);
+    for (int i = 0; i < nbThreads; ++i)
+    {
+        m_queues[i].begin = 0;
+        m_queues[i].end = 0;
+    }
+    for (int i = 1; i < nbThreads; ++i)
+        m_threads.push_back(std::thread(&TileScheduler::worker, this, i));
+}
+
+TileScheduler::~TileScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_start.notify_all();
+    for (auto &thread : m_threads)
+        thread.join();
+}
+
+void TileScheduler::prepareTiles(const vec2i &size)
+{
+    if (size.x == m_size.x && size.y == m_size.y)
+        return;
+    m_size = size;
+
+    const int nbTilesX = (size.x + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    const int nbTilesY = (size.y + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    std::vector<std::pair<unsigned int, CPUTile>> tiles;
+    tiles.reserve(nbTilesX * nbTilesY);
+    for (int y = 0; y < nbTilesY; ++y)
+        for (int x = 0; x < nbTilesX; ++x)
+        {
+            CPUTile tile;
+            tile.x = x * CPU_TILE_SIZE;
+            tile.y = y * CPU_TILE_SIZE;
+            tile.z = std::min(CPU_TILE_SIZE, size.x - tile.x);
+            tile.w = std::min(CPU_TILE_SIZE, size.y - tile.y);
+            tiles.push_back(std::make_pair(mortonCode(x, y), tile));
+        }
+    std::sort(tiles.begin(), tiles.end(),
+              [](const std::pair<unsigned int, CPUTile> &a, const std::pair<unsigned int, CPUTile> &b)
+              { return a.first < b.first; });
+
+    m_tiles.clear();
+    for (const auto &tile : tiles)
+        m_tiles.push_back(tile.second);
+}
+
+void TileScheduler::run(const vec2i &size, const std::function<void(const CPUTile &)> &kernel)
+{
+    prepareTiles(size);
+
+    // Each thread starts with a contiguous range of the Morton curve
+    const int nbThreads = getNbThreads();
+    const int nbTiles = static_cast<int>(m_tiles.size());
+    for (int i = 0; i < nbThreads; ++i)
+    {
+        m_queues[i].begin = nbTiles * i / nbThreads;
+        m_queues[i].end = nbTiles * (i + 1) / nbThreads;
+    }
+
+    if (nbThreads > 1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_kernel = &kernel;
+            m_nbBusyThreads = nbThreads - 1;
+            ++m_generation;
+        }
+        m_start.notify_all();
+    }
+    else
+        m_kernel = &kernel;
+
+    processTiles(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_nbBusyThreads == 0; });
+    m_kernel = 0;
+}
+
+void TileScheduler::worker(const int index)
+{
+    int generation = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_start.wait(lock, [&] { return m_quit || m_generation != generation; });
+            if (m_quit)
+                return;
+            generation = m_generation;
+        }
+
+        processTiles(index);
+
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            last = (--m_nbBusyThreads == 0);
+        }
+        if (last)
+            m_done.notify_one();
+    }
+}
+
+void TileScheduler::processTiles(const int index)
+{
+    int tile;
+    do
+    {
+        while (popTile(index, tile))
+            (*m_kernel)(m_tiles[tile]);
+    } while (stealTiles(index));
+}
+
+bool TileScheduler::popTile(const int index, int &tile)
+{
+    TileQueue &queue = m_queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.begin >= queue.end)
+        return false;
+    tile = queue.begin++;
+    return true;
+}
+
+bool TileScheduler::stealTiles(const int index)
+{
+    const int nbThreads = getNbThreads();
+    for (int i = 1; i < nbThreads; ++i)
+    {
+        TileQueue &victim = m_queues[(index + i) % nbThreads];
+        int begin, end;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            const int remaining = victim.end - victim.begin;
+            if (remaining <= 0)
+                continue;
+            begin = victim.end - (remaining + 1) / 2;
+            end = victim.end;
+            victim.end = begin;
+        }
+
+        TileQueue &queue = m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.begin = begin;
+        queue.end = end;
+        return true;
+    }
+    return false;
+}
+}
@@ -0,0 +1,95 @@
+/* Copyright (c) 2011-2014, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "CPURayTracer.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace solr
+{
+// Size, in pixels, of the square tiles dispatched to the threads
+const int CPU_TILE_SIZE = 16;
+
+/*
+________________________________________________________________________________
+
+Work-stealing tile scheduler used by the CPU engine
+
+Tiles are sorted in Morton order and split into one contiguous range per
+thread, so that consecutive tiles of a thread are neighbours in the image and
+share the same parts of the scene. A thread that runs out of tiles steals the
+second half of the remaining range of another thread. The calling thread takes
+part in the rendering, the other ones are kept alive between frames.
+________________________________________________________________________________
+*/
+class TileScheduler
+{
+public:
+    TileScheduler();
+    ~TileScheduler();
+
+    // Runs kernel(tile) on all the tiles of an image of the given size, and
+    // returns once they have all been processed
+    void run(const vec2i &size, const std::function<void(const CPUTile &)> &kernel);
+
+    int getNbThreads() const { return static_cast<int>(m_threads.size()) + 1; }
+
+private:
+    void prepareTiles(const vec2i &size);
+    void worker(const int index);
+    void processTiles(const int index);
+    bool popTile(const int index, int &tile);
+    bool stealTiles(const int index);
+
+private:
+    // Range of tiles owned by a thread. The owner pops from the front, thieves
+    // take the back half. The trailing padding keeps the mutex and range of
+    // two queues at least one cache line apart, whatever the alignment of the
+    // array, without requiring an over-aligned allocation
+    struct TileQueue
+    {
+        std::mutex mutex;
+        int begin;
+        int end;
+        char padding[64];
+    };
+
+    std::vector<std::thread> m_threads;
+    std::unique_ptr<TileQueue[]> m_queues;
+    std::vector<CPUTile> m_tiles;
+    vec2i m_size;
+
+    // Current job, shared with the threads
+    const std::function<void(const CPUTile &)> *m_kernel;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    int m_generation;
+    int m_nbBusyThreads;
+    bool m_quit;
+};
+}
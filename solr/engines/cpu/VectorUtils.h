@@ -0,0 +1,181 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "../../types.h"
+
+#include <math.h>
+
+/*
+________________________________________________________________________________
+
+Vector operators and functions of the CPU engine
+
+Same semantics as the OpenCL built-in functions: all 4 components of vec4f are
+used, and 3 component vectors are vec4f with a w component
+________________________________________________________________________________
+*/
+
+// vec4f
+__INLINE__ vec4f operator+(const vec4f &a, const vec4f &b)
+{
+    return make_vec4f(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w);
+}
+
+__INLINE__ vec4f operator-(const vec4f &a, const vec4f &b)
+{
+    return make_vec4f(a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w);
+}
+
+__INLINE__ vec4f operator*(const vec4f &a, const vec4f &b)
+{
+    return make_vec4f(a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w);
+}
+
+__INLINE__ vec4f operator/(const vec4f &a, const vec4f &b)
+{
+    return make_vec4f(a.x / b.x, a.y / b.y, a.z / b.z, a.w / b.w);
+}
+
+__INLINE__ vec4f operator*(const vec4f &a, const float s)
+{
+    return make_vec4f(a.x * s, a.y * s, a.z * s, a.w * s);
+}
+
+__INLINE__ vec4f operator*(const float s, const vec4f &a)
+{
+    return a * s;
+}
+
+__INLINE__ vec4f operator/(const vec4f &a, const float s)
+{
+    return make_vec4f(a.x / s, a.y / s, a.z / s, a.w / s);
+}
+
+__INLINE__ vec4f operator-(const vec4f &a)
+{
+    return make_vec4f(-a.x, -a.y, -a.z, -a.w);
+}
+
+__INLINE__ vec4f &operator+=(vec4f &a, const vec4f &b)
+{
+    a = a + b;
+    return a;
+}
+
+__INLINE__ vec4f &operator-=(vec4f &a, const vec4f &b)
+{
+    a = a - b;
+    return a;
+}
+
+__INLINE__ vec4f &operator*=(vec4f &a, const vec4f &b)
+{
+    a = a * b;
+    return a;
+}
+
+__INLINE__ vec4f &operator*=(vec4f &a, const float s)
+{
+    a = a * s;
+    return a;
+}
+
+__INLINE__ vec4f &operator/=(vec4f &a, const float s)
+{
+    a = a / s;
+    return a;
+}
+
+__INLINE__ float dot(const vec4f &a, const vec4f &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+__INLINE__ vec4f cross(const vec4f &a, const vec4f &b)
+{
+    return make_vec4f(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x, 0.f);
+}
+
+__INLINE__ float length(const vec4f &a)
+{
+    return sqrtf(dot(a, a));
+}
+
+__INLINE__ float distance(const vec4f &a, const vec4f &b)
+{
+    return length(a - b);
+}
+
+__INLINE__ vec4f normalize(const vec4f &a)
+{
+    const float l = length(a);
+    return (l == 0.f) ? a : a / l;
+}
+
+// vec2f
+__INLINE__ vec2f operator+(const vec2f &a, const vec2f &b)
+{
+    return make_vec2f(a.x + b.x, a.y + b.y);
+}
+
+__INLINE__ vec2f operator-(const vec2f &a, const vec2f &b)
+{
+    return make_vec2f(a.x - b.x, a.y - b.y);
+}
+
+__INLINE__ vec2f operator*(const vec2f &a, const float s)
+{
+    return make_vec2f(a.x * s, a.y * s);
+}
+
+__INLINE__ vec2f operator*(const float s, const vec2f &a)
+{
+    return a * s;
+}
+
+__INLINE__ vec2f operator/(const vec2f &a, const float s)
+{
+    return make_vec2f(a.x / s, a.y / s);
+}
+
+// vec4i
+__INLINE__ vec4i operator+(const vec4i &a, const vec4i &b)
+{
+    return make_vec4i(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w);
+}
+
+__INLINE__ vec4i operator*(const int s, const vec4i &a)
+{
+    return make_vec4i(s * a.x, s * a.y, s * a.z, s * a.w);
+}
+
+__INLINE__ vec4i operator/(const vec4i &a, const int s)
+{
+    return make_vec4i(a.x / s, a.y / s, a.z / s, a.w / s);
+}
+
+// Conversions
+__INLINE__ vec4f convert_float4(const vec4i &a)
+{
+    return make_vec4f(static_cast<float>(a.x), static_cast<float>(a.y), static_cast<float>(a.z),
+                      static_cast<float>(a.w));
+}
@@ -0,0 +1,288 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "WideBVH.h"
+#include "../BVHBuilder.h"
+
+#include <Logging.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+// Items are boxes of the flattened tree. Negative items stand for the
+// primitives of box -(item + 1) only, for boxes holding both primitives and
+// children
+inline int boxIndex(const int item)
+{
+    return (item < 0) ? -(item + 1) : item;
+}
+
+inline bool isInner(const BoundingBox *boxes, const int item)
+{
+    return item >= 0 && boxes[item].indexForNextBox.x > 1;
+}
+
+inline float itemArea(const BoundingBox *boxes, const int item)
+{
+    const BoundingBox &box = boxes[boxIndex(item)];
+    return solr::BVHBuilder::surfaceArea(box.parameters[0], box.parameters[1]);
+}
+
+// Bounds of the distances at which the rays of a packet enter and leave the
+// slab [lower, upper] of an axis. Axes along which the directions change sign
+// do not cull anything
+inline void slabInterval(const float lower, const float upper, const float origin0, const float origin1,
+                         const float direction0, const float direction1, float &tnear, float &tfar)
+{
+    if (direction0 > 0.f || direction1 < 0.f)
+    {
+        const float inv0 = 1.f / direction0;
+        const float inv1 = 1.f / direction1;
+        const float nearPlane = (direction0 > 0.f) ? lower : upper;
+        const float farPlane = (direction0 > 0.f) ? upper : lower;
+        tnear = std::min(std::min((nearPlane - origin0) * inv0, (nearPlane - origin0) * inv1),
+                         std::min((nearPlane - origin1) * inv0, (nearPlane - origin1) * inv1));
+        tfar = std::max(std::max((farPlane - origin0) * inv0, (farPlane - origin0) * inv1),
+                        std::max((farPlane - origin1) * inv0, (farPlane - origin1) * inv1));
+    }
+    else
+    {
+        tnear = -std::numeric_limits<float>::max();
+        tfar = std::numeric_limits<float>::max();
+    }
+}
+}
+
+namespace solr
+{
+template <int W>
+void WideBVH<W>::appendChildren(const BoundingBox *boxes, const int item, std::vector<int> &items) const
+{
+    const BoundingBox &box = boxes[item];
+    if (box.nbPrimitives != 0)
+        items.push_back(-(item + 1));
+
+    const int end = item + box.indexForNextBox.x;
+    for (int child = item + 1; child < end; child += std::max(1, boxes[child].indexForNextBox.x))
+        items.push_back(child);
+}
+
+template <int W>
+int WideBVH<W>::buildNode(const BoundingBox *boxes, std::vector<int> items)
+{
+    // Inner boxes with the largest surface are opened as long as their
+    // children fit in the node
+    bool opened = true;
+    while (opened && items.size() < W)
+    {
+        opened = false;
+        int candidate = -1;
+        float candidateArea = -1.f;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            if (!isInner(boxes, items[i]))
+                continue;
+            std::vector<int> children;
+            appendChildren(boxes, items[i], children);
+            const float area = itemArea(boxes, items[i]);
+            if (items.size() - 1 + children.size() <= W && area > candidateArea)
+            {
+                candidate = static_cast<int>(i);
+                candidateArea = area;
+            }
+        }
+        if (candidate != -1)
+        {
+            const int item = items[candidate];
+            items.erase(items.begin() + candidate);
+            appendChildren(boxes, item, items);
+            opened = true;
+        }
+    }
+
+    const int index = static_cast<int>(m_nodes.size());
+    m_nodes.push_back(Node());
+    Node node;
+    const float m = std::numeric_limits<float>::max();
+    for (int i = 0; i < W; ++i)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            node.lower[axis][i] = m;
+            node.upper[axis][i] = -m;
+        }
+        node.children[i] = 0;
+        node.nbPrimitives[i] = 0;
+    }
+
+    // Boxes with more children than the node can hold are split into groups
+    // of consecutive children
+    const size_t nbItems = items.size();
+    const size_t nbSlots = std::min(nbItems, static_cast<size_t>(W));
+    for (size_t slot = 0; slot < nbSlots; ++slot)
+    {
+        const size_t first = slot * nbItems / nbSlots;
+        const size_t last = (slot + 1) * nbItems / nbSlots;
+        vec3f corner0 = boxes[boxIndex(items[first])].parameters[0];
+        vec3f corner1 = boxes[boxIndex(items[first])].parameters[1];
+        if (last - first > 1)
+        {
+            for (size_t i = first + 1; i < last; ++i)
+            {
+                const BoundingBox &box = boxes[boxIndex(items[i])];
+                corner0.x = std::min(corner0.x, box.parameters[0].x);
+                corner0.y = std::min(corner0.y, box.parameters[0].y);
+                corner0.z = std::min(corner0.z, box.parameters[0].z);
+                corner1.x = std::max(corner1.x, box.parameters[1].x);
+                corner1.y = std::max(corner1.y, box.parameters[1].y);
+                corner1.z = std::max(corner1.z, box.parameters[1].z);
+            }
+            node.children[slot] = buildNode(boxes, std::vector<int>(items.begin() + first, items.begin() + last));
+        }
+        else
+        {
+            const int item = items[first];
+            const BoundingBox &box = boxes[boxIndex(item)];
+            if (isInner(boxes, item))
+            {
+                std::vector<int> children;
+                appendChildren(boxes, item, children);
+                node.children[slot] = buildNode(boxes, children);
+            }
+            else if (box.nbPrimitives != 0)
+            {
+                node.children[slot] = box.startIndex;
+                node.nbPrimitives[slot] = box.nbPrimitives;
+            }
+            else
+                continue; // Empty leaf
+        }
+        node.lower[0][slot] = corner0.x;
+        node.lower[1][slot] = corner0.y;
+        node.lower[2][slot] = corner0.z;
+        node.upper[0][slot] = corner1.x;
+        node.upper[1][slot] = corner1.y;
+        node.upper[2][slot] = corner1.z;
+    }
+    m_nodes[index] = node;
+    return index;
+}
+
+template <int W>
+void WideBVH<W>::build(const BoundingBox *boxes, const int begin, const int end)
+{
+    m_nodes.clear();
+    m_stackSize = 0;
+    if (end <= begin)
+        return;
+
+    // Roots of the flattened forest
+    std::vector<int> roots;
+    for (int box = begin; box < end; box += std::max(1, boxes[box].indexForNextBox.x))
+        roots.push_back(box);
+    buildNode(boxes, roots);
+
+    // Depth of the tree, for the traversal stack
+    std::vector<std::pair<int, int>> nodes(1, std::make_pair(0, 1));
+    int depth = 0;
+    while (!nodes.empty())
+    {
+        const std::pair<int, int> node = nodes.back();
+        nodes.pop_back();
+        depth = std::max(depth, node.second);
+        for (int i = 0; i < W; ++i)
+            if (m_nodes[node.first].nbPrimitives[i] == 0 &&
+                m_nodes[node.first].lower[0][i] <= m_nodes[node.first].upper[0][i])
+                nodes.push_back(std::make_pair(m_nodes[node.first].children[i], node.second + 1));
+    }
+    m_stackSize = (W - 1) * depth + 1;
+    LOG_INFO(3, "Wide BVH: " << end - begin << " boxes collapsed into " << m_nodes.size() << " nodes of " << W
+                             << " children, depth " << depth);
+}
+
+template <int W>
+bool WideBVH<W>::collectLeaves(const RayPacket &packet, const float t0, const float t1,
+                               std::vector<PacketLeaf> &leaves) const
+{
+    leaves.clear();
+    if (m_nodes.empty())
+        return true;
+
+    const float origin[2][3] = {{packet.origin[0].x, packet.origin[0].y, packet.origin[0].z},
+                                {packet.origin[1].x, packet.origin[1].y, packet.origin[1].z}};
+    const float direction[2][3] = {{packet.direction[0].x, packet.direction[0].y, packet.direction[0].z},
+                                   {packet.direction[1].x, packet.direction[1].y, packet.direction[1].z}};
+
+    int stack[WIDE_BVH_STACK_DEPTH * W];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize != 0)
+    {
+        const Node &node = m_nodes[stack[--stackSize]];
+        for (int i = 0; i < W; ++i)
+        {
+            if (node.lower[0][i] > node.upper[0][i])
+                continue; // Unused slot
+
+            float tnear = t0;
+            float tfar = t1;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float axisNear, axisFar;
+                slabInterval(node.lower[axis][i], node.upper[axis][i], origin[0][axis], origin[1][axis],
+                             direction[0][axis], direction[1][axis], axisNear, axisFar);
+                tnear = std::max(tnear, axisNear);
+                tfar = std::min(tfar, axisFar);
+            }
+            if (tnear > tfar)
+                continue;
+
+            if (node.nbPrimitives[i] == 0)
+            {
+                if (stackSize == WIDE_BVH_STACK_DEPTH * W)
+                    return false;
+                stack[stackSize++] = node.children[i];
+                continue;
+            }
+
+            if (static_cast<int>(leaves.size()) == WIDE_BVH_PACKET_MAX_LEAVES)
+                return false;
+            PacketLeaf leaf;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                leaf.lower[axis] = node.lower[axis][i];
+                leaf.upper[axis] = node.upper[axis][i];
+            }
+            leaf.startIndex = node.children[i];
+            leaf.nbPrimitives = node.nbPrimitives[i];
+            leaf.t = tnear;
+            leaves.push_back(leaf);
+        }
+    }
+    std::sort(leaves.begin(), leaves.end(),
+              [](const PacketLeaf &a, const PacketLeaf &b) { return a.t < b.t; });
+    return true;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
+}
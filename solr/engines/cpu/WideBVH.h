@@ -0,0 +1,326 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDE_BVH_SSE
+#include <xmmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+namespace solr
+{
+// Depth of the tree up to which the traversal stack is kept on the call stack.
+// Deeper trees use a stack allocated on the heap
+const int WIDE_BVH_STACK_DEPTH = 64;
+
+// Maximum number of leaves shared by the rays of a packet. Beyond that, rays
+// are not coherent enough and are traversed one by one
+const int WIDE_BVH_PACKET_MAX_LEAVES = 128;
+
+// Bounds of the origins and directions of a packet of rays. Boxes are tested
+// once for the whole packet, with interval arithmetic
+struct RayPacket
+{
+    vec3f origin[2];
+    vec3f direction[2];
+
+    bool covers(const Ray &ray) const
+    {
+        return ray.origin.x >= origin[0].x && ray.origin.x <= origin[1].x && ray.origin.y >= origin[0].y &&
+               ray.origin.y <= origin[1].y && ray.origin.z >= origin[0].z && ray.origin.z <= origin[1].z &&
+               ray.direction.x >= direction[0].x && ray.direction.x <= direction[1].x &&
+               ray.direction.y >= direction[0].y && ray.direction.y <= direction[1].y &&
+               ray.direction.z >= direction[0].z && ray.direction.z <= direction[1].z;
+    }
+};
+
+// Leaf that may be hit by a ray of a packet
+struct PacketLeaf
+{
+    float lower[3];
+    float upper[3];
+    int startIndex;
+    int nbPrimitives;
+    float t; // Lower bound of the entry distance of the rays of the packet
+};
+
+/*
+________________________________________________________________________________
+
+Wide bounding volume hierarchy used by the CPU engine
+
+The binary tree flattened by GPUKernel is collapsed into nodes of W children
+(4 or 8), whose bounds are stored as a structure of arrays so that a ray is
+tested against all the children of a node at once. Hit children are visited
+from the nearest to the farthest.
+________________________________________________________________________________
+*/
+template <int W>
+class WideBVH
+{
+public:
+    WideBVH()
+        : m_stackSize(0)
+    {
+    }
+
+    // Collapses the flattened boxes [begin, end) into a wide tree
+    void build(const BoundingBox *boxes, const int begin, const int end);
+
+    // Calls leaf(startIndex, nbPrimitives, t1) for every leaf hit by the ray
+    // between t0 and t1. The functor may reduce t1 to cull farther nodes, and
+    // stops the traversal by returning true. Returns true when stopped
+    template <typename LeafFunctor>
+    bool traverse(const Ray &ray, const float t0, float t1, LeafFunctor &leaf) const;
+
+    // Collects the leaves that may be hit by a ray of the packet between t0
+    // and t1, sorted by entry distance. Returns false when the packet hits
+    // more than WIDE_BVH_PACKET_MAX_LEAVES leaves
+    bool collectLeaves(const RayPacket &packet, const float t0, const float t1, std::vector<PacketLeaf> &leaves) const;
+
+    bool empty() const { return m_nodes.empty(); }
+    int getNbNodes() const { return static_cast<int>(m_nodes.size()); }
+
+private:
+    // Children of a node. Inner children have no primitive and reference a
+    // node, leaves reference a range of primitives. Unused slots have empty
+    // bounds and are never hit
+    struct Node
+    {
+        float lower[3][W];
+        float upper[3][W];
+        int children[W]; // Index of the node, or of the first primitive
+        int nbPrimitives[W];
+    };
+
+    struct StackEntry
+    {
+        int child;
+        int nbPrimitives;
+        float t;
+    };
+
+    int buildNode(const BoundingBox *boxes, std::vector<int> items);
+    void appendChildren(const BoundingBox *boxes, const int item, std::vector<int> &items) const;
+
+    int intersectChildren(const Node &node, const Ray &ray, const float t0, const float t1, float *t) const;
+
+    std::vector<Node> m_nodes;
+    int m_stackSize; // Maximum number of entries of the traversal stack
+};
+
+#ifdef __AVX__
+typedef WideBVH<8> CPUBVH;
+#else
+typedef WideBVH<4> CPUBVH;
+#endif
+
+/*
+________________________________________________________________________________
+
+Tests the ray against all the children of the node. Returns the mask of the
+children that are hit, and their entry distances in t
+________________________________________________________________________________
+*/
+template <int W>
+inline int WideBVH<W>::intersectChildren(const Node &node, const Ray &ray, const float t0, const float t1,
+                                         float *t) const
+{
+    // Near and far planes only depend on the direction of the ray
+    const float *nearX = ray.signs.x ? node.upper[0] : node.lower[0];
+    const float *farX = ray.signs.x ? node.lower[0] : node.upper[0];
+    const float *nearY = ray.signs.y ? node.upper[1] : node.lower[1];
+    const float *farY = ray.signs.y ? node.lower[1] : node.upper[1];
+    const float *nearZ = ray.signs.z ? node.upper[2] : node.lower[2];
+    const float *farZ = ray.signs.z ? node.lower[2] : node.upper[2];
+    int mask = 0;
+#if defined(__AVX__)
+    if (W == 8)
+    {
+        const __m256 ox = _mm256_set1_ps(ray.origin.x);
+        const __m256 oy = _mm256_set1_ps(ray.origin.y);
+        const __m256 oz = _mm256_set1_ps(ray.origin.z);
+        const __m256 ix = _mm256_set1_ps(ray.inv_direction.x);
+        const __m256 iy = _mm256_set1_ps(ray.inv_direction.y);
+        const __m256 iz = _mm256_set1_ps(ray.inv_direction.z);
+        __m256 tmin = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearX), ox), ix);
+        __m256 tmax = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farX), ox), ix);
+        tmin = _mm256_max_ps(tmin, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearY), oy), iy));
+        tmax = _mm256_min_ps(tmax, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farY), oy), iy));
+        tmin = _mm256_max_ps(tmin, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearZ), oz), iz));
+        tmax = _mm256_min_ps(tmax, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farZ), oz), iz));
+        const __m256 hit = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+                                                       _mm256_cmp_ps(tmin, _mm256_set1_ps(t1), _CMP_LT_OQ)),
+                                         _mm256_cmp_ps(tmax, _mm256_set1_ps(t0), _CMP_GT_OQ));
+        _mm256_storeu_ps(t, tmin);
+        return _mm256_movemask_ps(hit);
+    }
+#endif
+#if defined(WIDE_BVH_SSE)
+    const __m128 ox = _mm_set1_ps(ray.origin.x);
+    const __m128 oy = _mm_set1_ps(ray.origin.y);
+    const __m128 oz = _mm_set1_ps(ray.origin.z);
+    const __m128 ix = _mm_set1_ps(ray.inv_direction.x);
+    const __m128 iy = _mm_set1_ps(ray.inv_direction.y);
+    const __m128 iz = _mm_set1_ps(ray.inv_direction.z);
+    const __m128 s0 = _mm_set1_ps(t0);
+    const __m128 s1 = _mm_set1_ps(t1);
+    for (int i = 0; i < W; i += 4)
+    {
+        __m128 tmin = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX + i), ox), ix);
+        __m128 tmax = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX + i), ox), ix);
+        tmin = _mm_max_ps(tmin, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY + i), oy), iy));
+        tmax = _mm_min_ps(tmax, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY + i), oy), iy));
+        tmin = _mm_max_ps(tmin, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ + i), oz), iz));
+        tmax = _mm_min_ps(tmax, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ + i), oz), iz));
+        const __m128 hit =
+            _mm_and_ps(_mm_and_ps(_mm_cmple_ps(tmin, tmax), _mm_cmplt_ps(tmin, s1)), _mm_cmpgt_ps(tmax, s0));
+        _mm_storeu_ps(t + i, tmin);
+        mask |= _mm_movemask_ps(hit) << i;
+    }
+#else
+    for (int i = 0; i < W; ++i)
+    {
+        float tmin = (nearX[i] - ray.origin.x) * ray.inv_direction.x;
+        float tmax = (farX[i] - ray.origin.x) * ray.inv_direction.x;
+        tmin = std::max(tmin, (nearY[i] - ray.origin.y) * ray.inv_direction.y);
+        tmax = std::min(tmax, (farY[i] - ray.origin.y) * ray.inv_direction.y);
+        tmin = std::max(tmin, (nearZ[i] - ray.origin.z) * ray.inv_direction.z);
+        tmax = std::min(tmax, (farZ[i] - ray.origin.z) * ray.inv_direction.z);
+        t[i] = tmin;
+        if (tmin <= tmax && tmin < t1 && tmax > t0)
+            mask |= 1 << i;
+    }
+#endif
+    return mask;
+}
+
+template <int W>
+template <typename LeafFunctor>
+bool WideBVH<W>::traverse(const Ray &ray, const float t0, float t1, LeafFunctor &leaf) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    // Every level of the tree leaves at most W - 1 siblings on the stack
+    StackEntry localStack[WIDE_BVH_STACK_DEPTH * W];
+    std::vector<StackEntry> heapStack;
+    StackEntry *stack = localStack;
+    if (m_stackSize > WIDE_BVH_STACK_DEPTH * W)
+    {
+        heapStack.resize(m_stackSize);
+        stack = heapStack.data();
+    }
+    int stackSize = 0;
+    stack[stackSize].child = 0;
+    stack[stackSize].nbPrimitives = 0;
+    stack[stackSize].t = t0;
+    ++stackSize;
+    while (stackSize != 0)
+    {
+        const StackEntry entry = stack[--stackSize];
+        if (entry.t >= t1)
+            continue;
+
+        if (entry.nbPrimitives != 0)
+        {
+            if (leaf(entry.child, entry.nbPrimitives, t1))
+                return true;
+            continue;
+        }
+
+        const Node &node = m_nodes[entry.child];
+        float t[W];
+        int mask = intersectChildren(node, ray, t0, t1, t);
+        if (mask == 0)
+            continue;
+
+        // Hit children are sorted from the farthest to the nearest, so that
+        // the nearest one is on top of the stack
+        int hits[W];
+        int nbHits = 0;
+        while (mask != 0)
+        {
+            int i = 0;
+            while ((mask & (1 << i)) == 0)
+                ++i;
+            mask &= ~(1 << i);
+            int j = nbHits++;
+            while (j > 0 && t[hits[j - 1]] < t[i])
+            {
+                hits[j] = hits[j - 1];
+                --j;
+            }
+            hits[j] = i;
+        }
+        for (int h = 0; h < nbHits; ++h)
+        {
+            const int i = hits[h];
+            stack[stackSize].child = node.children[i];
+            stack[stackSize].nbPrimitives = node.nbPrimitives[i];
+            stack[stackSize].t = t[i];
+            ++stackSize;
+        }
+    }
+    return false;
+}
+
+/*
+________________________________________________________________________________
+
+Same as WideBVH::traverse, for a ray covered by a packet whose leaves have been
+collected: inner nodes are skipped, only the boxes of the leaves are tested
+________________________________________________________________________________
+*/
+template <typename LeafFunctor>
+bool traverseLeaves(const std::vector<PacketLeaf> &leaves, const Ray &ray, const float t0, float t1,
+                    LeafFunctor &leaf)
+{
+    for (const PacketLeaf &packetLeaf : leaves)
+    {
+        // Leaves are sorted by entry distance, the following ones are farther
+        if (packetLeaf.t >= t1)
+            break;
+
+        float tmin = ((ray.signs.x ? packetLeaf.upper[0] : packetLeaf.lower[0]) - ray.origin.x) * ray.inv_direction.x;
+        float tmax = ((ray.signs.x ? packetLeaf.lower[0] : packetLeaf.upper[0]) - ray.origin.x) * ray.inv_direction.x;
+        tmin = std::max(tmin, ((ray.signs.y ? packetLeaf.upper[1] : packetLeaf.lower[1]) - ray.origin.y) *
+                                  ray.inv_direction.y);
+        tmax = std::min(tmax, ((ray.signs.y ? packetLeaf.lower[1] : packetLeaf.upper[1]) - ray.origin.y) *
+                                  ray.inv_direction.y);
+        tmin = std::max(tmin, ((ray.signs.z ? packetLeaf.upper[2] : packetLeaf.lower[2]) - ray.origin.z) *
+                                  ray.inv_direction.z);
+        tmax = std::min(tmax, ((ray.signs.z ? packetLeaf.lower[2] : packetLeaf.upper[2]) - ray.origin.z) *
+                                  ray.inv_direction.z);
+        if (tmin <= tmax && tmin < t1 && tmax > t0 && leaf(packetLeaf.startIndex, packetLeaf.nbPrimitives, t1))
+            return true;
+    }
+    return false;
+}
+}
@@ -198,11 +198,28 @@ void CudaKernel::render_begin(const float timer)
         {
             LOG_INFO(3, "Transfering " << nbBoxes << " boxes, " << nbPrimitives << " primitives and " << nbLamps
                                        << " lamps");
-            h2d_scene(m_occupancyParameters, m_hBoundingBoxes, nbBoxes, m_hPrimitives, nbPrimitives, m_hLamps, nbLamps);
+            h2d_scene(m_occupancyParameters, m_hBoundingBoxes, nbBoxes + m_nbActiveMeshBoxes[m_frame], m_hPrimitives,
+                      nbPrimitives, m_hLamps, nbLamps);
+            if (!m_hMeshTriangles.empty())
+                LOG_ERROR("Indexed meshes are not supported by the CUDA engine, they are not rendered");
 
             LOG_INFO(3, "Transfering " << m_lightInformationSize << " light elements");
             h2d_lightInformation(m_occupancyParameters, m_lightInformation, m_lightInformationSize);
             m_primitivesTransfered = true;
+            m_dirtyPrimitives.clear();
+            m_dirtyBoxes.clear();
+        }
+        else
+        {
+            // Refitted BVH, only modified ranges are uploaded
+            for (const auto &range : m_dirtyBoxes)
+                h2d_boundingBoxes(m_occupancyParameters, m_hBoundingBoxes, static_cast<int>(range.begin),
+                                  static_cast<int>(range.end - range.begin));
+            for (const auto &range : m_dirtyPrimitives)
+                h2d_primitives(m_occupancyParameters, m_hPrimitives, static_cast<int>(range.begin),
+                               static_cast<int>(range.end - range.begin));
+            m_dirtyBoxes.clear();
+            m_dirtyPrimitives.clear();
         }
 
         if (!m_randomsTransfered)
@@ -216,18 +233,36 @@ void CudaKernel::render_begin(const float timer)
         {
             realignTexturesAndMaterials();
 
-            h2d_materials(m_occupancyParameters, m_hMaterials, nbMaterials);
+            h2d_materials(m_occupancyParameters, m_hMaterials, 0, nbMaterials);
             LOG_INFO(3, "Transfering " << nbMaterials << " materials");
             m_materialsTransfered = true;
         }
+        else
+        {
+            // Only modified materials are uploaded
+            realignDirtyMaterials();
+            for (const auto &range : m_dirtyMaterials)
+                h2d_materials(m_occupancyParameters, m_hMaterials, static_cast<int>(range.begin),
+                              static_cast<int>(range.end - range.begin));
+        }
+        m_dirtyMaterials.clear();
 
         if (!m_texturesTransfered)
         {
             LOG_INFO(3, "Transfering " << m_nbActiveTextures << " textures, and " << m_lightInformationSize
                                        << " light information");
-            h2d_textures(m_occupancyParameters, NB_MAX_TEXTURES, m_hTextures);
+            h2d_textures(m_occupancyParameters, static_cast<int>(m_texturePool.getSize()), NB_MAX_TEXTURES,
+                         m_hTextures);
             m_texturesTransfered = true;
         }
+        else
+        {
+            // Only new and modified textures are uploaded
+            for (const auto &index : m_dirtyTextures)
+                if (m_hTextures[index].buffer != 0)
+                    h2d_texture(m_occupancyParameters, static_cast<int>(m_texturePool.getSize()), m_hTextures[index]);
+        }
+        m_dirtyTextures.clear();
 
 #if USE_KINECT
         if (m_kinectEnabled)
@@ -310,12 +345,13 @@ void CudaKernel::render_end()
     if (m_sceneInfo.pathTracingIteration == m_sceneInfo.maxPathTracingIterations - 1)
         LOG_INFO(1, "Rendering completed in " << GetTickCount() - m_counter << " ms");
 #endif // WIN32
-    if (m_sceneInfo.frameBufferType == ftRGB)
+    if (m_sceneInfo.frameBufferType == ftRGB || m_sceneInfo.frameBufferType == ftRGBA)
     {
+        const bool rgba = m_sceneInfo.frameBufferType == ftRGBA;
         ::glEnable(GL_TEXTURE_2D);
         ::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        ::glTexImage2D(GL_TEXTURE_2D, 0, gColorDepth, m_sceneInfo.size.x, m_sceneInfo.size.y, 0, GL_RGB,
-                       GL_UNSIGNED_BYTE, m_bitmap);
+        ::glTexImage2D(GL_TEXTURE_2D, 0, rgba ? GL_RGBA8 : gColorDepth, m_sceneInfo.size.x, m_sceneInfo.size.y, 0,
+                       rgba ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, m_bitmap);
 
         if (m_sceneInfo.cameraType == ctVR)
         {
@@ -540,6 +576,8 @@ void CudaKernel::reshape()
 {
     LOG_INFO(3, "CudaKernel::reshape");
     GPUKernel::reshape();
+    reshape_scene(m_occupancyParameters, m_sceneInfo);
+    m_randomsTransfered = false;
 }
 
 std::string CudaKernel::getGPUDescription()
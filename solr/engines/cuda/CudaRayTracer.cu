@@ -25,14 +25,19 @@
 #include "GeometryIntersections.cuh"
 #include "VectorUtils.cuh"
 
+#include <algorithm>
+
 // Device resources
 #ifndef USE_MANAGED_MEMORY
 BoundingBox* d_boundingBoxes[MAX_GPU_COUNT];
+size_t d_boundingBoxesSize[MAX_GPU_COUNT]; // Capacity of d_boundingBoxes, in boxes
 Primitive* d_primitives[MAX_GPU_COUNT];
+size_t d_primitivesSize[MAX_GPU_COUNT]; // Capacity of d_primitives, in primitives
 #endif
 Lamp* d_lamps[MAX_GPU_COUNT];
 Material* d_materials[MAX_GPU_COUNT];
 BitmapBuffer* d_textures[MAX_GPU_COUNT];
+size_t d_texturesSize[MAX_GPU_COUNT]; // Capacity of d_textures, in bytes
 LightInformation* d_lightInformation[MAX_GPU_COUNT];
 RandomBuffer* d_randoms[MAX_GPU_COUNT];
 PostProcessingBuffer* d_postProcessingBuffer[MAX_GPU_COUNT];
@@ -1370,26 +1375,27 @@ extern "C" void reshape_scene(int2 occupancyParameters, SceneInfo sceneInfo)
         FREECUDARESOURCE(d_bitmap[device]);
         FREECUDARESOURCE(d_primitivesXYIds[device]);
 
-        // Randoms
+        // Randoms, a pool shared by all pixels whatever the size of the frame
         size_t size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT * sizeof(RandomBuffer);
         LOG_INFO(3, "d_randoms: " << size << " bytes");
         checkCudaErrors(cudaMalloc((void**)&d_randoms[device], size));
         totalMemoryAllocation += size;
 
-        // Post-processing
-        size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT * sizeof(PostProcessingBuffer) / occupancyParameters.x;
+        // Post-processing, bitmap and primitive IDs have the size of the frame
+        const size_t nbPixels = static_cast<size_t>(max(1, sceneInfo.size.x)) * max(1, sceneInfo.size.y);
+        size = nbPixels * sizeof(PostProcessingBuffer) / occupancyParameters.x;
         LOG_INFO(3, "d_postProcessingBuffer: " << size << " bytes");
         checkCudaErrors(cudaMalloc((void**)&d_postProcessingBuffer[device], size));
         totalMemoryAllocation += size;
 
         // Bitmap
-        size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT * gColorDepth * sizeof(BitmapBuffer) / occupancyParameters.x;
+        size = nbPixels * gMaxColorDepth * sizeof(BitmapBuffer) / occupancyParameters.x;
         LOG_INFO(3, "d_bitmap: " << size << " bytes");
         checkCudaErrors(cudaMalloc((void**)&d_bitmap[device], size));
         totalMemoryAllocation += size;
 
         // Primitive IDs
-        size = MAX_BITMAP_WIDTH * MAX_BITMAP_HEIGHT * sizeof(PrimitiveXYIdBuffer) / occupancyParameters.x;
+        size = nbPixels * sizeof(PrimitiveXYIdBuffer) / occupancyParameters.x;
         LOG_INFO(3, "d_primitivesXYIds: " << size << " bytes");
         checkCudaErrors(cudaMalloc((void**)&d_primitivesXYIds[device], size));
         totalMemoryAllocation += size;
@@ -1436,25 +1442,27 @@ extern "C" void initialize_scene(int2 occupancyParameters, SceneInfo sceneInfo,
             checkCudaErrors(cudaStreamCreate(&d_streams[device][stream]));
         LOG_INFO(3, "Created " << occupancyParameters.y << " streams on device " << device);
 
+#ifdef USE_MANAGED_MEMORY
         // Bounding boxes
         int size(NB_MAX_BOXES * sizeof(BoundingBox));
         LOG_INFO(3, "d_boundingBoxes: " << size << " bytes");
-#ifdef USE_MANAGED_MEMORY
         checkCudaErrors(cudaMallocManaged(&boundingBoxes, size, cudaMemAttachHost));
-#else
-        checkCudaErrors(cudaMalloc((void**)&d_boundingBoxes[device], size));
-#endif
         totalMemoryAllocation += size;
 
         // Primitives
         size = NB_MAX_PRIMITIVES * sizeof(Primitive);
         LOG_INFO(3, "d_primitives: " << size << " bytes");
-#ifdef USE_MANAGED_MEMORY
         checkCudaErrors(cudaMallocManaged(&primitives, size, cudaMemAttachHost));
+        totalMemoryAllocation += size;
 #else
-        checkCudaErrors(cudaMalloc((void**)&d_primitives[device], size));
+        // Bounding boxes and primitives are allocated by h2d_scene, for the
+        // size of the scene
+        d_boundingBoxes[device] = 0;
+        d_boundingBoxesSize[device] = 0;
+        d_primitives[device] = 0;
+        d_primitivesSize[device] = 0;
+        int size(0);
 #endif
-        totalMemoryAllocation += size;
 
         // Lamps
         size = NB_MAX_LAMPS * sizeof(Lamp);
@@ -1475,6 +1483,7 @@ extern "C" void initialize_scene(int2 occupancyParameters, SceneInfo sceneInfo,
         totalMemoryAllocation += size;
 
         d_textures[device] = 0;
+        d_texturesSize[device] = 0;
         LOG_INFO(3, "Total constant GPU memory allocated on device " << device << ": " << totalMemoryAllocation
                                                                      << " bytes");
     }
@@ -1512,11 +1521,14 @@ extern "C" void finalize_scene(int2 occupancyParameters
         FREECUDARESOURCE(primitives);
 #else
         FREECUDARESOURCE(d_boundingBoxes[device]);
+        d_boundingBoxesSize[device] = 0;
         FREECUDARESOURCE(d_primitives[device]);
+        d_primitivesSize[device] = 0;
 #endif
         FREECUDARESOURCE(d_lamps[device]);
         FREECUDARESOURCE(d_materials[device]);
         FREECUDARESOURCE(d_textures[device]);
+        d_texturesSize[device] = 0;
         FREECUDARESOURCE(d_lightInformation[device]);
         FREECUDARESOURCE(d_randoms[device]);
         FREECUDARESOURCE(d_postProcessingBuffer[device]);
@@ -1537,6 +1549,21 @@ ________________________________________________________________________________
 CPU -> GPU data transfers
 ________________________________________________________________________________
 */
+#ifndef USE_MANAGED_MEMORY
+// Device buffers of the scene only grow when it does not fit anymore, and then
+// grow geometrically
+template <typename T>
+void reserveDeviceBuffer(T*& buffer, size_t& capacity, const size_t size)
+{
+    if (size <= capacity)
+        return;
+    FREECUDARESOURCE(buffer);
+    capacity = std::max(size, capacity * 3 / 2);
+    checkCudaErrors(cudaMalloc((void**)&buffer, capacity * sizeof(T)));
+    LOG_INFO(1, "Device buffer allocated: " << capacity * sizeof(T) << " bytes");
+}
+#endif
+
 extern "C" void h2d_scene(int2 occupancyParameters, BoundingBox* boundingBoxes, int nbActiveBoxes,
                           Primitive* primitives, int nbPrimitives, Lamp* lamps, int nbLamps)
 {
@@ -1544,6 +1571,8 @@ extern "C" void h2d_scene(int2 occupancyParameters, BoundingBox* boundingBoxes,
     {
         checkCudaErrors(cudaSetDevice(device));
 #ifndef USE_MANAGED_MEMORY
+        reserveDeviceBuffer(d_boundingBoxes[device], d_boundingBoxesSize[device], nbActiveBoxes);
+        reserveDeviceBuffer(d_primitives[device], d_primitivesSize[device], nbPrimitives);
         checkCudaErrors(cudaMemcpyAsync(d_boundingBoxes[device], boundingBoxes, nbActiveBoxes * sizeof(BoundingBox),
                                         cudaMemcpyHostToDevice, d_streams[device][0]));
         checkCudaErrors(cudaMemcpyAsync(d_primitives[device], primitives, nbPrimitives * sizeof(Primitive),
@@ -1554,12 +1583,37 @@ extern "C" void h2d_scene(int2 occupancyParameters, BoundingBox* boundingBoxes,
     }
 }
 
-extern "C" void h2d_materials(int2 occupancyParameters, Material* materials, int nbActiveMaterials)
+extern "C" void h2d_boundingBoxes(int2 occupancyParameters, BoundingBox* boundingBoxes, int from, int nbBoxes)
+{
+#ifndef USE_MANAGED_MEMORY
+    for (int device(0); device < occupancyParameters.x; ++device)
+    {
+        checkCudaErrors(cudaSetDevice(device));
+        checkCudaErrors(cudaMemcpyAsync(d_boundingBoxes[device] + from, boundingBoxes + from,
+                                        nbBoxes * sizeof(BoundingBox), cudaMemcpyHostToDevice, d_streams[device][0]));
+    }
+#endif
+}
+
+extern "C" void h2d_primitives(int2 occupancyParameters, Primitive* primitives, int from, int nbPrimitives)
+{
+#ifndef USE_MANAGED_MEMORY
+    for (int device(0); device < occupancyParameters.x; ++device)
+    {
+        checkCudaErrors(cudaSetDevice(device));
+        checkCudaErrors(cudaMemcpyAsync(d_primitives[device] + from, primitives + from,
+                                        nbPrimitives * sizeof(Primitive), cudaMemcpyHostToDevice,
+                                        d_streams[device][0]));
+    }
+#endif
+}
+
+extern "C" void h2d_materials(int2 occupancyParameters, Material* materials, int from, int nbMaterials)
 {
     for (int device(0); device < occupancyParameters.x; ++device)
     {
         checkCudaErrors(cudaSetDevice(device));
-        checkCudaErrors(cudaMemcpyAsync(d_materials[device], materials, nbActiveMaterials * sizeof(Material),
+        checkCudaErrors(cudaMemcpyAsync(d_materials[device] + from, materials + from, nbMaterials * sizeof(Material),
                                         cudaMemcpyHostToDevice, d_streams[device][0]));
     }
 }
@@ -1575,40 +1629,61 @@ extern "C" void h2d_randoms(int2 occupancyParameters, float* randoms)
     }
 }
 
-extern "C" void h2d_textures(int2 occupancyParameters, int activeTextures, TextureInfo* textureInfos)
+/*
+________________________________________________________________________________
+
+Texture buffer of a device, grown geometrically. Its content is kept when
+requested, textures are then only uploaded when they are new or modified
+________________________________________________________________________________
+*/
+static void reserveTextures(const int device, const size_t size, const bool keepContent)
+{
+    if (size <= d_texturesSize[device])
+        return;
+
+    const size_t capacity = std::max(size, d_texturesSize[device] * 3 / 2);
+    BitmapBuffer* textures = 0;
+    checkCudaErrors(cudaMalloc((void**)&textures, capacity));
+    if (d_textures[device] && keepContent)
+        checkCudaErrors(cudaMemcpyAsync(textures, d_textures[device], d_texturesSize[device],
+                                        cudaMemcpyDeviceToDevice, d_streams[device][0]));
+    checkCudaErrors(cudaStreamSynchronize(d_streams[device][0]));
+    FREECUDARESOURCE(d_textures[device]);
+    d_textures[device] = textures;
+    d_texturesSize[device] = capacity;
+    LOG_INFO(3, "Total GPU texture memory allocated: " << capacity << " bytes");
+}
+
+extern "C" void h2d_textures(int2 occupancyParameters, int totalSize, int activeTextures, TextureInfo* textureInfos)
 {
     for (int device(0); device < occupancyParameters.x; ++device)
     {
         checkCudaErrors(cudaSetDevice(device));
-        int totalSize(0);
+        reserveTextures(device, totalSize * sizeof(BitmapBuffer), false);
         for (int i(0); i < activeTextures; ++i)
-            if (textureInfos[i].buffer)
+            if (textureInfos[i].buffer != 0)
             {
-                LOG_INFO(3, "Texture [" << i << "] memory allocated="
-                                        << textureInfos[i].size.x * textureInfos[i].size.y * textureInfos[i].size.z
-                                        << " bytes");
-                totalSize += textureInfos[i].size.x * textureInfos[i].size.y * textureInfos[i].size.z;
+                LOG_INFO(3, "Texture [" << i << "] transfered=" << textureInfos[i].size.x << ","
+                                        << textureInfos[i].size.y << "," << textureInfos[i].size.z
+                                        << ", offset=" << textureInfos[i].offset);
+                size_t textureSize = textureBufferSize(textureInfos[i]);
+                checkCudaErrors(cudaMemcpyAsync(d_textures[device] + textureInfos[i].offset, textureInfos[i].buffer,
+                                                textureSize * sizeof(BitmapBuffer), cudaMemcpyHostToDevice,
+                                                d_streams[device][0]));
             }
+    }
+}
 
-        FREECUDARESOURCE(d_textures[device]);
-        if (totalSize > 0)
-        {
-            totalSize *= sizeof(BitmapBuffer);
-            LOG_INFO(3, "Total GPU texture memory to allocate: " << totalSize << " bytes");
-            checkCudaErrors(cudaMalloc((void**)&d_textures[device], totalSize));
-
-            for (int i(0); i < activeTextures; ++i)
-                if (textureInfos[i].buffer != 0)
-                {
-                    LOG_INFO(3, "Texture [" << i << "] transfered=" << textureInfos[i].size.x << ","
-                                            << textureInfos[i].size.y << "," << textureInfos[i].size.z
-                                            << ", offset=" << textureInfos[i].offset);
-                    int textureSize = textureInfos[i].size.x * textureInfos[i].size.y * textureInfos[i].size.z;
-                    checkCudaErrors(cudaMemcpyAsync(d_textures[device] + textureInfos[i].offset, textureInfos[i].buffer,
-                                                    textureSize * sizeof(BitmapBuffer), cudaMemcpyHostToDevice,
-                                                    d_streams[device][0]));
-                }
-        }
+extern "C" void h2d_texture(int2 occupancyParameters, int totalSize, TextureInfo textureInfo)
+{
+    for (int device(0); device < occupancyParameters.x; ++device)
+    {
+        checkCudaErrors(cudaSetDevice(device));
+        reserveTextures(device, totalSize * sizeof(BitmapBuffer), true);
+        size_t textureSize = textureBufferSize(textureInfo);
+        checkCudaErrors(cudaMemcpyAsync(d_textures[device] + textureInfo.offset, textureInfo.buffer,
+                                        textureSize * sizeof(BitmapBuffer), cudaMemcpyHostToDevice,
+                                        d_streams[device][0]));
     }
 }
 
@@ -1647,7 +1722,8 @@ ________________________________________________________________________________
 extern "C" void d2h_bitmap(int2 occupancyParameters, SceneInfo sceneInfo, BitmapBuffer* bitmap,
                            PrimitiveXYIdBuffer* primitivesXYIds)
 {
-    int offsetBitmap = sceneInfo.size.x * sceneInfo.size.y * gColorDepth * sizeof(BitmapBuffer) / occupancyParameters.x;
+    int offsetBitmap = sceneInfo.size.x * sceneInfo.size.y * frameBufferDepth(sceneInfo.frameBufferType) *
+                       sizeof(BitmapBuffer) / occupancyParameters.x;
     int offsetXYIds = sceneInfo.size.x * sceneInfo.size.y * sizeof(PrimitiveXYIdBuffer) / occupancyParameters.x;
     for (int device(0); device < occupancyParameters.x; ++device)
     {
@@ -42,11 +42,17 @@ extern "C" void reshape_scene(vec2i occupancyParameters, SceneInfo sceneInfo);
 extern "C" void h2d_scene(vec2i occupancyParameters, BoundingBox *boundingBoxes, int nbActiveBoxes,
                           Primitive *primitives, int nbPrimitives, Lamp *lamps, int nbLamps);
 
-extern "C" void h2d_materials(vec2i occupancyParameters, Material *materials, int nbActiveMaterials);
+extern "C" void h2d_boundingBoxes(vec2i occupancyParameters, BoundingBox *boundingBoxes, int from, int nbBoxes);
+
+extern "C" void h2d_primitives(vec2i occupancyParameters, Primitive *primitives, int from, int nbPrimitives);
+
+extern "C" void h2d_materials(vec2i occupancyParameters, Material *materials, int from, int nbMaterials);
 
 extern "C" void h2d_randoms(vec2i occupancyParameters, float *randoms);
 
-extern "C" void h2d_textures(vec2i occupancyParameters, int activeTextures, TextureInfo *textureInfos);
+extern "C" void h2d_textures(vec2i occupancyParameters, int totalSize, int activeTextures, TextureInfo *textureInfos);
+
+extern "C" void h2d_texture(vec2i occupancyParameters, int totalSize, TextureInfo textureInfo);
 
 extern "C" void h2d_lightInformation(vec2i occupancyParameters, LightInformation *lightInformation,
                                      int lightInformationSize);
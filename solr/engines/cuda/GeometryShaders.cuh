@@ -141,6 +141,24 @@ __device__ __INLINE__ void makeColor(const SceneInfo &sceneInfo, vec4f &color, B
 
     switch (sceneInfo.frameBufferType)
     {
+    case ftRGBA:
+    {
+        // OpenGL, one 32 bit store per pixel
+        reinterpret_cast<uchar4 *>(bitmap)[index] =
+            make_uchar4((BitmapBuffer)(color.x * 255.f), (BitmapBuffer)(color.y * 255.f),
+                        (BitmapBuffer)(color.z * 255.f), 255);
+        break;
+    }
+    case ftBGRA:
+    {
+        // Delphi, one 32 bit store per pixel
+        int y = index / sceneInfo.size.y;
+        int x = index % sceneInfo.size.x;
+        reinterpret_cast<uchar4 *>(bitmap)[(y + 1) * sceneInfo.size.y - x - 1] =
+            make_uchar4((BitmapBuffer)(color.z * 255.f), (BitmapBuffer)(color.y * 255.f),
+                        (BitmapBuffer)(color.x * 255.f), 255);
+        break;
+    }
     case ftBGR:
     {
         // Delphi
@@ -35,6 +35,8 @@
 #include <math.h>
 #include <sstream>
 #endif
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 
 #define __CL_ENABLE_EXCEPTIONS
@@ -205,24 +207,44 @@ OpenCLKernel::OpenCLKernel()
     , m_k3DVisionRenderer(0)
     , m_kFishEyeRenderer(0)
     , m_kVolumeRenderer(0)
+    , m_kWavefrontGenerate(0)
+    , m_kWavefrontExtend(0)
+    , m_kWavefrontShade(0)
+    , m_kWavefrontShadows(0)
+    , m_kWavefrontResolve(0)
     , m_kDefault(0)
     , m_kDepthOfField(0)
     , m_kAmbientOcclusion(0)
     , m_kRadiosity(0)
     , m_kFilter(0)
+    , m_readbackSlot(0)
+    , m_dBoundingBoxes(0)
+    , m_boundingBoxesBufferSize(0)
     , _dPrimitives(0)
+    , m_primitivesBufferSize(0)
     , m_dLamps(0)
     , m_dLightInformation(0)
     , m_dTextures(0)
+    , m_texturesBufferSize(0)
     , m_dRandoms(0)
     , m_dBitmap(0)
     , m_dPostProcessingBuffer(0)
     , m_dPrimitivesXYIds(0)
+    , m_dWavefrontPaths(0)
+    , m_dWavefrontQueues(0)
+    , m_dWavefrontCounters(0)
 {
     // TODO: Occupancy parameters
     m_occupancyParameters.x = 1;
     m_occupancyParameters.y = 1;
 
+    for (int i = 0; i < NB_READBACK_SLOTS; ++i)
+    {
+        m_hReadbackBitmaps[i] = 0;
+        m_hReadbackPrimitivesXYIds[i] = 0;
+        m_hReadbackEvents[i] = 0;
+    }
+
 #ifdef LOGGING
     // Initialize Log
     LOG_INITIALIZE_ETW(&GPU_OPENCLRAYTRACERMODULE, &GPU_OPENCLRAYTRACERMODULE_EVENT_DEBUG,
@@ -278,7 +300,7 @@ void OpenCLKernel::recompileKernels()
         {
             LOG_INFO(1, "Recompiling kernel from " << m_kernelFilename);
             while (getline(inputFile, line))
-                kernelCode += line;
+                kernelCode += line + "\n";
             inputFile.close();
         }
         else
@@ -306,6 +328,12 @@ void OpenCLKernel::recompileKernels()
 #ifdef USE_KINECT
         compilationOptions += " -DUSE_KINECT";
 #endif
+        if (m_quantizedBVH != 0)
+        {
+            std::stringstream quantization;
+            quantization << " -DQUANTIZED_BVH=" << m_quantizedBVH << " -DQUANTIZED_BVH_DEPTH=" << QUANTIZED_BVH_DEPTH;
+            compilationOptions += quantization.str();
+        }
         LOG_INFO(1, "Building Program with " << compilationOptions);
         CHECKSTATUS(
             clBuildProgram(m_hProgram, 1, &m_devices[m_platform][m_device], compilationOptions.c_str(), &buildNotify, NULL));
@@ -330,6 +358,8 @@ void OpenCLKernel::recompileKernels()
         LOG_INFO(3, "PostProcessingInfo: " << sizeof(PostProcessingInfo));
         LOG_INFO(3, "TextureInfo       : " << sizeof(TextureInfo));
         LOG_INFO(3, "Primitive         : " << sizeof(Primitive));
+        LOG_INFO(3, "CompactPrimitive  : " << sizeof(CompactPrimitive));
+        LOG_INFO(3, "ShadingPrimitive  : " << sizeof(ShadingPrimitive));
         LOG_INFO(3, "BoundingBox       : " << sizeof(BoundingBox));
         LOG_INFO(3, "Material          : " << sizeof(Material));
         LOG_INFO(3, "LightInformation  : " << sizeof(LightInformation));
@@ -354,6 +384,24 @@ void OpenCLKernel::recompileKernels()
 
         LOG_INFO(1, "Rendering kernels created");
 
+        // Wavefront rendering kernels
+        m_kWavefrontGenerate = clCreateKernel(m_hProgram, "k_wavefrontGenerate", &status);
+        CHECKSTATUS(status);
+
+        m_kWavefrontExtend = clCreateKernel(m_hProgram, "k_wavefrontExtend", &status);
+        CHECKSTATUS(status);
+
+        m_kWavefrontShade = clCreateKernel(m_hProgram, "k_wavefrontShade", &status);
+        CHECKSTATUS(status);
+
+        m_kWavefrontShadows = clCreateKernel(m_hProgram, "k_wavefrontShadows", &status);
+        CHECKSTATUS(status);
+
+        m_kWavefrontResolve = clCreateKernel(m_hProgram, "k_wavefrontResolve", &status);
+        CHECKSTATUS(status);
+
+        LOG_INFO(1, "Wavefront rendering kernels created");
+
         // Post-processing kernels
         m_kDefault = clCreateKernel(m_hProgram, "k_default", &status);
         CHECKSTATUS(status);
@@ -400,11 +448,20 @@ void OpenCLKernel::initializeDevice()
     LOG_INFO(3, "Setup device memory");
     vec1i errorCode = 0;
     reshape();
-    m_dBoundingBoxes = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(BoundingBox) * NB_MAX_BOXES, 0, &errorCode);
+    // Boxes and primitives are allocated when the scene is uploaded
+    reserveBoundingBoxes(sizeof(BoundingBox));
     m_dLamps = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Lamp) * NB_MAX_LAMPS, 0, &errorCode);
     m_dLightInformation = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY,
                                          sizeof(LightInformation) * NB_MAX_LIGHTINFORMATIONS, 0, &errorCode);
     m_dMaterials = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Material) * NB_MAX_MATERIALS, 0, &errorCode);
+    m_dWavefrontPaths =
+        clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, sizeof(WavefrontPath) * WAVEFRONT_NB_MAX_PATHS, 0, &errorCode);
+    m_dWavefrontQueues = clCreateBuffer(m_hContext, CL_MEM_READ_WRITE,
+                                        sizeof(vec1i) * WAVEFRONT_NB_QUEUES * WAVEFRONT_NB_MAX_PATHS, 0, &errorCode);
+    // Counters are then only reset by the kernels (see renderWavefront)
+    vec1i counters[WAVEFRONT_NB_QUEUES] = {0, 0, 0};
+    m_dWavefrontCounters = clCreateBuffer(m_hContext, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                          sizeof(vec1i) * WAVEFRONT_NB_QUEUES, counters, &errorCode);
 
 #if USE_KINECT
     m_dVideo = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY,
@@ -449,6 +506,33 @@ void OpenCLKernel::releaseKernels()
         m_kVolumeRenderer = 0;
     }
 
+    // Wavefront rendering kernels
+    if (m_kWavefrontGenerate)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kWavefrontGenerate));
+        m_kWavefrontGenerate = 0;
+    }
+    if (m_kWavefrontExtend)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kWavefrontExtend));
+        m_kWavefrontExtend = 0;
+    }
+    if (m_kWavefrontShade)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kWavefrontShade));
+        m_kWavefrontShade = 0;
+    }
+    if (m_kWavefrontShadows)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kWavefrontShadows));
+        m_kWavefrontShadows = 0;
+    }
+    if (m_kWavefrontResolve)
+    {
+        CHECKSTATUS(clReleaseKernel(m_kWavefrontResolve));
+        m_kWavefrontResolve = 0;
+    }
+
     // Post processing kernels
     if (m_kDefault)
     {
@@ -490,17 +574,24 @@ void OpenCLKernel::releaseKernels()
 void OpenCLKernel::releaseDevice()
 {
     releaseKernels();
+    releaseReadbacks();
+    releaseUploads(true);
 
     LOG_INFO(3, "Release device memory");
     if (_dPrimitives)
         CHECKSTATUS(clReleaseMemObject(_dPrimitives));
     _dPrimitives = 0;
+    m_primitivesBufferSize = 0;
     if (m_dBoundingBoxes)
         CHECKSTATUS(clReleaseMemObject(m_dBoundingBoxes));
+    m_dBoundingBoxes = 0;
+    m_boundingBoxesBufferSize = 0;
     if (m_dMaterials)
         CHECKSTATUS(clReleaseMemObject(m_dMaterials));
     if (m_dTextures)
         CHECKSTATUS(clReleaseMemObject(m_dTextures));
+    m_dTextures = 0;
+    m_texturesBufferSize = 0;
     if (m_dRandoms)
         CHECKSTATUS(clReleaseMemObject(m_dRandoms));
     if (m_dPostProcessingBuffer)
@@ -509,6 +600,12 @@ void OpenCLKernel::releaseDevice()
         CHECKSTATUS(clReleaseMemObject(m_dPrimitivesXYIds));
     if (m_dBitmap)
         CHECKSTATUS(clReleaseMemObject(m_dBitmap));
+    if (m_dWavefrontPaths)
+        CHECKSTATUS(clReleaseMemObject(m_dWavefrontPaths));
+    if (m_dWavefrontQueues)
+        CHECKSTATUS(clReleaseMemObject(m_dWavefrontQueues));
+    if (m_dWavefrontCounters)
+        CHECKSTATUS(clReleaseMemObject(m_dWavefrontCounters));
 
     // Queue and context
     if (m_hQueue)
@@ -523,15 +620,246 @@ void OpenCLKernel::releaseDevice()
     }
 }
 
+void OpenCLKernel::writeQuantizedBoundingBoxes(const int nbBoxes)
+{
+    BVHBuilder::quantize(m_hBoundingBoxes, nbBoxes, m_quantizedBVH, QUANTIZED_BVH_DEPTH, m_hQuantizedBoundingBoxes);
+    reserveBoundingBoxes(m_hQuantizedBoundingBoxes.size());
+    writeBuffer(m_dBoundingBoxes, 0, m_hQuantizedBoundingBoxes.size(), &m_hQuantizedBoundingBoxes[0]);
+    LOG_INFO(3, nbBoxes << " boxes quantized on " << m_quantizedBVH << " bits: " << m_hQuantizedBoundingBoxes.size()
+                        << " bytes instead of " << nbBoxes * sizeof(BoundingBox));
+}
+
+void OpenCLKernel::updateQuantizedBoundingBoxes(const int nbBoxes)
+{
+    std::vector<int> dirty;
+    for (const auto &range : m_dirtyBoxes)
+        for (size_t i = range.begin; i < range.end; ++i)
+            dirty.push_back(static_cast<int>(i));
+    std::vector<int> modified;
+    if (!BVHBuilder::requantize(m_hBoundingBoxes, nbBoxes, m_quantizedBVH, QUANTIZED_BVH_DEPTH, dirty,
+                                m_hQuantizedBoundingBoxes, modified))
+    {
+        writeQuantizedBoundingBoxes(nbBoxes);
+        return;
+    }
+
+    // Boxes follow the frame of reference of the roots
+    const size_t headerSize = 2 * sizeof(vec4f);
+    const size_t boxSize = (m_quantizedBVH == 16) ? sizeof(QuantizedBoundingBox16) : sizeof(QuantizedBoundingBox8);
+    DirtyRanges ranges;
+    for (const auto index : modified)
+        addDirtyRange(ranges, index, index + 1);
+    for (const auto &range : ranges)
+        writeBuffer(m_dBoundingBoxes, headerSize + range.begin * boxSize, (range.end - range.begin) * boxSize,
+                    &m_hQuantizedBoundingBoxes[headerSize + range.begin * boxSize]);
+    LOG_INFO(3, dirty.size() << " refitted boxes, " << modified.size() << " quantized again in " << ranges.size()
+                             << " ranges");
+}
+
+void OpenCLKernel::reserveBoundingBoxes(const size_t size)
+{
+    // Like the primitives, the buffer only grows when the boxes do not fit
+    // anymore, and then grows geometrically
+    if (size <= m_boundingBoxesBufferSize)
+        return;
+    int errorCode;
+    if (m_dBoundingBoxes)
+        CHECKSTATUS(clReleaseMemObject(m_dBoundingBoxes));
+    m_boundingBoxesBufferSize = std::max(size, m_boundingBoxesBufferSize * 3 / 2);
+    m_dBoundingBoxes = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, m_boundingBoxesBufferSize, 0, &errorCode);
+    CHECKSTATUS(errorCode);
+    LOG_INFO(1, "Bounding box buffer allocated: " << m_boundingBoxesBufferSize << " bytes");
+}
+
+void OpenCLKernel::writeBuffer(cl_mem buffer, const size_t offset, const size_t size, const void *data)
+{
+    releaseUploads(false);
+    m_hUploads.push_back(Upload());
+    Upload &upload = m_hUploads.back();
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    upload.data.assign(bytes, bytes + size);
+    upload.event = 0;
+    CHECKSTATUS(
+        clEnqueueWriteBuffer(m_hQueue, buffer, CL_FALSE, offset, size, upload.data.data(), 0, NULL, &upload.event));
+}
+
+void OpenCLKernel::releaseUploads(const bool wait)
+{
+    // The command queue is in order, uploads are completed in the order they were enqueued
+    while (!m_hUploads.empty())
+    {
+        cl_event event = m_hUploads.front().event;
+        if (wait)
+        {
+            CHECKSTATUS(clWaitForEvents(1, &event));
+        }
+        else
+        {
+            cl_int status = CL_COMPLETE;
+            CHECKSTATUS(clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL));
+            if (status > CL_COMPLETE)
+                break;
+        }
+        CHECKSTATUS(clReleaseEvent(event));
+        m_hUploads.pop_front();
+    }
+}
+
+void OpenCLKernel::releaseReadbacks()
+{
+    for (int i = 0; i < NB_READBACK_SLOTS; ++i)
+        if (m_hReadbackEvents[i])
+        {
+            CHECKSTATUS(clWaitForEvents(1, &m_hReadbackEvents[i]));
+            CHECKSTATUS(clReleaseEvent(m_hReadbackEvents[i]));
+            m_hReadbackEvents[i] = 0;
+        }
+}
+
+void OpenCLKernel::renderWavefront(const SceneInfo &sceneInfo, const int nbBoxes, const int nbPrimitives)
+{
+    const int nbPixels = sceneInfo.size.x * sceneInfo.size.y;
+    const int nbSamples = (sceneInfo.cameraType == ctAntialiazed) ? 5 : 1;
+    long nbRays = 0;
+    long nbShadowRays = 0;
+
+    // Arguments that remain the same for the whole frame
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 0, sizeof(vec2i), (void *)&m_occupancyParameters));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 4, sizeof(cl_mem), (void *)&m_dRandoms));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 5, sizeof(vec4f), (void *)&m_viewPos));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 6, sizeof(vec4f), (void *)&m_viewDir));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 7, sizeof(vec4f), (void *)&m_angles));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 8, sizeof(SceneInfo), (void *)&sceneInfo));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 9, sizeof(PostProcessingInfo), (void *)&m_postProcessingInfo));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 10, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 11, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 12, sizeof(cl_mem), (void *)&m_dWavefrontPaths));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 13, sizeof(cl_mem), (void *)&m_dWavefrontQueues));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 14, sizeof(cl_mem), (void *)&m_dWavefrontCounters));
+
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 2, sizeof(cl_mem), (void *)&m_dBoundingBoxes));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 3, sizeof(vec1i), (void *)&nbBoxes));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 4, sizeof(cl_mem), (void *)&_dPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 5, sizeof(vec1i), (void *)&nbPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 6, sizeof(cl_mem), (void *)&m_dMaterials));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 7, sizeof(cl_mem), (void *)&m_dTextures));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 8, sizeof(SceneInfo), (void *)&sceneInfo));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 9, sizeof(cl_mem), (void *)&m_dWavefrontPaths));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 10, sizeof(cl_mem), (void *)&m_dWavefrontQueues));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 11, sizeof(cl_mem), (void *)&m_dWavefrontCounters));
+
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 3, sizeof(cl_mem), (void *)&_dPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 4, sizeof(vec1i), (void *)&nbPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 5, sizeof(cl_mem), (void *)&m_dLightInformation));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 6, sizeof(vec1i), (void *)&m_lightInformationSize));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 7, sizeof(cl_mem), (void *)&m_dMaterials));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 8, sizeof(cl_mem), (void *)&m_dTextures));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 9, sizeof(cl_mem), (void *)&m_dRandoms));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 10, sizeof(SceneInfo), (void *)&sceneInfo));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 11, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 12, sizeof(cl_mem), (void *)&m_dWavefrontPaths));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 13, sizeof(cl_mem), (void *)&m_dWavefrontQueues));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 14, sizeof(cl_mem), (void *)&m_dWavefrontCounters));
+
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 2, sizeof(cl_mem), (void *)&m_dBoundingBoxes));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 3, sizeof(vec1i), (void *)&nbBoxes));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 4, sizeof(cl_mem), (void *)&_dPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 5, sizeof(vec1i), (void *)&nbPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 6, sizeof(cl_mem), (void *)&m_dLightInformation));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 7, sizeof(cl_mem), (void *)&m_dMaterials));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 8, sizeof(cl_mem), (void *)&m_dTextures));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 9, sizeof(cl_mem), (void *)&m_dRandoms));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 10, sizeof(SceneInfo), (void *)&sceneInfo));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 11, sizeof(cl_mem), (void *)&m_dPrimitivesXYIds));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 12, sizeof(cl_mem), (void *)&m_dWavefrontPaths));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 13, sizeof(cl_mem), (void *)&m_dWavefrontQueues));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 14, sizeof(cl_mem), (void *)&m_dWavefrontCounters));
+
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 3, sizeof(vec1i), (void *)&nbSamples));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 4, sizeof(cl_mem), (void *)&_dPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 5, sizeof(vec1i), (void *)&nbPrimitives));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 6, sizeof(cl_mem), (void *)&m_dMaterials));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 7, sizeof(cl_mem), (void *)&m_dRandoms));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 8, sizeof(SceneInfo), (void *)&sceneInfo));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 9, sizeof(cl_mem), (void *)&m_dPostProcessingBuffer));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 10, sizeof(cl_mem), (void *)&m_dWavefrontPaths));
+    CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 11, sizeof(cl_mem), (void *)&m_dWavefrontCounters));
+
+    // Frames that have more pixels than paths in flight are rendered in bands
+    for (int offset = 0; offset < nbPixels; offset += WAVEFRONT_NB_MAX_PATHS)
+    {
+        const int nbPaths = std::min(WAVEFRONT_NB_MAX_PATHS, nbPixels - offset);
+        const size_t szPaths[] = {static_cast<size_t>(nbPaths)};
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 1, sizeof(vec1i), (void *)&offset));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 2, sizeof(vec1i), (void *)&nbPaths));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 0, sizeof(vec1i), (void *)&nbPaths));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 0, sizeof(vec1i), (void *)&offset));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 1, sizeof(vec1i), (void *)&nbPaths));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 0, sizeof(vec1i), (void *)&offset));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontShadows, 1, sizeof(vec1i), (void *)&nbPaths));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 0, sizeof(vec1i), (void *)&offset));
+        CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 1, sizeof(vec1i), (void *)&nbPaths));
+
+        for (int sample = 0; sample < nbSamples; ++sample)
+        {
+            // Generation of the primary rays. Counters were reset by the resolution of the previous sample
+            CHECKSTATUS(clSetKernelArg(m_kWavefrontGenerate, 3, sizeof(vec1i), (void *)&sample));
+            CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kWavefrontGenerate, 1, NULL, szPaths, NULL, 0, 0, 0));
+
+            // Active paths are extended until all of them are done. Counters stay on the device, the extension
+            // resets the ones filled by the shading. They are read back without blocking, and the host only waits
+            // for the counters of a bounce while the next one runs. Done paths never come back, so the number of
+            // paths queued by a bounce bounds the size of the kernels of the following one
+            vec1i counters[2][WAVEFRONT_NB_QUEUES];
+            cl_event readbacks[2] = {0, 0};
+            CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dWavefrontCounters, CL_FALSE, 0, sizeof(counters[0]),
+                                            counters[0], 0, NULL, &readbacks[0]));
+            int queue = 0;
+            int pending = 0;
+            size_t nbQueued = static_cast<size_t>(nbPaths);
+            while (true)
+            {
+                const size_t szQueued[] = {nbQueued};
+                CHECKSTATUS(clSetKernelArg(m_kWavefrontExtend, 1, sizeof(vec1i), (void *)&queue));
+                CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kWavefrontExtend, 1, NULL, szQueued, NULL, 0, 0, 0));
+                CHECKSTATUS(clSetKernelArg(m_kWavefrontShade, 2, sizeof(vec1i), (void *)&queue));
+                CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kWavefrontShade, 1, NULL, szQueued, NULL, 0, 0, 0));
+                CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kWavefrontShadows, 1, NULL, szQueued, NULL, 0, 0, 0));
+                CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dWavefrontCounters, CL_FALSE, 0, sizeof(counters[0]),
+                                                counters[1 - pending], 0, NULL, &readbacks[1 - pending]));
+                CHECKSTATUS(clFlush(m_hQueue));
+
+                // Paths of the bounce that was just enqueued, and shadow rays of the previous one
+                CHECKSTATUS(clWaitForEvents(1, &readbacks[pending]));
+                CHECKSTATUS(clReleaseEvent(readbacks[pending]));
+                readbacks[pending] = 0;
+                const vec1i *previous = counters[pending];
+                nbRays += previous[queue];
+                nbShadowRays += previous[WAVEFRONT_SHADOW_QUEUE];
+                pending = 1 - pending;
+                if (previous[queue] == 0)
+                    break;
+                nbQueued = static_cast<size_t>(previous[queue]);
+                queue = 1 - queue;
+            }
+            CHECKSTATUS(clWaitForEvents(1, &readbacks[pending]));
+            CHECKSTATUS(clReleaseEvent(readbacks[pending]));
+
+            // Pixels
+            CHECKSTATUS(clSetKernelArg(m_kWavefrontResolve, 2, sizeof(vec1i), (void *)&sample));
+            CHECKSTATUS(clEnqueueNDRangeKernel(m_hQueue, m_kWavefrontResolve, 1, NULL, szPaths, NULL, 0, 0, 0));
+        }
+    }
+    LOG_INFO(3, "Wavefront rendering: " << nbRays << " rays and " << nbShadowRays << " shadow rays");
+}
+
 /*
  * runKernel
  */
 void OpenCLKernel::render_begin(const float timer)
 {
-#ifdef WIN32
     if (m_sceneInfo.pathTracingIteration == 0)
-        m_counter = GetTickCount();
-#endif
+        m_renderStart = std::chrono::steady_clock::now();
 
     GPUKernel::render_begin(timer);
     if (m_refresh)
@@ -546,39 +874,106 @@ void OpenCLKernel::render_begin(const float timer)
 
         if (!m_primitivesTransfered)
         {
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dBoundingBoxes, CL_TRUE, 0, nbBoxes * sizeof(BoundingBox),
-                                             m_hBoundingBoxes, 0, NULL, NULL));
+            // Bottom level hierarchies of meshes are stored after the top level one
+            if (m_quantizedBVH != 0)
+                writeQuantizedBoundingBoxes(nbBoxes + m_nbActiveMeshBoxes[m_frame]);
+            else
+            {
+                const size_t boxesSize = (nbBoxes + m_nbActiveMeshBoxes[m_frame]) * sizeof(BoundingBox);
+                reserveBoundingBoxes(boxesSize);
+                writeBuffer(m_dBoundingBoxes, 0, boxesSize, m_hBoundingBoxes);
+            }
 
-            int errorCode;
-            if (_dPrimitives)
-                CHECKSTATUS(clReleaseMemObject(_dPrimitives));
-            _dPrimitives =
-                clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, sizeof(Primitive) * nbPrimitives, 0, &errorCode);
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, _dPrimitives, CL_TRUE, 0, nbPrimitives * sizeof(Primitive),
-                                             m_hPrimitives, 0, NULL, NULL));
-            CHECKSTATUS(
-                clEnqueueWriteBuffer(m_hQueue, m_dLamps, CL_TRUE, 0, nbLamps * sizeof(Lamp), m_hLamps, 0, NULL, NULL));
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dLightInformation, CL_TRUE, 0,
-                                             m_lightInformationSize * sizeof(LightInformation), m_lightInformation, 0,
-                                             NULL, NULL));
+            // Shading data of the primitives, and the geometry of indexed meshes are stored after their
+            // intersection data, in the same buffer
+            m_hMeshGeometry = make_vec4i(static_cast<int>(m_hMeshTriangles.size()),
+                                         static_cast<int>(m_hMeshVertices.size()));
+            const vec4i &geometry = m_hMeshGeometry;
+            const size_t geometrySizes[5] = {sizeof(vec4i), geometry.x * sizeof(vec4i), geometry.y * sizeof(vec3f),
+                                             geometry.y * sizeof(vec3f), geometry.y * sizeof(vec2f)};
+            const void *geometryData[5] = {&geometry, m_hMeshTriangles.data(), m_hMeshVertices.data(),
+                                           m_hMeshNormals.data(), m_hMeshTextureCoordinates.data()};
+            size_t geometryOffset = (sizeof(CompactPrimitive) + sizeof(ShadingPrimitive)) * nbPrimitives;
+            const size_t geometrySize = geometrySizes[0] + geometrySizes[1] + geometrySizes[2] + geometrySizes[3] +
+                                        geometrySizes[4];
+
+            // The buffer is only created again when the scene does not fit anymore, and then grows geometrically
+            if (geometryOffset + geometrySize > m_primitivesBufferSize)
+            {
+                int errorCode;
+                if (_dPrimitives)
+                    CHECKSTATUS(clReleaseMemObject(_dPrimitives));
+                m_primitivesBufferSize = std::max(geometryOffset + geometrySize, m_primitivesBufferSize * 3 / 2);
+                _dPrimitives = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, m_primitivesBufferSize, 0, &errorCode);
+                CHECKSTATUS(errorCode);
+                LOG_INFO(1, "Primitive buffer allocated: " << m_primitivesBufferSize << " bytes");
+            }
+            writeBuffer(_dPrimitives, 0, nbPrimitives * sizeof(CompactPrimitive), m_hCompactPrimitives);
+            writeBuffer(_dPrimitives, nbPrimitives * sizeof(CompactPrimitive), nbPrimitives * sizeof(ShadingPrimitive),
+                        m_hShadingPrimitives);
+            for (int i = 0; i < 5; ++i)
+            {
+                if (geometrySizes[i] != 0)
+                    writeBuffer(_dPrimitives, geometryOffset, geometrySizes[i], geometryData[i]);
+                geometryOffset += geometrySizes[i];
+            }
+            LOG_INFO(1, nbPrimitives << " primitives: " << sizeof(CompactPrimitive)
+                                     << " bytes of intersection data and " << sizeof(ShadingPrimitive)
+                                     << " bytes of shading data per primitive");
+            if (geometry.x != 0)
+                LOG_INFO(1, geometry.x << " indexed triangles: " << geometrySize / geometry.x
+                                       << " bytes per triangle");
+            writeBuffer(m_dLamps, 0, nbLamps * sizeof(Lamp), m_hLamps);
+            writeBuffer(m_dLightInformation, 0, m_lightInformationSize * sizeof(LightInformation), m_lightInformation);
             m_primitivesTransfered = true;
+            m_dirtyPrimitives.clear();
+            m_dirtyBoxes.clear();
+        }
+        else
+        {
+            // Refitted BVH, only modified ranges are uploaded
+            if (m_quantizedBVH != 0)
+            {
+                if (!m_dirtyBoxes.empty())
+                    updateQuantizedBoundingBoxes(nbBoxes + m_nbActiveMeshBoxes[m_frame]);
+            }
+            else
+                for (const auto &range : m_dirtyBoxes)
+                    writeBuffer(m_dBoundingBoxes, range.begin * sizeof(BoundingBox),
+                                (range.end - range.begin) * sizeof(BoundingBox), m_hBoundingBoxes + range.begin);
+            for (const auto &range : m_dirtyPrimitives)
+            {
+                writeBuffer(_dPrimitives, range.begin * sizeof(CompactPrimitive),
+                            (range.end - range.begin) * sizeof(CompactPrimitive), m_hCompactPrimitives + range.begin);
+                writeBuffer(_dPrimitives,
+                            nbPrimitives * sizeof(CompactPrimitive) + range.begin * sizeof(ShadingPrimitive),
+                            (range.end - range.begin) * sizeof(ShadingPrimitive), m_hShadingPrimitives + range.begin);
+            }
+            m_dirtyBoxes.clear();
+            m_dirtyPrimitives.clear();
         }
 
         if (!m_randomsTransfered)
         {
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dRandoms, CL_TRUE, 0,
-                                             m_sceneInfo.size.x * m_sceneInfo.size.y * sizeof(RandomBuffer), m_hRandoms,
-                                             0, NULL, NULL));
+            writeBuffer(m_dRandoms, 0, MAX_BITMAP_SIZE * sizeof(RandomBuffer), m_hRandoms);
             m_randomsTransfered = true;
         }
 
         if (!m_materialsTransfered)
         {
             realignTexturesAndMaterials();
-            CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dMaterials, CL_TRUE, 0, nbMaterials * sizeof(Material),
-                                             m_hMaterials, 0, NULL, NULL));
+            writeBuffer(m_dMaterials, 0, nbMaterials * sizeof(Material), m_hMaterials);
             m_materialsTransfered = true;
         }
+        else
+        {
+            // Only modified materials are uploaded
+            realignDirtyMaterials();
+            for (const auto &range : m_dirtyMaterials)
+                writeBuffer(m_dMaterials, range.begin * sizeof(Material), (range.end - range.begin) * sizeof(Material),
+                            m_hMaterials + range.begin);
+        }
+        m_dirtyMaterials.clear();
 
 #ifdef USE_KINECT
         if (m_kinectEnabled)
@@ -624,49 +1019,49 @@ void OpenCLKernel::render_begin(const float timer)
 
 #endif // USE_KINECT
 
-        if (!m_texturesTransfered)
+        // The texture buffer grows geometrically and keeps its content, only new and modified textures are
+        // uploaded
+        const size_t texturesSize = m_texturePool.getSize() * sizeof(BitmapBuffer);
+        if (texturesSize > m_texturesBufferSize)
         {
-            int totalSize(0);
-            for (int i(0); i < m_nbActiveTextures; ++i)
-            {
-                totalSize += m_hTextures[i].size.x * m_hTextures[i].size.y * m_hTextures[i].size.z;
-            }
-            LOG_INFO(3, "Total texture size: " << totalSize << " bytes");
-
+            const size_t size = std::max(texturesSize, m_texturesBufferSize * 3 / 2);
+            int errorCode;
+            cl_mem textures = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, size, 0, &errorCode);
+            CHECKSTATUS(errorCode);
             if (m_dTextures)
             {
-                LOG_INFO(3, "Releasing existing texture resources");
+                if (m_texturesTransfered)
+                    CHECKSTATUS(clEnqueueCopyBuffer(m_hQueue, m_dTextures, textures, 0, 0, m_texturesBufferSize, 0,
+                                                    NULL, NULL));
                 CHECKSTATUS(clReleaseMemObject(m_dTextures));
-                m_dTextures = 0;
             }
+            m_dTextures = textures;
+            m_texturesBufferSize = size;
+            LOG_INFO(1, "Texture buffer allocated: " << size << " bytes");
+        }
 
-            if (totalSize > 0)
-            {
-                // Allocate host buffer
-                BitmapBuffer *tmpTextures = new BitmapBuffer[totalSize];
-                for (int i(0); i < m_nbActiveTextures; ++i)
-                {
-                    if (m_hTextures[i].buffer != 0)
-                    {
-                        int textureSize = m_hTextures[i].size.x * m_hTextures[i].size.y * m_hTextures[i].size.z;
-                        memcpy(tmpTextures + m_hTextures[i].offset, m_hTextures[i].buffer, textureSize);
-                    }
-                }
-                LOG_INFO(3, "Creating texture buffer");
-                m_dTextures = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, totalSize * sizeof(BitmapBuffer), 0, NULL);
-                CHECKSTATUS(clEnqueueWriteBuffer(m_hQueue, m_dTextures, CL_TRUE, 0, totalSize * sizeof(BitmapBuffer),
-                                                 tmpTextures, 0, NULL, NULL));
-                LOG_INFO(3, "Total GPU texture memory allocated: " << totalSize << " bytes");
-                delete[] tmpTextures;
-            }
+        if (!m_texturesTransfered)
+        {
+            for (int i(0); i < static_cast<int>(NB_MAX_TEXTURES); ++i)
+                if (m_hTextures[i].buffer != 0)
+                    m_dirtyTextures.insert(i);
             m_texturesTransfered = true;
         }
+        for (const auto &index : m_dirtyTextures)
+            if (m_hTextures[index].buffer != 0)
+                writeBuffer(m_dTextures, m_hTextures[index].offset * sizeof(BitmapBuffer),
+                            textureBufferSize(m_hTextures[index]) * sizeof(BitmapBuffer), m_hTextures[index].buffer);
+        if (!m_dirtyTextures.empty())
+            LOG_INFO(3, m_dirtyTextures.size() << " textures uploaded");
+        m_dirtyTextures.clear();
 
         // Kernel execution
         LOG_INFO(3, "CPU PostProcessingBuffer: " << sizeof(PostProcessingBuffer));
         LOG_INFO(3, "CPU PrimitiveXYIdBuffer : " << sizeof(PrimitiveXYIdBuffer));
         LOG_INFO(3, "CPU BoundingBox         : " << sizeof(BoundingBox));
         LOG_INFO(3, "CPU Primitive           : " << sizeof(Primitive));
+        LOG_INFO(3, "CPU CompactPrimitive    : " << sizeof(CompactPrimitive));
+        LOG_INFO(3, "CPU ShadingPrimitive    : " << sizeof(ShadingPrimitive));
         LOG_INFO(3, "CPU Material            : " << sizeof(Material));
 
         SceneInfo sceneInfo = m_sceneInfo;
@@ -790,6 +1185,11 @@ void OpenCLKernel::render_begin(const float timer)
         }
         default:
         {
+            if (m_wavefrontRendering)
+            {
+                renderWavefront(sceneInfo, nbBoxes, nbPrimitives);
+                break;
+            }
             CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 0, sizeof(vec2i), (void *)&m_occupancyParameters));
             CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 1, sizeof(vec1i), (void *)&zero));
             CHECKSTATUS(clSetKernelArg(m_kStandardRenderer, 2, sizeof(vec1i), (void *)&zero));
@@ -884,29 +1284,67 @@ void OpenCLKernel::render_end()
     // ------------------------------------------------------------
     // Read back the results
     // ------------------------------------------------------------
-    size_t size = m_sceneInfo.size.x * m_sceneInfo.size.y * sizeof(BitmapBuffer) * gColorDepth;
-    LOG_INFO(3, m_hQueue << ", " << m_dBitmap << ", " << m_bitmap << " - Bitmap Size=" << size);
-    CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dBitmap, CL_TRUE, 0, size, m_bitmap, 0, NULL, NULL));
-    size = m_sceneInfo.size.x * m_sceneInfo.size.y * sizeof(PrimitiveXYIdBuffer);
-    LOG_INFO(3, "PrimitivesID Size=" << size);
-    CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dPrimitivesXYIds, CL_TRUE, 0, size, m_hPrimitivesXYIds, 0, NULL, NULL));
-    LOG_INFO(3, "Flushing queues");
-    CHECKSTATUS(clFlush(m_hQueue));
-    CHECKSTATUS(clFinish(m_hQueue));
-#ifdef WIN32
+    const size_t bitmapSize =
+        m_sceneInfo.size.x * m_sceneInfo.size.y * sizeof(BitmapBuffer) * frameBufferDepth(m_sceneInfo.frameBufferType);
+    const size_t primitivesXYIdsSize = m_sceneInfo.size.x * m_sceneInfo.size.y * sizeof(PrimitiveXYIdBuffer);
+    LOG_INFO(3, m_hQueue << ", " << m_dBitmap << ", " << m_bitmap << " - Bitmap Size=" << bitmapSize);
+    LOG_INFO(3, "PrimitivesID Size=" << primitivesXYIdsSize);
+    if (m_asynchronousReadback)
+    {
+        // The frame is read back into the current slot, and the oldest slot is handed to the caller. The command
+        // queue is in order, the device bitmap is not overwritten by the next frame before it is read back
+        const int slot = m_readbackSlot;
+        CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dBitmap, CL_FALSE, 0, bitmapSize, m_hReadbackBitmaps[slot], 0,
+                                        NULL, NULL));
+        CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dPrimitivesXYIds, CL_FALSE, 0, primitivesXYIdsSize,
+                                        m_hReadbackPrimitivesXYIds[slot], 0, NULL, &m_hReadbackEvents[slot]));
+        LOG_INFO(3, "Flushing queues");
+        CHECKSTATUS(clFlush(m_hQueue));
+
+        m_readbackSlot = (slot + 1) % NB_READBACK_SLOTS;
+        const int oldest = m_readbackSlot;
+        if (m_hReadbackEvents[oldest])
+        {
+            CHECKSTATUS(clWaitForEvents(1, &m_hReadbackEvents[oldest]));
+            CHECKSTATUS(clReleaseEvent(m_hReadbackEvents[oldest]));
+            m_hReadbackEvents[oldest] = 0;
+            std::swap(m_bitmap, m_hReadbackBitmaps[oldest]);
+            std::swap(m_hPrimitivesXYIds, m_hReadbackPrimitivesXYIds[oldest]);
+        }
+        releaseUploads(false);
+    }
+    else
+    {
+        releaseReadbacks();
+        CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dBitmap, CL_TRUE, 0, bitmapSize, m_bitmap, 0, NULL, NULL));
+        CHECKSTATUS(clEnqueueReadBuffer(m_hQueue, m_dPrimitivesXYIds, CL_TRUE, 0, primitivesXYIdsSize,
+                                        m_hPrimitivesXYIds, 0, NULL, NULL));
+        LOG_INFO(3, "Flushing queues");
+        CHECKSTATUS(clFlush(m_hQueue));
+        CHECKSTATUS(clFinish(m_hQueue));
+        releaseUploads(false);
+    }
     if (m_sceneInfo.pathTracingIteration == m_sceneInfo.maxPathTracingIterations - 1)
-        LOG_INFO(1, "Rendering completed in " << GetTickCount() - m_counter << " ms");
-#endif
+    {
+        const double duration = std::max(
+            1e-3, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_renderStart).count());
+        const double nbRays = double(m_sceneInfo.size.x) * m_sceneInfo.size.y * m_sceneInfo.maxPathTracingIterations;
+        const double nbSamples = nbRays * ((m_sceneInfo.cameraType == ctAntialiazed) ? 5 : 1);
+        LOG_INFO(1, "Rendering completed in " << duration << " ms (" << 1000.0 * nbRays / duration
+                                              << " primary rays/s, " << 1000.0 * nbSamples / duration
+                                              << " samples/s)");
+    }
 
-    if (m_sceneInfo.frameBufferType == 0)
+    if (m_sceneInfo.frameBufferType == ftRGB || m_sceneInfo.frameBufferType == ftRGBA)
     {
+        const bool rgba = m_sceneInfo.frameBufferType == ftRGBA;
         ::glEnable(GL_TEXTURE_2D);
         //::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         //::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         ::glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
         //::glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-        ::glTexImage2D(GL_TEXTURE_2D, 0, gColorDepth, m_sceneInfo.size.x, m_sceneInfo.size.y, 0, GL_RGB,
-                       GL_UNSIGNED_BYTE, m_bitmap);
+        ::glTexImage2D(GL_TEXTURE_2D, 0, rgba ? GL_RGBA8 : gColorDepth, m_sceneInfo.size.x, m_sceneInfo.size.y, 0,
+                       rgba ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, m_bitmap);
 
         if (m_sceneInfo.cameraType == ctVR)
         {
@@ -993,6 +1431,11 @@ OpenCLKernel::~OpenCLKernel()
     LOG_INFO(3, "OpenCLKernel::~OpenCLKernel");
     // Clean up
     releaseDevice();
+    for (int i = 0; i < NB_READBACK_SLOTS; ++i)
+    {
+        delete[] m_hReadbackBitmaps[i];
+        delete[] m_hReadbackPrimitivesXYIds[i];
+    }
 
 #if USE_KINECT
     CloseHandle(m_skeletons);
@@ -1007,6 +1450,7 @@ void OpenCLKernel::reshape()
 {
     LOG_INFO(3, "OpenCLKernel::reshape");
     GPUKernel::reshape();
+    releaseReadbacks();
     if (m_dRandoms)
         CHECKSTATUS(clReleaseMemObject(m_dRandoms));
     if (m_dPostProcessingBuffer)
@@ -1016,14 +1460,30 @@ void OpenCLKernel::reshape()
     if (m_dBitmap)
         CHECKSTATUS(clReleaseMemObject(m_dBitmap));
 
+    // Device buffers have the size of the frame, except the pool of randoms
+    const size_t size = m_frameBufferSize;
     int errorCode;
-    m_dBitmap = clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, MAX_BITMAP_SIZE * sizeof(BitmapBuffer) * gColorDepth, 0,
-                               &errorCode);
+    m_dBitmap =
+        clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, size * sizeof(BitmapBuffer) * gMaxColorDepth, 0, &errorCode);
     m_dRandoms = clCreateBuffer(m_hContext, CL_MEM_READ_ONLY, MAX_BITMAP_SIZE * sizeof(RandomBuffer), 0, &errorCode);
     m_dPostProcessingBuffer =
-        clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, MAX_BITMAP_SIZE * sizeof(PostProcessingBuffer), 0, &errorCode);
+        clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, size * sizeof(PostProcessingBuffer), 0, &errorCode);
     m_dPrimitivesXYIds =
-        clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, MAX_BITMAP_SIZE * sizeof(PrimitiveXYIdBuffer), 0, &errorCode);
+        clCreateBuffer(m_hContext, CL_MEM_READ_WRITE, size * sizeof(PrimitiveXYIdBuffer), 0, &errorCode);
+    m_randomsTransfered = false;
+
+    // Readback slots have the size of the host bitmap and primitive IDs
+    for (int i = 0; i < NB_READBACK_SLOTS; ++i)
+    {
+        delete[] m_hReadbackBitmaps[i];
+        m_hReadbackBitmaps[i] = new BitmapBuffer[size * gMaxColorDepth];
+        memset(m_hReadbackBitmaps[i], 0, size * gMaxColorDepth * sizeof(BitmapBuffer));
+        delete[] m_hReadbackPrimitivesXYIds[i];
+        m_hReadbackPrimitivesXYIds[i] = new PrimitiveXYIdBuffer[size];
+        memset(m_hReadbackPrimitivesXYIds[i], 0, size * sizeof(PrimitiveXYIdBuffer));
+    }
+    m_readbackSlot = 0;
+    LOG_INFO(1, "Frame buffers allocated for " << m_sceneInfo.size.x << "x" << m_sceneInfo.size.y << " pixels");
 }
 
 int OpenCLKernel::getNumPlatforms()
@@ -1191,6 +1651,8 @@ void OpenCLKernel::queryDevice()
     LOG_INFO(3, "- Material          : " << sizeof(Material));
     LOG_INFO(3, "- BoundingBox       : " << sizeof(BoundingBox));
     LOG_INFO(3, "- Primitive         : " << sizeof(Primitive));
+    LOG_INFO(3, "- CompactPrimitive  : " << sizeof(CompactPrimitive));
+    LOG_INFO(3, "- ShadingPrimitive  : " << sizeof(ShadingPrimitive));
     LOG_INFO(3, "- TextureInfo       : " << sizeof(TextureInfo));
     LOG_INFO(3, "- PostProcessingInfo: " << sizeof(PostProcessingInfo));
     LOG_INFO(3, "_______________________________________|");
@@ -23,6 +23,9 @@
 #include "types.h"
 #include <engines/GPUKernel.h>
 
+#include <chrono>
+#include <deque>
+
 #ifdef WIN32
 #include <windows.h>
 #else
@@ -37,6 +40,17 @@
 const long MAX_PLATFORMS = 10;
 const long MAX_DEVICES = 10;
 
+// Wavefront rendering: maximum number of paths in flight. Larger frames are
+// rendered in bands of that many pixels
+const int WAVEFRONT_NB_MAX_PATHS = 512 * 512;
+// Queues 0 and 1 alternate as the input and output of the extension stage
+const int WAVEFRONT_SHADOW_QUEUE = 2;
+const int WAVEFRONT_NB_QUEUES = 3;
+
+// Asynchronous readback: number of host buffers the frames are read back into.
+// While a frame is rendered, the previous one is handed to the caller
+const int NB_READBACK_SLOTS = 2;
+
 namespace solr
 {
 class SOLR_API OpenCLKernel : public GPUKernel
@@ -115,6 +129,13 @@ private:
     cl_kernel m_kFishEyeRenderer;
     cl_kernel m_kVolumeRenderer;
 
+    // Wavefront rendering kernels
+    cl_kernel m_kWavefrontGenerate;
+    cl_kernel m_kWavefrontExtend;
+    cl_kernel m_kWavefrontShade;
+    cl_kernel m_kWavefrontShadows;
+    cl_kernel m_kWavefrontResolve;
+
     // Post processing kernels
     cl_kernel m_kDefault;
     cl_kernel m_kDepthOfField;
@@ -122,18 +143,67 @@ private:
     cl_kernel m_kRadiosity;
     cl_kernel m_kFilter;
 
+private:
+    // Quantizes and uploads the top level and mesh boxes
+    void writeQuantizedBoundingBoxes(const int nbBoxes);
+    // Quantizes and uploads the refitted boxes that outgrew their corners
+    void updateQuantizedBoundingBoxes(const int nbBoxes);
+    void reserveBoundingBoxes(const size_t size);
+
+    std::vector<unsigned char> m_hQuantizedBoundingBoxes;
+
+private:
+    // Renders the standard camera types with the wavefront pipeline
+    void renderWavefront(const SceneInfo &sceneInfo, const int nbBoxes, const int nbPrimitives);
+
+private:
+    // Uploads are not blocking. Their data is copied first, the host buffers
+    // can be modified as soon as writeBuffer returns. A copy is released once
+    // its upload is completed, the host only waits for uploads in cleanup
+    struct Upload
+    {
+        cl_event event;
+        std::vector<unsigned char> data;
+    };
+    void writeBuffer(cl_mem buffer, const size_t offset, const size_t size, const void *data);
+    void releaseUploads(const bool wait);
+
+    std::deque<Upload> m_hUploads;
+    vec4i m_hMeshGeometry;
+
+private:
+    // Start of the first path tracing iteration, for the rays/s report
+    std::chrono::steady_clock::time_point m_renderStart;
+
+private:
+    // Waits for pending readbacks and discards them
+    void releaseReadbacks();
+
+    BitmapBuffer *m_hReadbackBitmaps[NB_READBACK_SLOTS];
+    PrimitiveXYIdBuffer *m_hReadbackPrimitivesXYIds[NB_READBACK_SLOTS];
+    cl_event m_hReadbackEvents[NB_READBACK_SLOTS];
+    int m_readbackSlot;
+
 private:
     cl_mem m_dBoundingBoxes;
+    size_t m_boundingBoxesBufferSize; // Capacity of m_dBoundingBoxes, in bytes
     cl_mem _dPrimitives;
+    size_t m_primitivesBufferSize; // Capacity of _dPrimitives, in bytes
     cl_mem m_dLamps;
     cl_mem m_dLightInformation;
     cl_mem m_dMaterials;
     cl_mem m_dTextures;
+    size_t m_texturesBufferSize; // Capacity of m_dTextures, in bytes
     cl_mem m_dRandoms;
     cl_mem m_dBitmap;
     cl_mem m_dPostProcessingBuffer;
     cl_mem m_dPrimitivesXYIds;
 
+    // Wavefront rendering: paths, queues of path indices, and queue sizes
+    cl_mem m_dWavefrontPaths;
+    cl_mem m_dWavefrontQueues;
+    cl_mem m_dWavefrontCounters;
+
 #ifdef USE_KINECT
 private:
     cl_mem m_dVideo;
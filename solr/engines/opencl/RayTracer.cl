@@ -73,7 +73,9 @@ typedef struct
 enum FrameBufferType
 {
     fbRGB = 0,
-    fbBGR = 1
+    fbBGR = 1,
+    fbRGBA = 2,
+    fbBGRA = 3
 };
 
 enum AdvancedIllumination
@@ -104,6 +106,13 @@ enum GraphicsLevel
     glFull = 4
 };
 
+enum TextureCompression
+{
+    tc_none = 0,
+    tc_bc1,
+    tc_bc3
+};
+
 enum AtmosphericEffect
 {
     aeNone = 0,
@@ -171,7 +180,9 @@ enum PrimitiveType
     ptMagicCarpet = 8,
     ptEnvironment = 9,
     ptEllipsoid = 10,
-    ptQuad = 11
+    ptQuad = 11,
+    ptCone = 12,
+    ptInstance = 13
 };
 
 typedef struct ALIGNMENT
@@ -196,7 +207,7 @@ typedef struct ALIGNMENT
     // w: Wireframe Width
     int4 textureMapping; // x: U padding
     // y: V padding
-    // z: Texture ID (Deprecated)
+    // z: Number of mip levels of the maps
     // w: Texture color depth
     int4 textureOffset; // x: Offset in the diffuse map
     // y: Offset in the normal map
@@ -209,11 +220,11 @@ typedef struct ALIGNMENT
     int4 advancedTextureOffset; // x: Offset in the Reflection map
     // y: Offset in the Transparency map
     // z: Offset in the Ambient Occulsion map
-    // w: not used
+    // w: Compression of the maps, 2 bits per TextureType
     int4 advancedTextureIds; // x: Reflection map
     // y: Transparency map
     // z: Ambient Occulsion map
-    // w: not used
+    // w: Color depth of the maps, 4 bits per TextureType
     float2 mappingOffset; // Texture mapping offsets based on sceneInfo.timestamp
 } Material;
 
@@ -225,6 +236,75 @@ typedef struct ALIGNMENT
     int2 indexForNextBox; // If no intersection, how many of the following boxes can be skipped?
 } BoundingBox;
 
+#ifdef QUANTIZED_BVH
+// Quantized boxes (see BVHBuilder::quantize). Corners are stored on the grid of
+// a frame of reference, defined by the decoded corners of an ancestor box. The
+// buffer starts with the frame of reference of the roots
+#if QUANTIZED_BVH == 16
+typedef ushort4 QuantizedCorner;
+#define QUANTIZED_BVH_LEVELS 65535
+#else
+typedef uchar4 QuantizedCorner;
+#define QUANTIZED_BVH_LEVELS 255
+#endif
+
+typedef struct ALIGNMENT
+{
+    QuantizedCorner lower; // w: Frame of reference of the corners
+    QuantizedCorner upper; // w: Frame defined by the box for its descendants
+    int nbPrimitives;
+    int startIndex;
+    int2 indexForNextBox;
+} QuantizedBoundingBox;
+
+// Frames of reference decoded during the traversal, by depth. The first one is
+// the one of the roots
+typedef struct
+{
+    float4 lower[QUANTIZED_BVH_DEPTH + 1];
+    float4 scale[QUANTIZED_BVH_DEPTH + 1];
+} BVHFrames;
+
+// Boxes received by the kernels are quantized
+#define BoundingBox QuantizedBoundingBox
+#define BVH_NODE(__boxes, __index) (((CONST BoundingBox*)((CONST float4*)(__boxes) + 2)) + (__index))
+#define BVH_FRAMES(__frames, __boxes)                      \
+    BVHFrames __frames;                                    \
+    __frames.lower[0] = ((CONST float4*)(__boxes))[0];     \
+    __frames.scale[0] = ((CONST float4*)(__boxes))[1]
+#define BVH_INTERSECTION(__box, __frames, __ray, __t0, __t1) \
+    quantizedBoxIntersection(__box, &__frames, __ray, __t0, __t1)
+#else
+#define BVH_NODE(__boxes, __index) (&(__boxes)[__index])
+#define BVH_FRAMES(__frames, __boxes)
+#define BVH_INTERSECTION(__box, __frames, __ray, __t0, __t1) boxIntersection(__box, __ray, __t0, __t1)
+#endif
+
+// Traversal of the top level boxes. The statements between BVH_LEAVES_BEGIN and
+// BVH_LEAVES_END are run for every box hit by the ray between __t0 and __t1, as
+// long as __condition holds. __start and __count are the range of primitives of
+// the box. Engines running this file on the host define their own traversal
+#ifndef BVH_LEAVES_BEGIN
+#define BVH_LEAVES_BEGIN(__boxes, __nbBoxes, __ray, __t0, __t1, __condition, __start, __count) \
+    {                                                                                          \
+        int cptBoxes = 0;                                                                      \
+        BVH_FRAMES(frames, __boxes);                                                           \
+        while ((__condition) && cptBoxes < (__nbBoxes))                                        \
+        {                                                                                      \
+            CONST BoundingBox* box = BVH_NODE(__boxes, cptBoxes);                              \
+            if (!BVH_INTERSECTION(box, frames, __ray, __t0, __t1))                             \
+            {                                                                                  \
+                cptBoxes += (*box).indexForNextBox.x;                                          \
+                continue;                                                                      \
+            }                                                                                  \
+            ++cptBoxes;                                                                        \
+            const int __start = (*box).startIndex;                                             \
+            const int __count = (*box).nbPrimitives;
+#define BVH_LEAVES_END(__t1, __condition) \
+        }                                 \
+    }
+#endif
+
 typedef struct ALIGNMENT
 {
     // Vertices
@@ -249,6 +329,42 @@ typedef struct ALIGNMENT
     float2 vt2;
 } Primitive;
 
+// Intersection data of a primitive, the only data read when traversing the
+// scene. The primitive buffer starts with the intersection data of all
+// primitives
+typedef struct ALIGNMENT
+{
+    float4 p0;      // First vertex, center of spheres
+    float4 e1;      // p1 - p0, p1 for instances
+    float4 e2;      // p2 - p0, p2 for instances
+    float4 size;    // Size( x,y,z ), x is the radius of spheres
+    int type;       // See PrimitiveType
+    int index;      // Index of the primitive in the CPU container
+    int materialId; // Material ID
+} CompactPrimitive;
+
+// Shading data of a primitive, stored after the intersection data in the same
+// buffer. Only read for the closest intersection, see loadPrimitive
+typedef struct ALIGNMENT
+{
+    float4 n0;
+    float4 n1;
+    float4 n2;
+    float2 vt0;
+    float2 vt1;
+    float2 vt2;
+} ShadingPrimitive;
+
+#define SHADING_PRIMITIVES(__primitives, __nbPrimitives) \
+    ((CONST ShadingPrimitive*)((__primitives) + (__nbPrimitives)))
+
+// Geometry shared by the triangles of indexed meshes, stored after the shading
+// data. The first element holds the number of triangles and vertices. It is
+// followed by the triangles (indices of the vertices, and material ID), the
+// vertices, the normals and the texture coordinates
+#define MESH_GEOMETRY(__primitives, __nbPrimitives) \
+    ((CONST int4*)(SHADING_PRIMITIVES(__primitives, __nbPrimitives) + (__nbPrimitives)))
+
 enum TextureType
 {
     tex_diffuse = 0,
@@ -286,6 +402,79 @@ typedef struct ALIGNMENT
     int param3;   // iterations;
 } PostProcessingInfo;
 
+// Shading of an intersection, split around the shadow ray cast towards the lamp
+// (see prepareShading and completeShading)
+typedef struct ALIGNMENT
+{
+    float4 origin;            // Origin of the ray that hit the intersection
+    float4 intersectionColor; // Color of the primitive at the intersection
+    float4 specular;          // x: Value, y: Power, z: Transparency (specular map)
+    float4 lampCenter;        // Location of the lamp, randomized for soft shadows
+    float4 lightRay;          // Normalized direction of the lamp
+    float lambert;            // Lambert term, before shadows are applied
+    float photonEnergy;       // Attenuation of the light with the distance to the lamp
+    float ambientOcclusion;   // Value of the ambient occlusion map
+    int lamp;                 // Lamp lighting the intersection, -1 if none
+    int materialId;           // Material of the intersected primitive
+    int constantColor;        // Wireframes and emitting materials are not shaded
+    int shadows;              // A shadow ray has to be cast towards the lamp
+    int padding;
+} ShadingSample;
+
+// Wavefront rendering: the paths of the pixels are stored in global memory and
+// processed by one kernel per stage (generation, extension, shading, shadows).
+// Each stage appends the paths that remain active to a queue, so that the next
+// stage only processes contiguous active paths. Queues 0 and 1 alternate as the
+// input and output of the extension stage, queue 2 holds the shadow rays
+#define WAVEFRONT_SHADOW_QUEUE 2
+
+enum WavefrontStage
+{
+    wsPrimary = 0,     // Primary ray and its reflections and refractions
+    wsReflection = 1,  // Reflection of the first transparent and reflective material
+    wsPathTracing = 2, // Global illumination ray
+    wsDone = 3
+};
+
+// Must be kept in sync with the WavefrontPath host structure
+typedef struct ALIGNMENT
+{
+    Ray ray;                   // Current ray (origin and target)
+    Ray reflectedRay;          // Reflection of the first transparent and reflective material
+    Ray pathTracingRay;        // Global illumination ray, cast from the first intersection
+    float4 intersection;       // Closest intersection found by the last extension
+    float4 normal;             // Normal at the closest intersection
+    float4 areas;              // Areas at the closest intersection (triangles)
+    float4 latestIntersection; // Previous intersection of the path
+    float4 closestColor;       // See primitiveShader
+    float4 blinn;              // Specular term of the current iteration
+    float4 recursiveBlinn;     // Strongest specular term of the path
+    float4 colorBox;           // Bounding boxes crossed by the path (renderBoxes)
+    float4 color;              // Colors of the iterations, composed front to back
+    float4 sampleColor;        // Sum of the antialiasing samples of the pixel
+    ShadingSample shading;     // Shading of the closest intersection
+    float weight;              // Weight of the color of the next iteration
+    float colorWeight;         // Weight of the color being shaded
+    float firstWeight;         // Weight of the color of the first iteration
+    float reflectedWeight;     // Weight of the color of the iteration that spawned the reflected ray
+    float reflectedRatio;      // Reflection rate of the material that spawned the reflected ray
+    float pathTracingRatio;    // Contribution of the global illumination ray
+    float initialRefraction;   // Refraction index of the medium the ray travels through
+    float rayLength;           // Length of the path, for the opacity of transparent materials
+    float opacity;             // Light absorbed by the transparent material being shaded
+    float depth;               // Distance to the first intersection (depth of field)
+    float coneSpread;          // Spread angle of the ray cone of the pixel (texture mip level)
+    int closestPrimitive;      // Primitive of the closest intersection
+    int closestInstance;       // Instance of the closest intersection, -1 if none
+    int currentMaterialId;     // Material of the closest intersection
+    int iteration;             // Number of iterations of the primary stage
+    int reflectedRays;         // Iteration that spawned the reflected ray, -1 if none
+    int shadedIteration;       // Iteration being shaded, -1 for the reflected ray
+    int stage;                 // See WavefrontStage
+    int hit;                   // The last extension found an intersection
+    int active;                // The pixel is rendered in the current frame
+} WavefrontPath;
+
 // ________________________________________________________________________________
 static void saturateVector(float4* v)
 {
@@ -336,11 +525,10 @@ static void vectorRefraction(float4* refracted, const float4 incident, const flo
 /*
 ________________________________________________________________________________
 __v : Vector to rotate
-__c : Center of rotations
 __a : Angles
 ________________________________________________________________________________
 */
-static void vectorRotation(float4* vector, const float4 center, const float4 angles)
+static void vectorRotation(float4* vector, const float4 angles)
 {
     float4 __r = (*vector);
     /* X axis */
@@ -373,10 +561,40 @@ static void computeRayAttributes(Ray* ray)
 /*
 ________________________________________________________________________________
 
+Ray cone spread
+Angle between the rays of two neighbouring pixels. Rays are defined by their
+origin and a target on the screen plane, targets being one step apart
+________________________________________________________________________________
+*/
+static float rayConeSpread(const Ray* ray, const float step)
+{
+    float4 target = (*ray).direction - (*ray).origin;
+    target.w = 0.f;
+    return step / length(target);
+}
+
+/*
+________________________________________________________________________________
+
+Ray cone footprint
+Width of the cone of a pixel projected on the surface it hits, used to select
+the mip level of textures. The cone gets stretched at grazing angles
+________________________________________________________________________________
+*/
+static float rayConeFootprint(const float coneWidth, const float4 origin, const float4 intersection,
+                              const float4 normal)
+{
+    const float cosine = fabs(dot(normalize(intersection - origin), normal));
+    return coneWidth / max(cosine, 0.1f);
+}
+
+/*
+________________________________________________________________________________
+
 Convert float4 into OpenGL RGB color
 ________________________________________________________________________________
 */
-static void makeColor(const SceneInfo* sceneInfo, const float4* color, CONST BitmapBuffer* bitmap, int index)
+static void makeColor(const SceneInfo* sceneInfo, float4* color, CONST BitmapBuffer* bitmap, int index)
 {
     (*color).x = ((*color).x > 1.f) ? 1.f : (*color).x;
     (*color).y = ((*color).y > 1.f) ? 1.f : (*color).y;
@@ -388,6 +606,24 @@ static void makeColor(const SceneInfo* sceneInfo, const float4* color, CONST Bit
     int mdc_index = index * gColorDepth;
     switch ((*sceneInfo).frameBufferType)
     {
+        case fbRGBA:
+        {
+            // OpenGL, one 32 bit store per pixel
+            const uchar4 rgba = {(BitmapBuffer)((*color).x * 255.f), (BitmapBuffer)((*color).y * 255.f),
+                                 (BitmapBuffer)((*color).z * 255.f), 255};
+            ((CONST uchar4*)bitmap)[index] = rgba;
+            break;
+        }
+        case fbBGRA:
+        {
+            // Delphi, one 32 bit store per pixel
+            int y = index / (*sceneInfo).size.y;
+            int x = index % (*sceneInfo).size.x;
+            const uchar4 bgra = {(BitmapBuffer)((*color).z * 255.f), (BitmapBuffer)((*color).y * 255.f),
+                                 (BitmapBuffer)((*color).x * 255.f), 255};
+            ((CONST uchar4*)bitmap)[(y + 1) * (*sceneInfo).size.y - x - 1] = bgra;
+            break;
+        }
         case fbBGR:
         {
             // Delphi
@@ -417,7 +653,7 @@ ________________________________________________________________________________
 Mandelbrot Set
 ________________________________________________________________________________
 */
-static void juliaSet(CONST Primitive* primitive, CONST Material* materials, const SceneInfo* sceneInfo, const float x,
+static void juliaSet(const Primitive* primitive, CONST Material* materials, const SceneInfo* sceneInfo, const float x,
                      const float y, float4* color)
 {
     CONST Material* material = &materials[(*primitive).materialId];
@@ -462,7 +698,7 @@ ________________________________________________________________________________
 Mandelbrot Set
 ________________________________________________________________________________
 */
-static void mandelbrotSet(CONST Primitive* primitive, CONST Material* materials, const SceneInfo* sceneInfo,
+static void mandelbrotSet(const Primitive* primitive, CONST Material* materials, const SceneInfo* sceneInfo,
                           const float x, const float y, float4* color)
 {
     CONST Material* material = &materials[(*primitive).materialId];
@@ -499,86 +735,198 @@ static void mandelbrotSet(CONST Primitive* primitive, CONST Material* materials,
     (*color).w = 1.f - (n / maxIterations);
 }
 
+// ----------
+// Mip level selection
+// --------------------
+static int textureLevel(CONST Material* material, const float footprint, const float density)
+{
+    // Footprint of the ray cone, in texels of the full resolution maps
+    const float texels = footprint * density;
+    if ((*material).textureMapping.z <= 1 || !(texels > 1.f))
+        return 0;
+    return min((int)log2(texels), (*material).textureMapping.z - 1);
+}
+
+// ----------
+// Size of a mip level, in bytes
+// --------------------
+static int textureLevelSize(const int width, const int height, const int depth, const int compression)
+{
+    const int blocks = ((width + 3) / 4) * ((height + 3) / 4);
+    switch (compression)
+    {
+    case tc_bc1:
+        return blocks * 8;
+    case tc_bc3:
+        return blocks * 16;
+    }
+    return width * height * depth;
+}
+
+// ----------
+// Color of a compressed block (RGB 5:6:5)
+// --------------------
+static int4 blockColor(const int color)
+{
+    int4 result;
+    result.x = ((color >> 11) & 31) * 255 / 31;
+    result.y = ((color >> 5) & 63) * 255 / 63;
+    result.z = (color & 31) * 255 / 31;
+    result.w = 255;
+    return result;
+}
+
+// ----------
+// Texel of a map, as 0-255 RGBA values. texel.x and texel.y are the coordinates
+// in the full resolution map, texel.z is the mip level. Levels are stored one
+// after the other, each one half the size of the previous one.
+// Compressed maps are made of blocks of 4x4 texels. BC1 blocks hold two 5:6:5
+// colors and 2 bit indices, BC3 blocks add two alpha values and 3 bit indices
+// in front of a BC1 block
+// --------------------
+static int4 textureTexel(CONST Material* material, CONST BitmapBuffer* textures, const int offset, const int map,
+                         const int4 texel)
+{
+    const int compression = ((*material).advancedTextureOffset.w >> (2 * map)) & 3;
+    const int depth = ((*material).advancedTextureIds.w >> (4 * map)) & 15;
+    int width = (*material).textureMapping.x;
+    int height = (*material).textureMapping.y;
+    int i = offset;
+    for (int level = 0; level < texel.z; ++level)
+    {
+        i += textureLevelSize(width, height, depth, compression);
+        width = max(1, width / 2);
+        height = max(1, height / 2);
+    }
+    const int u = (texel.x >> texel.z) % width;
+    const int v = (texel.y >> texel.z) % height;
+
+    int4 result;
+    if (compression == tc_none)
+    {
+        i += (v * width + u) * depth;
+        if (depth == 4)
+        {
+            // Texture ranges are 4 byte aligned, RGBA texels are read at once
+            return convert_int4(((CONST uchar4*)textures)[i / 4]);
+        }
+        result.x = textures[i];
+        result.y = textures[i + 1];
+        result.z = textures[i + 2];
+        result.w = (depth > 3) ? textures[i + 3] : 255;
+        return result;
+    }
+
+    i += ((v / 4) * ((width + 3) / 4) + u / 4) * ((compression == tc_bc3) ? 16 : 8);
+    int alpha = 255;
+    if (compression == tc_bc3)
+    {
+        // Alpha, 6 values interpolated between the 2 stored ones, or 4 plus 0
+        // and 255
+        const int a0 = textures[i];
+        const int a1 = textures[i + 1];
+        const int bit = 3 * ((v % 4) * 4 + u % 4);
+        const int j = i + 2 + bit / 8;
+        const int code = ((textures[j] | (textures[j + 1] << 8)) >> (bit % 8)) & 7;
+        if (code == 0)
+            alpha = a0;
+        else if (code == 1)
+            alpha = a1;
+        else if (a0 > a1)
+            alpha = ((8 - code) * a0 + (code - 1) * a1) / 7;
+        else if (code < 6)
+            alpha = ((6 - code) * a0 + (code - 1) * a1) / 5;
+        else
+            alpha = (code == 6) ? 0 : 255;
+        i += 8;
+    }
+
+    // Color, 2 values interpolated between the 2 stored ones. BC1 blocks which
+    // first color is not the greatest have a single one, plus black
+    const int c0 = textures[i] | (textures[i + 1] << 8);
+    const int c1 = textures[i + 2] | (textures[i + 3] << 8);
+    const int code = (textures[i + 4 + v % 4] >> (2 * (u % 4))) & 3;
+    const int4 e0 = blockColor(c0);
+    const int4 e1 = blockColor(c1);
+    const bool fourColors = (c0 > c1) || (compression == tc_bc3);
+    switch (code)
+    {
+    case 0:
+        result = e0;
+        break;
+    case 1:
+        result = e1;
+        break;
+    case 2:
+        result = fourColors ? (2 * e0 + e1) / 3 : (e0 + e1) / 2;
+        break;
+    default:
+        result = fourColors ? (e0 + 2 * e1) / 3 : 0 * e0;
+        break;
+    }
+    result.w = alpha;
+    return result;
+}
+
 // ----------
 // Normal mapping
 // --------------------
-static void normalMap(const int index, CONST Material* material, CONST BitmapBuffer* textures, float4* normal,
+static void normalMap(const int4 texel, CONST Material* material, CONST BitmapBuffer* textures, float4* normal,
                       const float strength)
 {
-    int i = (*material).textureOffset.y + index;
-    BitmapBuffer r, g;
-    r = textures[i];
-    g = textures[i + 1];
-    (*normal).x -= strength * (r / 256.f - 0.5f);
-    (*normal).y -= strength * (g / 256.f - 0.5f);
+    const int4 t = textureTexel(material, textures, (*material).textureOffset.y, tex_normal, texel);
+    (*normal).x -= strength * (t.x / 256.f - 0.5f);
+    (*normal).y -= strength * (t.y / 256.f - 0.5f);
 }
 
 // ----------
 // Bump mapping
 // --------------------
-static void bumpMap(const int index, CONST Material* material, CONST BitmapBuffer* textures, float4* intersection,
-                    float* value)
+static void bumpMap(const int4 texel, CONST Material* material, CONST BitmapBuffer* textures, float* value)
 {
-    int i = (*material).textureOffset.z + index;
-    BitmapBuffer r, g, b;
-    r = textures[i];
-    g = textures[i + 1];
-    b = textures[i + 2];
-    (*value) = 10.f * (r + g + b) / 768.f;
+    const int4 t = textureTexel(material, textures, (*material).textureOffset.z, tex_bump, texel);
+    (*value) = 10.f * (t.x + t.y + t.z) / 768.f;
 }
 
 // ----------
 // Specular mapping
 // --------------------
-static void specularMap(const int index, CONST Material* material, CONST BitmapBuffer* textures, float4* specular)
+static void specularMap(const int4 texel, CONST Material* material, CONST BitmapBuffer* textures, float4* specular)
 {
-    int i = (*material).textureOffset.w + index;
-    BitmapBuffer r, g, b;
-    r = textures[i];
-    g = textures[i + 1];
-    b = textures[i + 2];
-    (*specular).x *= (r + g + b) / 768.f;
+    const int4 t = textureTexel(material, textures, (*material).textureOffset.w, tex_specular, texel);
+    (*specular).x *= (t.x + t.y + t.z) / 768.f;
 }
 
 // ----------
 // Reflection mapping
 // --------------------
-static void reflectionMap(const int index, CONST Material* material, CONST BitmapBuffer* textures, float4* attributes)
+static void reflectionMap(const int4 texel, CONST Material* material, CONST BitmapBuffer* textures,
+                          float4* attributes)
 {
-    int i = (*material).advancedTextureOffset.x + index;
-    BitmapBuffer r, g, b;
-    r = textures[i];
-    g = textures[i + 1];
-    b = textures[i + 2];
-    (*attributes).x *= (r + g + b) / 768.f;
+    const int4 t = textureTexel(material, textures, (*material).advancedTextureOffset.x, tex_reflective, texel);
+    (*attributes).x *= (t.x + t.y + t.z) / 768.f;
 }
 
 // ----------
 // Transparency mapping
 // --------------------
-static void transparencyMap(const int index, CONST Material* material, CONST BitmapBuffer* textures, float4* attributes)
-{
-    int i = (*material).advancedTextureOffset.y + index;
-    BitmapBuffer r, g, b;
-    r = textures[i];
-    g = textures[i + 1];
-    b = textures[i + 2];
-    (*attributes).y *= (r + g + b) / 768.f;
+static void transparencyMap(const int4 texel, CONST Material* material, CONST BitmapBuffer* textures,
+                            float4* attributes)
+{
+    const int4 t = textureTexel(material, textures, (*material).advancedTextureOffset.y, tex_transparent, texel);
+    (*attributes).y *= (t.x + t.y + t.z) / 768.f;
     //   (*attributes).z = 10.f*b/256.f;
 }
 
 // ----------
 // Ambient occlusion
 // --------------------
-static void ambientOcclusionMap(const int index, CONST Material* material, CONST BitmapBuffer* textures,
+static void ambientOcclusionMap(const int4 texel, CONST Material* material, CONST BitmapBuffer* textures,
                                 float4* advancedAttributes)
 {
-    int i = (*material).advancedTextureOffset.z + index;
-    BitmapBuffer r, g, b;
-    r = textures[i];
-    g = textures[i + 1];
-    b = textures[i + 2];
-    (*advancedAttributes).x = (r + g + b) / 768.f;
+    const int4 t =
+        textureTexel(material, textures, (*material).advancedTextureOffset.z, tex_ambient_occlusion, texel);
+    (*advancedAttributes).x = (t.x + t.y + t.z) / 768.f;
 }
 
 /*
@@ -587,9 +935,9 @@ ________________________________________________________________________________
 Sphere texture Mapping
 ________________________________________________________________________________
 */
-static float4 sphereUVMapping(CONST Primitive* primitive, CONST Material* materials, CONST BitmapBuffer* textures,
+static float4 sphereUVMapping(const Primitive* primitive, CONST Material* materials, CONST BitmapBuffer* textures,
                               float4* intersection, float4* normal, float4* specular, float4* attributes,
-                              float4* advancedAttributes)
+                              float4* advancedAttributes, const float footprint)
 {
     CONST Material* material = &materials[(*primitive).materialId];
     float4 result = (*material).color;
@@ -608,39 +956,37 @@ static float4 sphereUVMapping(CONST Primitive* primitive, CONST Material* materi
         u >= 0 && u < (*material).textureMapping.x && v >= 0 && v < (*material).textureMapping.y;
     if (condition)
     {
-        int A = (v * (*material).textureMapping.x + u) * (*material).textureMapping.w;
-        int B = (*material).textureMapping.x * (*material).textureMapping.y * (*material).textureMapping.w;
-        int index = A % B;
+        // Texels per unit of length along the equator
+        const float density = ((*primitive).size.x > 0.f) ? (*material).textureMapping.x * (*primitive).vt1.x /
+                                                                  (2.f * PI * (*primitive).size.x)
+                                                            : 0.f;
+        const int4 texel = {u, v, textureLevel(material, footprint, density), 0};
 
         // Diffuse
-        int i = (*material).textureOffset.x + index;
-        BitmapBuffer r, g, b;
-        r = textures[i];
-        g = textures[i + 1];
-        b = textures[i + 2];
-        result.x = r / 256.f;
-        result.y = g / 256.f;
-        result.z = b / 256.f;
+        const int4 diffuse = textureTexel(material, textures, (*material).textureOffset.x, tex_diffuse, texel);
+        result.x = diffuse.x / 256.f;
+        result.y = diffuse.y / 256.f;
+        result.z = diffuse.z / 256.f;
 
         float strength = 3.f;
         // Bump mapping
         if ((*material).textureIds.z != TEXTURE_NONE)
-            bumpMap(index, material, textures, intersection, &strength);
+            bumpMap(texel, material, textures, &strength);
         // Normal mapping
         if ((*material).textureIds.y != TEXTURE_NONE)
-            normalMap(index, material, textures, normal, strength);
+            normalMap(texel, material, textures, normal, strength);
         // Specular mapping
         if ((*material).textureIds.w != TEXTURE_NONE)
-            specularMap(index, material, textures, specular);
+            specularMap(texel, material, textures, specular);
         // Reflection mapping
         if ((*material).advancedTextureIds.x != TEXTURE_NONE)
-            reflectionMap(index, material, textures, attributes);
+            reflectionMap(texel, material, textures, attributes);
         // Transparency mapping
         if ((*material).advancedTextureIds.y != TEXTURE_NONE)
-            transparencyMap(index, material, textures, attributes);
+            transparencyMap(texel, material, textures, attributes);
         // Ambient occulusion mapping
         if ((*material).advancedTextureIds.z != TEXTURE_NONE)
-            ambientOcclusionMap(index, material, textures, advancedAttributes);
+            ambientOcclusionMap(texel, material, textures, advancedAttributes);
     }
     return result;
 }
@@ -651,9 +997,9 @@ ________________________________________________________________________________
 Cube texture mapping
 ________________________________________________________________________________
 */
-static float4 cubeMapping(const SceneInfo* sceneInfo, CONST Primitive* primitive, CONST Material* materials,
+static float4 cubeMapping(const SceneInfo* sceneInfo, const Primitive* primitive, CONST Material* materials,
                           CONST BitmapBuffer* textures, float4* intersection, float4* normal, float4* specular,
-                          float4* attributes, float4* advancedAttributes)
+                          float4* attributes, float4* advancedAttributes, const float footprint)
 {
     CONST Material* material = &materials[(*primitive).materialId];
     float4 result = (*material).color;
@@ -710,37 +1056,33 @@ static float4 cubeMapping(const SceneInfo* sceneInfo, CONST Primitive* primitive
                 break;
             default:
             {
-                int A = (v * (*material).textureMapping.x + u) * (*material).textureMapping.w;
-                int B = (*material).textureMapping.x * (*material).textureMapping.y * (*material).textureMapping.w;
-                int index = A % B;
-                int i = (*material).textureOffset.x + index;
-                BitmapBuffer r, g, b;
-                r = textures[i];
-                g = textures[i + 1];
-                b = textures[i + 2];
-                result.x = r / 256.f;
-                result.y = g / 256.f;
-                result.z = b / 256.f;
+                // One texel per unit of length
+                const int4 texel = {u, v, textureLevel(material, footprint, 1.f), 0};
+                const int4 diffuse =
+                    textureTexel(material, textures, (*material).textureOffset.x, tex_diffuse, texel);
+                result.x = diffuse.x / 256.f;
+                result.y = diffuse.y / 256.f;
+                result.z = diffuse.z / 256.f;
 
                 float strength = 3.f;
                 // Bump mapping
                 if ((*material).textureIds.z != TEXTURE_NONE)
-                    bumpMap(index, material, textures, intersection, &strength);
+                    bumpMap(texel, material, textures, &strength);
                 // Normal mapping
                 if ((*material).textureIds.y != TEXTURE_NONE)
-                    normalMap(index, material, textures, normal, strength);
+                    normalMap(texel, material, textures, normal, strength);
                 // Specular mapping
                 if ((*material).textureIds.w != TEXTURE_NONE)
-                    specularMap(index, material, textures, specular);
+                    specularMap(texel, material, textures, specular);
                 // Reflection mapping
                 if ((*material).advancedTextureIds.x != TEXTURE_NONE)
-                    reflectionMap(index, material, textures, attributes);
+                    reflectionMap(texel, material, textures, attributes);
                 // Transparency mapping
                 if ((*material).advancedTextureIds.y != TEXTURE_NONE)
-                    transparencyMap(index, material, textures, attributes);
+                    transparencyMap(texel, material, textures, attributes);
                 // Ambient occlusion mapping
                 if ((*material).advancedTextureIds.z != TEXTURE_NONE)
-                    ambientOcclusionMap(index, material, textures, advancedAttributes);
+                    ambientOcclusionMap(texel, material, textures, advancedAttributes);
             }
             break;
             }
@@ -755,9 +1097,9 @@ ________________________________________________________________________________
 Triangle texture Mapping
 ________________________________________________________________________________
 */
-static float4 triangleUVMapping(const SceneInfo* sceneInfo, CONST Primitive* primitive, CONST Material* materials,
-                                CONST BitmapBuffer* textures, float4* intersection, const float4 areas, float4* normal,
-                                float4* specular, float4* attributes, float4* advancedAttributes)
+static float4 triangleUVMapping(const SceneInfo* sceneInfo, const Primitive* primitive, CONST Material* materials,
+                                CONST BitmapBuffer* textures, const float4 areas, float4* normal, float4* specular,
+                                float4* attributes, float4* advancedAttributes, const float footprint)
 {
     CONST Material* material = &materials[(*primitive).materialId];
     float4 result = (*material).color;
@@ -788,50 +1130,52 @@ static float4 triangleUVMapping(const SceneInfo* sceneInfo, CONST Primitive* pri
             break;
         default:
         {
-            int A = (v * (*material).textureMapping.x + u) * (*material).textureMapping.w;
-            int B = (*material).textureMapping.x * (*material).textureMapping.y * (*material).textureMapping.w;
-            int index = A % B;
+            // Texels per unit of length, from the areas of the triangle in texture and world space
+            const float2 t1 = (*primitive).vt1 - (*primitive).vt0;
+            const float2 t2 = (*primitive).vt2 - (*primitive).vt0;
+            const float texelArea =
+                fabs(t1.x * t2.y - t1.y * t2.x) * (*material).textureMapping.x * (*material).textureMapping.y;
+            const float area = length(cross((*primitive).p1 - (*primitive).p0, (*primitive).p2 - (*primitive).p0));
+            const float density = (area > 0.f) ? sqrt(texelArea / area) : 0.f;
+            const int4 texel = {u, v, textureLevel(material, footprint, density), 0};
 
             // Diffuse
-            int i = (*material).textureOffset.x + index;
-            BitmapBuffer r, g, b;
-            r = textures[i];
-            g = textures[i + 1];
-            b = textures[i + 2];
+            int4 diffuse = textureTexel(material, textures, (*material).textureOffset.x, tex_diffuse, texel);
 #ifdef USE_KINECT
             if ((*material).textureIds.x == 0)
             {
-                r = textures[index + 2];
-                g = textures[index + 1];
-                b = textures[index];
+                const int index = (v * (*material).textureMapping.x + u) * (*material).textureMapping.w;
+                diffuse.x = textures[index + 2];
+                diffuse.y = textures[index + 1];
+                diffuse.z = textures[index];
             }
 #endif // USE_KINECT
-            result.x = r / 256.f;
-            result.y = g / 256.f;
-            result.z = b / 256.f;
+            result.x = diffuse.x / 256.f;
+            result.y = diffuse.y / 256.f;
+            result.z = diffuse.z / 256.f;
 
             float strength = 3.f;
             // Bump mapping
             if ((*material).textureIds.z != TEXTURE_NONE)
             {
-                bumpMap(index, material, textures, intersection, &strength);
+                bumpMap(texel, material, textures, &strength);
                 (*attributes).w *= strength / 10.f;
             }
             // Normal mapping
             if ((*material).textureIds.y != TEXTURE_NONE)
-                normalMap(index, material, textures, normal, strength);
+                normalMap(texel, material, textures, normal, strength);
             // Specular mapping
             if ((*material).textureIds.w != TEXTURE_NONE)
-                specularMap(index, material, textures, specular);
+                specularMap(texel, material, textures, specular);
             // Reflection mapping
             if ((*material).advancedTextureIds.x != TEXTURE_NONE)
-                reflectionMap(index, material, textures, attributes);
+                reflectionMap(texel, material, textures, attributes);
             // Transparency mapping
             if ((*material).advancedTextureIds.y != TEXTURE_NONE)
-                transparencyMap(index, material, textures, attributes);
+                transparencyMap(texel, material, textures, attributes);
             // Ambient occulusion mapping
             if ((*material).advancedTextureIds.z != TEXTURE_NONE)
-                ambientOcclusionMap(index, material, textures, advancedAttributes);
+                ambientOcclusionMap(texel, material, textures, advancedAttributes);
         }
         }
     }
@@ -844,14 +1188,14 @@ ________________________________________________________________________________
 Box intersection
 ________________________________________________________________________________
 */
-static bool boxIntersection(CONST BoundingBox* box, const Ray* ray, const float t0, const float t1)
+static bool slabsIntersection(const float4* parameters, const Ray* ray, const float t0, const float t1)
 {
     float tmin, tmax, tymin, tymax, tzmin, tzmax;
 
-    tmin = ((*box).parameters[(*ray).signs.x].x - (*ray).origin.x) * (*ray).inv_direction.x;
-    tmax = ((*box).parameters[1 - (*ray).signs.x].x - (*ray).origin.x) * (*ray).inv_direction.x;
-    tymin = ((*box).parameters[(*ray).signs.y].y - (*ray).origin.y) * (*ray).inv_direction.y;
-    tymax = ((*box).parameters[1 - (*ray).signs.y].y - (*ray).origin.y) * (*ray).inv_direction.y;
+    tmin = (parameters[(*ray).signs.x].x - (*ray).origin.x) * (*ray).inv_direction.x;
+    tmax = (parameters[1 - (*ray).signs.x].x - (*ray).origin.x) * (*ray).inv_direction.x;
+    tymin = (parameters[(*ray).signs.y].y - (*ray).origin.y) * (*ray).inv_direction.y;
+    tymax = (parameters[1 - (*ray).signs.y].y - (*ray).origin.y) * (*ray).inv_direction.y;
 
     if ((tmin > tymax) || (tymin > tmax))
         return false;
@@ -860,8 +1204,8 @@ static bool boxIntersection(CONST BoundingBox* box, const Ray* ray, const float
         tmin = tymin;
     if (tymax < tmax)
         tmax = tymax;
-    tzmin = ((*box).parameters[(*ray).signs.z].z - (*ray).origin.z) * (*ray).inv_direction.z;
-    tzmax = ((*box).parameters[1 - (*ray).signs.z].z - (*ray).origin.z) * (*ray).inv_direction.z;
+    tzmin = (parameters[(*ray).signs.z].z - (*ray).origin.z) * (*ray).inv_direction.z;
+    tzmax = (parameters[1 - (*ray).signs.z].z - (*ray).origin.z) * (*ray).inv_direction.z;
 
     if ((tmin > tzmax) || (tzmin > tmax))
         return false;
@@ -873,14 +1217,64 @@ static bool boxIntersection(CONST BoundingBox* box, const Ray* ray, const float
     return ((tmin < t1) && (tmax > t0));
 }
 
+#ifdef QUANTIZED_BVH
+/*
+________________________________________________________________________________
+
+Quantized box intersection. Corners are decoded in the frame of reference of
+the box. When the box is hit, the frame it defines for its descendants is
+stored at its depth. Cells of the frames are powers of two (see
+BVHBuilder::quantize): decoded corners are exact products, and match the ones
+of the host whether the sums are fused or not
+________________________________________________________________________________
+*/
+static float quantizationScale(const float range)
+{
+    int exponent;
+    frexp(range, &exponent);
+    const float scale = ldexp(1.f, exponent - QUANTIZED_BVH);
+    return (scale * (float)(QUANTIZED_BVH_LEVELS - 1) < range) ? 2.f * scale : scale;
+}
+
+static bool quantizedBoxIntersection(CONST BoundingBox* box, BVHFrames* frames, const Ray* ray, const float t0,
+                                     const float t1)
+{
+    const QuantizedCorner lower = (*box).lower;
+    const QuantizedCorner upper = (*box).upper;
+    const int reference = lower.w;
+    float4 parameters[2];
+    parameters[0] = fma(convert_float4(lower), (*frames).scale[reference], (*frames).lower[reference]);
+    parameters[1] = fma(convert_float4(upper), (*frames).scale[reference], (*frames).lower[reference]);
+    if (!slabsIntersection(parameters, ray, t0, t1))
+        return false;
+
+    const int depth = upper.w;
+    if (depth <= QUANTIZED_BVH_DEPTH)
+    {
+        (*frames).lower[depth] = parameters[0];
+        (*frames).scale[depth].x = quantizationScale(parameters[1].x - parameters[0].x);
+        (*frames).scale[depth].y = quantizationScale(parameters[1].y - parameters[0].y);
+        (*frames).scale[depth].z = quantizationScale(parameters[1].z - parameters[0].z);
+        (*frames).scale[depth].w = 0.f;
+    }
+    return true;
+}
+#else
+static bool boxIntersection(CONST BoundingBox* box, const Ray* ray, const float t0, const float t1)
+{
+    const float4 parameters[2] = {(*box).parameters[0], (*box).parameters[1]};
+    return slabsIntersection(parameters, ray, t0, t1);
+}
+#endif // QUANTIZED_BVH
+
 /*
 ________________________________________________________________________________
 
 Ellipsoid intersection
 ________________________________________________________________________________
 */
-static bool ellipsoidIntersection(const SceneInfo* sceneInfo, CONST Primitive* ellipsoid, CONST Material* materials,
-                                  const Ray* ray, float4* intersection, float4* normal, float* shadowIntensity)
+static bool ellipsoidIntersection(const SceneInfo* sceneInfo, const Primitive* ellipsoid, const Ray* ray,
+                                  float4* intersection, float4* normal, float* shadowIntensity)
 {
     // Shadow intensity
     (*shadowIntensity) = 1.f;
@@ -988,19 +1382,12 @@ static float4 skyboxMapping(const SceneInfo* sceneInfo, CONST Material* material
     const bool condition = u >= 0 && u < (*material).textureMapping.x && v >= 0 && v < (*material).textureMapping.y;
     if (condition)
     {
-        int A = (v * (*material).textureMapping.x + u) * (*material).textureMapping.w;
-        int B = (*material).textureMapping.x * (*material).textureMapping.y * (*material).textureMapping.w;
-        int index = A % B;
-
         // Diffuse
-        int i = (*material).textureOffset.x + index;
-        BitmapBuffer r, g, b;
-        r = textures[i];
-        g = textures[i + 1];
-        b = textures[i + 2];
-        result.x = r / 256.f;
-        result.y = g / 256.f;
-        result.z = b / 256.f;
+        const int4 texel = {u, v, 0, 0};
+        const int4 diffuse = textureTexel(material, textures, (*material).textureOffset.x, tex_diffuse, texel);
+        result.x = diffuse.x / 256.f;
+        result.y = diffuse.y / 256.f;
+        result.z = diffuse.z / 256.f;
     }
     return result;
 }
@@ -1011,7 +1398,7 @@ ________________________________________________________________________________
 Sphere intersection
 ________________________________________________________________________________
 */
-static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphere, CONST Material* materials,
+static bool sphereIntersection(const SceneInfo* sceneInfo, const Primitive* sphere, CONST Material* materials,
                                const Ray* ray, float4* intersection, float4* normal, float* shadowIntensity)
 {
     bool back = false;
@@ -1056,7 +1443,7 @@ static bool sphereIntersection(const SceneInfo* sceneInfo, CONST Primitive* sphe
     else
     {
         // Procedural texture
-        float4 newCenter;
+        float4 newCenter = (*sphere).p0;
         newCenter.x = (*sphere).p0.x + 0.008f * (*sphere).size.x * cos((*sceneInfo).timestamp + (*intersection).x);
         newCenter.y = (*sphere).p0.y + 0.008f * (*sphere).size.y * sin((*sceneInfo).timestamp + (*intersection).y);
         newCenter.z = (*sphere).p0.z + 0.008f * (*sphere).size.z * sin(cos((*sceneInfo).timestamp + (*intersection).z));
@@ -1084,8 +1471,8 @@ ________________________________________________________________________________
 Cylinder (*intersection)
 ________________________________________________________________________________
 */
-static bool cylinderIntersection(const SceneInfo* sceneInfo, CONST Primitive* cylinder, CONST Material* materials,
-                                 const Ray* ray, float4* intersection, float4* normal, float* shadowIntensity)
+static bool cylinderIntersection(const SceneInfo* sceneInfo, const Primitive* cylinder, const Ray* ray,
+                                 float4* intersection, float4* normal, float* shadowIntensity)
 {
     float4 O_C = (*ray).origin - (*cylinder).p0;
     float4 dir = (*ray).direction;
@@ -1148,7 +1535,7 @@ ________________________________________________________________________________
 Checkboard (*intersection)
 ________________________________________________________________________________
 */
-static bool planeIntersection(const SceneInfo* sceneInfo, CONST Primitive* primitive, CONST Material* materials,
+static bool planeIntersection(const SceneInfo* sceneInfo, const Primitive* primitive, CONST Material* materials,
                        CONST BitmapBuffer* textures, const Ray* ray, float4* intersection, float4* normal,
                        float* shadowIntensity, bool reverse)
 {
@@ -1293,8 +1680,9 @@ static bool planeIntersection(const SceneInfo* sceneInfo, CONST Primitive* primi
             float4 specular = {0.f, 0.f, 0.f, 0.f};
             float4 attributes;
             float4 advancedAttributes;
-            color = cubeMapping(sceneInfo, primitive, materials, textures, intersection, normal, &specular, &attributes,
-                                &advancedAttributes);
+            const Primitive mappedPrimitive = (*primitive);
+            color = cubeMapping(sceneInfo, &mappedPrimitive, materials, textures, intersection, normal, &specular,
+                                &attributes, &advancedAttributes, 0.f);
             (*shadowIntensity) = color.w;
         }
 
@@ -1307,10 +1695,75 @@ static bool planeIntersection(const SceneInfo* sceneInfo, CONST Primitive* primi
 /*
 ________________________________________________________________________________
 
+Triangle hit
+
+Intersection point, barycentric areas and interpolated normal of a triangle,
+given the ray parameter of the intersection
+________________________________________________________________________________
+*/
+static void triangleHit(const Primitive* triangle, const Ray* ray, const float t, float4* intersection,
+                        float4* normal, float4* areas)
+{
+    // Intersection
+    (*intersection) = (*ray).origin + t * (*ray).direction;
+
+    // Normal
+    float4 v0 = ((*triangle).p0 - (*intersection));
+    float4 v1 = ((*triangle).p1 - (*intersection));
+    float4 v2 = ((*triangle).p2 - (*intersection));
+
+    (*areas).x = 0.5f * length(cross(v1, v2));
+    (*areas).y = 0.5f * length(cross(v0, v2));
+    (*areas).z = 0.5f * length(cross(v0, v1));
+    (*areas) = normalize(*areas);
+
+    (*normal) = ((*triangle).n0 * (*areas).x + (*triangle).n1 * (*areas).y + (*triangle).n2 * (*areas).z) /
+                ((*areas).x + (*areas).y + (*areas).z);
+}
+
+/*
+________________________________________________________________________________
+
+Triangle facing
+
+Rejects triangles with a normal opposite to the ray when double sided triangles
+are enabled, and turns the normal towards the ray
+________________________________________________________________________________
+*/
+static bool triangleFacing(const SceneInfo* sceneInfo, const Ray* ray, const bool processingShadows, float4* normal)
+{
+    if ((*sceneInfo).doubleSidedTriangles)
+    {
+        // Double Sided triangles
+        // Reject triangles with normal opposite to ray.
+        float4 N = normalize((*ray).direction);
+        if (processingShadows)
+        {
+            if (dot(N, (*normal)) <= 0.f)
+                return false;
+        }
+        else
+        {
+            if (dot(N, (*normal)) >= 0.f)
+                return false;
+        }
+    }
+
+    float4 dir = normalize((*ray).direction);
+    float r = dot(dir, (*normal));
+
+    if (r > 0.f)
+        (*normal) *= -1.f;
+    return true;
+}
+
+/*
+________________________________________________________________________________
+
 Triangle intersection
 ________________________________________________________________________________
 */
-static bool triangleIntersection(const SceneInfo* sceneInfo, CONST Primitive* triangle, const Ray* ray,
+static bool triangleIntersection(const SceneInfo* sceneInfo, const Primitive* triangle, const Ray* ray,
                                  float4* intersection, float4* normal, float4* areas, float* shadowIntensity,
                                  const bool processingShadows)
 {
@@ -1360,72 +1813,489 @@ static bool triangleIntersection(const SceneInfo* sceneInfo, CONST Primitive* tr
     if (t < 0.f)
         return false;
 
-    // Intersection
-    (*intersection) = (*ray).origin + t * (*ray).direction;
+    triangleHit(triangle, ray, t, intersection, normal, areas);
+    if (!triangleFacing(sceneInfo, ray, processingShadows, normal))
+        return false;
 
-    // Normal
-    float4 v0 = ((*triangle).p0 - (*intersection));
-    float4 v1 = ((*triangle).p1 - (*intersection));
-    float4 v2 = ((*triangle).p2 - (*intersection));
+    // Shadow management
+    (*shadowIntensity) = 1.f;
+    return true;
+}
 
-    (*areas).x = 0.5f * length(cross(v1, v2));
-    (*areas).y = 0.5f * length(cross(v0, v2));
-    (*areas).z = 0.5f * length(cross(v0, v1));
-    (*areas) = normalize(*areas);
+/*
+________________________________________________________________________________
 
-    (*normal) = ((*triangle).n0 * (*areas).x + (*triangle).n1 * (*areas).y + (*triangle).n2 * (*areas).z) /
-                ((*areas).x + (*areas).y + (*areas).z);
+Indexed meshes
+________________________________________________________________________________
+*/
+static CONST int4* meshTriangles(CONST int4* geometry)
+{
+    return geometry + 1;
+}
 
-    if ((*sceneInfo).doubleSidedTriangles)
-    {
-        // Double Sided triangles
-        // Reject triangles with normal opposite to ray.
-        float4 N = normalize((*ray).direction);
-        if (processingShadows)
-        {
-            if (dot(N, (*normal)) <= 0.f)
-                return false;
-        }
-        else
-        {
-            if (dot(N, (*normal)) >= 0.f)
-                return false;
-        }
-    }
+static CONST float4* meshVertices(CONST int4* geometry)
+{
+    return (CONST float4*)(geometry + 1 + geometry[0].x);
+}
 
-    float4 dir = normalize((*ray).direction);
-    float r = dot(dir, (*normal));
+static CONST float4* meshNormals(CONST int4* geometry)
+{
+    return meshVertices(geometry) + geometry[0].y;
+}
 
-    if (r > 0.f)
-        (*normal) *= -1.f;
+static CONST float2* meshTextureCoordinates(CONST int4* geometry)
+{
+    return (CONST float2*)(meshNormals(geometry) + geometry[0].y);
+}
 
-    // Shadow management
-    (*shadowIntensity) = 1.f;
-    return true;
+/*
+________________________________________________________________________________
+
+Primitives
+
+The complete attributes of a primitive are assembled from its intersection and
+its shading data. Triangles only need them once the closest intersection is
+known. Other types keep some of their parameters in the normals, and are
+assembled before being intersected
+________________________________________________________________________________
+*/
+static void loadPrimitive(CONST CompactPrimitive* primitives, const int nbPrimitives, const int id,
+                          Primitive* primitive)
+{
+    CONST CompactPrimitive* compactPrimitive = &primitives[id];
+    CONST ShadingPrimitive* shadingPrimitive = &SHADING_PRIMITIVES(primitives, nbPrimitives)[id];
+    (*primitive).p0 = (*compactPrimitive).p0;
+    if ((*compactPrimitive).type == ptInstance)
+    {
+        (*primitive).p1 = (*compactPrimitive).e1;
+        (*primitive).p2 = (*compactPrimitive).e2;
+    }
+    else
+    {
+        (*primitive).p1 = (*compactPrimitive).p0 + (*compactPrimitive).e1;
+        (*primitive).p2 = (*compactPrimitive).p0 + (*compactPrimitive).e2;
+    }
+    (*primitive).n0 = (*shadingPrimitive).n0;
+    (*primitive).n1 = (*shadingPrimitive).n1;
+    (*primitive).n2 = (*shadingPrimitive).n2;
+    (*primitive).size = (*compactPrimitive).size;
+    (*primitive).type = (*compactPrimitive).type;
+    (*primitive).index = (*compactPrimitive).index;
+    (*primitive).materialId = (*compactPrimitive).materialId;
+    (*primitive).vt0 = (*shadingPrimitive).vt0;
+    (*primitive).vt1 = (*shadingPrimitive).vt1;
+    (*primitive).vt2 = (*shadingPrimitive).vt2;
 }
 
 /*
 ________________________________________________________________________________
 
-(*intersection) Shader
+Hit primitives
+
+Triangles of indexed meshes have no primitive of their own. When hit, they are
+identified by the number of primitives plus the index of the triangle
 ________________________________________________________________________________
 */
-static float4 intersectionShader(const SceneInfo* sceneInfo, CONST Primitive* primitive, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, float4* intersection, const float4 areas, float4* normal,
-                                 float4* specular, float4* attributes, float4* advancedAttributes)
+static int hitMaterialId(CONST CompactPrimitive* primitives, const int nbPrimitives, const int id)
 {
-    float4 colorAtIntersection = materials[(*primitive).materialId].color;
-    colorAtIntersection.w = 0.f; // w attribute is used to dtermine light intensity of the material
+    if (id < nbPrimitives)
+        return primitives[id].materialId;
+    return meshTriangles(MESH_GEOMETRY(primitives, nbPrimitives))[id - nbPrimitives].w;
+}
 
-    if ((*sceneInfo).extendedGeometry)
-    {
-        switch ((*primitive).type)
-        {
+static int hitIndex(CONST CompactPrimitive* primitives, const int nbPrimitives, const int id)
+{
+    return (id < nbPrimitives) ? primitives[id].index : -1;
+}
+
+static void hitPrimitive(CONST CompactPrimitive* primitives, const int nbPrimitives, const int id, Primitive* primitive)
+{
+    if (id < nbPrimitives)
+    {
+        loadPrimitive(primitives, nbPrimitives, id, primitive);
+        return;
+    }
+
+    CONST int4* geometry = MESH_GEOMETRY(primitives, nbPrimitives);
+    const int4 triangle = meshTriangles(geometry)[id - nbPrimitives];
+    CONST float4* vertices = meshVertices(geometry);
+    CONST float4* normals = meshNormals(geometry);
+    CONST float2* textureCoordinates = meshTextureCoordinates(geometry);
+    (*primitive).p0 = vertices[triangle.x];
+    (*primitive).p1 = vertices[triangle.y];
+    (*primitive).p2 = vertices[triangle.z];
+    (*primitive).n0 = normals[triangle.x];
+    (*primitive).n1 = normals[triangle.y];
+    (*primitive).n2 = normals[triangle.z];
+    const float4 size = {0.f, 0.f, 0.f, 0.f};
+    (*primitive).size = size;
+    (*primitive).type = ptTriangle;
+    (*primitive).index = -1;
+    (*primitive).materialId = triangle.w;
+    (*primitive).vt0 = textureCoordinates[triangle.x];
+    (*primitive).vt1 = textureCoordinates[triangle.y];
+    (*primitive).vt2 = textureCoordinates[triangle.z];
+}
+
+/*
+________________________________________________________________________________
+
+Indexed triangle intersection
+
+Same as the triangle intersection, vertices and normals are read through the
+indices of the triangle
+________________________________________________________________________________
+*/
+static bool indexedTriangleIntersection(const SceneInfo* sceneInfo, CONST float4* vertices, CONST float4* normals,
+                                        const int4 triangle, const Ray* ray, float4* intersection, float4* normal,
+                                        float4* areas, const bool processingShadows)
+{
+    const float4 p0 = vertices[triangle.x];
+    const float4 p1 = vertices[triangle.y];
+    const float4 p2 = vertices[triangle.z];
+    const float4 E01 = p1 - p0;
+    const float4 E03 = p2 - p0;
+    const float4 P = cross((*ray).direction, E03);
+    const float det = dot(E01, P);
+    if (fabs(det) < (*sceneInfo).geometryEpsilon)
+        return false;
+
+    const float4 T = (*ray).origin - p0;
+    const float a = dot(T, P) / det;
+    if (a < 0.f || a > 1.f)
+        return false;
+
+    const float4 Q = cross(T, E01);
+    const float b = dot((*ray).direction, Q) / det;
+    if (b < 0.f || (a + b) > 1.f)
+        return false;
+
+    const float t = dot(E03, Q) / det;
+    if (t < 0.f)
+        return false;
+
+    // Intersection
+    (*intersection) = (*ray).origin + t * (*ray).direction;
+
+    // Normal
+    const float4 v0 = p0 - (*intersection);
+    const float4 v1 = p1 - (*intersection);
+    const float4 v2 = p2 - (*intersection);
+    (*areas).x = 0.5f * length(cross(v1, v2));
+    (*areas).y = 0.5f * length(cross(v0, v2));
+    (*areas).z = 0.5f * length(cross(v0, v1));
+    (*areas) = normalize(*areas);
+
+    // Vertices without a normal fall back to the normal of the face
+    (*normal) = normals[triangle.x] * (*areas).x + normals[triangle.y] * (*areas).y + normals[triangle.z] * (*areas).z;
+    (*normal) = (dot((*normal), (*normal)) > 0.f) ? normalize(*normal) : normalize(cross(E01, E03));
+
+    const float4 dir = normalize((*ray).direction);
+    const float r = dot(dir, (*normal));
+    if ((*sceneInfo).doubleSidedTriangles)
+    {
+        // Reject triangles with normal opposite to ray
+        if (processingShadows ? (r <= 0.f) : (r >= 0.f))
+            return false;
+    }
+
+    if (r > 0.f)
+        (*normal) *= -1.f;
+    return true;
+}
+
+/*
+________________________________________________________________________________
+
+Compact intersection
+
+Only reads the intersection data of the primitive, and returns the distance to
+the intersection. Primitives are tested without any culling so that a primitive
+is never rejected here when the complete intersection would report it. The
+test of triangles is complete otherwise, only culling needs their normals (see
+triangleFacing). Types that cannot be tested with this data are always
+reported, at a distance of 0
+________________________________________________________________________________
+*/
+static bool compactTriangle(const SceneInfo* sceneInfo, CONST CompactPrimitive* primitive)
+{
+    return (*primitive).type != ptInstance && (!(*sceneInfo).extendedGeometry || (*primitive).type == ptTriangle);
+}
+
+static bool compactIntersection(const SceneInfo* sceneInfo, CONST CompactPrimitive* primitive, const Ray* ray,
+                                float* distance)
+{
+    (*distance) = 0.f;
+    const int type = compactTriangle(sceneInfo, primitive) ? ptTriangle : (*primitive).type;
+    switch (type)
+    {
+    case ptTriangle:
+    {
+        const float4 P = cross((*ray).direction, (*primitive).e2);
+        const float det = dot((*primitive).e1, P);
+        if (fabs(det) < (*sceneInfo).geometryEpsilon)
+            return false;
+
+        const float4 T = (*ray).origin - (*primitive).p0;
+        const float a = dot(T, P) / det;
+        if (a < 0.f || a > 1.f)
+            return false;
+
+        const float4 Q = cross(T, (*primitive).e1);
+        const float b = dot((*ray).direction, Q) / det;
+        if (b < 0.f || (a + b) > 1.f)
+            return false;
+
+        const float t = dot((*primitive).e2, Q) / det;
+        if (t < 0.f)
+            return false;
+        (*distance) = t * length((*ray).direction);
+        return true;
+    }
+    case ptSphere:
+    {
+        const float4 O_C = (*ray).origin - (*primitive).p0;
+        const float4 dir = normalize((*ray).direction);
+        const float a = 2.f * dot(dir, dir);
+        const float b = 2.f * dot(O_C, dir);
+        const float c = dot(O_C, O_C) - ((*primitive).size.x * (*primitive).size.x);
+        const float d = b * b - 2.f * a * c;
+        if (d <= 0.f || a == 0.f)
+            return false;
+        const float r = sqrt(d);
+        const float t1 = (-b - r) / a;
+        const float t2 = (-b + r) / a;
+        if (t1 <= (*sceneInfo).geometryEpsilon && t2 <= (*sceneInfo).geometryEpsilon)
+            return false;
+        if (t1 <= (*sceneInfo).geometryEpsilon)
+            (*distance) = t2;
+        else if (t2 <= (*sceneInfo).geometryEpsilon)
+            (*distance) = t1;
+        else
+            (*distance) = min(t1, t2);
+        return true;
+    }
+    }
+    return true;
+}
+
+/*
+________________________________________________________________________________
+
+Instance intersection
+
+The ray is transformed into the space of the mesh, and the bottom level
+hierarchy of the mesh is traversed. The rows of the rotation from world space
+to mesh space are stored in p0, p1 and p2, the translation in n0, the scale in
+size.x, and the range of boxes of the hierarchy in size.y and size.z. n1.x is
+set for indexed meshes, the leaves of which reference triangles instead of
+primitives. The direction is scaled as well, so that ray parameters are the
+same in both spaces. The closest intersection is returned in world space
+________________________________________________________________________________
+*/
+static float4 instancePoint(const Primitive* instance, const float4 point)
+{
+    return (*instance).n0 + (*instance).size.x * (point.x * (*instance).p0 + point.y * (*instance).p1 +
+                                                  point.z * (*instance).p2);
+}
+
+static void instanceToWorld(const Primitive* instance, float4* intersection, float4* normal)
+{
+    (*intersection) = instancePoint(instance, (*intersection));
+    (*normal) = normalize((*normal).x * (*instance).p0 + (*normal).y * (*instance).p1 + (*normal).z * (*instance).p2);
+}
+
+// Places the primitive of a mesh hit through an instance in world space, where
+// its intersection is shaded. Triangles are shaded from their areas and vertex
+// attributes, which do not depend on the placement of the mesh
+static void instancePrimitive(CONST CompactPrimitive* primitives, const int nbPrimitives, const int instanceId,
+                              Primitive* primitive)
+{
+    if (instanceId == -1 || (*primitive).type == ptTriangle)
+        return;
+
+    Primitive instance;
+    loadPrimitive(primitives, nbPrimitives, instanceId, &instance);
+    (*primitive).p0 = instancePoint(&instance, (*primitive).p0);
+    (*primitive).p1 = instancePoint(&instance, (*primitive).p1);
+    (*primitive).p2 = instancePoint(&instance, (*primitive).p2);
+    (*primitive).size.x *= instance.size.x;
+    (*primitive).size.y *= instance.size.x;
+    (*primitive).size.z *= instance.size.x;
+}
+
+static bool instanceIntersection(const SceneInfo* sceneInfo, CONST BoundingBox* boundingBoxes,
+                                 CONST CompactPrimitive* primitives, const int nbPrimitives, CONST Material* materials,
+                                 CONST BitmapBuffer* textures, const Primitive* instance, const Ray* ray,
+                                 const float maxDistance, const int currentMaterialId, const int objectId,
+                                 const bool processingShadows, int* closestPrimitive, float4* closestIntersection,
+                                 float4* closestNormal, float4* closestAreas, float* closestShadowIntensity)
+{
+    const float scale = (*instance).size.x;
+    const float4 origin = (*ray).origin - (*instance).n0;
+    Ray r;
+    r.origin.x = dot((*instance).p0, origin) / scale;
+    r.origin.y = dot((*instance).p1, origin) / scale;
+    r.origin.z = dot((*instance).p2, origin) / scale;
+    r.origin.w = 0.f;
+    r.direction.x = dot((*instance).p0, (*ray).direction) / scale;
+    r.direction.y = dot((*instance).p1, (*ray).direction) / scale;
+    r.direction.z = dot((*instance).p2, (*ray).direction) / scale;
+    r.direction.w = 0.f;
+    computeRayAttributes(&r);
+
+    CONST int4* geometry = MESH_GEOMETRY(primitives, nbPrimitives);
+    const bool indexed = ((*instance).n1.x != 0.f);
+
+    bool hit = false;
+    bool closestTriangle = false;
+    float minDistance = maxDistance;
+    const int lastBox = (int)(*instance).size.y + (int)(*instance).size.z;
+    int cptBoxes = (int)(*instance).size.y;
+    BVH_FRAMES(frames, boundingBoxes);
+    while (cptBoxes < lastBox)
+    {
+        CONST BoundingBox* box = BVH_NODE(boundingBoxes, cptBoxes);
+        if (BVH_INTERSECTION(box, frames, &r, 0.f, maxDistance))
+        {
+            for (int cptPrimitives = 0; cptPrimitives < (*box).nbPrimitives; ++cptPrimitives)
+            {
+                float4 intersection = {0.f, 0.f, 0.f, 0.f};
+                float4 normal = {0.f, 0.f, 0.f, 0.f};
+                float4 areas = {0.f, 0.f, 0.f, 0.f};
+                float shadowIntensity = 0.f;
+                bool i = false;
+                int hitId = (*box).startIndex + cptPrimitives;
+                if (indexed)
+                {
+                    const int4 triangle = meshTriangles(geometry)[hitId];
+                    CONST Material* material = &materials[triangle.w];
+                    const bool skip = processingShadows
+                                          ? ((*material).attributes.x != 0)
+                                          : ((*material).attributes.x == 1 && currentMaterialId == triangle.w);
+                    if (skip)
+                        continue;
+                    i = indexedTriangleIntersection(sceneInfo, meshVertices(geometry), meshNormals(geometry), triangle,
+                                                    &r, &intersection, &normal, &areas, processingShadows);
+                    hitId += nbPrimitives;
+                }
+                else
+                {
+                    CONST CompactPrimitive* compactPrimitive = &primitives[hitId];
+                    CONST Material* material = &materials[(*compactPrimitive).materialId];
+                    const bool skip = processingShadows ? ((*compactPrimitive).index == objectId ||
+                                                           (*material).attributes.x != 0)
+                                                        : ((*material).attributes.x == 1 &&
+                                                           currentMaterialId == (*compactPrimitive).materialId);
+                    float distance;
+                    if (skip || !compactIntersection(sceneInfo, compactPrimitive, &r, &distance) ||
+                        distance * scale >= minDistance)
+                        continue;
+
+                    if (compactTriangle(sceneInfo, compactPrimitive))
+                    {
+                        // The shading data of triangles is only read for culling, and for the closest one
+                        i = distance * scale > (*sceneInfo).geometryEpsilon;
+                        if (i && (*sceneInfo).doubleSidedTriangles)
+                        {
+                            Primitive triangle;
+                            loadPrimitive(primitives, nbPrimitives, hitId, &triangle);
+                            triangleHit(&triangle, &r, distance / length(r.direction), &intersection, &normal,
+                                        &areas);
+                            i = triangleFacing(sceneInfo, &r, processingShadows, &normal);
+                        }
+                        if (i)
+                        {
+                            minDistance = distance * scale;
+                            (*closestPrimitive) = hitId;
+                            closestTriangle = true;
+                            hit = true;
+                        }
+                        continue;
+                    }
+
+                    Primitive primitive;
+                    loadPrimitive(primitives, nbPrimitives, hitId, &primitive);
+                    switch (primitive.type)
+                    {
+                    case ptEnvironment:
+                    case ptSphere:
+                        i = sphereIntersection(sceneInfo, &primitive, materials, &r, &intersection, &normal,
+                                               &shadowIntensity);
+                        break;
+                    case ptCylinder:
+                        i = cylinderIntersection(sceneInfo, &primitive, &r, &intersection, &normal, &shadowIntensity);
+                        break;
+                    case ptEllipsoid:
+                        i = ellipsoidIntersection(sceneInfo, &primitive, &r, &intersection, &normal, &shadowIntensity);
+                        break;
+                    default:
+                        i = planeIntersection(sceneInfo, &primitive, materials, textures, &r, &intersection, &normal,
+                                              &shadowIntensity, false);
+                        break;
+                    }
+                }
+
+                if (i)
+                {
+                    // Back to world space
+                    instanceToWorld(instance, &intersection, &normal);
+                    const float distance = length(intersection - (*ray).origin);
+                    if (distance > (*sceneInfo).geometryEpsilon && distance < minDistance)
+                    {
+                        minDistance = distance;
+                        (*closestPrimitive) = hitId;
+                        (*closestIntersection) = intersection;
+                        (*closestNormal) = normal;
+                        (*closestAreas) = areas;
+                        (*closestShadowIntensity) = shadowIntensity;
+                        closestTriangle = false;
+                        hit = true;
+                    }
+                }
+            }
+            ++cptBoxes;
+        }
+        else
+            cptBoxes += (*box).indexForNextBox.x;
+    }
+
+    if (closestTriangle)
+    {
+        Primitive triangle;
+        loadPrimitive(primitives, nbPrimitives, (*closestPrimitive), &triangle);
+        triangleHit(&triangle, &r, minDistance / (scale * length(r.direction)), closestIntersection, closestNormal,
+                    closestAreas);
+        triangleFacing(sceneInfo, &r, processingShadows, closestNormal);
+        instanceToWorld(instance, closestIntersection, closestNormal);
+        (*closestShadowIntensity) = 1.f;
+    }
+    return hit;
+}
+
+/*
+________________________________________________________________________________
+
+(*intersection) Shader
+________________________________________________________________________________
+*/
+static float4 intersectionShader(const SceneInfo* sceneInfo, const Primitive* primitive, CONST Material* materials,
+                                 CONST BitmapBuffer* textures, float4* intersection, const float4 areas, float4* normal,
+                                 float4* specular, float4* attributes, float4* advancedAttributes,
+                                 const float footprint)
+{
+    float4 colorAtIntersection = materials[(*primitive).materialId].color;
+    colorAtIntersection.w = 0.f; // w attribute is used to dtermine light intensity of the material
+
+    if ((*sceneInfo).extendedGeometry)
+    {
+        switch ((*primitive).type)
+        {
         case ptCylinder:
         {
             if (materials[(*primitive).materialId].textureIds.x != TEXTURE_NONE)
                 colorAtIntersection = sphereUVMapping(primitive, materials, textures, intersection, normal, specular,
-                                                      attributes, advancedAttributes);
+                                                      attributes, advancedAttributes, footprint);
             break;
         }
         case ptEnvironment:
@@ -1434,14 +2304,14 @@ static float4 intersectionShader(const SceneInfo* sceneInfo, CONST Primitive* pr
         {
             if (materials[(*primitive).materialId].textureIds.x != TEXTURE_NONE)
                 colorAtIntersection = sphereUVMapping(primitive, materials, textures, intersection, normal, specular,
-                                                      attributes, advancedAttributes);
+                                                      attributes, advancedAttributes, footprint);
             break;
         }
         case ptCheckboard:
         {
             if (materials[(*primitive).materialId].textureIds.x != TEXTURE_NONE)
                 colorAtIntersection = cubeMapping(sceneInfo, primitive, materials, textures, intersection, normal,
-                                                  specular, attributes, advancedAttributes);
+                                                  specular, attributes, advancedAttributes, footprint);
             else
             {
                 int x = (*sceneInfo).viewDistance + (((*intersection).x - (*primitive).p0.x) / (*primitive).size.x);
@@ -1474,22 +2344,22 @@ static float4 intersectionShader(const SceneInfo* sceneInfo, CONST Primitive* pr
         {
             if (materials[(*primitive).materialId].textureIds.x != TEXTURE_NONE)
                 colorAtIntersection = cubeMapping(sceneInfo, primitive, materials, textures, intersection, normal,
-                                                  specular, attributes, advancedAttributes);
+                                                  specular, attributes, advancedAttributes, footprint);
             break;
         }
         case ptTriangle:
         {
             if (materials[(*primitive).materialId].textureIds.x != TEXTURE_NONE)
-                colorAtIntersection = triangleUVMapping(sceneInfo, primitive, materials, textures, intersection, areas,
-                                                        normal, specular, attributes, advancedAttributes);
+                colorAtIntersection = triangleUVMapping(sceneInfo, primitive, materials, textures, areas, normal,
+                                                        specular, attributes, advancedAttributes, footprint);
             break;
         }
         }
     }
     else
         if (materials[(*primitive).materialId].textureIds.x != TEXTURE_NONE)
-            colorAtIntersection = triangleUVMapping(sceneInfo, primitive, materials, textures, intersection, areas,
-                                                    normal, specular, attributes, advancedAttributes);
+            colorAtIntersection = triangleUVMapping(sceneInfo, primitive, materials, textures, areas, normal, specular,
+                                                    attributes, advancedAttributes, footprint);
     return colorAtIntersection;
 }
 
@@ -1507,12 +2377,11 @@ light source center.
 ________________________________________________________________________________
 */
 static float processShadows(const SceneInfo* sceneInfo, CONST BoundingBox* boudingBoxes, const int nbActiveBoxes,
-                            CONST Primitive* primitives, CONST Material* materials, CONST BitmapBuffer* textures,
+                            CONST CompactPrimitive* primitives, CONST Material* materials, CONST BitmapBuffer* textures,
                             const int nbPrimitives, const float4 lampCenter, const float4 origin, const int objectId,
                             const int iteration, float4* color)
 {
     float result = 0.f;
-    int cptBoxes = 0;
     (*color).x = 0.f;
     (*color).y = 0.f;
     (*color).z = 0.f;
@@ -1522,90 +2391,124 @@ static float processShadows(const SceneInfo* sceneInfo, CONST BoundingBox* boudi
     computeRayAttributes(&r);
     float minDistance = (iteration < 2) ? (*sceneInfo).viewDistance : (*sceneInfo).viewDistance / (iteration + 1);
 
-    while (result < (*sceneInfo).shadowIntensity && cptBoxes < nbActiveBoxes)
-    {
-        CONST BoundingBox* box = &boudingBoxes[cptBoxes];
-        if (boxIntersection(box, &r, 0.05f, minDistance))
+    BVH_LEAVES_BEGIN(boudingBoxes, nbActiveBoxes, &r, 0.05f, minDistance, result < (*sceneInfo).shadowIntensity,
+                     firstPrimitive, nbBoxPrimitives)
+        int cptPrimitives = 0;
+        while (result < (*sceneInfo).shadowIntensity && cptPrimitives < nbBoxPrimitives)
         {
-            int cptPrimitives = 0;
-            while (result < (*sceneInfo).shadowIntensity && cptPrimitives < (*box).nbPrimitives)
+            float4 intersection = {0.f, 0.f, 0.f, 0.f};
+            float4 normal = {0.f, 0.f, 0.f, 0.f};
+            float4 areas = {0.f, 0.f, 0.f, 0.f};
+            float shadowIntensity = 0.f;
+
+            // The shading data of the primitive is only read when its intersection data is hit
+            const int id = firstPrimitive + cptPrimitives;
+            CONST CompactPrimitive* compactPrimitive = &primitives[id];
+            float distance;
+            const bool candidate = compactIntersection(sceneInfo, compactPrimitive, &r, &distance);
+            int materialId = (*compactPrimitive).materialId;
+            int primitiveIndex = (*compactPrimitive).index;
+            bool instanceHit = false;
+            if (candidate && (*compactPrimitive).type == ptInstance)
             {
-                float4 intersection = {0.f, 0.f, 0.f, 0.f};
-                float4 normal = {0.f, 0.f, 0.f, 0.f};
-                float4 areas = {0.f, 0.f, 0.f, 0.f};
-                float shadowIntensity = 0.f;
-
-                CONST Primitive* primitive = &primitives[(*box).startIndex + cptPrimitives];
-                if ((*primitive).index != objectId && materials[(*primitive).materialId].attributes.x == 0)
+                // The closest primitive of the mesh is the occluder
+                Primitive instance;
+                loadPrimitive(primitives, nbPrimitives, id, &instance);
+                int occluder;
+                instanceHit = instanceIntersection(sceneInfo, boudingBoxes, primitives, nbPrimitives, materials,
+                                                   textures, &instance, &r, minDistance, -1, objectId, true,
+                                                   &occluder, &intersection, &normal, &areas, &shadowIntensity);
+                if (instanceHit)
                 {
-                    bool hit = false;
-                    if ((*sceneInfo).extendedGeometry)
+                    materialId = hitMaterialId(primitives, nbPrimitives, occluder);
+                    primitiveIndex = hitIndex(primitives, nbPrimitives, occluder);
+                }
+            }
+            if (candidate && (instanceHit || (*compactPrimitive).type != ptInstance) &&
+                primitiveIndex != objectId && materials[materialId].attributes.x == 0)
+            {
+                bool hit = instanceHit;
+                float l = 0.f;
+                if (!instanceHit && compactTriangle(sceneInfo, compactPrimitive))
+                {
+                    // The normal of triangles is only needed for culling, and for transparent occluders
+                    hit = true;
+                    l = distance;
+                    shadowIntensity = 1.f;
+                    if ((*sceneInfo).doubleSidedTriangles || materials[materialId].transparency != 0.f)
+                    {
+                        Primitive triangle;
+                        loadPrimitive(primitives, nbPrimitives, id, &triangle);
+                        triangleHit(&triangle, &r, distance / length(r.direction), &intersection, &normal, &areas);
+                        hit = triangleFacing(sceneInfo, &r, true, &normal);
+                    }
+                }
+                else
+                {
+                    if (!instanceHit)
                     {
-                        switch ((*primitive).type)
+                        Primitive primitive;
+                        loadPrimitive(primitives, nbPrimitives, id, &primitive);
+                        switch (primitive.type)
                         {
                         case ptSphere:
-                            hit = sphereIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
+                            hit = sphereIntersection(sceneInfo, &primitive, materials, &r, &intersection, &normal,
                                                      &shadowIntensity);
                             break;
                         case ptCylinder:
-                            hit = cylinderIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
+                            hit = cylinderIntersection(sceneInfo, &primitive, &r, &intersection, &normal,
                                                        &shadowIntensity);
                             break;
                         case ptCamera:
                             hit = false;
                             break;
                         case ptEllipsoid:
-                            hit = ellipsoidIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
+                            hit = ellipsoidIntersection(sceneInfo, &primitive, &r, &intersection, &normal,
                                                         &shadowIntensity);
                             break;
-                        case ptTriangle:
-                            hit = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                       &shadowIntensity, true);
-                            break;
                         default:
-                            hit = planeIntersection(sceneInfo, primitive, materials, textures, &r, &intersection,
+                            hit = planeIntersection(sceneInfo, &primitive, materials, textures, &r, &intersection,
                                                     &normal, &shadowIntensity, false);
                             break;
                         }
                     }
-                    else
-                    {
-                        hit = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                   &shadowIntensity, true);
-                    }
-                    if (hit)
+                    l = length(intersection - r.origin);
+                }
+                if (hit)
+                {
+                    float4 O_L = r.direction;
+                    if (l > (*sceneInfo).geometryEpsilon && l < length(O_L))
                     {
-                        float4 O_I = intersection - r.origin;
-                        float4 O_L = r.direction;
-                        float l = length(O_I);
-                        if (l > (*sceneInfo).geometryEpsilon && l < length(O_L))
+                        float ratio = shadowIntensity * (*sceneInfo).shadowIntensity;
+                        if (materials[materialId].transparency != 0.f)
                         {
-                            float ratio = shadowIntensity * (*sceneInfo).shadowIntensity;
-                            if (materials[(*primitive).materialId].transparency != 0.f)
-                            {
-                                // Shadow color
-                                O_L = normalize(O_L);
-                                float a = fabs(dot(O_L, normal));
-                                float r = (materials[(*primitive).materialId].transparency == 0.f)
-                                              ? 1.f
-                                              : (1.f - 0.8f * materials[(*primitive).materialId].transparency);
-                                ratio *= r * a;
-                                (*color).x += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.x);
-                                (*color).y += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.y);
-                                (*color).z += ratio * (0.3f - 0.3f * materials[(*primitive).materialId].color.z);
-                            }
-                            result += ratio;
+                            // Shadow color
+                            O_L = normalize(O_L);
+                            float a = fabs(dot(O_L, normal));
+                            float r = (materials[materialId].transparency == 0.f)
+                                          ? 1.f
+                                          : (1.f - 0.8f * materials[materialId].transparency);
+                            ratio *= r * a;
+                            (*color).x += ratio * (0.3f - 0.3f * materials[materialId].color.x);
+                            (*color).y += ratio * (0.3f - 0.3f * materials[materialId].color.y);
+                            (*color).z += ratio * (0.3f - 0.3f * materials[materialId].color.z);
                         }
+                        result += ratio;
                     }
                 }
-                ++cptPrimitives;
             }
-            ++cptBoxes;
-        }
-        else
-        {
-            cptBoxes += (*box).indexForNextBox.x;
+            ++cptPrimitives;
         }
+    BVH_LEAVES_END(minDistance, result < (*sceneInfo).shadowIntensity)
+
+    // No light goes through occluders blocking it completely, whatever the
+    // transparent ones found before them. The color does then not depend on the
+    // order in which the traversal finds the occluders
+    if (result >= (*sceneInfo).shadowIntensity)
+    {
+        (*color).x = 0.f;
+        (*color).y = 0.f;
+        (*color).z = 0.f;
     }
     result = max(0.f, min(result, (*sceneInfo).shadowIntensity));
     return result;
@@ -1614,182 +2517,235 @@ static float processShadows(const SceneInfo* sceneInfo, CONST BoundingBox* boudi
 /*
 ________________________________________________________________________________
 
-Primitive shader
+Shading preparation
+Everything that can be computed before the shadow ray is cast towards the lamp.
+Returns false when the primitive is not shaded (no shading, emitting material or
+wireframe), in which case its color is (*sample).intersectionColor
 ________________________________________________________________________________
 */
-static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, const PostProcessingInfo* postProcessingInfo,
-                              CONST BoundingBox* boundingBoxes, const int nbActiveBoxes, CONST Primitive* primitives,
-                              const int nbActivePrimitives, CONST LightInformation* lightInformation,
-                              const int lightInformationSize, const int nbActiveLamps, CONST Material* materials,
-                              CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, const float4 origin,
-                              float4* normal, const int objectId, float4* intersection, const float4 areas,
-                              float4* closestColor, const int iteration, float4* refractionFromColor,
-                              float* shadowIntensity, float4* totalBlinn, float4* attributes)
-{
-    CONST Primitive* primitive = &(primitives[objectId]);
+static bool prepareShading(const int index, const SceneInfo* sceneInfo, CONST CompactPrimitive* primitives,
+                           const int nbActivePrimitives, CONST LightInformation* lightInformation,
+                           const int lightInformationSize, CONST Material* materials, CONST BitmapBuffer* textures,
+                           CONST RandomBuffer* randoms, const float4 origin, float4* normal, const int objectId,
+                           const int instanceId, float4* intersection, const float4 areas, const int iteration,
+                           float4* attributes, const float coneWidth, ShadingSample* sample)
+{
+    Primitive hit;
+    hitPrimitive(primitives, nbActivePrimitives, objectId, &hit);
+    instancePrimitive(primitives, nbActivePrimitives, instanceId, &hit);
+    const Primitive* primitive = &hit;
     CONST Material* material = &materials[(*primitive).materialId];
-    float4 lampsColor = {0.f, 0.f, 0.f, 0.f};
-
-    // Lamp Impact
-    (*shadowIntensity) = 0.f;
+    (*sample).origin = origin;
+    (*sample).materialId = (*primitive).materialId;
+    (*sample).lamp = -1;
+    (*sample).shadows = 0;
 
     // Bump
     float4 bumpNormal = {0.f, 0.f, 0.f, 0.f};
     float4 advancedAttributes = {0.f, 0.f, 0.f, 0.f};
 
     // Specular
-    float4 specular;
-    specular.x = (*material).specular.x;
-    specular.y = (*material).specular.y;
-    specular.z = (*material).specular.z;
+    (*sample).specular.x = (*material).specular.x;
+    (*sample).specular.y = (*material).specular.y;
+    (*sample).specular.z = (*material).specular.z;
 
     // Intersection color
-    float4 intersectionColor = intersectionShader(sceneInfo, primitive, materials, textures, intersection, areas,
-                                                  &bumpNormal, &specular, attributes, &advancedAttributes);
+    const float footprint = rayConeFootprint(coneWidth, origin, (*intersection), (*normal));
+    (*sample).intersectionColor = intersectionShader(sceneInfo, primitive, materials, textures, intersection, areas,
+                                                     &bumpNormal, &(*sample).specular, attributes,
+                                                     &advancedAttributes, footprint);
+    (*sample).ambientOcclusion = advancedAttributes.x;
     (*normal) += bumpNormal;
     (*normal) = normalize((*normal));
 
     const bool condition =
         (*sceneInfo).graphicsLevel == glNoShading || (*material).innerIllumination.x != 0.f ||
         (*material).attributes.z != 0;
+    (*sample).constantColor = condition;
     if (condition)
-    {
         // Wireframe returns constant color
-        return intersectionColor;
-    }
+        return false;
 
-    if ((*sceneInfo).graphicsLevel > glNoShading)
+    int cptLamp = ((*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS)
+                      ? ((*sceneInfo).pathTracingIteration % lightInformationSize)
+                      : 0;
+
+    if (lightInformation[cptLamp].primitiveId != (*primitive).index)
     {
-        (*closestColor) *= (*material).innerIllumination.x;
-        int C = 1; // (lightInformationSize>1) ? 2 : 1;
-        for (int c = 0; c < C; ++c)
+        // randomize lamp center
+        float4 center = lightInformation[cptLamp].location;
+
+        int t = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
+        CONST Material* m = &materials[lightInformation[cptLamp].materialId];
+        const bool condition =
+            (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS &&
+            lightInformation[cptLamp].primitiveId >= 0 &&
+            lightInformation[cptLamp].primitiveId < nbActivePrimitives;
+        if (condition)
         {
-            int cptLamp = ((*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS)
-                              ? ((*sceneInfo).pathTracingIteration % lightInformationSize + C - 1)
-                              : 0;
-
-            if (lightInformation[cptLamp].primitiveId != (*primitive).index)
-            {
-                // randomize lamp center
-                float4 center = lightInformation[cptLamp].location;
+            float a = (*m).innerIllumination.y * 10.f * (*sceneInfo).pathTracingIteration /
+                      (float)((*sceneInfo).maxPathTracingIterations);
+            center.x += randoms[t] * a;
+            center.y += randoms[t + 1] * a;
+            center.z += randoms[t + 2] * a;
+        }
 
-                int t = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
-                CONST Material* m = &materials[lightInformation[cptLamp].materialId];
-                const bool condition =
-                    (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS &&
-                    lightInformation[cptLamp].primitiveId >= 0 &&
-                    lightInformation[cptLamp].primitiveId < nbActivePrimitives;
-                if (condition)
-                {
-                    float a = (*m).innerIllumination.y * 10.f * (*sceneInfo).pathTracingIteration /
-                              (float)((*sceneInfo).maxPathTracingIterations);
-                    center.x += randoms[t] * a;
-                    center.y += randoms[t + 1] * a;
-                    center.z += randoms[t + 2] * a;
-                }
+        float4 lightRay = center - (*intersection);
+        float lightRayLength = length(lightRay);
+        if (lightRayLength < (*m).innerIllumination.z)
+        {
+            // --------------------------------------------------------------------------------
+            // Lambert
+            // --------------------------------------------------------------------------------
+            lightRay = normalize(lightRay);
+            float lambert = dot((*normal), lightRay);
 
-                float4 lightRay = center - (*intersection);
-                float lightRayLength = length(lightRay);
-                if (lightRayLength < (*m).innerIllumination.z)
-                {
-                    float4 shadowColor = {0.f, 0.f, 0.f, 0.f};
+            const bool condition =
+                lambert > 0.f && (*sceneInfo).graphicsLevel > glReflectionsAndRefractions &&
+                iteration < 4 && // No need to process shadows after 4 generations of rays... cannot be seen anyway.
+                (*material).innerIllumination.x == 0.f;
+
+            float photonEnergy = sqrt(lightRayLength / (*m).innerIllumination.z);
+            photonEnergy = (photonEnergy > 1.f) ? 1.f : photonEnergy;
+            photonEnergy = (photonEnergy < 0.f) ? 0.f : photonEnergy;
+
+            (*sample).lamp = cptLamp;
+            (*sample).shadows = condition;
+            (*sample).lampCenter = center;
+            (*sample).lightRay = lightRay;
+            (*sample).lambert = lambert;
+            (*sample).photonEnergy = photonEnergy;
+        }
+    }
+    return true;
+}
 
-                    // --------------------------------------------------------------------------------
-                    // Lambert
-                    // --------------------------------------------------------------------------------
-                    lightRay = normalize(lightRay);
-                    float lambert = dot((*normal), lightRay);
+/*
+________________________________________________________________________________
 
-                    const bool condition =
-                        lambert > 0.f && (*sceneInfo).graphicsLevel > glReflectionsAndRefractions &&
-                        iteration < 4 && // No need to process shadows after 4 generations of rays... cannot be seen anyway.
-                        (*material).innerIllumination.x == 0.f;
-                    if (condition)
-                        (*shadowIntensity) =
-                            processShadows(sceneInfo, boundingBoxes, nbActiveBoxes, primitives, materials, textures,
-                                           nbActivePrimitives, center, (*intersection),
-                                           lightInformation[cptLamp].primitiveId, iteration, &shadowColor);
+Shading completion
+Applies the shadow intensity and color returned by the shadow ray, if any, to
+the prepared sample
+________________________________________________________________________________
+*/
+static void completeShading(const int index, const SceneInfo* sceneInfo, CONST LightInformation* lightInformation,
+                            CONST Material* materials, CONST RandomBuffer* randoms, const ShadingSample* sample,
+                            const float shadowIntensity, const float4 shadowColor, const float4 normal,
+                            const float4 intersection, float4* closestColor, float4* refractionFromColor,
+                            float4* totalBlinn)
+{
+    CONST Material* material = &materials[(*sample).materialId];
+    float4 lampsColor = {0.f, 0.f, 0.f, 0.f};
+    (*closestColor) *= (*material).innerIllumination.x;
 
-                    if ((*sceneInfo).graphicsLevel > glNoShading)
-                    {
-                        float photonEnergy = sqrt(lightRayLength / (*m).innerIllumination.z);
-                        photonEnergy = (photonEnergy > 1.f) ? 1.f : photonEnergy;
-                        photonEnergy = (photonEnergy < 0.f) ? 0.f : photonEnergy;
+    const int cptLamp = (*sample).lamp;
+    if (cptLamp != -1)
+    {
+        float lambert = (*sample).lambert;
+        const float photonEnergy = (*sample).photonEnergy;
 
-                        // Transparent materials are lighted on both sides but the amount of light received by the dark
-                        // side depends on the transparency rate.
-                        lambert *= (lambert < 0.f) ? -materials[(*primitive).materialId].transparency : 1.f;
+        // Transparent materials are lighted on both sides but the amount of light received by the dark
+        // side depends on the transparency rate.
+        lambert *= (lambert < 0.f) ? -(*material).transparency : 1.f;
 
-                        if (lightInformation[cptLamp].materialId != MATERIAL_NONE)
-                        {
-                            CONST Material* m = &materials[lightInformation[cptLamp].materialId];
-                            lambert *= (*m).innerIllumination.x; // Lamp illumination
-                        }
-                        else
-                            lambert *= lightInformation[cptLamp].color.w;
+        if (lightInformation[cptLamp].materialId != MATERIAL_NONE)
+        {
+            CONST Material* m = &materials[lightInformation[cptLamp].materialId];
+            lambert *= (*m).innerIllumination.x; // Lamp illumination
+        }
+        else
+            lambert *= lightInformation[cptLamp].color.w;
 
-                        if ((*material).innerIllumination.w != 0.f)
-                            // Randomize lamp intensity depending on material noise, for more realistic rendering
-                            lambert *= (1.f + randoms[t] * (*material).innerIllumination.w * 100.f);
+        if ((*material).innerIllumination.w != 0.f)
+        {
+            // Randomize lamp intensity depending on material noise, for more realistic rendering
+            int t = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
+            lambert *= (1.f + randoms[t] * (*material).innerIllumination.w * 100.f);
+        }
 
-                        lambert *= (1.f - (*shadowIntensity));
-                        lambert += (*sceneInfo).backgroundColor.w;
-                        lambert *= (1.f - photonEnergy);
+        lambert *= (1.f - shadowIntensity);
+        lambert += (*sceneInfo).backgroundColor.w;
+        lambert *= (1.f - photonEnergy);
 
-                        // Lighted object, not in the shades
-                        lampsColor += lambert * lightInformation[cptLamp].color - shadowColor;
+        // Lighted object, not in the shades
+        lampsColor += lambert * lightInformation[cptLamp].color - shadowColor;
 
-                        const bool condition =
-                            (*sceneInfo).graphicsLevel > glPhong &&
-                            (*shadowIntensity) < (*sceneInfo).shadowIntensity;
+        const bool condition =
+            (*sceneInfo).graphicsLevel > glPhong && shadowIntensity < (*sceneInfo).shadowIntensity;
 
-                        if (condition)
-                        {
-                            // --------------------------------------------------------------------------------
-                            // Blinn - Phong
-                            // --------------------------------------------------------------------------------
-                            float4 viewRay = normalize((*intersection) - origin);
-                            float4 blinnDir = lightRay - viewRay;
-                            const float temp = sqrt(dot(blinnDir, blinnDir));
-                            if (temp != 0.f)
-                            {
-                                // Specular reflection
-                                blinnDir = (1.f / temp) * blinnDir;
-                                float blinnTerm = dot(blinnDir, (*normal));
-                                blinnTerm = (blinnTerm < 0.f) ? 0.f : blinnTerm;
-
-                                blinnTerm = specular.x * pow(blinnTerm, specular.y);
-                                blinnTerm *= (1.f - photonEnergy);
-                                (*totalBlinn).x +=
-                                    lightInformation[cptLamp].color.x * lightInformation[cptLamp].color.w * blinnTerm;
-                                (*totalBlinn).y +=
-                                    lightInformation[cptLamp].color.y * lightInformation[cptLamp].color.w * blinnTerm;
-                                (*totalBlinn).z +=
-                                    lightInformation[cptLamp].color.z * lightInformation[cptLamp].color.w * blinnTerm;
-
-                                // Get transparency from specular map
-                                (*totalBlinn).w = specular.z;
-                            }
-                        }
-                    }
-                }
+        if (condition)
+        {
+            // --------------------------------------------------------------------------------
+            // Blinn - Phong
+            // --------------------------------------------------------------------------------
+            float4 viewRay = normalize(intersection - (*sample).origin);
+            float4 blinnDir = (*sample).lightRay - viewRay;
+            const float temp = sqrt(dot(blinnDir, blinnDir));
+            if (temp != 0.f)
+            {
+                // Specular reflection
+                blinnDir = (1.f / temp) * blinnDir;
+                float blinnTerm = dot(blinnDir, normal);
+                blinnTerm = (blinnTerm < 0.f) ? 0.f : blinnTerm;
+
+                blinnTerm = (*sample).specular.x * pow(blinnTerm, (*sample).specular.y);
+                blinnTerm *= (1.f - photonEnergy);
+                (*totalBlinn).x += lightInformation[cptLamp].color.x * lightInformation[cptLamp].color.w * blinnTerm;
+                (*totalBlinn).y += lightInformation[cptLamp].color.y * lightInformation[cptLamp].color.w * blinnTerm;
+                (*totalBlinn).z += lightInformation[cptLamp].color.z * lightInformation[cptLamp].color.w * blinnTerm;
+
+                // Get transparency from specular map
+                (*totalBlinn).w = (*sample).specular.z;
             }
-
-            // Light impact on material
-            (*closestColor) += intersectionColor * lampsColor;
-
-            (*refractionFromColor) = intersectionColor; // Refraction depending on color;
-            saturateVector(totalBlinn);
         }
     }
 
+    // Light impact on material
+    (*closestColor) += (*sample).intersectionColor * lampsColor;
+
+    (*refractionFromColor) = (*sample).intersectionColor; // Refraction depending on color;
+    saturateVector(totalBlinn);
+
     // Ambient occlusion
     if ((*material).advancedTextureIds.z != TEXTURE_NONE)
-        (*closestColor) *= advancedAttributes.x;
+        (*closestColor) *= (*sample).ambientOcclusion;
 
     // Saturate color
     saturateVector(closestColor);
+}
+
+/*
+________________________________________________________________________________
+
+Primitive shader
+________________________________________________________________________________
+*/
+static float4 primitiveShader(const int index, const SceneInfo* sceneInfo, CONST BoundingBox* boundingBoxes,
+                              const int nbActiveBoxes, CONST CompactPrimitive* primitives, const int nbActivePrimitives,
+                              CONST LightInformation* lightInformation, const int lightInformationSize,
+                              CONST Material* materials, CONST BitmapBuffer* textures, CONST RandomBuffer* randoms,
+                              const float4 origin, float4* normal, const int objectId, const int instanceId,
+                              float4* intersection, const float4 areas, float4* closestColor, const int iteration,
+                              float4* refractionFromColor, float* shadowIntensity, float4* totalBlinn,
+                              float4* attributes, const float coneWidth)
+{
+    // Lamp Impact
+    (*shadowIntensity) = 0.f;
 
+    ShadingSample sample;
+    if (!prepareShading(index, sceneInfo, primitives, nbActivePrimitives, lightInformation, lightInformationSize,
+                        materials, textures, randoms, origin, normal, objectId, instanceId, intersection, areas,
+                        iteration, attributes, coneWidth, &sample))
+        return sample.intersectionColor;
+
+    float4 shadowColor = {0.f, 0.f, 0.f, 0.f};
+    if (sample.shadows)
+        (*shadowIntensity) = processShadows(sceneInfo, boundingBoxes, nbActiveBoxes, primitives, materials, textures,
+                                            nbActivePrimitives, sample.lampCenter, (*intersection),
+                                            lightInformation[sample.lamp].primitiveId, iteration, &shadowColor);
+
+    completeShading(index, sceneInfo, lightInformation, materials, randoms, &sample, (*shadowIntensity), shadowColor,
+                    (*normal), (*intersection), closestColor, refractionFromColor, totalBlinn);
     return (*closestColor);
 }
 
@@ -1800,11 +2756,12 @@ Intersections with primitives
 ________________________________________________________________________________
 */
 inline bool intersectionWithPrimitives(const SceneInfo* sceneInfo, CONST BoundingBox* boundingBoxes,
-                                       const int nbActiveBoxes, CONST Primitive* primitives,
+                                       const int nbActiveBoxes, CONST CompactPrimitive* primitives,
                                        const int nbActivePrimitives, CONST Material* materials,
                                        CONST BitmapBuffer* textures, const Ray* ray, const int iteration,
-                                       int* closestPrimitive, float4* closestIntersection, float4* closestNormal,
-                                       float4* closestAreas, float4* colorBox, const int currentMaterialId)
+                                       int* closestPrimitive, int* closestInstance, float4* closestIntersection,
+                                       float4* closestNormal, float4* closestAreas, float4* colorBox,
+                                       const int currentMaterialId)
 {
     bool intersections = false;
     float minDistance = (iteration < 2) ? (*sceneInfo).viewDistance : (*sceneInfo).viewDistance / (iteration + 1);
@@ -1818,84 +2775,110 @@ inline bool intersectionWithPrimitives(const SceneInfo* sceneInfo, CONST Boundin
     float4 normal; // = {0.f, 0.f, 0.f, 0.f};
     bool i = false;
     float shadowIntensity = 0.f;
+    bool closestTriangle = false;
 
-    int cptBoxes = 0;
-    while (cptBoxes < nbActiveBoxes)
-    {
-        CONST BoundingBox* box = &boundingBoxes[cptBoxes];
-        if (boxIntersection(box, &r, 0.f, minDistance))
+    BVH_LEAVES_BEGIN(boundingBoxes, nbActiveBoxes, &r, 0.f, minDistance, true, firstPrimitive, nbBoxPrimitives)
+        // Intersection with Box
+        if ((*sceneInfo).renderBoxes == 0)
         {
-            // Intersection with Box
-            if ((*sceneInfo).renderBoxes == 0)
+            // Intersection with primitive within boxes
+            for (int cptPrimitives = 0; cptPrimitives < nbBoxPrimitives; ++cptPrimitives)
             {
-                // Intersection with primitive within boxes
-                for (int cptPrimitives = 0; cptPrimitives < (*box).nbPrimitives; ++cptPrimitives)
+                CONST CompactPrimitive* compactPrimitive = &primitives[firstPrimitive + cptPrimitives];
+                CONST Material* material = &materials[(*compactPrimitive).materialId];
+                int hitPrimitive = firstPrimitive + cptPrimitives;
+                const bool condition =
+                    (*compactPrimitive).type == ptInstance ||
+                    (*material).attributes.x == 0 ||
+                    ((*material).attributes.x == 1 &&
+                     currentMaterialId != (*compactPrimitive).materialId);
+                float distance;
+                if (condition && // !!!! TEST SHALL BE REMOVED TO INCREASE TRANSPARENCY QUALITY !!!
+                    compactIntersection(sceneInfo, compactPrimitive, &r, &distance) && distance < minDistance)
                 {
-                    CONST Primitive* primitive = &primitives[(*box).startIndex + cptPrimitives];
-                    CONST Material* material = &materials[(*primitive).materialId];
-                    const bool condition =
-                        (*material).attributes.x == 0 ||
-                        ((*material).attributes.x == 1 &&
-                         currentMaterialId != (*primitive).materialId);
-                    if (condition) // !!!! TEST SHALL BE REMOVED TO INCREASE TRANSPARENCY QUALITY !!!
+                    float4 areas = {0.f, 0.f, 0.f, 0.f};
+                    if (compactTriangle(sceneInfo, compactPrimitive))
                     {
-                        float4 areas = {0.f, 0.f, 0.f, 0.f};
-                        i = false;
-                        if ((*sceneInfo).extendedGeometry)
+                        // The shading data of triangles is only read for culling, and for the closest one
+                        i = distance > (*sceneInfo).geometryEpsilon;
+                        if (i && (*sceneInfo).doubleSidedTriangles)
                         {
-                            switch ((*primitive).type)
-                            {
-                            case ptEnvironment:
-                            case ptSphere:
-                                i = sphereIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                       &shadowIntensity);
-                                break;
-                            case ptCylinder:
-                                i = cylinderIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                         &shadowIntensity);
-                                break;
-                            case ptEllipsoid:
-                                i = ellipsoidIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                          &shadowIntensity);
-                                break;
-                            case ptTriangle:
-                                i = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                         &shadowIntensity, false);
-                                break;
-                            default:
-                                i = planeIntersection(sceneInfo, primitive, materials, textures, &r, &intersection,
-                                                      &normal, &shadowIntensity, false);
-                                break;
-                            }
+                            Primitive triangle;
+                            loadPrimitive(primitives, nbActivePrimitives, hitPrimitive, &triangle);
+                            triangleHit(&triangle, &r, distance / length(r.direction), &intersection, &normal,
+                                        &areas);
+                            i = triangleFacing(sceneInfo, &r, false, &normal);
                         }
-                        else
-                            i = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                     &shadowIntensity, false);
-
-                        const float distance = length(intersection - r.origin);
-                        const bool condition =
-                            i &&
-                            distance > (*sceneInfo).geometryEpsilon &&
-                            distance < minDistance;
-                        if (condition)
+                        if (i)
                         {
-                            // Only keep intersection with the closest object
                             minDistance = distance;
-                            (*closestPrimitive) = (*box).startIndex + cptPrimitives;
-                            (*closestIntersection) = intersection;
-                            (*closestNormal) = normal;
-                            (*closestAreas) = areas;
+                            (*closestPrimitive) = hitPrimitive;
+                            (*closestInstance) = -1;
+                            closestTriangle = true;
                             intersections = true;
                         }
+                        continue;
+                    }
+
+                    // Other primitives closer than the current intersection are fully intersected
+                    Primitive primitive;
+                    loadPrimitive(primitives, nbActivePrimitives, hitPrimitive, &primitive);
+                    i = false;
+                    switch (primitive.type)
+                    {
+                    case ptInstance:
+                        i = instanceIntersection(sceneInfo, boundingBoxes, primitives, nbActivePrimitives, materials,
+                                                 textures, &primitive, &r, minDistance, currentMaterialId, -1, false,
+                                                 &hitPrimitive, &intersection, &normal, &areas, &shadowIntensity);
+                        break;
+                    case ptEnvironment:
+                    case ptSphere:
+                        i = sphereIntersection(sceneInfo, &primitive, materials, &r, &intersection, &normal,
+                                               &shadowIntensity);
+                        break;
+                    case ptCylinder:
+                        i = cylinderIntersection(sceneInfo, &primitive, &r, &intersection, &normal, &shadowIntensity);
+                        break;
+                    case ptEllipsoid:
+                        i = ellipsoidIntersection(sceneInfo, &primitive, &r, &intersection, &normal, &shadowIntensity);
+                        break;
+                    default:
+                        i = planeIntersection(sceneInfo, &primitive, materials, textures, &r, &intersection, &normal,
+                                              &shadowIntensity, false);
+                        break;
+                    }
+
+                    distance = length(intersection - r.origin);
+                    const bool condition =
+                        i &&
+                        distance > (*sceneInfo).geometryEpsilon &&
+                        distance < minDistance;
+                    if (condition)
+                    {
+                        // Only keep intersection with the closest object
+                        minDistance = distance;
+                        (*closestPrimitive) = hitPrimitive;
+                        (*closestInstance) = (primitive.type == ptInstance) ? firstPrimitive + cptPrimitives : -1;
+                        (*closestIntersection) = intersection;
+                        (*closestNormal) = normal;
+                        (*closestAreas) = areas;
+                        closestTriangle = false;
+                        intersections = true;
                     }
                 }
             }
-            else
-                (*colorBox) += materials[(*box).startIndex % NB_MAX_MATERIALS].color / 50.f;
-            ++cptBoxes;
         }
         else
-            cptBoxes += (*box).indexForNextBox.x;
+            (*colorBox) += materials[firstPrimitive % NB_MAX_MATERIALS].color / 50.f;
+    BVH_LEAVES_END(minDistance, true)
+
+    if (closestTriangle)
+    {
+        Primitive triangle;
+        loadPrimitive(primitives, nbActivePrimitives, (*closestPrimitive), &triangle);
+        triangleHit(&triangle, &r, minDistance / length(r.direction), closestIntersection, closestNormal,
+                    closestAreas);
+        triangleFacing(sceneInfo, &r, false, closestNormal);
     }
     return intersections;
 }
@@ -1907,12 +2890,10 @@ Intersections with primitives
 ________________________________________________________________________________
 */
 inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* sceneInfo, CONST BoundingBox* boundingBoxes,
-                                          const int nbActiveBoxes, CONST Primitive* primitives,
+                                          const int nbActiveBoxes, CONST CompactPrimitive* primitives,
                                           const int nbActivePrimitives, CONST Material* materials,
                                           CONST BitmapBuffer* textures, CONST LightInformation* lightInformation,
-                                          const int lightInformationSize, const int nbActiveLamps,
-                                          CONST RandomBuffer* randoms, const PostProcessingInfo* postProcessingInfo,
-                                          const Ray* ray)
+                                          const int lightInformationSize, CONST RandomBuffer* randoms, const Ray* ray)
 {
     Ray r;
     r.origin = (*ray).origin;
@@ -1935,102 +2916,101 @@ inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* scen
     // bool normals[MAXDEPTH];
     // memset(&normals[0],0,sizeof(bool)*MAXDEPTH);
 
-    int cptBoxes = 0;
-    while (cptBoxes < nbActiveBoxes)
-    {
-        CONST BoundingBox* box = &boundingBoxes[cptBoxes];
-        if (boxIntersection(box, &r, 0.f, (*sceneInfo).viewDistance))
+    BVH_LEAVES_BEGIN(boundingBoxes, nbActiveBoxes, &r, 0.f, (*sceneInfo).viewDistance, true, firstPrimitive,
+                     nbBoxPrimitives)
+        // Intersection with primitive within boxes
+        for (int cptPrimitives = 0; cptPrimitives < nbBoxPrimitives; ++cptPrimitives)
         {
-            // Intersection with primitive within boxes
-            for (int cptPrimitives = 0; cptPrimitives < (*box).nbPrimitives; ++cptPrimitives)
+            i = false;
+            Primitive p;
+            loadPrimitive(primitives, nbActivePrimitives, firstPrimitive + cptPrimitives, &p);
+            const Primitive* primitive = &p;
+            CONST Material* material = &materials[(*primitive).materialId];
+            float4 areas = {0.f, 0.f, 0.f, 0.f};
+            if ((*primitive).type == ptInstance)
             {
-                i = false;
-                CONST Primitive* primitive = &primitives[(*box).startIndex + cptPrimitives];
-                CONST Material* material = &materials[(*primitive).materialId];
-                float4 areas = {0.f, 0.f, 0.f, 0.f};
-                if ((*sceneInfo).extendedGeometry)
-                {
-                    switch ((*primitive).type)
-                    {
-                    case ptEnvironment:
-                    case ptSphere:
-                        i = sphereIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                               &shadowIntensity);
-                        break;
-                    case ptCylinder:
-                        i = cylinderIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                 &shadowIntensity);
-                        break;
-                    case ptEllipsoid:
-                        i = ellipsoidIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
-                                                  &shadowIntensity);
-                        break;
-                    case ptTriangle:
-                        i = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
-                                                 &shadowIntensity, false);
-                        break;
-                    default:
-                        i = planeIntersection(sceneInfo, primitive, materials, textures, &r, &intersection, &normal,
-                                              &shadowIntensity, false);
-                        break;
-                    }
-                }
-                else
+                int hitPrimitive;
+                i = instanceIntersection(sceneInfo, boundingBoxes, primitives, nbActivePrimitives, materials,
+                                         textures, primitive, &r, (*sceneInfo).viewDistance, -1, -1, false,
+                                         &hitPrimitive, &intersection, &normal, &areas, &shadowIntensity);
+                if (i)
+                    material = &materials[hitMaterialId(primitives, nbActivePrimitives, hitPrimitive)];
+            }
+            else if ((*sceneInfo).extendedGeometry)
+            {
+                switch ((*primitive).type)
                 {
-                    i = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas, &shadowIntensity,
-                                             false);
+                case ptEnvironment:
+                case ptSphere:
+                    i = sphereIntersection(sceneInfo, primitive, materials, &r, &intersection, &normal,
+                                           &shadowIntensity);
+                    break;
+                case ptCylinder:
+                    i = cylinderIntersection(sceneInfo, primitive, &r, &intersection, &normal, &shadowIntensity);
+                    break;
+                case ptEllipsoid:
+                    i = ellipsoidIntersection(sceneInfo, primitive, &r, &intersection, &normal, &shadowIntensity);
+                    break;
+                case ptTriangle:
+                    i = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas,
+                                             &shadowIntensity, false);
+                    break;
+                default:
+                    i = planeIntersection(sceneInfo, primitive, materials, textures, &r, &intersection, &normal,
+                                          &shadowIntensity, false);
+                    break;
                 }
-                if (i)
+            }
+            else
+            {
+                i = triangleIntersection(sceneInfo, primitive, &r, &intersection, &normal, &areas, &shadowIntensity,
+                                         false);
+            }
+            if (i)
+            {
+                float dist = length(intersection - r.origin);
+                // if( dist>(*postProcessingInfo).param1 )
                 {
-                    float dist = length(intersection - r.origin);
-                    // if( dist>(*postProcessingInfo).param1 )
+                    float4 color = (*material).color;
+                    if (false && (*sceneInfo).graphicsLevel != glNoShading)
                     {
-                        float4 color = (*material).color;
-                        if (false && (*sceneInfo).graphicsLevel != glNoShading)
-                        {
-                            color *= (1.f - (*material).transparency);
-                            float4 attributes;
-                            attributes.x = (*material).reflection;
-                            attributes.y = (*material).transparency;
-                            attributes.z = (*material).refraction;
-                            attributes.w = (*material).opacity;
-                            float4 rBlinn = {0.f, 0.f, 0.f, 0.f};
-                            float4 refractionFromColor;
-                            float4 closestColor = (*material).color;
-                            shadowIntensity = 0.f;
-                            color =
-                                primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
-                                                primitives, nbActivePrimitives, lightInformation, lightInformationSize,
-                                                nbActiveLamps, materials, textures, randoms, r.origin, &normal,
-                                                (*box).startIndex + cptPrimitives, &intersection, areas, &closestColor,
-                                                0, &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
-                        }
-                        for (int i = 0; i < MAXDEPTH; ++i)
+                        color *= (1.f - (*material).transparency);
+                        float4 attributes;
+                        attributes.x = (*material).reflection;
+                        attributes.y = (*material).transparency;
+                        attributes.z = (*material).refraction;
+                        attributes.w = (*material).opacity;
+                        float4 rBlinn = {0.f, 0.f, 0.f, 0.f};
+                        float4 refractionFromColor;
+                        float4 closestColor = (*material).color;
+                        shadowIntensity = 0.f;
+                        color =
+                            primitiveShader(index, sceneInfo, boundingBoxes, nbActiveBoxes, primitives,
+                                            nbActivePrimitives, lightInformation, lightInformationSize, materials,
+                                            textures, randoms, r.origin, &normal,
+                                            firstPrimitive + cptPrimitives, -1, &intersection, areas, &closestColor,
+                                            0, &refractionFromColor, &shadowIntensity, &rBlinn, &attributes, 0.f);
+                    }
+                    for (int i = 0; i < MAXDEPTH; ++i)
+                    {
+                        if (dist < colors[i].w)
                         {
-                            if (dist < colors[i].w)
+                            for (int j = MAXDEPTH - 1; j >= i; --j)
                             {
-                                for (int j = MAXDEPTH - 1; j >= i; --j)
-                                {
-                                    colors[j + 1] = colors[j];
-                                    // normals[j+1]=normals[j];
-                                    // float a=dot(normalize(r.direction-r.origin),normal);
-                                    colors[j] = color; // *(fabs(a));
-                                    colors[j].w = dist;
-                                    // normals[j] = (a>=0.f);
-                                }
-                                break;
+                                colors[j + 1] = colors[j];
+                                // normals[j+1]=normals[j];
+                                // float a=dot(normalize(r.direction-r.origin),normal);
+                                colors[j] = color; // *(fabs(a));
+                                colors[j].w = dist;
+                                // normals[j] = (a>=0.f);
                             }
+                            break;
                         }
                     }
                 }
             }
-            ++cptBoxes;
-        }
-        else
-        {
-            cptBoxes += (*box).indexForNextBox.x;
         }
-    }
+    BVH_LEAVES_END((*sceneInfo).viewDistance, true)
 
     float4 color = (*sceneInfo).backgroundColor;
 
@@ -2071,11 +3051,10 @@ inline float4 intersectionsWithPrimitives(const int index, const SceneInfo* scen
 }
 
 inline float4 launchVolumeRendering(const int index, CONST BoundingBox* boundingBoxes, const int nbActiveBoxes,
-                                    CONST Primitive* primitives, const int nbActivePrimitives,
+                                    CONST CompactPrimitive* primitives, const int nbActivePrimitives,
                                     CONST LightInformation* lightInformation, const int lightInformationSize,
-                                    const int nbActiveLamps, CONST Material* materials, CONST BitmapBuffer* textures,
+                                    CONST Material* materials, CONST BitmapBuffer* textures,
                                     CONST RandomBuffer* randoms, const Ray* ray, const SceneInfo* sceneInfo,
-                                    const PostProcessingInfo* postProcessingInfo, float* depthOfField,
                                     CONST PrimitiveXYIdBuffer* primitiveXYId)
 {
     (*primitiveXYId).x = -1;
@@ -2083,14 +3062,37 @@ inline float4 launchVolumeRendering(const int index, CONST BoundingBox* bounding
     (*primitiveXYId).z = 0;
     float4 intersectionColor =
         intersectionsWithPrimitives(index, sceneInfo, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                    materials, textures, lightInformation, lightInformationSize, nbActiveLamps, randoms,
-                                    postProcessingInfo, ray);
+                                    materials, textures, lightInformation, lightInformationSize, randoms, ray);
     return intersectionColor;
 }
 
 /*
 ________________________________________________________________________________
 
+Background shader
+Color of the rays that do not intersect any primitive
+________________________________________________________________________________
+*/
+static float4 backgroundShader(const SceneInfo* sceneInfo, CONST Material* materials, CONST BitmapBuffer* textures,
+                               const Ray* ray)
+{
+    if ((*sceneInfo).skyboxMaterialId != MATERIAL_NONE)
+        return skyboxMapping(sceneInfo, materials, textures, ray);
+
+    if ((*sceneInfo).extendedGeometry == 2)
+    {
+        float4 normal = {0.f, 1.f, 0.f, 0.f};
+        float4 dir = normalize((*ray).direction - (*ray).origin);
+        float angle = 0.5f - dot(normal, dir);
+        angle = (angle > 1.f) ? 1.f : angle;
+        return (1.f - angle) * (*sceneInfo).backgroundColor;
+    }
+    return (*sceneInfo).backgroundColor;
+}
+
+/*
+________________________________________________________________________________
+
 Calculate the reflected vector
 We now have to know the colour of this (*intersection)
 Color_from_object will compute the amount of light received by the
@@ -2102,11 +3104,10 @@ is > 0.
 ________________________________________________________________________________
 */
 inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes, const int nbActiveBoxes,
-                               CONST Primitive* primitives, const int nbActivePrimitives,
+                               CONST CompactPrimitive* primitives, const int nbActivePrimitives,
                                CONST LightInformation* lightInformation, const int lightInformationSize,
-                               const int nbActiveLamps, CONST Material* materials, CONST BitmapBuffer* textures,
-                               CONST RandomBuffer* randoms, const Ray* ray, const SceneInfo* sceneInfo,
-                               const PostProcessingInfo* postProcessingInfo, float* depthOfField,
+                               CONST Material* materials, CONST BitmapBuffer* textures, CONST RandomBuffer* randoms,
+                               const Ray* ray, const float coneSpread, const SceneInfo* sceneInfo, float* depthOfField,
                                CONST PrimitiveXYIdBuffer* primitiveXYId)
 {
     float4 intersectionColor = {0.f, 0.f, 0.f, 0.f};
@@ -2115,6 +3116,7 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
     float4 normal = {0.f, 0.f, 0.f, 0.f};
     float4 closestColor = {0.f, 0.f, 0.f, 0.f};
     int closestPrimitive = 0;
+    int closestInstance = -1;
     bool carryon = true;
     Ray rayOrigin = (*ray);
     float initialRefraction = 1.f;
@@ -2170,12 +3172,13 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
             carryon =
                 intersectionWithPrimitives(sceneInfo, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
                                            materials, textures, &rayOrigin, iteration, &closestPrimitive,
-                                           &closestIntersection, &normal, &areas, &colorBox, currentMaterialId);
+                                           &closestInstance, &closestIntersection, &normal, &areas, &colorBox,
+                                           currentMaterialId);
         }
 
         if (carryon)
         {
-            currentMaterialId = primitives[closestPrimitive].materialId;
+            currentMaterialId = hitMaterialId(primitives, nbActivePrimitives, closestPrimitive);
 
             if (iteration == 0)
             {
@@ -2205,22 +3208,24 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
                 }
 
                 // Primitive ID for current pixel
-                (*primitiveXYId).x = primitives[closestPrimitive].index;
+                (*primitiveXYId).x = hitIndex(primitives, nbActivePrimitives, closestPrimitive);
             }
 
             float4 attributes;
-            attributes.x = materials[primitives[closestPrimitive].materialId].reflection;
-            attributes.y = materials[primitives[closestPrimitive].materialId].transparency;
-            attributes.z = materials[primitives[closestPrimitive].materialId].refraction;
-            attributes.w = materials[primitives[closestPrimitive].materialId].opacity;
+            attributes.x = materials[currentMaterialId].reflection;
+            attributes.y = materials[currentMaterialId].transparency;
+            attributes.z = materials[currentMaterialId].refraction;
+            attributes.w = materials[currentMaterialId].opacity;
 
             // Get object color
             rBlinn.w = attributes.y;
-            colors[iteration] = primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
-                                                primitives, nbActivePrimitives, lightInformation, lightInformationSize,
-                                                nbActiveLamps, materials, textures, randoms, rayOrigin.origin, &normal,
-                                                closestPrimitive, &closestIntersection, areas, &closestColor, iteration,
-                                                &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
+            const float coneWidth = coneSpread * (rayLength + length(closestIntersection - rayOrigin.origin));
+            colors[iteration] = primitiveShader(index, sceneInfo, boundingBoxes, nbActiveBoxes, primitives,
+                                                nbActivePrimitives, lightInformation, lightInformationSize, materials,
+                                                textures, randoms, rayOrigin.origin, &normal, closestPrimitive,
+                                                closestInstance, &closestIntersection, areas, &closestColor, iteration,
+                                                &refractionFromColor, &shadowIntensity, &rBlinn, &attributes,
+                                                coneWidth);
 
             // Primitive illumination
             float colorLight = colors[iteration].x + colors[iteration].y + colors[iteration].z;
@@ -2296,11 +3301,10 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
             rayOrigin.direction = closestIntersection + reflectedTarget;
 
             // Noise management
-            if ((*sceneInfo).pathTracingIteration != 0 &&
-                materials[primitives[closestPrimitive].materialId].color.w != 0.f)
+            if ((*sceneInfo).pathTracingIteration != 0 && materials[currentMaterialId].color.w != 0.f)
             {
                 // Randomize view
-                float ratio = materials[primitives[closestPrimitive].materialId].color.w;
+                float ratio = materials[currentMaterialId].color.w;
                 ratio *= (attributes.y == 0.f) ? 1000.f : 1.f;
                 int rindex = (index + (*sceneInfo).timestamp) % (MAX_BITMAP_SIZE - 3);
                 rayOrigin.direction.x += randoms[rindex] * ratio;
@@ -2311,21 +3315,7 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
         else
         {
             // Background
-            if ((*sceneInfo).skyboxMaterialId != MATERIAL_NONE)
-                colors[iteration] = skyboxMapping(sceneInfo, materials, textures, &rayOrigin);
-            else
-            {
-                if ((*sceneInfo).extendedGeometry == 2)
-                {
-                    float4 normal = {0.f, 1.f, 0.f, 0.f};
-                    float4 dir = normalize(rayOrigin.direction - rayOrigin.origin);
-                    float angle = 0.5f - dot(normal, dir);
-                    angle = (angle > 1.f) ? 1.f : angle;
-                    colors[iteration] = (1.f - angle) * (*sceneInfo).backgroundColor;
-                }
-                else
-                    colors[iteration] = (*sceneInfo).backgroundColor;
-            }
+            colors[iteration] = backgroundShader(sceneInfo, materials, textures, &rayOrigin);
             colorContributions[iteration] = 1.f;
         }
         iteration++;
@@ -2338,15 +3328,17 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
         // TODO: Dodgy implementation of reflections for transparent material
         if (intersectionWithPrimitives(sceneInfo, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
                                        materials, textures, &reflectedRay, reflectedRays, &closestPrimitive,
-                                       &closestIntersection, &normal, &areas, &colorBox, currentMaterialId))
+                                       &closestInstance, &closestIntersection, &normal, &areas, &colorBox,
+                                       currentMaterialId))
         {
             float4 attributes;
-            attributes.x = materials[primitives[closestPrimitive].materialId].reflection;
-            float4 color = primitiveShader(index, sceneInfo, postProcessingInfo, boundingBoxes, nbActiveBoxes,
-                                           primitives, nbActivePrimitives, lightInformation, lightInformationSize,
-                                           nbActiveLamps, materials, textures, randoms, reflectedRay.origin, &normal,
-                                           closestPrimitive, &closestIntersection, areas, &closestColor, iteration,
-                                           &refractionFromColor, &shadowIntensity, &rBlinn, &attributes);
+            attributes.x = materials[hitMaterialId(primitives, nbActivePrimitives, closestPrimitive)].reflection;
+            const float coneWidth = coneSpread * (rayLength + length(closestIntersection - reflectedRay.origin));
+            float4 color = primitiveShader(index, sceneInfo, boundingBoxes, nbActiveBoxes, primitives,
+                                           nbActivePrimitives, lightInformation, lightInformationSize, materials,
+                                           textures, randoms, reflectedRay.origin, &normal, closestPrimitive,
+                                           closestInstance, &closestIntersection, areas, &closestColor, iteration,
+                                           &refractionFromColor, &shadowIntensity, &rBlinn, &attributes, coneWidth);
             colors[reflectedRays] += color * reflectedRatio;
 
             (*primitiveXYId).w = shadowIntensity * 255;
@@ -2364,7 +3356,8 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
             // Global illumination
             if (intersectionWithPrimitives(sceneInfo, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
                                            materials, textures, &pathTracingRay, NB_MAX_ITERATIONS, &closestPrimitive,
-                                           &closestIntersection, &normal, &areas, &colorBox, MATERIAL_NONE))
+                                           &closestInstance, &closestIntersection, &normal, &areas, &colorBox,
+                                           MATERIAL_NONE))
             {
                 // if( (*sceneInfo).advancedIllumination==aiGlobalIllumination )
                 {
@@ -2398,91 +3391,341 @@ inline float4 launchRayTracing(const int index, CONST BoundingBox* boundingBoxes
             colors[0] += pathTracingColor * pathTracingRatio;
     }
 
-    if (test)
+    if (test)
+    {
+        for (int i = iteration - 2; i >= 0; --i)
+            colors[i] = colors[i] * (1.f - colorContributions[i]) + colors[i + 1] * colorContributions[i];
+        intersectionColor = colors[0];
+        intersectionColor += recursiveBlinn;
+    }
+    else
+        intersectionColor = colors[0];
+
+    float len = length(firstIntersection - (*ray).origin);
+    (*depthOfField) = len;
+    if (closestPrimitive != -1)
+    {
+        if (materials[hitMaterialId(primitives, nbActivePrimitives, closestPrimitive)].attributes.z == 1) // Wireframe
+            len = (*sceneInfo).viewDistance;
+    }
+
+    // --------------------------------------------------
+    // Background color
+    // --------------------------------------------------
+    float D1 = (*sceneInfo).viewDistance * 0.95f;
+    if ((*sceneInfo).atmosphericEffect == aeFog && len > D1)
+    {
+        float D2 = (*sceneInfo).viewDistance * 0.05f;
+        float a = len - D1;
+        float b = 1.f - (a / D2);
+        intersectionColor = intersectionColor * b + (*sceneInfo).backgroundColor * (1.f - b);
+    }
+
+    // Primitive information
+    (*primitiveXYId).y = iteration;
+
+    // Depth of field
+    intersectionColor -= colorBox;
+
+    saturateVector(&intersectionColor);
+    return intersectionColor;
+}
+
+/*
+________________________________________________________________________________
+
+Standard renderer
+________________________________________________________________________________
+*/
+__kernel void k_standardRenderer(const int2 occupancyParameters, int device_split, int stream_split,
+                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes,
+                                 CONST CompactPrimitive* primitives, int nbActivePrimitives,
+                                 CONST LightInformation* lightInformation, int lightInformationSize, int nbActiveLamps,
+                                 CONST Material* materials, CONST BitmapBuffer* textures, CONST RandomBuffer* randoms,
+                                 float4 origin, float4 direction, float4 angles, const SceneInfo sceneInfo,
+                                 const PostProcessingInfo postProcessingInfo,
+                                 CONST PostProcessingBuffer* postProcessingBuffer,
+                                 CONST PrimitiveXYIdBuffer* primitiveXYIds)
+{
+    // Part of the kernel interface
+    (void)nbActiveLamps;
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int index = (stream_split + y) * sceneInfo.size.x + x;
+    if (index > sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
+        return;
+
+    // Antialisazing
+    float2 AArotatedGrid[4] = {{3.f, 5.f}, {5.f, -3.f}, {-3.f, -5.f}, {-5.f, 3.f}};
+
+    // Beware out of bounds error!
+    // And only process pixels that need extra rendering
+    const bool condition =
+        index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
+        (sceneInfo.pathTracingIteration > primitiveXYIds[index].y && // Still need to process iterations
+         primitiveXYIds[index].w == 0 &&                             // Shadows? if so, compute soft shadows by randomizing light positions
+         sceneInfo.pathTracingIteration > 0 && sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS);
+    if (condition)
+        return;
+
+    Ray ray;
+    ray.origin = origin;
+    ray.direction = direction;
+
+
+    bool antialiasingActivated = (sceneInfo.cameraType == ctAntialiazed);
+
+    if (postProcessingInfo.type != ppe_depthOfField && sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS)
+    {
+        // Randomize view for natural depth of field
+        float a = postProcessingInfo.param1 / 20000.f;
+        int rindex = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 2);
+        ray.origin.x += randoms[rindex] * postProcessingBuffer[index].colorInfo.w * a;
+        ray.origin.y += randoms[rindex + 1] * postProcessingBuffer[index].colorInfo.w * a;
+    }
+
+    float dof = 0.f;
+
+    // Orthographic rays do not spread
+    float coneSpread = 0.f;
+    if (sceneInfo.cameraType == ctOrthographic)
+    {
+        ray.direction.x = ray.origin.z * 0.001f * (float)(x - (sceneInfo.size.x / 2));
+        ray.direction.y = -ray.origin.z * 0.001f * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+        ray.origin.x = ray.direction.x;
+        ray.origin.y = ray.direction.y;
+    }
+    else
+    {
+        float ratio = (float)sceneInfo.size.x / (float)sceneInfo.size.y;
+        float2 step;
+        step.x = ratio * angles.w / (float)sceneInfo.size.x;
+        step.y = angles.w / (float)sceneInfo.size.y;
+        ray.direction.x = ray.direction.x - step.x * (float)(x - (sceneInfo.size.x / 2));
+        ray.direction.y = ray.direction.y + step.y * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+        coneSpread = rayConeSpread(&ray, step.y);
+    }
+
+    vectorRotation(&ray.origin, angles);
+    vectorRotation(&ray.direction, angles);
+
+    float4 color = {0.f, 0.f, 0.f, 0.f};
+    Ray r = ray;
+    if (antialiasingActivated)
+    {
+        for (int I = 0; I < 4; ++I)
+        {
+            r.direction.x = ray.direction.x + AArotatedGrid[I].x;
+            r.direction.y = ray.direction.y + AArotatedGrid[I].y;
+            float4 c = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
+                                        lightInformation, lightInformationSize, materials, textures, randoms, &r,
+                                        coneSpread, &sceneInfo, &dof, &primitiveXYIds[index]);
+            color += c;
+        }
+    }
+    else
+    {
+        r.direction.x = ray.direction.x + AArotatedGrid[sceneInfo.pathTracingIteration % 4].x;
+        r.direction.y = ray.direction.y + AArotatedGrid[sceneInfo.pathTracingIteration % 4].y;
+    }
+    color += launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
+                              lightInformationSize, materials, textures, randoms, &r, coneSpread, &sceneInfo, &dof,
+                              &primitiveXYIds[index]);
+
+    if (sceneInfo.advancedIllumination == aiRandomIllumination)
+    {
+        // Randomize light intensity
+        int rindex = (index + sceneInfo.timestamp) % MAX_BITMAP_SIZE;
+        color += sceneInfo.backgroundColor * randoms[rindex] * 5.f;
+    }
+
+    if (antialiasingActivated)
+        color /= 5.f;
+
+    if (sceneInfo.pathTracingIteration == 0)
+        postProcessingBuffer[index].colorInfo.w = dof;
+
+    if (sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
+    {
+        postProcessingBuffer[index].colorInfo.x = color.x;
+        postProcessingBuffer[index].colorInfo.y = color.y;
+        postProcessingBuffer[index].colorInfo.z = color.z;
+    }
+    else
+    {
+        postProcessingBuffer[index].colorInfo.x += color.x;
+        postProcessingBuffer[index].colorInfo.y += color.y;
+        postProcessingBuffer[index].colorInfo.z += color.z;
+    }
+}
+
+/*
+________________________________________________________________________________
+
+Wavefront rendering
+Appends a path to one of the queues of the wavefront pipeline
+________________________________________________________________________________
+*/
+static void wavefrontEnqueue(CONST int* queues, CONST int* counters, const int queue, const int nbPaths,
+                             const int path)
+{
+    const int position = atomic_inc(&counters[queue]);
+    queues[queue * nbPaths + position] = path;
+}
+
+/*
+________________________________________________________________________________
+
+Wavefront rendering
+Completes the shading of the closest intersection of a path, once the shadow
+ray has been cast if one was needed, and adds the resulting color to the path
+________________________________________________________________________________
+*/
+static void wavefrontComplete(const int index, const SceneInfo* sceneInfo, CONST LightInformation* lightInformation,
+                              CONST Material* materials, CONST RandomBuffer* randoms, CONST WavefrontPath* path,
+                              const float shadowIntensity, const float4 shadowColor,
+                              CONST PrimitiveXYIdBuffer* primitiveXYId)
+{
+    const ShadingSample sample = (*path).shading;
+    float4 color = sample.intersectionColor;
+    float4 blinn = (*path).blinn;
+    if (!sample.constantColor)
+    {
+        float4 closestColor = (*path).closestColor;
+        float4 refractionFromColor;
+        completeShading(index, sceneInfo, lightInformation, materials, randoms, &sample, shadowIntensity, shadowColor,
+                        (*path).normal, (*path).intersection, &closestColor, &refractionFromColor, &blinn);
+        (*path).closestColor = closestColor;
+        color = closestColor;
+    }
+
+    if ((*path).shadedIteration == -1)
     {
-        for (int i = iteration - 2; i >= 0; --i)
-            colors[i] = colors[i] * (1.f - colorContributions[i]) + colors[i + 1] * colorContributions[i];
-        intersectionColor = colors[0];
-        intersectionColor += recursiveBlinn;
+        // Reflection of a transparent material
+        (*primitiveXYId).w = shadowIntensity * 255;
     }
     else
-        intersectionColor = colors[0];
-
-    float len = length(firstIntersection - (*ray).origin);
-    (*depthOfField) = len;
-    if (closestPrimitive != -1)
     {
-        CONST Primitive* primitive = &primitives[closestPrimitive];
-        if (materials[(*primitive).materialId].attributes.z == 1) // Wireframe
-            len = (*sceneInfo).viewDistance;
+        // Primitive illumination
+        float colorLight = color.x + color.y + color.z;
+        (*primitiveXYId).z += (colorLight > (*sceneInfo).transparentColor) ? 16 : 0;
+
+        // Opacity
+        color.x -= (*path).opacity;
+        color.y -= (*path).opacity;
+        color.z -= (*path).opacity;
+
+        // Contribute to final color
+        blinn /= ((*path).shadedIteration + 1);
+        (*path).recursiveBlinn.x = (blinn.x > (*path).recursiveBlinn.x) ? blinn.x : (*path).recursiveBlinn.x;
+        (*path).recursiveBlinn.y = (blinn.y > (*path).recursiveBlinn.y) ? blinn.y : (*path).recursiveBlinn.y;
+        (*path).recursiveBlinn.z = (blinn.z > (*path).recursiveBlinn.z) ? blinn.z : (*path).recursiveBlinn.z;
     }
+    (*path).blinn = blinn;
+    (*path).color += color * (*path).colorWeight;
+}
 
-    // --------------------------------------------------
-    // Background color
-    // --------------------------------------------------
-    float D1 = (*sceneInfo).viewDistance * 0.95f;
-    if ((*sceneInfo).atmosphericEffect == aeFog && len > D1)
+/*
+________________________________________________________________________________
+
+Wavefront rendering
+Moves a path to its next stage once the current one is over: the reflection of
+the first transparent and reflective material, then global illumination
+________________________________________________________________________________
+*/
+static void wavefrontNextStage(const SceneInfo* sceneInfo, CONST Material* materials, CONST BitmapBuffer* textures,
+                               CONST WavefrontPath* path, CONST PrimitiveXYIdBuffer* primitiveXYId,
+                               CONST int* queues, CONST int* counters, const int queue, const int nbPaths,
+                               const int p)
+{
+    if ((*path).stage == wsPrimary)
     {
-        float D2 = (*sceneInfo).viewDistance * 0.05f;
-        float a = len - D1;
-        float b = 1.f - (a / D2);
-        intersectionColor = intersectionColor * b + (*sceneInfo).backgroundColor * (1.f - b);
-    }
+        // Primitive information
+        (*primitiveXYId).y = (*path).iteration;
 
-    // Primitive information
-    (*primitiveXYId).y = iteration;
+        if ((*sceneInfo).graphicsLevel >= glReflectionsAndRefractions && (*path).reflectedRays != -1)
+        {
+            (*path).stage = wsReflection;
+            wavefrontEnqueue(queues, counters, queue, nbPaths, p);
+            return;
+        }
+    }
 
-    // Depth of field
-    intersectionColor -= colorBox;
+    // The global illumination ray is cast from the first intersection
+    const bool condition =
+        (*path).stage != wsPathTracing && (*path).currentMaterialId != -2 &&
+        ((*sceneInfo).advancedIllumination == aiBasic || (*sceneInfo).advancedIllumination == aiFull) &&
+        (*sceneInfo).pathTracingIteration >= NB_MAX_ITERATIONS;
+    if (condition)
+    {
+        if ((*sceneInfo).advancedIllumination == aiFull)
+        {
+            (*path).stage = wsPathTracing;
+            wavefrontEnqueue(queues, counters, queue, nbPaths, p);
+            return;
+        }
 
-    saturateVector(&intersectionColor);
-    return intersectionColor;
+        // Background
+        if ((*sceneInfo).skyboxMaterialId != MATERIAL_NONE)
+        {
+            const Ray pathTracingRay = (*path).pathTracingRay;
+            (*path).color += skyboxMapping(sceneInfo, materials, textures, &pathTracingRay) *
+                             (*path).pathTracingRatio * 0.5f * (*path).firstWeight;
+        }
+    }
+    (*path).stage = wsDone;
 }
 
 /*
 ________________________________________________________________________________
 
-Standard renderer
+Wavefront rendering: generation stage
+Computes the primary rays of the pixels of the current band, and initializes
+their paths. The antialiasing samples of a pixel are generated one after the
+other, in the same path
 ________________________________________________________________________________
 */
-__kernel void k_standardRenderer(const int2 occupancyParameters, int device_split, int stream_split,
-                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
-                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
-                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
-                                 float4 direction, float4 angles, const SceneInfo sceneInfo,
-                                 const PostProcessingInfo postProcessingInfo,
-                                 CONST PostProcessingBuffer* postProcessingBuffer,
-                                 CONST PrimitiveXYIdBuffer* primitiveXYIds)
+__kernel void k_wavefrontGenerate(const int2 occupancyParameters, const int offset, const int nbPaths,
+                                  const int sample, CONST RandomBuffer* randoms, float4 origin, float4 direction,
+                                  float4 angles, const SceneInfo sceneInfo, const PostProcessingInfo postProcessingInfo,
+                                  CONST PostProcessingBuffer* postProcessingBuffer,
+                                  CONST PrimitiveXYIdBuffer* primitiveXYIds, CONST WavefrontPath* paths,
+                                  CONST int* queues, CONST int* counters)
 {
-    int x = get_global_id(0);
-    int y = get_global_id(1);
-    int index = (stream_split + y) * sceneInfo.size.x + x;
-    if (index > sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x)
+    const int p = get_global_id(0);
+    if (p >= nbPaths)
+        return;
+
+    const int index = offset + p;
+    CONST WavefrontPath* path = &paths[p];
+    if (sample == 0)
+    {
+        // Beware out of bounds error!
+        // And only process pixels that need extra rendering
+        const bool condition =
+            index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
+            (sceneInfo.pathTracingIteration > primitiveXYIds[index].y && // Still need to process iterations
+             primitiveXYIds[index].w == 0 && // Shadows? if so, compute soft shadows by randomizing light positions
+             sceneInfo.pathTracingIteration > 0 && sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS);
+        (*path).active = !condition;
+        const float4 black = {0.f, 0.f, 0.f, 0.f};
+        (*path).sampleColor = black;
+    }
+    (*path).stage = wsDone;
+    if (!(*path).active)
         return;
 
+    const int x = index % sceneInfo.size.x;
+    const int y = index / sceneInfo.size.x;
+
     // Antialisazing
     float2 AArotatedGrid[4] = {{3.f, 5.f}, {5.f, -3.f}, {-3.f, -5.f}, {-5.f, 3.f}};
 
-    // Beware out of bounds error!
-    // And only process pixels that need extra rendering
-    const bool condition =
-        index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
-        (sceneInfo.pathTracingIteration > primitiveXYIds[index].y && // Still need to process iterations
-         primitiveXYIds[index].w == 0 &&                             // Shadows? if so, compute soft shadows by randomizing light positions
-         sceneInfo.pathTracingIteration > 0 && sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS);
-    if (condition)
-        return;
-
     Ray ray;
     ray.origin = origin;
     ray.direction = direction;
 
-    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
-        rotationCenter = origin;
-
-    bool antialiasingActivated = (sceneInfo.cameraType == ctAntialiazed);
 
     if (postProcessingInfo.type != ppe_depthOfField && sceneInfo.pathTracingIteration >= NB_MAX_ITERATIONS)
     {
@@ -2493,12 +3736,12 @@ __kernel void k_standardRenderer(const int2 occupancyParameters, int device_spli
         ray.origin.y += randoms[rindex + 1] * postProcessingBuffer[index].colorInfo.w * a;
     }
 
-    float dof = 0.f;
-
+    // Orthographic rays do not spread
+    float coneSpread = 0.f;
     if (sceneInfo.cameraType == ctOrthographic)
     {
         ray.direction.x = ray.origin.z * 0.001f * (float)(x - (sceneInfo.size.x / 2));
-        ray.direction.y = -ray.origin.z * 0.001f * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+        ray.direction.y = -ray.origin.z * 0.001f * (float)(y - (sceneInfo.size.y / 2));
         ray.origin.x = ray.direction.x;
         ray.origin.y = ray.direction.y;
     }
@@ -2509,34 +3752,473 @@ __kernel void k_standardRenderer(const int2 occupancyParameters, int device_spli
         step.x = ratio * angles.w / (float)sceneInfo.size.x;
         step.y = angles.w / (float)sceneInfo.size.y;
         ray.direction.x = ray.direction.x - step.x * (float)(x - (sceneInfo.size.x / 2));
-        ray.direction.y = ray.direction.y + step.y * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+        ray.direction.y = ray.direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
+        coneSpread = rayConeSpread(&ray, step.y);
     }
 
-    vectorRotation(&ray.origin, rotationCenter, angles);
-    vectorRotation(&ray.direction, rotationCenter, angles);
+    vectorRotation(&ray.origin, angles);
+    vectorRotation(&ray.direction, angles);
+
+    // As in the standard renderer, the last antialiasing sample reuses the
+    // offset of the previous one
+    const int grid = (sceneInfo.cameraType == ctAntialiazed) ? min(sample, 3) : sceneInfo.pathTracingIteration % 4;
+    ray.direction.x += AArotatedGrid[grid].x;
+    ray.direction.y += AArotatedGrid[grid].y;
+
+    const float4 zero = {0.f, 0.f, 0.f, 0.f};
+    (*path).ray = ray;
+    (*path).latestIntersection = ray.origin;
+    (*path).closestColor = zero;
+    (*path).blinn = zero;
+    (*path).recursiveBlinn = zero;
+    (*path).colorBox = zero;
+    (*path).color = zero;
+    (*path).weight = 1.f;
+    (*path).colorWeight = 0.f;
+    (*path).firstWeight = 0.f;
+    (*path).reflectedWeight = 0.f;
+    (*path).reflectedRatio = 0.f;
+    (*path).pathTracingRatio = 0.f;
+    (*path).initialRefraction = 1.f;
+    (*path).rayLength = 0.f;
+    (*path).opacity = 0.f;
+    (*path).depth = length(ray.origin);
+    (*path).coneSpread = coneSpread;
+    (*path).closestPrimitive = 0;
+    (*path).closestInstance = -1;
+    (*path).currentMaterialId = -2;
+    (*path).iteration = 0;
+    (*path).reflectedRays = -1;
+    (*path).shadedIteration = 0;
+    (*path).stage = wsPrimary;
+    (*path).hit = 0;
+
+    primitiveXYIds[index].x = -1;
+    primitiveXYIds[index].z = 0;
+
+    wavefrontEnqueue(queues, counters, 0, nbPaths, p);
+}
 
-    float4 color = {0.f, 0.f, 0.f, 0.f};
-    Ray r = ray;
-    if (antialiasingActivated)
+/*
+________________________________________________________________________________
+
+Wavefront rendering: extension stage
+Finds the closest intersection of the current ray of the queued paths
+________________________________________________________________________________
+*/
+__kernel void k_wavefrontExtend(const int nbPaths, const int queue, CONST BoundingBox* boundingBoxes,
+                                int nbActiveBoxes, CONST CompactPrimitive* primitives, int nbActivePrimitives,
+                                CONST Material* materials, CONST BitmapBuffer* textures, const SceneInfo sceneInfo,
+                                CONST WavefrontPath* paths, CONST int* queues, CONST int* counters)
+{
+    const int i = get_global_id(0);
+
+    // Queues filled by the shading stage that follows
+    if (i == 0)
     {
-        for (int I = 0; I < 4; ++I)
+        counters[1 - queue] = 0;
+        counters[WAVEFRONT_SHADOW_QUEUE] = 0;
+    }
+    if (i >= counters[queue])
+        return;
+
+    CONST WavefrontPath* path = &paths[queues[queue * nbPaths + i]];
+    Ray ray;
+    int iteration;
+    int currentMaterialId = (*path).currentMaterialId;
+    switch ((*path).stage)
+    {
+    case wsPrimary:
+        ray = (*path).ray;
+        iteration = (*path).iteration;
+        break;
+    case wsReflection:
+        ray = (*path).reflectedRay;
+        iteration = (*path).reflectedRays;
+        break;
+    default:
+        ray = (*path).pathTracingRay;
+        iteration = NB_MAX_ITERATIONS;
+        currentMaterialId = MATERIAL_NONE;
+        break;
+    }
+
+    int closestPrimitive = (*path).closestPrimitive;
+    int closestInstance = (*path).closestInstance;
+    float4 intersection;
+    float4 normal;
+    float4 areas = {0.f, 0.f, 0.f, 0.f};
+    float4 colorBox = (*path).colorBox;
+    const bool hit = intersectionWithPrimitives(&sceneInfo, boundingBoxes, nbActiveBoxes, primitives,
+                                                nbActivePrimitives, materials, textures, &ray, iteration,
+                                                &closestPrimitive, &closestInstance, &intersection, &normal, &areas,
+                                                &colorBox, currentMaterialId);
+    (*path).hit = hit;
+    (*path).colorBox = colorBox;
+    if (hit)
+    {
+        (*path).closestPrimitive = closestPrimitive;
+        (*path).closestInstance = closestInstance;
+        (*path).intersection = intersection;
+        (*path).normal = normal;
+        (*path).areas = areas;
+    }
+}
+
+/*
+________________________________________________________________________________
+
+Wavefront rendering: shading stage
+Shades the intersections found by the extension stage, and computes the next
+ray of the paths. Paths that still have a ray to trace are appended to the
+output queue, and those that need a shadow ray to the shadow queue. The shading
+of the other ones is completed right away
+________________________________________________________________________________
+*/
+__kernel void k_wavefrontShade(const int offset, const int nbPaths, const int queue, CONST CompactPrimitive* primitives,
+                               int nbActivePrimitives, CONST LightInformation* lightInformation,
+                               int lightInformationSize, CONST Material* materials, CONST BitmapBuffer* textures,
+                               CONST RandomBuffer* randoms, const SceneInfo sceneInfo,
+                               CONST PrimitiveXYIdBuffer* primitiveXYIds, CONST WavefrontPath* paths,
+                               CONST int* queues, CONST int* counters)
+{
+    const int i = get_global_id(0);
+    if (i >= counters[queue])
+        return;
+
+    const int p = queues[queue * nbPaths + i];
+    const int index = offset + p;
+    const int nextQueue = 1 - queue;
+    CONST WavefrontPath* path = &paths[p];
+    CONST PrimitiveXYIdBuffer* primitiveXYId = &primitiveXYIds[index];
+    const float4 zero = {0.f, 0.f, 0.f, 0.f};
+
+    if ((*path).stage == wsPathTracing)
+    {
+        // Global illumination
+        float4 pathTracingColor = zero;
+        float pathTracingRatio = (*path).pathTracingRatio;
+        if ((*path).hit)
         {
-            r.direction.x = ray.direction.x + AArotatedGrid[I].x;
-            r.direction.y = ray.direction.y + AArotatedGrid[I].y;
-            float4 c = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                        lightInformation, lightInformationSize, nbActiveLamps, materials, textures,
-                                        randoms, &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
-            color += c;
+            // Ambient occlusion
+            pathTracingColor.x = -1.f;
+            pathTracingColor.y = -1.f;
+            pathTracingColor.z = -1.f;
+            pathTracingRatio = 1.f;
+        }
+        else if (sceneInfo.skyboxMaterialId != MATERIAL_NONE)
+        {
+            // Background
+            const Ray pathTracingRay = (*path).pathTracingRay;
+            pathTracingColor = skyboxMapping(&sceneInfo, materials, textures, &pathTracingRay);
+            pathTracingRatio *= SKYBOX_LUNINANCE_STRENGTH;
+        }
+        (*path).color += pathTracingColor * pathTracingRatio * (*path).firstWeight;
+        (*path).stage = wsDone;
+        return;
+    }
+
+    if ((*path).stage == wsReflection)
+    {
+        // TODO: Dodgy implementation of reflections for transparent material
+        if ((*path).hit)
+        {
+            float4 attributes = zero;
+            const int materialId = hitMaterialId(primitives, nbActivePrimitives, (*path).closestPrimitive);
+            attributes.x = materials[materialId].reflection;
+            float4 intersection = (*path).intersection;
+            float4 normal = (*path).normal;
+            ShadingSample sample;
+            const float coneWidth =
+                (*path).coneSpread * ((*path).rayLength + length(intersection - (*path).reflectedRay.origin));
+            prepareShading(index, &sceneInfo, primitives, nbActivePrimitives, lightInformation, lightInformationSize,
+                           materials, textures, randoms, (*path).reflectedRay.origin, &normal,
+                           (*path).closestPrimitive, (*path).closestInstance, &intersection, (*path).areas,
+                           (*path).iteration, &attributes, coneWidth, &sample);
+            (*path).shading = sample;
+            (*path).intersection = intersection;
+            (*path).normal = normal;
+            (*path).shadedIteration = -1;
+            (*path).colorWeight = (*path).reflectedWeight * (*path).reflectedRatio;
+            (*path).opacity = 0.f;
+            if (sample.shadows)
+                wavefrontEnqueue(queues, counters, WAVEFRONT_SHADOW_QUEUE, nbPaths, p);
+            else
+                wavefrontComplete(index, &sceneInfo, lightInformation, materials, randoms, path, 0.f, zero,
+                                  primitiveXYId);
+        }
+        wavefrontNextStage(&sceneInfo, materials, textures, path, primitiveXYId, queues, counters, nextQueue, nbPaths,
+                           p);
+        return;
+    }
+
+    const int iteration = (*path).iteration;
+    (*path).iteration = iteration + 1;
+    if (!(*path).hit)
+    {
+        // Background
+        const Ray ray = (*path).ray;
+        (*path).color += backgroundShader(&sceneInfo, materials, textures, &ray) * (*path).weight;
+        wavefrontNextStage(&sceneInfo, materials, textures, path, primitiveXYId, queues, counters, nextQueue, nbPaths,
+                           p);
+        return;
+    }
+
+    const int currentMaterialId = hitMaterialId(primitives, nbActivePrimitives, (*path).closestPrimitive);
+    (*path).currentMaterialId = currentMaterialId;
+    float4 intersection = (*path).intersection;
+    float4 normal = (*path).normal;
+    Ray ray = (*path).ray;
+
+    if (iteration == 0)
+    {
+        (*path).latestIntersection = intersection;
+        (*path).depth = length(intersection - ray.origin);
+
+        if (sceneInfo.advancedIllumination == aiBasic || sceneInfo.advancedIllumination == aiFull)
+        {
+            // Global illumination
+            int t = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 3);
+            Ray pathTracingRay;
+            pathTracingRay.origin = intersection + normal * sceneInfo.rayEpsilon;
+            pathTracingRay.direction = zero;
+            pathTracingRay.direction.x = 50.f * randoms[t];
+            pathTracingRay.direction.y = 50.f * randoms[t + 1];
+            pathTracingRay.direction.z = 50.f * randoms[t + 2];
+
+            float cos_theta = dot(normalize(pathTracingRay.direction), normal);
+            if (cos_theta < 0.f)
+                pathTracingRay.direction = -pathTracingRay.direction;
+            pathTracingRay.direction += intersection;
+            (*path).pathTracingRay = pathTracingRay;
+            (*path).pathTracingRatio = fabs(cos_theta);
+        }
+
+        // Primitive ID for current pixel
+        (*primitiveXYId).x = hitIndex(primitives, nbActivePrimitives, (*path).closestPrimitive);
+    }
+
+    float4 attributes;
+    attributes.x = materials[currentMaterialId].reflection;
+    attributes.y = materials[currentMaterialId].transparency;
+    attributes.z = materials[currentMaterialId].refraction;
+    attributes.w = materials[currentMaterialId].opacity;
+
+    // Get object color
+    (*path).blinn.w = attributes.y;
+    ShadingSample sample;
+    const float coneWidth = (*path).coneSpread * ((*path).rayLength + length(intersection - ray.origin));
+    prepareShading(index, &sceneInfo, primitives, nbActivePrimitives, lightInformation, lightInformationSize,
+                   materials, textures, randoms, ray.origin, &normal, (*path).closestPrimitive,
+                   (*path).closestInstance, &intersection, (*path).areas, iteration, &attributes, coneWidth, &sample);
+    (*path).shading = sample;
+    (*path).intersection = intersection;
+    (*path).normal = normal;
+
+    float segmentLength = length(intersection - (*path).latestIntersection);
+    (*path).latestIntersection = intersection;
+    // ----------
+    // Refraction
+    // ----------
+    float4 reflectedTarget = zero;
+    float transparency = attributes.y;
+    float a = 0.f;
+    float contribution;
+    bool carryon = true;
+    float rayLength = (*path).rayLength;
+    if (transparency != 0.f) // Transparency
+    {
+        float refraction = attributes.z;
+        float initialRefraction = (*path).initialRefraction;
+
+        // Back of the object? If so, reset refraction to 1.f (air)
+        if (initialRefraction == refraction)
+        {
+            // Opacity
+            refraction = 1.f;
+            rayLength += segmentLength * (attributes.w * (1.f - transparency));
+            rayLength = (rayLength > sceneInfo.viewDistance) ? sceneInfo.viewDistance : rayLength;
+            a = (rayLength / sceneInfo.viewDistance);
+        }
+
+        // Actual refraction
+        float4 O_E = normalize(intersection - ray.origin);
+        vectorRefraction(&reflectedTarget, O_E, refraction, normal, initialRefraction);
+
+        contribution = transparency - a;
+
+        // Prepare next ray
+        (*path).initialRefraction = refraction;
+
+        if ((*path).reflectedRays == -1 && attributes.x != 0.f) // Reflection
+        {
+            Ray reflectedRay;
+            vectorReflection(reflectedRay.direction, O_E, normal);
+            reflectedRay.origin = intersection + reflectedRay.direction * sceneInfo.rayEpsilon;
+            reflectedRay.direction = intersection + reflectedRay.direction;
+            (*path).reflectedRay = reflectedRay;
+            (*path).reflectedRatio = attributes.x;
+            (*path).reflectedRays = iteration;
         }
     }
     else
     {
-        r.direction.x = ray.direction.x + AArotatedGrid[sceneInfo.pathTracingIteration % 4].x;
-        r.direction.y = ray.direction.y + AArotatedGrid[sceneInfo.pathTracingIteration % 4].y;
+        rayLength += segmentLength;
+        if (attributes.x != 0.f) // Reflection
+        {
+            float4 O_E = normalize(intersection - ray.origin);
+            vectorReflection(reflectedTarget, O_E, normal);
+            contribution = attributes.x;
+        }
+        else
+        {
+            // No more intersections with primitives -> skybox
+            carryon = false;
+            contribution = 1.f;
+        }
+    }
+    (*path).rayLength = rayLength;
+
+    ray.origin = intersection + reflectedTarget * sceneInfo.rayEpsilon;
+    ray.direction = intersection + reflectedTarget;
+
+    // Noise management
+    if (sceneInfo.pathTracingIteration != 0 && materials[currentMaterialId].color.w != 0.f)
+    {
+        // Randomize view
+        float ratio = materials[currentMaterialId].color.w;
+        ratio *= (attributes.y == 0.f) ? 1000.f : 1.f;
+        int rindex = (index + sceneInfo.timestamp) % (MAX_BITMAP_SIZE - 3);
+        ray.direction.x += randoms[rindex] * ratio;
+        ray.direction.y += randoms[rindex + 1] * ratio;
+        ray.direction.z += randoms[rindex + 2] * ratio;
+    }
+    (*path).ray = ray;
+
+    // Colors are composed front to back: the color of an iteration is weighted by
+    // the contributions of the previous ones, and by its own one unless it is the
+    // last iteration of the path
+    int maxIteration = (sceneInfo.graphicsLevel < glReflectionsAndRefractions)
+                           ? 1
+                           : sceneInfo.nbRayIterations + sceneInfo.pathTracingIteration;
+    maxIteration = (maxIteration > NB_MAX_ITERATIONS) ? NB_MAX_ITERATIONS : maxIteration;
+    const bool continued = carryon && iteration + 1 < maxIteration && rayLength < sceneInfo.viewDistance;
+    const float weight = (*path).weight;
+    (*path).colorWeight = continued ? weight * (1.f - contribution) : weight;
+    if (iteration == 0)
+        (*path).firstWeight = (*path).colorWeight;
+    if ((*path).reflectedRays == iteration)
+        (*path).reflectedWeight = (*path).colorWeight;
+    (*path).weight = weight * contribution;
+    (*path).opacity = a;
+    (*path).shadedIteration = iteration;
+
+    if (sample.shadows)
+        wavefrontEnqueue(queues, counters, WAVEFRONT_SHADOW_QUEUE, nbPaths, p);
+    else
+        wavefrontComplete(index, &sceneInfo, lightInformation, materials, randoms, path, 0.f, zero, primitiveXYId);
+
+    if (continued)
+        wavefrontEnqueue(queues, counters, nextQueue, nbPaths, p);
+    else
+        wavefrontNextStage(&sceneInfo, materials, textures, path, primitiveXYId, queues, counters, nextQueue, nbPaths,
+                           p);
+}
+
+/*
+________________________________________________________________________________
+
+Wavefront rendering: shadow stage
+Casts the shadow rays of the shaded paths towards the lamp, and completes their
+shading
+________________________________________________________________________________
+*/
+__kernel void k_wavefrontShadows(const int offset, const int nbPaths, CONST BoundingBox* boundingBoxes,
+                                 int nbActiveBoxes, CONST CompactPrimitive* primitives, int nbActivePrimitives,
+                                 CONST LightInformation* lightInformation, CONST Material* materials,
+                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, const SceneInfo sceneInfo,
+                                 CONST PrimitiveXYIdBuffer* primitiveXYIds, CONST WavefrontPath* paths,
+                                 CONST int* queues, CONST int* counters)
+{
+    const int i = get_global_id(0);
+    if (i >= counters[WAVEFRONT_SHADOW_QUEUE])
+        return;
+
+    const int p = queues[WAVEFRONT_SHADOW_QUEUE * nbPaths + i];
+    const int index = offset + p;
+    CONST WavefrontPath* path = &paths[p];
+    const int iteration = ((*path).shadedIteration == -1) ? (*path).iteration : (*path).shadedIteration;
+    float4 shadowColor = {0.f, 0.f, 0.f, 0.f};
+    const float shadowIntensity =
+        processShadows(&sceneInfo, boundingBoxes, nbActiveBoxes, primitives, materials, textures, nbActivePrimitives,
+                       (*path).shading.lampCenter, (*path).intersection,
+                       lightInformation[(*path).shading.lamp].primitiveId, iteration, &shadowColor);
+    wavefrontComplete(index, &sceneInfo, lightInformation, materials, randoms, path, shadowIntensity, shadowColor,
+                      &primitiveXYIds[index]);
+}
+
+/*
+________________________________________________________________________________
+
+Wavefront rendering: resolution stage
+Applies the effects of the standard renderer to the colors of the paths, and
+writes the pixels once all their antialiasing samples have been traced
+________________________________________________________________________________
+*/
+__kernel void k_wavefrontResolve(const int offset, const int nbPaths, const int sample, const int nbSamples,
+                                 CONST CompactPrimitive* primitives, int nbActivePrimitives, CONST Material* materials,
+                                 CONST RandomBuffer* randoms, const SceneInfo sceneInfo,
+                                 CONST PostProcessingBuffer* postProcessingBuffer, CONST WavefrontPath* paths,
+                                 CONST int* counters)
+{
+    const int p = get_global_id(0);
+
+    // Queues filled by the generation of the next sample
+    if (p == 0)
+    {
+        counters[0] = 0;
+        counters[1] = 0;
+        counters[WAVEFRONT_SHADOW_QUEUE] = 0;
+    }
+    if (p >= nbPaths)
+        return;
+
+    const int index = offset + p;
+    CONST WavefrontPath* path = &paths[p];
+    if (!(*path).active)
+        return;
+
+    float4 intersectionColor = (*path).color + (*path).recursiveBlinn;
+
+    const float dof = (*path).depth;
+    float len = dof;
+    if ((*path).closestPrimitive != -1)
+    {
+        if (materials[hitMaterialId(primitives, nbActivePrimitives, (*path).closestPrimitive)].attributes.z ==
+            1) // Wireframe
+            len = sceneInfo.viewDistance;
+    }
+
+    // --------------------------------------------------
+    // Background color
+    // --------------------------------------------------
+    float D1 = sceneInfo.viewDistance * 0.95f;
+    if (sceneInfo.atmosphericEffect == aeFog && len > D1)
+    {
+        float D2 = sceneInfo.viewDistance * 0.05f;
+        float a = len - D1;
+        float b = 1.f - (a / D2);
+        intersectionColor = intersectionColor * b + sceneInfo.backgroundColor * (1.f - b);
     }
-    color += launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
-                              lightInformationSize, nbActiveLamps, materials, textures, randoms, &r, &sceneInfo,
-                              &postProcessingInfo, &dof, &primitiveXYIds[index]);
+
+    // Depth of field
+    intersectionColor -= (*path).colorBox;
+
+    saturateVector(&intersectionColor);
+    float4 color = (*path).sampleColor + intersectionColor;
+    (*path).sampleColor = color;
+    if (sample < nbSamples - 1)
+        return;
 
     if (sceneInfo.advancedIllumination == aiRandomIllumination)
     {
@@ -2545,8 +4227,7 @@ __kernel void k_standardRenderer(const int2 occupancyParameters, int device_spli
         color += sceneInfo.backgroundColor * randoms[rindex] * 5.f;
     }
 
-    if (antialiasingActivated)
-        color /= 5.f;
+    color /= (float)nbSamples;
 
     if (sceneInfo.pathTracingIteration == 0)
         postProcessingBuffer[index].colorInfo.w = dof;
@@ -2572,7 +4253,7 @@ Standard renderer
 ________________________________________________________________________________
 */
 __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split, int stream_split,
-                               CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
+                               CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST CompactPrimitive* primitives,
                                int nbActivePrimitives, CONST LightInformation* lightInformation,
                                int lightInformationSize, int nbActiveLamps, CONST Material* materials,
                                CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
@@ -2581,6 +4262,9 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
                                CONST PostProcessingBuffer* postProcessingBuffer,
                                CONST PrimitiveXYIdBuffer* primitiveXYIds)
 {
+    // Part of the kernel interface
+    (void)nbActiveLamps;
+
     int x = get_global_id(0);
     int y = get_global_id(1);
     int index = (stream_split + y) * sceneInfo.size.x + x;
@@ -2603,9 +4287,6 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
     ray.origin = origin;
     ray.direction = direction;
 
-    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
-        rotationCenter = origin;
 
     bool antialiasingActivated = (sceneInfo.cameraType == ctAntialiazed);
 
@@ -2637,8 +4318,8 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
         ray.direction.y = ray.direction.y + step.y * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
     }
 
-    vectorRotation(&ray.origin, rotationCenter, angles);
-    vectorRotation(&ray.direction, rotationCenter, angles);
+    vectorRotation(&ray.origin, angles);
+    vectorRotation(&ray.direction, angles);
 
     float4 color = {0.f, 0.f, 0.f, 0.f};
     Ray r = ray;
@@ -2650,8 +4331,8 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
             r.direction.y = ray.direction.y + AArotatedGrid[I].y;
             float4 c =
                 launchVolumeRendering(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                      lightInformation, lightInformationSize, nbActiveLamps, materials, textures,
-                                      randoms, &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                                      lightInformation, lightInformationSize, materials, textures, randoms, &r,
+                                      &sceneInfo, &primitiveXYIds[index]);
             color += c;
         }
     }
@@ -2661,8 +4342,8 @@ __kernel void k_volumeRenderer(const int2 occupancyParameters, int device_split,
         r.direction.y = ray.direction.y + AArotatedGrid[sceneInfo.pathTracingIteration % 4].y;
     }
     color += launchVolumeRendering(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                   lightInformation, lightInformationSize, nbActiveLamps, materials, textures, randoms,
-                                   &r, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                                   lightInformation, lightInformationSize, materials, textures, randoms, &r, &sceneInfo,
+                                   &primitiveXYIds[index]);
 
     if (sceneInfo.advancedIllumination == aiRandomIllumination)
     {
@@ -2698,15 +4379,20 @@ Anaglyph Renderer
 ________________________________________________________________________________
 */
 __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_split, int stream_split,
-                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
-                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
-                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
-                                 float4 direction, float4 angles, const SceneInfo sceneInfo,
+                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes,
+                                 CONST CompactPrimitive* primitives, int nbActivePrimitives,
+                                 CONST LightInformation* lightInformation, int lightInformationSize, int nbActiveLamps,
+                                 CONST Material* materials, CONST BitmapBuffer* textures, CONST RandomBuffer* randoms,
+                                 float4 origin, float4 direction, float4 angles, const SceneInfo sceneInfo,
                                  const PostProcessingInfo postProcessingInfo,
                                  CONST PostProcessingBuffer* postProcessingBuffer,
                                  CONST PrimitiveXYIdBuffer* primitiveXYIds)
 {
+    // Part of the kernel interface
+    (void)device_split;
+    (void)stream_split;
+    (void)nbActiveLamps;
+
     int x = get_global_id(0);
     int y = get_global_id(1);
     int index = y * sceneInfo.size.x + x;
@@ -2718,9 +4404,6 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
     float focus = primitiveXYIds[sceneInfo.size.x * sceneInfo.size.y / 2].x - origin.z;
     float eyeSeparation = sceneInfo.eyeSeparation * (focus / direction.z);
 
-    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
-        rotationCenter = origin;
 
     if (sceneInfo.pathTracingIteration == 0)
     {
@@ -2747,13 +4430,13 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
     eyeRay.direction.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
     eyeRay.direction.z = direction.z;
 
-    // vectorRotation( eyeRay.origin, rotationCenter, angles );
-    vectorRotation(&eyeRay.direction, rotationCenter, angles);
+    // vectorRotation(&eyeRay.origin, angles);
+    vectorRotation(&eyeRay.direction, angles);
 
     float4 colorLeft =
         launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
-                         lightInformationSize, nbActiveLamps, materials, textures, randoms, &eyeRay, &sceneInfo,
-                         &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                         lightInformationSize, materials, textures, randoms, &eyeRay, rayConeSpread(&eyeRay, step.y),
+                         &sceneInfo, &dof, &primitiveXYIds[index]);
 
     // Right eye
     eyeRay.origin.x = origin.x - eyeSeparation;
@@ -2764,12 +4447,12 @@ __kernel void k_anaglyphRenderer(const int2 occupancyParameters, int device_spli
     eyeRay.direction.y = direction.y + step.y * (float)(y - (sceneInfo.size.y / 2));
     eyeRay.direction.z = direction.z;
 
-    vectorRotation(&eyeRay.direction, rotationCenter, angles);
+    vectorRotation(&eyeRay.direction, angles);
 
     float4 colorRight =
         launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives, lightInformation,
-                         lightInformationSize, nbActiveLamps, materials, textures, randoms, &eyeRay, &sceneInfo,
-                         &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                         lightInformationSize, materials, textures, randoms, &eyeRay, rayConeSpread(&eyeRay, step.y),
+                         &sceneInfo, &dof, &primitiveXYIds[index]);
 
     float r1 = colorLeft.x * 0.299f + colorLeft.y * 0.587f + colorLeft.z * 0.114f;
     float b1 = 0.f;
@@ -2802,15 +4485,20 @@ ________________________________________________________________________________
 ________________________________________________________________________________
 */
 __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_split, int stream_split,
-                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
-                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
-                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
-                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
-                                 float4 direction, float4 angles, const SceneInfo sceneInfo,
+                                 CONST BoundingBox* boundingBoxes, int nbActiveBoxes,
+                                 CONST CompactPrimitive* primitives, int nbActivePrimitives,
+                                 CONST LightInformation* lightInformation, int lightInformationSize, int nbActiveLamps,
+                                 CONST Material* materials, CONST BitmapBuffer* textures, CONST RandomBuffer* randoms,
+                                 float4 origin, float4 direction, float4 angles, const SceneInfo sceneInfo,
                                  const PostProcessingInfo postProcessingInfo,
                                  CONST PostProcessingBuffer* postProcessingBuffer,
                                  CONST PrimitiveXYIdBuffer* primitiveXYIds)
 {
+    // Part of the kernel interface
+    (void)device_split;
+    (void)stream_split;
+    (void)nbActiveLamps;
+
     int x = get_global_id(0);
     int y = get_global_id(1);
     int index = y * sceneInfo.size.x + x;
@@ -2822,10 +4510,6 @@ __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_spli
     float focus = primitiveXYIds[sceneInfo.size.x * sceneInfo.size.y / 2].x - origin.z;
     float eyeSeparation = sceneInfo.eyeSeparation * (direction.z / focus);
 
-    float4 rotationCenter = {0.f, 0.f, 0.f, 0.f};
-    if (sceneInfo.cameraType == ctVR)
-        rotationCenter = origin;
-
     if (sceneInfo.pathTracingIteration == 0)
     {
         postProcessingBuffer[index].colorInfo.x = 0.f;
@@ -2871,12 +4555,12 @@ __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_spli
     if (sqrt(eyeRay.direction.x * eyeRay.direction.x + eyeRay.direction.y * eyeRay.direction.y) > (halfWidth * 6))
         return;
 
-    vectorRotation(&eyeRay.origin, rotationCenter, angles);
-    vectorRotation(&eyeRay.direction, rotationCenter, angles);
+    vectorRotation(&eyeRay.origin, angles);
+    vectorRotation(&eyeRay.direction, angles);
 
     float4 color = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
-                                    lightInformation, lightInformationSize, nbActiveLamps, materials, textures, randoms,
-                                    &eyeRay, &sceneInfo, &postProcessingInfo, &dof, &primitiveXYIds[index]);
+                                    lightInformation, lightInformationSize, materials, textures, randoms, &eyeRay,
+                                    rayConeSpread(&eyeRay, step.y), &sceneInfo, &dof, &primitiveXYIds[index]);
 
     // Randomize light intensity
     int rindex = (index + sceneInfo.timestamp) % MAX_BITMAP_SIZE;
@@ -2902,11 +4586,11 @@ __kernel void k_3DVisionRenderer(const int2 occupancyParameters, int device_spli
 /*
 ________________________________________________________________________________
 
-3D Vision Renderer
+Fish eye Renderer
 ________________________________________________________________________________
 */
 __kernel void k_fishEyeRenderer(const int2 occupancyParameters, int device_split, int stream_split,
-                                CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST Primitive* primitives,
+                                CONST BoundingBox* boundingBoxes, int nbActiveBoxes, CONST CompactPrimitive* primitives,
                                 int nbActivePrimitives, CONST LightInformation* lightInformation,
                                 int lightInformationSize, int nbActiveLamps, CONST Material* materials,
                                 CONST BitmapBuffer* textures, CONST RandomBuffer* randoms, float4 origin,
@@ -2915,6 +4599,56 @@ __kernel void k_fishEyeRenderer(const int2 occupancyParameters, int device_split
                                 CONST PostProcessingBuffer* postProcessingBuffer,
                                 CONST PrimitiveXYIdBuffer* primitiveXYIds)
 {
+    // Part of the kernel interface
+    (void)postProcessingInfo;
+    (void)nbActiveLamps;
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int index = (stream_split + y) * sceneInfo.size.x + x;
+
+    // Beware out of bounds error!
+    // And only process pixels that need extra rendering
+    const bool condition =
+        index >= sceneInfo.size.x * sceneInfo.size.y / occupancyParameters.x ||
+        (sceneInfo.pathTracingIteration > primitiveXYIds[index].y && primitiveXYIds[index].w == 0 &&
+         sceneInfo.pathTracingIteration > 0 && sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS);
+    if (condition)
+        return;
+
+    // Same vertical field of view as the standard renderer, and 360 degrees
+    // around the Y axis of the eye
+    const float step = angles.w / (float)sceneInfo.size.y;
+    float4 target = direction - origin;
+    target.y += step * (float)(device_split + stream_split + y - (sceneInfo.size.y / 2));
+    float4 fishEyeAngles = angles;
+    fishEyeAngles.y += 2.f * PI * (float)x / (float)sceneInfo.size.x;
+    vectorRotation(&target, fishEyeAngles);
+
+    Ray ray;
+    ray.origin = origin;
+    ray.direction = origin + target;
+
+    float dof = 0.f;
+    float4 color = launchRayTracing(index, boundingBoxes, nbActiveBoxes, primitives, nbActivePrimitives,
+                                    lightInformation, lightInformationSize, materials, textures, randoms, &ray,
+                                    rayConeSpread(&ray, step), &sceneInfo, &dof, &primitiveXYIds[index]);
+
+    if (sceneInfo.pathTracingIteration == 0)
+        postProcessingBuffer[index].colorInfo.w = dof;
+
+    if (sceneInfo.pathTracingIteration <= NB_MAX_ITERATIONS)
+    {
+        postProcessingBuffer[index].colorInfo.x = color.x;
+        postProcessingBuffer[index].colorInfo.y = color.y;
+        postProcessingBuffer[index].colorInfo.z = color.z;
+    }
+    else
+    {
+        postProcessingBuffer[index].colorInfo.x += color.x;
+        postProcessingBuffer[index].colorInfo.y += color.y;
+        postProcessingBuffer[index].colorInfo.z += color.z;
+    }
 }
 
 /*
@@ -3057,6 +4791,11 @@ __kernel void k_radiosity(const int2 occupancyParameters, SceneInfo sceneInfo, P
                           CONST PrimitiveXYIdBuffer* primitiveXYIds, CONST PostProcessingBuffer* postProcessingBuffer,
                           CONST RandomBuffer* randoms, CONST BitmapBuffer* bitmap)
 {
+    // Part of the kernel interface
+    (void)postProcessingInfo;
+    (void)postProcessingBuffer;
+    (void)randoms;
+
     int x = get_global_id(0);
     int y = get_global_id(1);
     int index = y * sceneInfo.size.x + x;
@@ -3092,11 +4831,10 @@ __kernel void k_filter(const int2 occupancyParameters, SceneInfo sceneInfo, Post
 
     // Filters
     #define NB_FILTERS 6
-    const int2 filterSize[NB_FILTERS]; // = {{3, 3}, {5, 5}, {3, 3}, {3, 3}, {5, 5}, {5, 5}};
+    const int2 filterSize[NB_FILTERS] = {{3, 3}, {5, 5}, {3, 3}, {3, 3}, {5, 5}, {5, 5}};
 
-    const float2 filterFactors[NB_FILTERS];
-    // = {{1.f, 128.f}, {1.f, 0.f},  {1.f, 0.f},
-    // {1.f, 0.f},   {0.2f, 0.f}, {0.125f, 0.f}}; // Factor and Bias
+    const float2 filterFactors[NB_FILTERS] = {{1.f, 128.f}, {1.f, 0.f},  {1.f, 0.f},
+                                              {1.f, 0.f},   {0.2f, 0.f}, {0.125f, 0.f}}; // Factor and Bias
 
     const float filterInfo[NB_FILTERS][5][5] =
     {
@@ -3196,6 +4934,8 @@ __kernel void k_alignment()
     printf("OCL  [1] PostProcessingInfo:  %i\n", sizeof(PostProcessingInfo));
     printf("OCL  [1] TextureInfo       :  %i\n", sizeof(TextureInfo));
     printf("OCL  [1] Primitive         :  %i\n", sizeof(Primitive));
+    printf("OCL  [1] CompactPrimitive  :  %i\n", sizeof(CompactPrimitive));
+    printf("OCL  [1] ShadingPrimitive  :  %i\n", sizeof(ShadingPrimitive));
     printf("OCL  [1] BoundingBox       :  %i\n", sizeof(BoundingBox));
     printf("OCL  [1] Material          :  %i\n", sizeof(Material));
     printf("OCL  [1] LightInformation  :  %i\n", sizeof(LightInformation));
@@ -18,12 +18,15 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 
 #include "../Consts.h"
 #include "../Logging.h"
 
 #include "ImageLoader.h"
+#include "PixelConverter.h"
 
 #include "jpgd.h"
 #include "tgad.h"
@@ -317,4 +320,196 @@ bool ImageLoader::loadTGA(const int index, const std::string &filename, TextureI
 
     return true;
 }
+
+// 5:6:5 color, and its expansion to 8 bits per channel as done by the kernels
+static int packColor(const int *rgb)
+{
+    return (((rgb[0] * 31 + 127) / 255) << 11) | (((rgb[1] * 63 + 127) / 255) << 5) | ((rgb[2] * 31 + 127) / 255);
+}
+
+static void unpackColor(const int color, int *rgb)
+{
+    rgb[0] = ((color >> 11) & 31) * 255 / 31;
+    rgb[1] = ((color >> 5) & 63) * 255 / 63;
+    rgb[2] = (color & 31) * 255 / 31;
+}
+
+// Texels of the 4x4 block starting at (x,y), edge texels are repeated for the
+// blocks that go beyond the texture
+static void readBlock(const unsigned char *level, const int width, const int height, const int depth, const int x,
+                      const int y, int block[16][4])
+{
+    for (int j = 0; j < 4; ++j)
+        for (int i = 0; i < 4; ++i)
+        {
+            const unsigned char *texel =
+                level + (std::min(y + j, height - 1) * width + std::min(x + i, width - 1)) * depth;
+            for (int c = 0; c < 4; ++c)
+                block[j * 4 + i][c] = (c < depth) ? texel[c] : 255;
+        }
+}
+
+// Colors of the block: the two stored colors are the most distant texels of the
+// block, the first one being the greatest so that the block has 4 colors
+static void writeColorBlock(const int block[16][4], unsigned char *destination)
+{
+    int a = 0;
+    int b = 0;
+    int maxDistance = -1;
+    for (int i = 0; i < 16; ++i)
+        for (int j = i + 1; j < 16; ++j)
+        {
+            int distance = 0;
+            for (int c = 0; c < 3; ++c)
+                distance += (block[i][c] - block[j][c]) * (block[i][c] - block[j][c]);
+            if (distance > maxDistance)
+            {
+                maxDistance = distance;
+                a = i;
+                b = j;
+            }
+        }
+
+    int c0 = packColor(block[a]);
+    int c1 = packColor(block[b]);
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    int palette[4][3];
+    unpackColor(c0, palette[0]);
+    unpackColor(c1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    destination[0] = static_cast<unsigned char>(c0 & 0xff);
+    destination[1] = static_cast<unsigned char>(c0 >> 8);
+    destination[2] = static_cast<unsigned char>(c1 & 0xff);
+    destination[3] = static_cast<unsigned char>(c1 >> 8);
+    for (int row = 0; row < 4; ++row)
+    {
+        int indices = 0;
+        for (int column = 0; column < 4; ++column)
+        {
+            // Blocks with a single color only use the first one
+            const int *texel = block[row * 4 + column];
+            int best = 0;
+            int bestDistance = -1;
+            for (int p = 0; p < ((c0 == c1) ? 1 : 4); ++p)
+            {
+                int distance = 0;
+                for (int c = 0; c < 3; ++c)
+                    distance += (texel[c] - palette[p][c]) * (texel[c] - palette[p][c]);
+                if (bestDistance < 0 || distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    best = p;
+                }
+            }
+            indices |= best << (2 * column);
+        }
+        destination[4 + row] = static_cast<unsigned char>(indices);
+    }
+}
+
+// Alpha of the block: the two stored values are the extremes, the first one
+// being the greatest so that the block has 8 values
+static void writeAlphaBlock(const int block[16][4], unsigned char *destination)
+{
+    int a0 = 0;
+    int a1 = 255;
+    for (int i = 0; i < 16; ++i)
+    {
+        a0 = std::max(a0, block[i][3]);
+        a1 = std::min(a1, block[i][3]);
+    }
+
+    int palette[8];
+    palette[0] = a0;
+    palette[1] = a1;
+    for (int p = 2; p < 8; ++p)
+        palette[p] = ((8 - p) * a0 + (p - 1) * a1) / 7;
+
+    unsigned long long indices = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = 0;
+        for (int p = 1; p < ((a0 == a1) ? 1 : 8); ++p)
+            if (std::abs(block[i][3] - palette[p]) < std::abs(block[i][3] - palette[best]))
+                best = p;
+        indices |= static_cast<unsigned long long>(best) << (3 * i);
+    }
+
+    destination[0] = static_cast<unsigned char>(a0);
+    destination[1] = static_cast<unsigned char>(a1);
+    for (int i = 0; i < 6; ++i)
+        destination[2 + i] = static_cast<unsigned char>((indices >> (8 * i)) & 0xff);
+}
+
+bool ImageLoader::compress(TextureInfo &textureInfo)
+{
+    if (textureInfo.buffer == 0 || textureInfo.compression != tc_none)
+        return false;
+
+    TextureInfo compressed = textureInfo;
+    switch (textureInfo.size.z)
+    {
+    case 3:
+        compressed.compression = tc_bc1;
+        break;
+    case 4:
+        compressed.compression = tc_bc3;
+        break;
+    default:
+        return false;
+    }
+
+    const size_t size = textureBufferSize(compressed);
+    compressed.buffer = new unsigned char[size];
+    const int depth = textureInfo.size.z;
+    const unsigned char *source = textureInfo.buffer;
+    unsigned char *destination = compressed.buffer;
+    int width = textureInfo.size.x;
+    int height = textureInfo.size.y;
+    int block[16][4];
+    for (int level = 0; level < textureInfo.levels || level == 0; ++level)
+    {
+        for (int y = 0; y < height; y += 4)
+            for (int x = 0; x < width; x += 4)
+            {
+                readBlock(source, width, height, depth, x, y, block);
+                if (compressed.compression == tc_bc3)
+                {
+                    writeAlphaBlock(block, destination);
+                    destination += 8;
+                }
+                writeColorBlock(block, destination);
+                destination += 8;
+            }
+        source += textureLevelSize(width, height, depth, tc_none);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+
+    LOG_INFO(3, "Texture compressed: " << textureBufferSize(textureInfo) << " to " << size << " bytes");
+    delete[] textureInfo.buffer;
+    textureInfo = compressed;
+    return true;
+}
+
+bool ImageLoader::expandToRGBA(TextureInfo &textureInfo)
+{
+    if (textureInfo.buffer == 0 || textureInfo.compression != tc_none || textureInfo.size.z != 3)
+        return false;
+
+    const size_t nbTexels = textureBufferSize(textureInfo) / 3;
+    BitmapBuffer *buffer = new BitmapBuffer[nbTexels * 4];
+    convertPixels(textureInfo.buffer, 3, buffer, 4, nbTexels, false);
+    delete[] textureInfo.buffer;
+    textureInfo.buffer = buffer;
+    textureInfo.size.z = 4;
+    return true;
+}
 }
@@ -50,5 +50,13 @@ public:
 
     // TGA
     bool loadTGA(const int index, const std::string &filename, TextureInfo *textureInformations);
+
+    // Block compression of a texture and of its mip chain: BC1 for RGB textures,
+    // BC3 for RGBA ones. Other textures are left unchanged
+    bool compress(TextureInfo &textureInfo);
+
+    // Conversion of an RGB texture and of its mip chain to RGBA, with opaque
+    // alpha. Other textures are left unchanged
+    bool expandToRGBA(TextureInfo &textureInfo);
 };
 }
@@ -0,0 +1,133 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PixelConverter.h"
+
+#include <string.h>
+
+// The shuffle path is compiled for SSSE3 whatever the target of the build,
+// and only taken when the processor running the code supports it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_CONVERTER_SSSE3 __attribute__((target("ssse3")))
+#include <tmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PIXEL_CONVERTER_SSSE3
+#include <intrin.h>
+#include <tmmintrin.h>
+#endif
+
+namespace solr
+{
+// Source byte of a channel of a destination pixel, -1 for an opaque alpha
+static int sourceByte(const int pixel, const int channel, const int sourceDepth, const bool swapRedBlue)
+{
+    if (channel == 3)
+        return (sourceDepth == 4) ? pixel * 4 + 3 : -1;
+    return pixel * sourceDepth + (swapRedBlue ? 2 - channel : channel);
+}
+
+#ifdef PIXEL_CONVERTER_SSSE3
+static bool hasSSSE3()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+
+// Converts the leading groups of 4 pixels, returns the number of converted pixels
+PIXEL_CONVERTER_SSSE3 static size_t convertPixelsSSSE3(const BitmapBuffer *source, const int sourceDepth,
+                                                       BitmapBuffer *destination, const int destinationDepth,
+                                                       const size_t nbPixels, const bool swapRedBlue,
+                                                       const bool reversed)
+{
+    // Groups of 4 pixels are converted with a single byte shuffle. 3 byte
+    // pixels are loaded and stored as 8 + 4 bytes so that nothing is accessed
+    // beyond the buffers
+    BitmapBuffer shuffle[16];
+    BitmapBuffer alpha[16];
+    memset(shuffle, 0x80, sizeof(shuffle));
+    memset(alpha, 0, sizeof(alpha));
+    for (int pixel = 0; pixel < 4; ++pixel)
+        for (int channel = 0; channel < destinationDepth; ++channel)
+        {
+            const int byte = sourceByte(reversed ? 3 - pixel : pixel, channel, sourceDepth, swapRedBlue);
+            if (byte < 0)
+                alpha[pixel * destinationDepth + channel] = 255;
+            else
+                shuffle[pixel * destinationDepth + channel] = static_cast<BitmapBuffer>(byte);
+        }
+    const __m128i shuffleMask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(shuffle));
+    const __m128i alphaMask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(alpha));
+
+    size_t i = 0;
+    for (; i + 4 <= nbPixels; i += 4)
+    {
+        const BitmapBuffer *src = source + (reversed ? nbPixels - i - 4 : i) * sourceDepth;
+        __m128i pixels;
+        if (sourceDepth == 4)
+            pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        else
+        {
+            int last;
+            memcpy(&last, src + 8, 4);
+            pixels = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src)),
+                                        _mm_cvtsi32_si128(last));
+        }
+        pixels = _mm_or_si128(_mm_shuffle_epi8(pixels, shuffleMask), alphaMask);
+
+        BitmapBuffer *dst = destination + i * destinationDepth;
+        if (destinationDepth == 4)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), pixels);
+        else
+        {
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(dst), pixels);
+            const int last = _mm_cvtsi128_si32(_mm_srli_si128(pixels, 8));
+            memcpy(dst + 8, &last, 4);
+        }
+    }
+    return i;
+}
+#endif
+
+void convertPixels(const BitmapBuffer *source, const int sourceDepth, BitmapBuffer *destination,
+                   const int destinationDepth, const size_t nbPixels, const bool swapRedBlue, const bool reversed)
+{
+    size_t i = 0;
+#ifdef PIXEL_CONVERTER_SSSE3
+    static const bool ssse3 = hasSSSE3();
+    if (ssse3)
+        i = convertPixelsSSSE3(source, sourceDepth, destination, destinationDepth, nbPixels, swapRedBlue, reversed);
+#endif
+
+    for (; i < nbPixels; ++i)
+    {
+        const size_t pixel = reversed ? nbPixels - i - 1 : i;
+        for (int channel = 0; channel < destinationDepth; ++channel)
+        {
+            const int byte = sourceByte(0, channel, sourceDepth, swapRedBlue);
+            destination[i * destinationDepth + channel] = (byte < 0) ? 255 : source[pixel * sourceDepth + byte];
+        }
+    }
+}
+}
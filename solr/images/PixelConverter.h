@@ -0,0 +1,35 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <DLL_API.h>
+#include <types.h>
+
+namespace solr
+{
+// Converts 8 bit per channel pixels between layouts of 3 (RGB, BGR) and 4
+// (RGBA, BGRA) bytes per pixel. Red and blue are swapped when swapRedBlue is
+// set, added alpha channels are opaque. When reversed is set, the last source
+// pixel is the first destination one. Source and destination must not overlap
+void SOLR_API convertPixels(const BitmapBuffer *source, const int sourceDepth, BitmapBuffer *destination,
+                            const int destinationDepth, const size_t nbPixels, const bool swapRedBlue,
+                            const bool reversed = false);
+}
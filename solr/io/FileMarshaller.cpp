@@ -18,35 +18,328 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-#ifdef WIN32
-#include <windows.h>
-#else
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#endif
+
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <math.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "../Consts.h"
 #include "../Logging.h"
 
 #include "FileMarshaller.h"
+#include "MappedFile.h"
 
 namespace
 {
-const std::string SCENEINFO = "SCENEINFO";
-const std::string PRIMITIVE = "PRIMITIVE";
-const std::string MATERIAL = "MATERIAL";
-const std::string TEXTURE = "TEXTURE";
-#ifdef USE_OPENCL
+#if defined(USE_OPENCL) || defined(USE_CPU)
 const size_t FORMAT_VERSION = 1;
 #else
 const size_t FORMAT_VERSION = 2;
 #endif
+
+// ---------- Version 3 ----------
+const char IRT_MAGIC[8] = {'S', 'O', 'L', 'R', '-', 'I', 'R', 'T'};
+const uint32_t IRT_VERSION = 3;
+const uint64_t IRT_ALIGNMENT = 64;
+
+inline uint32_t makeTag(const char a, const char b, const char c, const char d)
+{
+    return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) | (static_cast<uint32_t>(c) << 16) |
+           (static_cast<uint32_t>(d) << 24);
+}
+
+const uint32_t TAG_PRIMITIVES = makeTag('P', 'R', 'I', 'M');
+const uint32_t TAG_MATERIALS = makeTag('M', 'A', 'T', 'L');
+const uint32_t TAG_TEXTURES = makeTag('T', 'E', 'X', 'I');
+const uint32_t TAG_TEXELS = makeTag('T', 'E', 'X', 'D');
+const uint32_t TAG_BVH_NODES = makeTag('B', 'V', 'H', 'N');
+const uint32_t TAG_BVH_ORDER = makeTag('B', 'V', 'H', 'O');
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+struct IrtHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nbChunks;
+    uint64_t chunkTableOffset; // Offset of the array of IrtChunk
+    float boundsMin[3];        // Bounds of the primitives, as saved
+    float boundsMax[3];
+    uint64_t primitivesHash; // Hash of the primitive section the hierarchy was saved for
+    uint64_t bvhHash;        // Hash of the node and order sections of the hierarchy
+};
+
+struct IrtChunk
+{
+    uint32_t tag;
+    uint32_t recordSize; // Size of a record, 1 for raw data
+    uint64_t count;      // Number of records
+    uint64_t offset;     // Offset of the section in the file, aligned on IRT_ALIGNMENT
+    uint64_t size;       // Size of the section in bytes
+};
+
+// Same layout as CPUPrimitive when 3 component vectors are padded to 4
+struct IrtPrimitive
+{
+    uint8_t belongsToModel;
+    uint8_t movable;
+    uint8_t reserved[14];
+    float p0[4];
+    float p1[4];
+    float p2[4];
+    float n0[4];
+    float n1[4];
+    float n2[4];
+    float size[4];
+    int32_t type;
+    int32_t materialId;
+    float vt0[2];
+    float vt1[2];
+    float vt2[2];
+    float speed0[4];
+    float speed1[4];
+    float speed2[4];
+};
+
+struct IrtMaterial
+{
+    int32_t id;
+    int32_t reserved[3];
+    float innerIllumination[4];
+    float color[4];
+    float specular[4];
+    float reflection;
+    float refraction;
+    float transparency;
+    float opacity;
+    int32_t attributes[4];
+    int32_t textureMapping[4];
+    int32_t textureOffset[4];
+    int32_t textureIds[4];
+    int32_t advancedTextureOffset[4];
+    int32_t advancedTextureIds[4];
+    float mappingOffset[2];
+    int32_t padding[2];
+};
+
+// Topology of a node of the top level hierarchy, see BVHNode. Primitives of the
+// leaves are stored in a section of uint32_t primitive indices
+struct IrtNode
+{
+    int32_t nbPrimitives;
+    int32_t startIndex;
+    int32_t indexForNextBox;
+    int32_t reserved;
+};
+
+struct IrtTexture
+{
+    int32_t size[3];
+    int32_t type;
+    int32_t compression;
+    int32_t reserved;
+    uint64_t dataOffset; // Offset of the texels in the file, aligned on IRT_ALIGNMENT
+};
+
+static_assert(sizeof(IrtHeader) == 64, "IRT header must be 64 bytes");
+static_assert(sizeof(IrtChunk) == 32, "IRT chunk must be 32 bytes");
+static_assert(sizeof(IrtPrimitive) == 208, "IRT primitive must be 208 bytes");
+static_assert(sizeof(IrtMaterial) == 192, "IRT material must be 192 bytes");
+static_assert(sizeof(IrtTexture) == 32, "IRT texture must be 32 bytes");
+static_assert(sizeof(IrtNode) == 16, "IRT node must be 16 bytes");
+
+// Primitive records can be copied as they are when CPUPrimitive has the layout
+// of IrtPrimitive, which is the case of the OpenCL and CPU engines
+const bool NATIVE_PRIMITIVES =
+    sizeof(solr::CPUPrimitive) == sizeof(IrtPrimitive) && sizeof(vec3f) == 4 * sizeof(float) &&
+    offsetof(solr::CPUPrimitive, p0) == offsetof(IrtPrimitive, p0) &&
+    offsetof(solr::CPUPrimitive, type) == offsetof(IrtPrimitive, type) &&
+    offsetof(solr::CPUPrimitive, vt0) == offsetof(IrtPrimitive, vt0) &&
+    offsetof(solr::CPUPrimitive, speed0) == offsetof(IrtPrimitive, speed0);
+
+bool isLittleEndian()
+{
+    const uint16_t value = 1;
+    return *reinterpret_cast<const uint8_t *>(&value) == 1;
+}
+
+template <typename T>
+void fromVec3(float *dst, const T &v)
+{
+    dst[0] = v.x;
+    dst[1] = v.y;
+    dst[2] = v.z;
+    dst[3] = 0.f;
+}
+
+template <typename T>
+void toVec3(T &v, const float *src)
+{
+    v = make_vec3f(src[0], src[1], src[2]);
+}
+
+template <typename D, typename T>
+void fromVec4(D *dst, const T &v)
+{
+    dst[0] = v.x;
+    dst[1] = v.y;
+    dst[2] = v.z;
+    dst[3] = v.w;
+}
+
+template <typename D, typename T>
+void toVec4(T &v, const D *src)
+{
+    v.x = src[0];
+    v.y = src[1];
+    v.z = src[2];
+    v.w = src[3];
+}
+
+void fromPrimitive(IrtPrimitive &dst, const solr::CPUPrimitive &src)
+{
+    memset(&dst, 0, sizeof(IrtPrimitive));
+    dst.belongsToModel = src.belongsToModel;
+    dst.movable = src.movable;
+    fromVec3(dst.p0, src.p0);
+    fromVec3(dst.p1, src.p1);
+    fromVec3(dst.p2, src.p2);
+    fromVec3(dst.n0, src.n0);
+    fromVec3(dst.n1, src.n1);
+    fromVec3(dst.n2, src.n2);
+    fromVec3(dst.size, src.size);
+    dst.type = src.type;
+    dst.materialId = src.materialId;
+    dst.vt0[0] = src.vt0.x;
+    dst.vt0[1] = src.vt0.y;
+    dst.vt1[0] = src.vt1.x;
+    dst.vt1[1] = src.vt1.y;
+    dst.vt2[0] = src.vt2.x;
+    dst.vt2[1] = src.vt2.y;
+    fromVec3(dst.speed0, src.speed0);
+    fromVec3(dst.speed1, src.speed1);
+    fromVec3(dst.speed2, src.speed2);
+}
+
+void toPrimitive(solr::CPUPrimitive &dst, const IrtPrimitive &src)
+{
+    memset(&dst, 0, sizeof(solr::CPUPrimitive));
+    dst.belongsToModel = (src.belongsToModel != 0);
+    dst.movable = (src.movable != 0);
+    toVec3(dst.p0, src.p0);
+    toVec3(dst.p1, src.p1);
+    toVec3(dst.p2, src.p2);
+    toVec3(dst.n0, src.n0);
+    toVec3(dst.n1, src.n1);
+    toVec3(dst.n2, src.n2);
+    toVec3(dst.size, src.size);
+    dst.type = src.type;
+    dst.materialId = src.materialId;
+    dst.vt0 = make_vec2f(src.vt0[0], src.vt0[1]);
+    dst.vt1 = make_vec2f(src.vt1[0], src.vt1[1]);
+    dst.vt2 = make_vec2f(src.vt2[0], src.vt2[1]);
+    toVec3(dst.speed0, src.speed0);
+    toVec3(dst.speed1, src.speed1);
+    toVec3(dst.speed2, src.speed2);
+}
+
+void fromMaterial(IrtMaterial &dst, const int id, const Material &src)
+{
+    memset(&dst, 0, sizeof(IrtMaterial));
+    dst.id = id;
+    fromVec4(dst.innerIllumination, src.innerIllumination);
+    fromVec4(dst.color, src.color);
+    fromVec4(dst.specular, src.specular);
+    dst.reflection = src.reflection;
+    dst.refraction = src.refraction;
+    dst.transparency = src.transparency;
+    dst.opacity = src.opacity;
+    fromVec4(dst.attributes, src.attributes);
+    fromVec4(dst.textureMapping, src.textureMapping);
+    fromVec4(dst.textureOffset, src.textureOffset);
+    fromVec4(dst.textureIds, src.textureIds);
+    fromVec4(dst.advancedTextureOffset, src.advancedTextureOffset);
+    fromVec4(dst.advancedTextureIds, src.advancedTextureIds);
+    dst.mappingOffset[0] = src.mappingOffset.x;
+    dst.mappingOffset[1] = src.mappingOffset.y;
+}
+
+void toMaterial(Material &dst, const IrtMaterial &src)
+{
+    memset(&dst, 0, sizeof(Material));
+    toVec4(dst.innerIllumination, src.innerIllumination);
+    toVec4(dst.color, src.color);
+    toVec4(dst.specular, src.specular);
+    dst.reflection = src.reflection;
+    dst.refraction = src.refraction;
+    dst.transparency = src.transparency;
+    dst.opacity = src.opacity;
+    toVec4(dst.attributes, src.attributes);
+    toVec4(dst.textureMapping, src.textureMapping);
+    toVec4(dst.textureOffset, src.textureOffset);
+    toVec4(dst.textureIds, src.textureIds);
+    toVec4(dst.advancedTextureOffset, src.advancedTextureOffset);
+    toVec4(dst.advancedTextureIds, src.advancedTextureIds);
+    dst.mappingOffset = make_vec2f(src.mappingOffset[0], src.mappingOffset[1]);
+}
+
+// ----------
+// 64 bit FNV-1a of data, processed by words. Sections are hashed in sequence
+// by passing the result of the previous one
+// ----------
+uint64_t hashData(const unsigned char *data, const size_t size, uint64_t hash)
+{
+    const uint64_t prime = 1099511628211ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i)
+        hash = (hash ^ data[i]) * prime;
+    return hash;
+}
+
+// ----------
+// Pads the stream with zeros up to the next IRT_ALIGNMENT boundary
+// ----------
+uint64_t alignStream(std::ofstream &stream)
+{
+    const uint64_t position = static_cast<uint64_t>(stream.tellp());
+    const uint64_t padding = (IRT_ALIGNMENT - position % IRT_ALIGNMENT) % IRT_ALIGNMENT;
+    const char zeros[IRT_ALIGNMENT] = {0};
+    stream.write(zeros, padding);
+    return position + padding;
+}
+
+// ----------
+// Texture slots referenced by a material are either none or one of the
+// textures of the file
+// ----------
+bool validTextureId(const int id, const uint64_t nbTextures)
+{
+    return id == TEXTURE_NONE || (id >= 0 && static_cast<uint64_t>(id) < nbTextures);
+}
+
+void remapTextureId(int &id, const std::map<size_t, int> &idMapping)
+{
+    if (id == TEXTURE_NONE)
+        return;
+    std::map<size_t, int>::const_iterator it = idMapping.find(id);
+    id = (it != idMapping.end()) ? it->second : TEXTURE_NONE;
+}
+
+void offsetTextureId(int &id, const int offset)
+{
+    if (id != TEXTURE_NONE)
+        id += offset;
+}
 }
 
 namespace solr
@@ -62,6 +355,261 @@ vec4f FileMarshaller::loadFromFile(GPUKernel &kernel, const std::string &filenam
     vec4f max = make_vec4f(-kernel.getSceneInfo().viewDistance, -kernel.getSceneInfo().viewDistance,
         -kernel.getSceneInfo().viewDistance);
 
+    const auto start = std::chrono::steady_clock::now();
+    if (!loadChunkedFile(kernel, filename, center, min, max) && !loadLegacyFile(kernel, filename, center, min, max))
+        return returnValue;
+    const float loadTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO(1, " - Loaded in.......: " << loadTime << "ms");
+    LOG_INFO(3, "File " << filename << " successfully loaded!");
+
+    // Object size
+    returnValue.x = fabs(max.x - min.x);
+    returnValue.y = fabs(max.y - min.y);
+    returnValue.z = fabs(max.z - min.z);
+
+    // Resize to fit required size
+    float ratio = scale / returnValue.y; // std::max(returnValue.x,std::max(returnValue.y,returnValue.z));
+    kernel.scalePrimitives(ratio, 0, NB_MAX_BOXES);
+
+    LOG_INFO(3, "Object size: " << returnValue.x << ", " << returnValue.y << ", " << returnValue.z);
+    return returnValue;
+}
+
+bool FileMarshaller::loadChunkedFile(GPUKernel &kernel, const std::string &filename, const vec4f &center,
+                                     vec4f &min, vec4f &max)
+{
+    MappedFile file(filename);
+    const unsigned char *data = file.data();
+    if (!data || file.size() < sizeof(IrtHeader) || memcmp(data, IRT_MAGIC, sizeof(IRT_MAGIC)) != 0)
+        return false;
+
+    const IrtHeader &header = *reinterpret_cast<const IrtHeader *>(data);
+    LOG_INFO(1, " - Version.........: " << header.version);
+    if (header.version != IRT_VERSION || !isLittleEndian())
+    {
+        LOG_ERROR("File not compatible with current engine");
+        return false;
+    }
+
+    if (header.chunkTableOffset % sizeof(uint64_t) != 0 || header.chunkTableOffset > file.size() ||
+        header.nbChunks > (file.size() - header.chunkTableOffset) / sizeof(IrtChunk))
+    {
+        LOG_ERROR("Corrupted chunk table in " << filename);
+        return false;
+    }
+
+    const IrtChunk *chunks = reinterpret_cast<const IrtChunk *>(data + header.chunkTableOffset);
+    const IrtChunk *primitives = 0;
+    const IrtChunk *materials = 0;
+    const IrtChunk *textures = 0;
+    const IrtChunk *bvhNodes = 0;
+    const IrtChunk *bvhOrder = 0;
+    for (uint32_t i = 0; i < header.nbChunks; ++i)
+    {
+        const IrtChunk &chunk = chunks[i];
+        if (chunk.offset % IRT_ALIGNMENT != 0 || chunk.offset > file.size() ||
+            chunk.size > file.size() - chunk.offset || chunk.recordSize == 0 ||
+            chunk.count > chunk.size / chunk.recordSize)
+        {
+            LOG_ERROR("Corrupted chunk " << i << " in " << filename);
+            return false;
+        }
+        if (chunk.tag == TAG_PRIMITIVES && chunk.recordSize == sizeof(IrtPrimitive))
+            primitives = &chunk;
+        else if (chunk.tag == TAG_MATERIALS && chunk.recordSize == sizeof(IrtMaterial))
+            materials = &chunk;
+        else if (chunk.tag == TAG_TEXTURES && chunk.recordSize == sizeof(IrtTexture))
+            textures = &chunk;
+        else if (chunk.tag == TAG_BVH_NODES && chunk.recordSize == sizeof(IrtNode))
+            bvhNodes = &chunk;
+        else if (chunk.tag == TAG_BVH_ORDER && chunk.recordSize == sizeof(uint32_t))
+            bvhOrder = &chunk;
+        // Other chunks, texels included, are referenced by offset or unknown
+    }
+
+    // --------------------------------------------------------------------------------
+    // Validation. The kernel is only modified once every section is known to be
+    // consistent, a corrupted file must not leave a partially loaded scene
+    // --------------------------------------------------------------------------------
+    const int nbActiveTextures = kernel.getNbActiveTextures();
+    const uint64_t nbTextures = textures ? textures->count : 0;
+    if (nbTextures > NB_MAX_TEXTURES - nbActiveTextures)
+    {
+        LOG_ERROR("Too many textures in " << filename);
+        return false;
+    }
+    const IrtTexture *textureRecords = textures ? reinterpret_cast<const IrtTexture *>(data + textures->offset) : 0;
+    for (uint64_t i = 0; i < nbTextures; ++i)
+    {
+        const IrtTexture &record = textureRecords[i];
+        if (record.size[0] <= 0 || record.size[1] <= 0 || record.size[2] <= 0 || record.size[2] > gMaxColorDepth ||
+            record.type < tex_diffuse || record.type > tex_transparent || record.compression < tc_none ||
+            record.compression > tc_bc3)
+        {
+            LOG_ERROR("Corrupted texture " << i << " in " << filename);
+            return false;
+        }
+
+        // Only the full resolution level is stored, in the encoding of the texture
+        const size_t imageSize = textureLevelSize(record.size[0], record.size[1], record.size[2],
+                                                  static_cast<TextureCompression>(record.compression));
+        if (record.dataOffset > file.size() || imageSize > file.size() - record.dataOffset)
+        {
+            LOG_ERROR("Corrupted texture " << i << " in " << filename);
+            return false;
+        }
+    }
+
+    const IrtMaterial *materialRecords =
+        materials ? reinterpret_cast<const IrtMaterial *>(data + materials->offset) : 0;
+    for (uint64_t i = 0; materials && i < materials->count; ++i)
+    {
+        const IrtMaterial &record = materialRecords[i];
+        bool valid = record.id >= 0 && static_cast<uint64_t>(record.id) < NB_MAX_MATERIALS;
+        for (int j = 0; j < 4; ++j)
+            valid = valid && validTextureId(record.textureIds[j], nbTextures) &&
+                    validTextureId(record.advancedTextureIds[j], nbTextures);
+        if (!valid)
+        {
+            LOG_ERROR("Corrupted material " << i << " in " << filename);
+            return false;
+        }
+    }
+
+    // Meshes are not saved, instances of them cannot be loaded
+    const IrtPrimitive *primitiveRecords =
+        primitives ? reinterpret_cast<const IrtPrimitive *>(data + primitives->offset) : 0;
+    for (uint64_t i = 0; primitives && i < primitives->count; ++i)
+    {
+        const IrtPrimitive &record = primitiveRecords[i];
+        if (record.type < ptSphere || record.type >= ptInstance ||
+            (record.materialId != MATERIAL_NONE &&
+             (record.materialId < 0 || static_cast<uint64_t>(record.materialId) >= NB_MAX_MATERIALS)))
+        {
+            LOG_ERROR("Corrupted primitive " << i << " in " << filename);
+            return false;
+        }
+    }
+
+    // --------------------------------------------------------------------------------
+    // Primitives
+    // --------------------------------------------------------------------------------
+    if (primitives && primitives->count != 0)
+    {
+        const size_t count = static_cast<size_t>(primitives->count);
+        LOG_INFO(1, " - Primitives......: " << count);
+        // Records can only be added in place when they do not need to be moved
+        const bool centered = (center.x == 0.f && center.y == 0.f && center.z == 0.f);
+        int first = -1;
+        if (NATIVE_PRIMITIVES && centered)
+            first = kernel.addPrimitives(count, reinterpret_cast<const CPUPrimitive *>(primitiveRecords));
+        else
+        {
+            const size_t batchSize = 4096;
+            std::vector<CPUPrimitive> batch(std::min(count, batchSize));
+            for (size_t i = 0; i < count; i += batch.size())
+            {
+                const size_t n = std::min(batch.size(), count - i);
+                for (size_t j = 0; j < n; ++j)
+                {
+                    CPUPrimitive &primitive = batch[j];
+                    toPrimitive(primitive, primitiveRecords[i + j]);
+                    primitive.p0.x += center.x;
+                    primitive.p0.y += center.y;
+                    primitive.p0.z += center.z;
+                    primitive.p1.x += center.x;
+                    primitive.p1.y += center.y;
+                    primitive.p1.z += center.z;
+                    primitive.p2.x += center.x;
+                    primitive.p2.y += center.y;
+                    primitive.p2.z += center.z;
+                }
+                const int index = kernel.addPrimitives(n, batch.data());
+                if (i == 0)
+                    first = index;
+            }
+        }
+
+        // Hierarchy saved for these primitives, indices are relative to the
+        // first loaded primitive
+        if (first != -1 && bvhNodes && bvhOrder && header.primitivesHash != 0 &&
+            hashData(data + primitives->offset, primitives->size, HASH_SEED) == header.primitivesHash &&
+            hashData(data + bvhOrder->offset, bvhOrder->size,
+                     hashData(data + bvhNodes->offset, bvhNodes->size, HASH_SEED)) == header.bvhHash)
+        {
+            const IrtNode *nodeRecords = reinterpret_cast<const IrtNode *>(data + bvhNodes->offset);
+            BVHNodes nodes(static_cast<size_t>(bvhNodes->count));
+            for (size_t i = 0; i < nodes.size(); ++i)
+            {
+                BVHNode &node = nodes[i];
+                memset(&node, 0, sizeof(BVHNode));
+                node.nbPrimitives = nodeRecords[i].nbPrimitives;
+                node.startIndex = nodeRecords[i].startIndex;
+                node.indexForNextBox = nodeRecords[i].indexForNextBox;
+            }
+            const uint32_t *orderRecords = reinterpret_cast<const uint32_t *>(data + bvhOrder->offset);
+            std::vector<long> order(static_cast<size_t>(bvhOrder->count));
+            for (size_t i = 0; i < order.size(); ++i)
+                order[i] = first + static_cast<long>(orderRecords[i]);
+            LOG_INFO(1, " - BVH nodes.......: " << nodes.size());
+            kernel.setBVH(std::move(nodes), std::move(order));
+        }
+
+        min.x = std::min(min.x, header.boundsMin[0]);
+        min.y = std::min(min.y, header.boundsMin[1]);
+        min.z = std::min(min.z, header.boundsMin[2]);
+        max.x = std::max(max.x, header.boundsMax[0]);
+        max.y = std::max(max.y, header.boundsMax[1]);
+        max.z = std::max(max.z, header.boundsMax[2]);
+    }
+
+    // --------------------------------------------------------------------------------
+    // Textures
+    // --------------------------------------------------------------------------------
+    if (textures)
+    {
+        LOG_INFO(1, " - Textures........: " << textures->count);
+        for (uint64_t i = 0; i < textures->count; ++i)
+        {
+            const IrtTexture &record = textureRecords[i];
+            TextureInfo texInfo;
+            memset(&texInfo, 0, sizeof(TextureInfo));
+            texInfo.size = make_vec3i(record.size[0], record.size[1], record.size[2]);
+            texInfo.type = static_cast<TextureType>(record.type);
+            texInfo.compression = static_cast<TextureCompression>(record.compression);
+            texInfo.buffer = const_cast<BitmapBuffer *>(data + record.dataOffset);
+            LOG_INFO(3, "Texture " << i << " of size " << texInfo.size.x << "x" << texInfo.size.y << "x"
+                                   << texInfo.size.z << " loaded into slot " << nbActiveTextures + i);
+            kernel.setTexture(nbActiveTextures + static_cast<int>(i), texInfo);
+        }
+    }
+
+    // --------------------------------------------------------------------------------
+    // Materials
+    // --------------------------------------------------------------------------------
+    if (materials)
+    {
+        LOG_INFO(1, " - Materials.......: " << materials->count);
+        for (uint64_t i = 0; i < materials->count; ++i)
+        {
+            Material material;
+            toMaterial(material, materialRecords[i]);
+            offsetTextureId(material.textureIds.x, nbActiveTextures);
+            offsetTextureId(material.textureIds.y, nbActiveTextures);
+            offsetTextureId(material.textureIds.z, nbActiveTextures);
+            offsetTextureId(material.textureIds.w, nbActiveTextures);
+            offsetTextureId(material.advancedTextureIds.x, nbActiveTextures);
+            offsetTextureId(material.advancedTextureIds.y, nbActiveTextures);
+            offsetTextureId(material.advancedTextureIds.z, nbActiveTextures);
+            kernel.setMaterial(static_cast<unsigned int>(materialRecords[i].id), material);
+        }
+    }
+    return true;
+}
+
+bool FileMarshaller::loadLegacyFile(GPUKernel &kernel, const std::string &filename, const vec4f &center, vec4f &min,
+                                    vec4f &max)
+{
     std::ifstream myfile;
     myfile.open(filename.c_str(), std::ifstream::binary);
     if (myfile.is_open())
@@ -75,7 +623,7 @@ vec4f FileMarshaller::loadFromFile(GPUKernel &kernel, const std::string &filenam
         {
             LOG_ERROR("File not compatible with current engine");
             myfile.close();
-            return returnValue;
+            return false;
         }
 
         SceneInfo sceneInfo;
@@ -138,7 +686,9 @@ vec4f FileMarshaller::loadFromFile(GPUKernel &kernel, const std::string &filenam
             LOG_INFO(3, "Texture with id " << id << " and size: " << texInfo.size.x << "x" << texInfo.size.y << "x"
                                            << texInfo.size.z << " loaded into slot " << nbActiveTextures + i);
 
-            size_t imageSize = texInfo.size.x * texInfo.size.y * texInfo.size.z;
+            // Only the full resolution level is stored, in the encoding of the texture
+            texInfo.levels = 0;
+            size_t imageSize = textureBufferSize(texInfo);
             texInfo.buffer = new BitmapBuffer[imageSize];
             myfile.read((char *)texInfo.buffer, imageSize);
 
@@ -173,147 +723,217 @@ vec4f FileMarshaller::loadFromFile(GPUKernel &kernel, const std::string &filenam
                 material.advancedTextureIds.y += nbActiveTextures;
             if (material.advancedTextureIds.z != TEXTURE_NONE)
                 material.advancedTextureIds.z += nbActiveTextures;
-            if (material.advancedTextureIds.w != TEXTURE_NONE)
-                material.advancedTextureIds.w += nbActiveTextures;
             LOG_INFO(3, "Loading material " << id << " (" << material.textureIds.x << "," << material.textureIds.y
                                             << "," << material.textureIds.z << "," << material.textureIds.w
                                             << material.advancedTextureIds.x << "," << material.advancedTextureIds.y
-                                            << "," << material.advancedTextureIds.z << ","
-                                            << material.advancedTextureIds.w << ")");
+                                            << "," << material.advancedTextureIds.z << ")");
             kernel.setMaterial(static_cast<unsigned int>(id), material);
         }
     }
+    const bool loaded = myfile.is_open();
     myfile.close();
-    LOG_INFO(3, "File " << filename << " successfully loaded!");
-
-    // Object size
-    returnValue.x = fabs(max.x - min.x);
-    returnValue.y = fabs(max.y - min.y);
-    returnValue.z = fabs(max.z - min.z);
-
-    // Resize to fit required size
-    float ratio = scale / returnValue.y; // std::max(returnValue.x,std::max(returnValue.y,returnValue.z));
-    kernel.scalePrimitives(ratio, 0, NB_MAX_BOXES);
-
-    LOG_INFO(3, "Object size: " << returnValue.x << ", " << returnValue.y << ", " << returnValue.z);
-    return returnValue;
+    return loaded;
 }
 
-void FileMarshaller::saveToFile(GPUKernel &kernel, const std::string &filename)
+void FileMarshaller::saveToFile(GPUKernel &kernel, const std::string &filename, const bool saveAccelerationStructure)
 {
     LOG_INFO(1, "Saving 3D scene to " << filename);
-    std::ofstream myfile;
-    myfile.open(filename.c_str(), std::ifstream::binary);
-    if (myfile.is_open())
+    if (!isLittleEndian())
     {
-        // Format version
-        size_t version = FORMAT_VERSION;
-        myfile.write((char *)&version, sizeof(size_t));
-
-        std::map<size_t, Material *> materials;
+        LOG_ERROR("Scene files can only be written on little-endian platforms");
+        return;
+    }
 
-        // Scene
-        SceneInfo &sceneInfo = kernel.getSceneInfo();
-        myfile.write((char *)&sceneInfo, sizeof(SceneInfo));
+    std::ofstream myfile;
+    myfile.open(filename.c_str(), std::ofstream::binary);
+    if (!myfile.is_open())
+    {
+        LOG_ERROR("Failed to open " << filename);
+        return;
+    }
 
-        // Primitives
-        // Count primitives belonging to the model
-        size_t nbTotalPrimitives = kernel.getNbActivePrimitives();
-        size_t nbPrimitives(0);
-        for (int i(0); i < nbTotalPrimitives; ++i)
+    IrtHeader header;
+    memset(&header, 0, sizeof(IrtHeader));
+    memcpy(header.magic, IRT_MAGIC, sizeof(IRT_MAGIC));
+    header.version = IRT_VERSION;
+    for (int i = 0; i < 3; ++i)
+    {
+        header.boundsMin[i] = std::numeric_limits<float>::max();
+        header.boundsMax[i] = -std::numeric_limits<float>::max();
+    }
+    myfile.write((char *)&header, sizeof(IrtHeader));
+    std::vector<IrtChunk> chunks;
+
+    // --------------------------------------------------------------------------------
+    // Primitives belonging to the model
+    // --------------------------------------------------------------------------------
+    // Primitives of the hierarchy are renumbered as they are saved
+    BVHNodes nodes;
+    std::vector<long> order;
+    bool saveBVH = saveAccelerationStructure && kernel.getBVH(nodes, order);
+
+    IrtChunk primitives = {TAG_PRIMITIVES, sizeof(IrtPrimitive), 0, alignStream(myfile), 0};
+    std::map<int, Material> materials;
+    const size_t nbTotalPrimitives = kernel.getNbActivePrimitives();
+    std::vector<int64_t> savedIndices(saveBVH ? nbTotalPrimitives : 0, -1);
+    uint64_t hash = HASH_SEED;
+    const size_t batchSize = 4096;
+    std::vector<IrtPrimitive> batch;
+    batch.reserve(batchSize);
+    for (size_t i = 0; i < nbTotalPrimitives; ++i)
+    {
+        CPUPrimitive primitive;
+        if (!kernel.getPrimitive(static_cast<unsigned int>(i), primitive) || !primitive.belongsToModel)
+            continue;
+
+        IrtPrimitive record;
+        fromPrimitive(record, primitive);
+        record.movable = 0;
+        if (saveBVH)
+            savedIndices[i] = static_cast<int64_t>(primitives.count + batch.size());
+        batch.push_back(record);
+        for (int j = 0; j < 3; ++j)
         {
-            if (kernel.getPrimitive(i)->belongsToModel)
-                ++nbPrimitives;
+            const float pmin = std::min(std::min(record.p0[j], record.p1[j]), record.p2[j]);
+            const float pmax = std::max(std::max(record.p0[j], record.p1[j]), record.p2[j]);
+            header.boundsMin[j] = std::min(header.boundsMin[j], pmin);
+            header.boundsMax[j] = std::max(header.boundsMax[j], pmax);
         }
-
-        myfile.write((char *)&nbPrimitives, sizeof(size_t));
-        LOG_INFO(1, "Saving " << nbPrimitives << " primitives");
-
-        // Identify used materials
-        std::map<int, int> materialIndexMapping;
-        for (int i(0); i < nbPrimitives; ++i)
+        if (materials.find(primitive.materialId) == materials.end())
         {
-            CPUPrimitive *primitive = kernel.getPrimitive(i);
-            myfile.write((char *)primitive, sizeof(CPUPrimitive));
-            materials[primitive->materialId] = kernel.getMaterial(primitive->materialId);
+            const Material *material = kernel.getMaterial(primitive.materialId);
+            if (material)
+                materials[primitive.materialId] = *material;
         }
-
-        // Determine textures in use
-        std::map<size_t, TextureInfo> textures;
-        for (auto material : materials)
+        if (batch.size() == batchSize)
         {
-            if (material.second->textureIds.x != TEXTURE_NONE)
-                textures[material.second->textureIds.x] = kernel.getTextureInformation(material.second->textureIds.x);
-            if (material.second->textureIds.y != TEXTURE_NONE)
-                textures[material.second->textureIds.y] = kernel.getTextureInformation(material.second->textureIds.y);
-            if (material.second->textureIds.z != TEXTURE_NONE)
-                textures[material.second->textureIds.z] = kernel.getTextureInformation(material.second->textureIds.z);
-            if (material.second->textureIds.w != TEXTURE_NONE)
-                textures[material.second->textureIds.w] = kernel.getTextureInformation(material.second->textureIds.w);
-            if (material.second->advancedTextureIds.x != TEXTURE_NONE)
-                textures[material.second->advancedTextureIds.x] =
-                    kernel.getTextureInformation(material.second->advancedTextureIds.x);
-            if (material.second->advancedTextureIds.y != TEXTURE_NONE)
-                textures[material.second->advancedTextureIds.y] =
-                    kernel.getTextureInformation(material.second->advancedTextureIds.y);
-            if (material.second->advancedTextureIds.z != TEXTURE_NONE)
-                textures[material.second->advancedTextureIds.z] =
-                    kernel.getTextureInformation(material.second->advancedTextureIds.z);
-            if (material.second->advancedTextureIds.w != TEXTURE_NONE)
-                textures[material.second->advancedTextureIds.w] =
-                    kernel.getTextureInformation(material.second->advancedTextureIds.w);
+            hash = hashData((const unsigned char *)batch.data(), batch.size() * sizeof(IrtPrimitive), hash);
+            myfile.write((char *)batch.data(), batch.size() * sizeof(IrtPrimitive));
+            primitives.count += batch.size();
+            batch.clear();
         }
-
-        // Write Textures
-        size_t nbTextures = textures.size();
-        myfile.write((char *)&nbTextures, sizeof(size_t));
-        LOG_INFO(1, "Saving " << nbTextures << " textures");
-
-        std::map<size_t, int> idMapping;
-        size_t index(0);
-        idMapping[TEXTURE_NONE] = TEXTURE_NONE;
-        for (const auto &texture : textures)
+    }
+    hash = hashData((const unsigned char *)batch.data(), batch.size() * sizeof(IrtPrimitive), hash);
+    myfile.write((char *)batch.data(), batch.size() * sizeof(IrtPrimitive));
+    primitives.count += batch.size();
+    primitives.size = primitives.count * sizeof(IrtPrimitive);
+    chunks.push_back(primitives);
+    LOG_INFO(1, "Saving " << primitives.count << " primitives");
+
+    // --------------------------------------------------------------------------------
+    // Hierarchy of the primitives of the model
+    // --------------------------------------------------------------------------------
+    std::vector<uint32_t> orderRecords(saveBVH ? order.size() : 0);
+    for (size_t i = 0; saveBVH && i < order.size(); ++i)
+    {
+        const long p = order[i];
+        saveBVH = (p >= 0 && static_cast<size_t>(p) < savedIndices.size() && savedIndices[p] != -1);
+        if (saveBVH)
+            orderRecords[i] = static_cast<uint32_t>(savedIndices[p]);
+    }
+    if (saveBVH)
+    {
+        LOG_INFO(1, "Saving " << nodes.size() << " BVH nodes");
+        std::vector<IrtNode> nodeRecords(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i)
         {
-            TextureInfo texInfo = texture.second;
-            BitmapBuffer *savedBuffer = texInfo.buffer;
-            texInfo.buffer = 0;
-            texInfo.offset = 0;
-            size_t id = texture.first;
-            idMapping[id] = static_cast<int>(index);
-            LOG_INFO(1, "Texture " << id << ": " << texInfo.size.x << "x" << texInfo.size.y << "x" << texInfo.size.z
-                                   << " saved with id " << index);
-            myfile.write((char *)(&index), sizeof(size_t));
-            myfile.write((char *)(&texInfo), sizeof(TextureInfo));
-            myfile.write((char *)(savedBuffer), texInfo.size.x * texInfo.size.y * texInfo.size.z);
-            ++index;
+            memset(&nodeRecords[i], 0, sizeof(IrtNode));
+            nodeRecords[i].nbPrimitives = nodes[i].nbPrimitives;
+            nodeRecords[i].startIndex = nodes[i].startIndex;
+            nodeRecords[i].indexForNextBox = nodes[i].indexForNextBox;
         }
+        IrtChunk nodeChunk = {TAG_BVH_NODES, sizeof(IrtNode), nodeRecords.size(), alignStream(myfile),
+                              nodeRecords.size() * sizeof(IrtNode)};
+        myfile.write((char *)nodeRecords.data(), nodeChunk.size);
+        chunks.push_back(nodeChunk);
+
+        IrtChunk orderChunk = {TAG_BVH_ORDER, sizeof(uint32_t), orderRecords.size(), alignStream(myfile),
+                               orderRecords.size() * sizeof(uint32_t)};
+        myfile.write((char *)orderRecords.data(), orderChunk.size);
+        chunks.push_back(orderChunk);
+        header.primitivesHash = hash;
+        header.bvhHash = hashData((const unsigned char *)orderRecords.data(), orderChunk.size,
+                                  hashData((const unsigned char *)nodeRecords.data(), nodeChunk.size, HASH_SEED));
+    }
 
-        // Write Materials
-        size_t nbMaterials = materials.size();
-        myfile.write((char *)&nbMaterials, sizeof(size_t));
-        LOG_INFO(1, "Saving " << nbMaterials << " materials");
-
-        for (const auto &material : materials)
-        {
-            material.second->textureIds.x = idMapping[material.second->textureIds.x];
-            material.second->textureIds.y = idMapping[material.second->textureIds.y];
-            material.second->textureIds.z = idMapping[material.second->textureIds.z];
-            material.second->textureIds.w = idMapping[material.second->textureIds.w];
-            material.second->advancedTextureIds.x = idMapping[material.second->advancedTextureIds.x];
-            material.second->advancedTextureIds.y = idMapping[material.second->advancedTextureIds.y];
-            material.second->advancedTextureIds.z = idMapping[material.second->advancedTextureIds.z];
-            material.second->advancedTextureIds.w = idMapping[material.second->advancedTextureIds.w];
-            myfile.write((char *)&(material.first), sizeof(size_t));
-            myfile.write((char *)(material.second), sizeof(Material));
-            LOG_INFO(1, "Saving material "
-                            << material.first << " (" << material.second->textureIds.x << ","
-                            << material.second->textureIds.y << "," << material.second->textureIds.z << ","
-                            << material.second->textureIds.w << "," << material.second->advancedTextureIds.x << ","
-                            << material.second->advancedTextureIds.y << "," << material.second->advancedTextureIds.z
-                            << "," << material.second->advancedTextureIds.w << ")");
-        }
+    // --------------------------------------------------------------------------------
+    // Textures used by the materials, texels first
+    // --------------------------------------------------------------------------------
+    std::map<size_t, TextureInfo> textures;
+    for (const auto &material : materials)
+    {
+        const int ids[] = {material.second.textureIds.x,         material.second.textureIds.y,
+                           material.second.textureIds.z,         material.second.textureIds.w,
+                           material.second.advancedTextureIds.x, material.second.advancedTextureIds.y,
+                           material.second.advancedTextureIds.z};
+        for (const int id : ids)
+            if (id != TEXTURE_NONE)
+                textures[id] = kernel.getTextureInformation(id);
+    }
+    LOG_INFO(1, "Saving " << textures.size() << " textures");
 
-        myfile.close();
+    std::map<size_t, int> idMapping;
+    std::vector<IrtTexture> textureRecords;
+    IrtChunk texels = {TAG_TEXELS, 1, 0, alignStream(myfile), 0};
+    for (const auto &texture : textures)
+    {
+        TextureInfo texInfo = texture.second;
+        texInfo.levels = 0;
+        IrtTexture record;
+        memset(&record, 0, sizeof(IrtTexture));
+        record.size[0] = texInfo.size.x;
+        record.size[1] = texInfo.size.y;
+        record.size[2] = texInfo.size.z;
+        record.type = texInfo.type;
+        record.compression = texInfo.compression;
+        record.dataOffset = alignStream(myfile);
+        const size_t imageSize = textureBufferSize(texInfo);
+        myfile.write((char *)texInfo.buffer, imageSize);
+
+        idMapping[texture.first] = static_cast<int>(textureRecords.size());
+        LOG_INFO(1, "Texture " << texture.first << ": " << texInfo.size.x << "x" << texInfo.size.y << "x"
+                               << texInfo.size.z << " saved with id " << textureRecords.size());
+        textureRecords.push_back(record);
     }
+    texels.count = static_cast<uint64_t>(myfile.tellp()) - texels.offset;
+    texels.size = texels.count;
+    chunks.push_back(texels);
+
+    IrtChunk textureChunk = {TAG_TEXTURES, sizeof(IrtTexture), textureRecords.size(), alignStream(myfile),
+                             textureRecords.size() * sizeof(IrtTexture)};
+    myfile.write((char *)textureRecords.data(), textureChunk.size);
+    chunks.push_back(textureChunk);
+
+    // --------------------------------------------------------------------------------
+    // Materials, with texture ids relative to the saved textures
+    // --------------------------------------------------------------------------------
+    LOG_INFO(1, "Saving " << materials.size() << " materials");
+    IrtChunk materialChunk = {TAG_MATERIALS, sizeof(IrtMaterial), materials.size(), alignStream(myfile),
+                              materials.size() * sizeof(IrtMaterial)};
+    for (auto &material : materials)
+    {
+        Material &m = material.second;
+        remapTextureId(m.textureIds.x, idMapping);
+        remapTextureId(m.textureIds.y, idMapping);
+        remapTextureId(m.textureIds.z, idMapping);
+        remapTextureId(m.textureIds.w, idMapping);
+        remapTextureId(m.advancedTextureIds.x, idMapping);
+        remapTextureId(m.advancedTextureIds.y, idMapping);
+        remapTextureId(m.advancedTextureIds.z, idMapping);
+        IrtMaterial record;
+        fromMaterial(record, material.first, m);
+        myfile.write((char *)&record, sizeof(IrtMaterial));
+    }
+    chunks.push_back(materialChunk);
+
+    // --------------------------------------------------------------------------------
+    // Chunk table, and header pointing to it
+    // --------------------------------------------------------------------------------
+    header.chunkTableOffset = alignStream(myfile);
+    header.nbChunks = static_cast<uint32_t>(chunks.size());
+    myfile.write((char *)chunks.data(), chunks.size() * sizeof(IrtChunk));
+    myfile.seekp(0);
+    myfile.write((char *)&header, sizeof(IrtHeader));
+    myfile.close();
 }
 }
@@ -24,6 +24,14 @@
 
 namespace solr
 {
+// IRT scene files are written in version 3 of the format: a 64 byte header,
+// followed by sections of fixed width little-endian records, each aligned on 64
+// bytes, and a table describing the sections (see IrtChunk). Files are mapped
+// in memory when loaded, primitives are copied from the mapping to the
+// primitive storage of the kernel without being parsed when the record layout
+// matches the one of the engine. The top level hierarchy of the SAH builder
+// can be saved with the primitives, it is then imported by the kernel instead
+// of being built again. Versions 1 and 2 can still be loaded
 class SOLR_API FileMarshaller
 {
 public:
@@ -31,6 +39,12 @@ public:
     ~FileMarshaller() {}
 public:
     vec4f loadFromFile(GPUKernel &kernel, const std::string &filename, const vec4f &center, const float scale);
-    void saveToFile(GPUKernel &kernel, const std::string &filename);
+    void saveToFile(GPUKernel &kernel, const std::string &filename, const bool saveAccelerationStructure = true);
+
+private:
+    bool loadChunkedFile(GPUKernel &kernel, const std::string &filename, const vec4f &center, vec4f &min,
+                         vec4f &max);
+    bool loadLegacyFile(GPUKernel &kernel, const std::string &filename, const vec4f &center, vec4f &min,
+                        vec4f &max);
 };
 }
@@ -0,0 +1,113 @@
+/* Copyright (c) 2011-2017, Cyrille Favreau
+ * All rights reserved. Do not distribute without permission.
+ * Responsible Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+ *
+ * This file is part of Sol-R <https://github.com/cyrillefavreau/Sol-R>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#ifdef WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <string>
+
+namespace solr
+{
+// Read only mapping of a whole file in memory. data() is NULL when the file
+// cannot be opened or is empty
+class MappedFile
+{
+public:
+    MappedFile(const std::string &filename)
+        : m_data(0)
+        , m_size(0)
+    {
+#ifdef WIN32
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        m_mapping = NULL;
+        if (m_file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return;
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_mapping == NULL)
+            return;
+        m_data = static_cast<const unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (m_data)
+            m_size = static_cast<size_t>(size.QuadPart);
+#else
+        m_file = open(filename.c_str(), O_RDONLY);
+        if (m_file == -1)
+            return;
+        struct stat status;
+        if (fstat(m_file, &status) != 0 || status.st_size == 0)
+            return;
+        void *data = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+        if (data == MAP_FAILED)
+            return;
+        // Sections are read front to back
+        madvise(data, status.st_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const unsigned char *>(data);
+        m_size = static_cast<size_t>(status.st_size);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping != NULL)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_data)
+            munmap(const_cast<unsigned char *>(m_data), m_size);
+        if (m_file != -1)
+            close(m_file);
+#endif
+    }
+
+    const unsigned char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    // The file and its mapping are released once
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+#ifdef WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_file;
+#endif
+    const unsigned char *m_data;
+    size_t m_size;
+};
+}
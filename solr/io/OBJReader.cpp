@@ -19,23 +19,421 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <math.h>
+#include <sstream>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <tuple>
 #include <vector>
 
 #include "../Consts.h"
 #include "../Logging.h"
 
+#include "MappedFile.h"
 #include "OBJReader.h"
 
 namespace solr
 {
-const int NB_MAX_FACES = static_cast<int>(NB_MAX_PRIMITIVES * 0.9f); // Max number of faces
+/*
+________________________________________________________________________________
+
+Indexed mesh under construction. Face corners sharing the same vertex, texture
+coordinates and normal are welded into a single mesh vertex
+________________________________________________________________________________
+*/
+struct IndexedMesh
+{
+    vec3fs vertices;
+    vec3fs normals;
+    vec2fs textureCoordinates;
+    vec4is triangles;
+    std::map<std::tuple<int, int, int>, int> corners;
+};
+
+int weldCorner(IndexedMesh &mesh, const vec4i &corner, const vec3f &vertex, const vec3f &normal,
+               const vec2f &textureCoordinates)
+{
+    const std::tuple<int, int, int> key(corner.x, corner.y, corner.z);
+    std::map<std::tuple<int, int, int>, int>::const_iterator it = mesh.corners.find(key);
+    if (it != mesh.corners.end())
+        return it->second;
+
+    const int index = static_cast<int>(mesh.vertices.size());
+    mesh.vertices.push_back(vertex);
+    mesh.normals.push_back(normal);
+    mesh.textureCoordinates.push_back(textureCoordinates);
+    mesh.corners[key] = index;
+    return index;
+}
+
+/*
+________________________________________________________________________________
+
+Streaming parser. The file is mapped in memory and cut into chunks on line
+boundaries. Chunks are parsed in parallel into flat arrays, then faces are
+resolved against the concatenated vertices, normals and texture coordinates
+________________________________________________________________________________
+*/
+namespace
+{
+const size_t OBJ_CHUNK_SIZE = 1 << 20;             // Bytes of text parsed by each task
+const size_t OBJ_TRIANGLE_BATCH = 1 << 20;         // Triangles handed to the kernel at once
+const int OBJ_MAX_FAST_EXPONENT = 22;              // Powers of 10 exactly represented by a double
+const uint64_t OBJ_MAX_FAST_MANTISSA = 1ULL << 53; // Integers exactly represented by a double
+
+enum ObjStatementType
+{
+    ostGroup,
+    ostMaterial
+};
+
+// g and usemtl statements, applied in file order to the faces that follow them
+struct ObjStatement
+{
+    ObjStatementType type;
+    size_t face; // Number of faces of the chunk preceding the statement
+    std::string value;
+};
+
+struct ObjFace
+{
+    size_t firstCorner;
+    unsigned int nbCorners;
+    int statement; // Last statement of the chunk preceding the face, -1 if none
+};
+
+struct ObjState
+{
+    int material;
+    bool light;
+};
+
+struct ObjChunk
+{
+    const char *begin;
+    const char *end;
+
+    // Parsed data
+    std::vector<float> vertices;           // x, y, z
+    std::vector<float> normals;            // x, y, z
+    std::vector<float> textureCoordinates; // u, v
+    std::vector<int> corners;              // vertex, texture coordinates and normal indices
+    std::vector<size_t> relativeCorners;   // Corners given with negative indices
+    std::vector<ObjFace> faces;
+    std::vector<ObjStatement> statements;
+    std::vector<std::string> materialLibraries;
+    float aabb[2][3];
+    bool hasLights;
+
+    // Resolved data
+    ObjState entry;
+    std::vector<ObjState> states;
+    size_t nbTriangles;
+};
+
+inline bool isBlank(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool isDigit(const char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline const char *skipBlanks(const char *p, const char *end)
+{
+    while (p < end && isBlank(*p))
+        ++p;
+    return p;
+}
+
+inline const char *skipToken(const char *p, const char *end)
+{
+    while (p < end && !isBlank(*p))
+        ++p;
+    return p;
+}
+
+bool startsWith(const char *p, const char *end, const char *keyword)
+{
+    const size_t length = strlen(keyword);
+    return static_cast<size_t>(end - p) >= length && memcmp(p, keyword, length) == 0;
+}
+
+// ----------
+// Parses the float starting at p and moves p to the end of the token. Values
+// with short mantissas and exponents are computed with a single rounding from
+// their digits, others are left to strtod. Both match atof
+// ----------
+float parseFloat(const char *&p, const char *end)
+{
+    static const double powers[OBJ_MAX_FAST_EXPONENT + 1] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                                             1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                                             1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *token = p;
+    const char *q = p;
+    const bool negative = (q < end && *q == '-');
+    if (q < end && (*q == '-' || *q == '+'))
+        ++q;
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool hasDigits = false;
+    bool exact = true;
+    for (; q < end && isDigit(*q); ++q)
+    {
+        hasDigits = true;
+        if (mantissa < OBJ_MAX_FAST_MANTISSA / 10)
+            mantissa = mantissa * 10 + (*q - '0');
+        else
+            exact = false;
+    }
+    if (q < end && *q == '.')
+        for (++q; q < end && isDigit(*q); ++q)
+        {
+            hasDigits = true;
+            if (mantissa < OBJ_MAX_FAST_MANTISSA / 10)
+            {
+                mantissa = mantissa * 10 + (*q - '0');
+                --exponent;
+            }
+            else
+                exact = false;
+        }
+    if (hasDigits && q + 1 < end && (*q == 'e' || *q == 'E'))
+    {
+        const char *e = q + 1;
+        const bool negativeExponent = (*e == '-');
+        if (*e == '-' || *e == '+')
+            ++e;
+        if (e < end && isDigit(*e))
+        {
+            int value = 0;
+            for (; e < end && isDigit(*e); ++e)
+                value = std::min(value * 10 + (*e - '0'), 1000);
+            exponent += negativeExponent ? -value : value;
+            q = e;
+        }
+    }
+
+    p = skipToken(q, end);
+    if (hasDigits && exact && q == p && exponent >= -OBJ_MAX_FAST_EXPONENT && exponent <= OBJ_MAX_FAST_EXPONENT)
+    {
+        double value = static_cast<double>(mantissa);
+        value = (exponent < 0) ? value / powers[-exponent] : value * powers[exponent];
+        return static_cast<float>(negative ? -value : value);
+    }
+
+    // Long mantissas, large exponents, hexadecimal values, inf or nan
+    char buffer[128];
+    const size_t length = std::min(static_cast<size_t>(p - token), sizeof(buffer) - 1);
+    memcpy(buffer, token, length);
+    buffer[length] = 0;
+    return static_cast<float>(atof(buffer));
+}
+
+// ----------
+// Integer prefix of the token starting at p, as atoi. p is moved to the first
+// character that is not part of the integer
+// ----------
+inline int parseInt(const char *&p, const char *end)
+{
+    const bool negative = (p < end && *p == '-');
+    if (p < end && (*p == '-' || *p == '+'))
+        ++p;
+    int value = 0;
+    for (; p < end && isDigit(*p); ++p)
+        value = value * 10 + (*p - '0');
+    return negative ? -value : value;
+}
+
+// ----------
+// Parses up to the given number of floats of a v, vn or vt statement. Missing
+// values are set to 0
+// ----------
+inline void parseFloats(const char *p, const char *end, float *values, const int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        p = skipBlanks(p, end);
+        values[i] = (p < end) ? parseFloat(p, end) : 0.f;
+    }
+}
+
+// ----------
+// Parses the corners of a face statement (vertex/texture/normal indices, 1
+// based, 0 when missing). Negative indices are made relative to the first
+// element of the chunk and recorded so that they can be offset once the size
+// of the previous chunks is known
+// ----------
+void parseFace(ObjChunk &chunk, const char *p, const char *end, const int statement)
+{
+    ObjFace face;
+    face.firstCorner = chunk.corners.size() / 3;
+    face.nbCorners = 0;
+    face.statement = statement;
+    const size_t counts[3] = {chunk.vertices.size() / 3, chunk.textureCoordinates.size() / 2,
+                              chunk.normals.size() / 3};
+    while ((p = skipBlanks(p, end)) < end)
+    {
+        int corner[3] = {0, 0, 0};
+        for (int i = 0; i < 3 && p < end && !isBlank(*p); ++i)
+        {
+            corner[i] = parseInt(p, end);
+            if (corner[i] < 0)
+            {
+                corner[i] += static_cast<int>(counts[i]) + 1;
+                chunk.relativeCorners.push_back(chunk.corners.size() + i);
+            }
+            while (p < end && !isBlank(*p) && *p != '/')
+                ++p;
+            if (p < end && *p == '/')
+                ++p;
+        }
+        p = skipToken(p, end);
+        chunk.corners.insert(chunk.corners.end(), corner, corner + 3);
+        ++face.nbCorners;
+    }
+    chunk.faces.push_back(face);
+}
+
+// ----------
+// Parses the statements of a chunk. Only the statements used by the reader are
+// considered, others are ignored
+// ----------
+void parseChunk(ObjChunk &chunk, const bool loadMaterials)
+{
+    const char *p = chunk.begin;
+    while (p < chunk.end)
+    {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', chunk.end - p));
+        if (!eol)
+            eol = chunk.end;
+        const char *next = eol + (eol < chunk.end ? 1 : 0);
+        while (eol > p && eol[-1] == '\r')
+            --eol;
+        p = skipBlanks(p, eol);
+        if (eol - p > 1)
+        {
+            if (p[0] == 'v' && isBlank(p[1]))
+            {
+                float vertex[3];
+                parseFloats(p + 1, eol, vertex, 3);
+                vertex[2] = -vertex[2];
+                chunk.vertices.insert(chunk.vertices.end(), vertex, vertex + 3);
+                for (int i = 0; i < 3; ++i)
+                {
+                    chunk.aabb[0][i] = std::min(chunk.aabb[0][i], vertex[i]);
+                    chunk.aabb[1][i] = std::max(chunk.aabb[1][i], vertex[i]);
+                }
+            }
+            else if (p[0] == 'v' && p[1] == 'n')
+            {
+                float normal[3];
+                parseFloats(skipToken(p, eol), eol, normal, 3);
+                normal[2] = -normal[2];
+                chunk.normals.insert(chunk.normals.end(), normal, normal + 3);
+            }
+            else if (p[0] == 'v' && p[1] == 't')
+            {
+                float textureCoordinates[2];
+                parseFloats(skipToken(p, eol), eol, textureCoordinates, 2);
+                // Negative texture coordinates are wrapped
+                for (int i = 0; i < 2; ++i)
+                    if (textureCoordinates[i] < 0.f)
+                        textureCoordinates[i] = fabs(textureCoordinates[i]) -
+                                                static_cast<int>(fabs(textureCoordinates[i]));
+                chunk.textureCoordinates.insert(chunk.textureCoordinates.end(), textureCoordinates,
+                                                textureCoordinates + 2);
+            }
+            else if (p[0] == 'f' && isBlank(p[1]))
+                parseFace(chunk, p + 1, eol, static_cast<int>(chunk.statements.size()) - 1);
+            else if (p[0] == 'g' || (startsWith(p, eol, "usemtl") && eol - p > 7))
+            {
+                ObjStatement statement;
+                statement.type = (p[0] == 'g') ? ostGroup : ostMaterial;
+                statement.face = chunk.faces.size();
+                statement.value = (p[0] == 'g') ? std::string(p, eol) : std::string(p + 7, eol);
+                chunk.hasLights |= (statement.type == ostGroup && statement.value.find("SoL_R") != std::string::npos);
+                chunk.statements.push_back(statement);
+            }
+            else if (loadMaterials && startsWith(p, eol, "mtllib") && eol - p > 7)
+                chunk.materialLibraries.push_back(std::string(p + 7, eol));
+        }
+        p = next;
+    }
+}
+
+// ----------
+// Attribute of the given 1 based index. Out of range indices, including 0 for
+// missing attributes, return the zero element stored at the front of the array
+// ----------
+inline const float *getAttribute(const std::vector<float> &values, const int index, const size_t size)
+{
+    const size_t count = values.size() / size - 1;
+    return (index > 0 && static_cast<size_t>(index) <= count) ? &values[index * size] : &values[0];
+}
+
+// ----------
+// Center and scale of the object, from the bounds of its vertices in the file
+// ----------
+void placeObject(const CPUBoundingBox &aabb, const vec4f &objectPosition, const bool autoScale, const vec4f &scale,
+                 const bool autoCenter, vec4f &objectCenter, vec4f &objectScale)
+{
+    objectCenter = objectPosition;
+    objectScale = scale;
+    if (autoScale)
+    {
+        float os = std::max(aabb.parameters[1].x - aabb.parameters[0].x,
+                            std::max(aabb.parameters[1].y - aabb.parameters[0].y,
+                                     aabb.parameters[1].z - aabb.parameters[0].z));
+        objectScale.x = scale.x / os;
+        objectScale.y = scale.y / os;
+        objectScale.z = scale.z / os;
+
+        if (autoCenter)
+        {
+            // Center align object
+            objectCenter.x = (aabb.parameters[0].x + aabb.parameters[1].x) / 2.f;
+            objectCenter.y = (aabb.parameters[0].y + aabb.parameters[1].y) / 2.f;
+            objectCenter.z = (aabb.parameters[0].z + aabb.parameters[1].z) / 2.f;
+        }
+    }
+}
+
+bool insideAABB(const CPUBoundingBox &aabb, const CPUBoundingBox &inAABB)
+{
+    return aabb.parameters[0].x >= inAABB.parameters[0].x && aabb.parameters[0].y >= inAABB.parameters[0].y &&
+           aabb.parameters[0].z >= inAABB.parameters[0].z && aabb.parameters[1].x <= inAABB.parameters[1].x &&
+           aabb.parameters[1].y <= inAABB.parameters[1].y && aabb.parameters[1].z <= inAABB.parameters[1].z;
+}
+
+// ----------
+// Shared meshes are stored in the space of the file, their instance scales,
+// centers and moves them to the requested position
+// ----------
+int addModelInstance(GPUKernel &kernel, const int meshId, const CPUBoundingBox &aabb, const vec4f &objectPosition,
+                     const bool autoScale, const vec4f &scale, const bool autoCenter, vec4f &objectSize)
+{
+    vec4f objectCenter;
+    vec4f objectScale;
+    placeObject(aabb, objectPosition, autoScale, scale, autoCenter, objectCenter, objectScale);
+    const vec3f translation = make_vec3f(objectPosition.x - objectScale.x * objectCenter.x,
+                                         objectPosition.y - objectScale.y * objectCenter.y,
+                                         objectPosition.z - objectScale.z * objectCenter.z);
+    objectSize.x = objectScale.x * (aabb.parameters[1].x - aabb.parameters[0].x);
+    objectSize.y = objectScale.y * (aabb.parameters[1].y - aabb.parameters[0].y);
+    objectSize.z = objectScale.z * (aabb.parameters[1].z - aabb.parameters[0].z);
+    return kernel.addInstance(meshId, translation, make_vec4f(), objectScale.x);
+}
+}
 
 OBJReader::OBJReader() {}
 
@@ -103,56 +501,6 @@ vec4i readFloat3(const std::string &face)
     return returnValue;
 }
 
-vec4i readFace(const std::string &face)
-{
-    vec4i returnValue = make_vec4i();
-    int item(0);
-    std::string value;
-    for (int i(0); i < face.length(); ++i)
-    {
-        if (face[i] != '/')
-            value += face[i];
-
-        if (face[i] == '/' /*|| i==(face.length()-1)*/)
-        {
-            switch (item)
-            {
-            case 0:
-                returnValue.x = (atoi(value.c_str()));
-                break;
-            case 1:
-                returnValue.y = (atoi(value.c_str()));
-                break;
-            case 2:
-                returnValue.z = (atoi(value.c_str()));
-                break;
-            }
-            ++item;
-            value = "";
-        }
-    }
-
-    if (value.length() != 0)
-    {
-        switch (item)
-        {
-        case 0:
-            returnValue.x = (atoi(value.c_str()));
-            break;
-        case 1:
-            returnValue.y = (atoi(value.c_str()));
-            break;
-        case 2:
-            returnValue.z = (atoi(value.c_str()));
-            break;
-        }
-    }
-
-    // std::cout << returnValue.x <<"," << returnValue.y << "," << returnValue.z
-    // << std::endl;
-    return returnValue;
-}
-
 unsigned int OBJReader::loadMaterialsFromFile(const std::string &filename,
                                               std::map<std::string, MaterialMTL> &materials, GPUKernel &kernel,
                                               int materialId)
@@ -409,15 +757,8 @@ vec4f OBJReader::loadModelFromFile(const std::string &filename, GPUKernel &kerne
                                    const CPUBoundingBox &inAABB)
 {
     LOG_INFO(1, "OBJ Filename.......: " << filename);
-    std::map<int, vec3f> vertices;
-    std::map<int, vec3f> normals;
-    std::map<int, vec2f> textureCoordinates;
     std::map<std::string, MaterialMTL> materials;
 
-    int index_vertices(1);
-    int index_normals(1);
-    int index_textureCoordinates(1);
-
     std::string noExtFilename(filename);
     size_t pos(noExtFilename.find(".obj"));
     if (pos != -1)
@@ -436,369 +777,405 @@ vec4f OBJReader::loadModelFromFile(const std::string &filename, GPUKernel &kerne
     aabb.parameters[1].y = -100000.f;
     aabb.parameters[1].z = -100000.f;
 
-    // Read vertices
-    std::ifstream file(modelFilename.c_str());
-    if (file.is_open())
+    // Models stored in an indexed mesh that are loaded again with the same
+    // materials only add an instance of that mesh
+    const bool indexed = kernel.getIndexedMeshes() && !allSpheres;
+    const bool uniformScale = (scale.x == scale.y && scale.y == scale.z);
+    std::ostringstream meshName;
+    meshName << modelFilename << ":" << loadMaterials << ":" << materialId;
+    const int sharedMeshId = (indexed && uniformScale) ? kernel.getMeshId(meshName.str()) : -1;
+    if (sharedMeshId != -1)
     {
-        while (file.good())
+        kernel.getMeshBounds(sharedMeshId, aabb.parameters[0], aabb.parameters[1]);
+        if (checkInAABB && !insideAABB(aabb, inAABB))
+            return objectSize;
+        const int instance = addModelInstance(kernel, sharedMeshId, aabb, objectPosition, autoScale, scale,
+                                              autoCenter, objectSize);
+        kernel.setPrimitiveBellongsToModel(instance, true);
+        LOG_INFO(1, " - Instance........: of mesh " << sharedMeshId);
+        LOG_INFO(1, " - Object size.....: " << objectSize.x << "," << objectSize.y << "," << objectSize.z);
+        return objectSize;
+    }
+
+    // Cut the file into chunks ending on line boundaries
+    const auto start = std::chrono::steady_clock::now();
+    MappedFile file(modelFilename);
+    const char *data = reinterpret_cast<const char *>(file.data());
+    std::vector<ObjChunk> chunks;
+    for (size_t begin = 0; begin < file.size();)
+    {
+        size_t end = std::min(begin + OBJ_CHUNK_SIZE, file.size());
+        const char *eol = static_cast<const char *>(memchr(data + end, '\n', file.size() - end));
+        end = eol ? eol - data + 1 : file.size();
+
+        ObjChunk chunk;
+        chunk.begin = data + begin;
+        chunk.end = data + end;
+        chunk.aabb[0][0] = chunk.aabb[0][1] = chunk.aabb[0][2] = aabb.parameters[0].x;
+        chunk.aabb[1][0] = chunk.aabb[1][1] = chunk.aabb[1][2] = aabb.parameters[1].x;
+        chunk.hasLights = false;
+        chunk.nbTriangles = 0;
+        chunks.push_back(chunk);
+        begin = end;
+    }
+    const int nbChunks = static_cast<int>(chunks.size());
+
+    // Read vertices, normals, texture coordinates and faces
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nbChunks; ++c)
+        parseChunk(chunks[c], loadMaterials);
+
+    // Concatenate attributes, the first element of each array is the one
+    // returned for missing or invalid indices
+    size_t counts[3] = {1, 1, 1};
+    std::vector<size_t> offsets(3 * nbChunks);
+    bool hasLights = false;
+    for (int c = 0; c < nbChunks; ++c)
+    {
+        ObjChunk &chunk = chunks[c];
+        offsets[3 * c] = counts[0];
+        offsets[3 * c + 1] = counts[1];
+        offsets[3 * c + 2] = counts[2];
+        counts[0] += chunk.vertices.size() / 3;
+        counts[1] += chunk.textureCoordinates.size() / 2;
+        counts[2] += chunk.normals.size() / 3;
+        hasLights |= chunk.hasLights;
+
+        aabb.parameters[0].x = std::min(aabb.parameters[0].x, chunk.aabb[0][0]);
+        aabb.parameters[0].y = std::min(aabb.parameters[0].y, chunk.aabb[0][1]);
+        aabb.parameters[0].z = std::min(aabb.parameters[0].z, chunk.aabb[0][2]);
+        aabb.parameters[1].x = std::max(aabb.parameters[1].x, chunk.aabb[1][0]);
+        aabb.parameters[1].y = std::max(aabb.parameters[1].y, chunk.aabb[1][1]);
+        aabb.parameters[1].z = std::max(aabb.parameters[1].z, chunk.aabb[1][2]);
+
+        for (size_t i = 0; i < chunk.materialLibraries.size(); ++i)
         {
-            std::string line;
-            std::getline(file, line);
-            line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-            if (line.length() > 1)
+            // Load materials
+            std::string folder = noExtFilename.substr(0, noExtFilename.rfind('/'));
+            std::string materialFileName = folder + '/' + chunk.materialLibraries[i];
+            loadMaterialsFromFile(materialFileName, materials, kernel, materialId);
+        }
+    }
+
+    std::vector<float> vertices(3 * counts[0], 0.f);
+    std::vector<float> textureCoordinates(2 * counts[1], 0.f);
+    std::vector<float> normals(3 * counts[2], 0.f);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nbChunks; ++c)
+    {
+        ObjChunk &chunk = chunks[c];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + 3 * offsets[3 * c]);
+        std::copy(chunk.textureCoordinates.begin(), chunk.textureCoordinates.end(),
+                  textureCoordinates.begin() + 2 * offsets[3 * c + 1]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + 3 * offsets[3 * c + 2]);
+        std::vector<float>().swap(chunk.vertices);
+        std::vector<float>().swap(chunk.textureCoordinates);
+        std::vector<float>().swap(chunk.normals);
+
+        // Negative indices become absolute
+        for (size_t i = 0; i < chunk.relativeCorners.size(); ++i)
+        {
+            const size_t corner = chunk.relativeCorners[i];
+            chunk.corners[corner] += static_cast<int>(offsets[3 * c + corner % 3]) - 1;
+        }
+    }
+
+    const float parsingTime =
+        std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO(1, " - Parsing.........: " << parsingTime << "ms, "
+                                        << file.size() / (1000.f * std::max(parsingTime, 1.f)) << "MB/s");
+
+    if (checkInAABB && !insideAABB(aabb, inAABB))
+        return objectSize;
+
+    // Scale object
+    vec4f objectCenter;
+    vec4f objectScale;
+    placeObject(aabb, objectPosition, autoScale, scale, autoCenter, objectCenter, objectScale);
+
+    const auto getVertex = [&vertices](const int index)
+    {
+        const float *v = getAttribute(vertices, index, 3);
+        return make_vec3f(v[0], v[1], v[2]);
+    };
+    const auto getNormal = [&normals](const int index)
+    {
+        const float *n = getAttribute(normals, index, 3);
+        return make_vec3f(n[0], n[1], n[2]);
+    };
+    const auto getTextureCoordinates = [&textureCoordinates](const int index)
+    {
+        const float *t = getAttribute(textureCoordinates, index, 2);
+        return make_vec2f(t[0], t[1]);
+    };
+
+    // Apply group and material statements in file order. Faces that are not
+    // plain triangles (lights, spheres, indexed meshes) depend on that order and
+    // are processed on the way, plain triangles are added in parallel afterwards
+    ObjState state;
+    state.material = materialId;
+    state.light = false;
+    int sketchupMaterial(MATERIAL_NONE);
+    std::vector<vec4f> solrVertices;
+    std::string component;
+    // Models with lights are not shared, their lights are not part of the mesh
+    const bool shared = indexed && uniformScale && !hasLights;
+    const bool visitFaces = allSpheres || indexed || hasLights;
+    IndexedMesh mesh;
+    for (int c = 0; c < nbChunks; ++c)
+    {
+        ObjChunk &chunk = chunks[c];
+        chunk.entry = state;
+        chunk.states.resize(chunk.statements.size());
+        size_t f = 0;
+        for (size_t s = 0; s <= chunk.statements.size(); ++s)
+        {
+            const size_t lastFace = (s < chunk.statements.size()) ? chunk.statements[s].face : chunk.faces.size();
+            for (; visitFaces && f < lastFace; ++f)
             {
-                if (loadMaterials && line.find("mtllib") != std::string::npos)
+                const ObjFace &objFace = chunk.faces[f];
+                if (objFace.nbCorners < 3)
+                    continue;
+
+                std::vector<vec4i> face(objFace.nbCorners);
+                for (size_t i = 0; i < face.size(); ++i)
                 {
-                    // Load materials
-                    std::string materialFileName = line.substr(7);
-                    std::string folder = noExtFilename.substr(0, noExtFilename.rfind('/'));
-                    materialFileName = folder + '/' + materialFileName;
-                    loadMaterialsFromFile(materialFileName, materials, kernel, materialId);
+                    const int *corner = &chunk.corners[3 * (objFace.firstCorner + i)];
+                    face[i] = make_vec4i(corner[0], corner[1], corner[2]);
                 }
-                if (line[0] == 'v')
+
+                const int material = state.material;
+                if (indexed && !state.light)
                 {
-                    // Vertices
-                    vec3f vertex = make_vec3f();
-                    std::string value("");
-
-                    size_t i(1);
-                    int item(0);
-                    char previousChar = line[0];
-                    while (i < line.length() && item < 4)
+                    // Quads are split into two triangles sharing their diagonal
+                    const int corners[2][3] = {{0, 1, 2}, {3, 2, 0}};
+                    const int nbTriangles = (face.size() == 4) ? 2 : 1;
+                    for (int t = 0; t < nbTriangles; ++t)
                     {
-                        if (line[i] == ' ' && previousChar != ' ')
-                        {
-                            switch (item)
-                            {
-                            case 1:
-                                vertex.x = static_cast<float>(atof(value.c_str()));
-                                break;
-                            case 2:
-                                vertex.y = static_cast<float>(atof(value.c_str()));
-                                break;
-                            case 3:
-                                vertex.z = static_cast<float>(atof(value.c_str()));
-                                break;
-                            }
-                            ++item;
-                            value = "";
-                        }
-                        else
+                        int triangle[3];
+                        for (int i = 0; i < 3; ++i)
                         {
-                            value += line[i];
+                            const vec4i &corner = face[corners[t][i]];
+                            const vec3f v = getVertex(corner.x);
+                            const vec3f vertex =
+                                shared ? v
+                                       : make_vec3f(objectPosition.x + objectScale.x * (-objectCenter.x + v.x),
+                                                    objectPosition.y + objectScale.y * (-objectCenter.y + v.y),
+                                                    objectPosition.z + objectScale.z * (-objectCenter.z + v.z));
+                            triangle[i] = weldCorner(mesh, corner, vertex, getNormal(corner.z),
+                                                     getTextureCoordinates(corner.y));
                         }
-
-                        previousChar = line[i];
-                        ++i;
+                        mesh.triangles.push_back(make_vec4i(triangle[0], triangle[1], triangle[2], material));
                     }
+                    continue;
+                }
 
-                    // Process last element
-                    if (value.length() != 0)
-                    {
-                        switch (item)
-                        {
-                        case 1:
-                            vertex.x = static_cast<float>(atof(value.c_str()));
-                            break;
-                        case 2:
-                            vertex.y = static_cast<float>(atof(value.c_str()));
-                            break;
-                        case 3:
-                            vertex.z = static_cast<float>(atof(value.c_str()));
-                            break;
-                        }
-                    }
+                if (!allSpheres && !state.light)
+                    continue;
 
-                    if (line[1] == 'n')
-                    {
-                        // Normals
-                        vertex.z = -vertex.z;
-                        normals[index_normals] = vertex;
-                        ++index_normals;
-                    }
-                    else if (line[1] == 't')
-                    {
-                        vec2f texCoords = make_vec2f(vertex.x, vertex.y);
+                vec3f v[3];
+                for (int i = 0; i < 3; ++i)
+                    v[i] = getVertex(face[i].x);
+                vec4f sphereCenter;
+                sphereCenter.x = (v[0].x + v[1].x + v[2].x) / 3.f;
+                sphereCenter.y = (v[0].y + v[1].y + v[2].y) / 3.f;
+                sphereCenter.z = (v[0].z + v[1].z + v[2].z) / 3.f;
 
-                        // Texture coordinates
-                        if (texCoords.x < 0.f)
-                        {
-                            int Xa = static_cast<int>(fabs(texCoords.x));
-                            float Xb = fabs(texCoords.x) - Xa;
-                            texCoords.x = Xb;
-                        }
+                if (state.light)
+                {
+                    solrVertices.push_back(sphereCenter);
+                    continue;
+                }
 
-                        if (texCoords.y < 0.f)
-                        {
-                            int Ya = static_cast<int>(fabs(texCoords.y));
-                            float Yb = fabs(texCoords.y) - Ya;
-                            texCoords.y = Yb;
-                        }
+                vec4f sphereRadius[3];
+                for (int i = 0; i < 3; ++i)
+                {
+                    sphereRadius[i].x = (sphereCenter.x - v[i].x);
+                    sphereRadius[i].y = (sphereCenter.y - v[i].y);
+                    sphereRadius[i].z = (sphereCenter.z - v[i].z);
+                }
+                vec4f size;
+                size.x = std::max(sphereRadius[0].x, std::max(sphereRadius[1].x, sphereRadius[2].x));
+                size.y = std::max(sphereRadius[0].y, std::max(sphereRadius[1].y, sphereRadius[2].y));
+                size.z = std::max(sphereRadius[0].z, std::max(sphereRadius[1].z, sphereRadius[2].z));
+
+                int nbPrimitives = kernel.addPrimitive(ptEllipsoid);
+                kernel.setPrimitive(nbPrimitives, objectPosition.x + objectScale.x * (-objectCenter.x + sphereCenter.x),
+                                    objectPosition.y + objectScale.y * (-objectCenter.y + sphereCenter.y),
+                                    objectPosition.z + objectScale.z * (-objectCenter.z + sphereCenter.z),
+                                    objectScale.x * size.x, objectScale.y * size.y, objectScale.z * size.z, material);
+                kernel.setPrimitiveBellongsToModel(nbPrimitives, true);
+                kernel.setPrimitiveTextureCoordinates(nbPrimitives, getTextureCoordinates(face[0].y),
+                                                      getTextureCoordinates(face[1].y),
+                                                      getTextureCoordinates(face[2].y));
+                kernel.setPrimitiveNormals(nbPrimitives, getNormal(face[0].z), getNormal(face[1].z),
+                                           getNormal(face[2].z));
+
+                if (face.size() == 4)
+                {
+                    const vec3f v3 = getVertex(face[3].x);
+                    sphereCenter.x = (v3.x + v[2].x + v[0].x) / 3.f;
+                    sphereCenter.y = (v3.y + v[2].y + v[0].y) / 3.f;
+                    sphereCenter.z = (v3.z + v[2].z + v[0].z) / 3.f;
+                    const float radius = 100.f;
+
+                    nbPrimitives = kernel.addPrimitive(ptSphere);
+                    kernel.setPrimitive(nbPrimitives,
+                                        objectPosition.x + objectScale.x * (-objectCenter.x + sphereCenter.x),
+                                        objectPosition.y + objectScale.y * (-objectCenter.y + sphereCenter.y),
+                                        objectPosition.z + objectScale.z * (-objectCenter.z + sphereCenter.z), radius,
+                                        0.f, 0.f, material);
+                    kernel.setPrimitiveBellongsToModel(nbPrimitives, true);
+                    kernel.setPrimitiveTextureCoordinates(nbPrimitives, getTextureCoordinates(face[3].y),
+                                                          getTextureCoordinates(face[2].y),
+                                                          getTextureCoordinates(face[0].y));
+                    kernel.setPrimitiveNormals(nbPrimitives, getNormal(face[3].z), getNormal(face[2].z),
+                                               getNormal(face[0].z));
+                }
+            }
+
+            if (s == chunk.statements.size())
+                break;
 
-                        textureCoordinates[index_textureCoordinates] = texCoords;
-                        ++index_textureCoordinates;
+            const ObjStatement &statement = chunk.statements[s];
+            if (statement.type == ostGroup)
+            {
+                // Compoment
+                state.light = (statement.value.find("SoL_R") != std::string::npos);
+                if (state.light)
+                {
+                    if (statement.value != component)
+                    {
+                        addLightComponent(kernel, solrVertices, objectPosition, objectCenter, objectScale,
+                                          sketchupMaterial, aabb);
                     }
-                    else
+                    component = statement.value;
+                }
+            }
+            else
+            {
+                if (materials.find(statement.value) != materials.end())
+                {
+                    MaterialMTL &m = materials[statement.value];
+                    state.material = m.index;
+                    if (state.light)
                     {
-                        // vec4f
-                        if (line[1] == ' ')
-                        {
-                            vertex.z = -vertex.z;
-                            vertices[index_vertices] = vertex;
-                            ++index_vertices;
-
-                            // min
-                            aabb.parameters[0].x = (vertex.x < aabb.parameters[0].x) ? vertex.x : aabb.parameters[0].x;
-                            aabb.parameters[0].y = (vertex.y < aabb.parameters[0].y) ? vertex.y : aabb.parameters[0].y;
-                            aabb.parameters[0].z = (vertex.z < aabb.parameters[0].z) ? vertex.z : aabb.parameters[0].z;
-
-                            // max
-                            aabb.parameters[1].x = (vertex.x > aabb.parameters[1].x) ? vertex.x : aabb.parameters[1].x;
-                            aabb.parameters[1].y = (vertex.y > aabb.parameters[1].y) ? vertex.y : aabb.parameters[1].y;
-                            aabb.parameters[1].z = (vertex.z > aabb.parameters[1].z) ? vertex.z : aabb.parameters[1].z;
-                        }
+                        LOG_INFO(1, "Sketchup Material " << state.material);
+                        sketchupMaterial = state.material;
                     }
                 }
+                else
+                    LOG_ERROR("Unknown Material " << statement.value);
             }
+            chunk.states[s] = state;
         }
-        file.close();
     }
 
-    if (checkInAABB)
-    {
-        if (aabb.parameters[0].x < inAABB.parameters[0].x)
-            return objectSize;
-        if (aabb.parameters[0].y < inAABB.parameters[0].y)
-            return objectSize;
-        if (aabb.parameters[0].z < inAABB.parameters[0].z)
-            return objectSize;
-
-        if (aabb.parameters[1].x > inAABB.parameters[1].x)
-            return objectSize;
-        if (aabb.parameters[1].y > inAABB.parameters[1].y)
-            return objectSize;
-        if (aabb.parameters[1].z > inAABB.parameters[1].z)
-            return objectSize;
-    }
+    // Remaining SoL-R lights
+    if (solrVertices.size() != 0)
+        addLightComponent(kernel, solrVertices, objectPosition, objectCenter, objectScale, sketchupMaterial, aabb);
 
-    // Scale object
-    vec4f objectCenter = objectPosition;
-    vec4f objectScale = scale;
-    if (autoScale)
+    if (!mesh.triangles.empty())
     {
-        float os = std::max(aabb.parameters[1].x - aabb.parameters[0].x,
-                            std::max(aabb.parameters[1].y - aabb.parameters[0].y,
-                                     aabb.parameters[1].z - aabb.parameters[0].z));
-        objectScale.x = scale.x / os;
-        objectScale.y = scale.y / os;
-        objectScale.z = scale.z / os;
-
-        if (autoCenter)
+        // Faces of shared meshes are in the space of the file, the others are
+        // already in world space and referenced by a single instance
+        const int meshId = kernel.addIndexedMesh(mesh.vertices, mesh.normals, mesh.textureCoordinates,
+                                                 mesh.triangles);
+        if (meshId != -1)
         {
-            // Center align object
-            objectCenter.x = (aabb.parameters[0].x + aabb.parameters[1].x) / 2.f;
-            objectCenter.y = (aabb.parameters[0].y + aabb.parameters[1].y) / 2.f;
-            objectCenter.z = (aabb.parameters[0].z + aabb.parameters[1].z) / 2.f;
+            int instance;
+            if (shared)
+            {
+                // The instance is placed from the bounds of the mesh, as when the model is loaded again
+                kernel.setMeshName(meshId, meshName.str());
+                kernel.getMeshBounds(meshId, aabb.parameters[0], aabb.parameters[1]);
+                placeObject(aabb, objectPosition, autoScale, scale, autoCenter, objectCenter, objectScale);
+                instance = addModelInstance(kernel, meshId, aabb, objectPosition, autoScale, scale, autoCenter,
+                                            objectSize);
+            }
+            else
+                instance = kernel.addInstance(meshId, make_vec3f(), make_vec4f(), 1.f);
+            kernel.setPrimitiveBellongsToModel(instance, true);
+            LOG_INFO(1, " - Indexed mesh....: " << mesh.triangles.size() << " triangles, "
+                                                << mesh.vertices.size() << " vertices");
         }
     }
 
-    // Read faces
-    file.open(modelFilename.c_str());
-    if (file.is_open())
+    // Plain triangles. Quads are split into two triangles sharing their diagonal
+    if (!allSpheres && !indexed)
     {
-        int material(materialId);
-        int sketchupMaterial(MATERIAL_NONE);
-        bool isSketchupLightMaterial(false);
-
-        std::vector<vec4f> solrVertices;
-        std::string component;
-        std::string line;
-        while (file.good() && kernel.getNbActivePrimitives() < NB_MAX_FACES)
+#pragma omp parallel for schedule(dynamic)
+        for (int c = 0; c < nbChunks; ++c)
         {
-            int nbPrimitives(0);
-            std::getline(file, line);
-            line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
-            if (line.length() != 0)
+            ObjChunk &chunk = chunks[c];
+            for (size_t f = 0; f < chunk.faces.size(); ++f)
             {
-                // Compoment
-                if (line.find("g") == 0)
-                {
-                    isSketchupLightMaterial = (line.find("SoL_R") != -1);
-                    if (isSketchupLightMaterial)
-                    {
-                        if (line != component)
-                        {
-                            addLightComponent(kernel, solrVertices, objectPosition, objectCenter, objectScale,
-                                              sketchupMaterial, aabb);
-                        }
-                        component = line;
-                    }
-                }
+                const ObjFace &face = chunk.faces[f];
+                const ObjState &faceState = (face.statement == -1) ? chunk.entry : chunk.states[face.statement];
+                if (face.nbCorners >= 3 && !faceState.light)
+                    chunk.nbTriangles += (face.nbCorners == 4) ? 2 : 1;
+            }
+        }
 
-                if (line.find("usemtl") == 0 && line.length() > 7)
-                {
-                    std::string value = line.substr(7);
-                    if (materials.find(value) != materials.end())
-                    {
-                        MaterialMTL &m = materials[value];
-                        material = m.index;
-                        if (isSketchupLightMaterial)
-                        {
-                            LOG_INFO(1, "Sketchup Material " << material);
-                            sketchupMaterial = material;
-                        }
-                    }
-                    else
-                        LOG_ERROR("Unknown Material " << value);
-                }
+        std::vector<float> batchVertices;
+        std::vector<float> batchNormals;
+        std::vector<float> batchTextureCoordinates;
+        std::vector<int> batchMaterials;
+        for (int first = 0; first < nbChunks;)
+        {
+            // Consecutive chunks are resolved together, up to OBJ_TRIANGLE_BATCH triangles
+            int last = first;
+            size_t nbTriangles = 0;
+            std::vector<size_t> batchOffsets;
+            while (last < nbChunks && (last == first || nbTriangles + chunks[last].nbTriangles <= OBJ_TRIANGLE_BATCH))
+            {
+                batchOffsets.push_back(nbTriangles);
+                nbTriangles += chunks[last].nbTriangles;
+                ++last;
+            }
 
-                if (line[0] == 'f')
+            batchVertices.resize(9 * nbTriangles);
+            batchNormals.resize(9 * nbTriangles);
+            batchTextureCoordinates.resize(6 * nbTriangles);
+            batchMaterials.resize(nbTriangles);
+#pragma omp parallel for schedule(dynamic)
+            for (int c = first; c < last; ++c)
+            {
+                const ObjChunk &chunk = chunks[c];
+                size_t t = batchOffsets[c - first];
+                for (size_t f = 0; f < chunk.faces.size(); ++f)
                 {
-                    std::string value("");
-
-                    std::vector<vec4i> face;
-                    size_t i(1);
-                    char previousChar = line[0];
-                    while (i < line.length())
+                    const ObjFace &face = chunk.faces[f];
+                    const ObjState &faceState = (face.statement == -1) ? chunk.entry : chunk.states[face.statement];
+                    if (face.nbCorners < 3 || faceState.light)
+                        continue;
+
+                    const int corners[2][3] = {{0, 1, 2}, {3, 2, 0}};
+                    const int nbTriangles = (face.nbCorners == 4) ? 2 : 1;
+                    for (int i = 0; i < nbTriangles; ++i, ++t)
                     {
-                        if (line[i] != ' ')
-                            value += line[i];
-                        if (i == (line.length() - 1) || (line[i] == ' ' && previousChar != ' '))
-                            if (value.length() != 0)
-                            {
-                                vec4i v = readFace(value);
-                                face.push_back(v);
-                                value = "";
-                            }
-
-                        previousChar = line[i];
-                        ++i;
-                    }
-
-                    int f(0);
-                    if (allSpheres || isSketchupLightMaterial)
-                    {
-                        vec4f sphereCenter;
-                        sphereCenter.x =
-                            (vertices[face[f].x].x + vertices[face[f + 1].x].x + vertices[face[f + 2].x].x) / 3.f;
-                        sphereCenter.y =
-                            (vertices[face[f].x].y + vertices[face[f + 1].x].y + vertices[face[f + 2].x].y) / 3.f;
-                        sphereCenter.z =
-                            (vertices[face[f].x].z + vertices[face[f + 1].x].z + vertices[face[f + 2].x].z) / 3.f;
-
-                        vec4f sphereRadius[3];
-                        for (int i = 0; i < 3; ++i)
+                        for (int j = 0; j < 3; ++j)
                         {
-                            sphereRadius[i].x = (sphereCenter.x - vertices[face[f + i].x].x);
-                            sphereRadius[i].y = (sphereCenter.y - vertices[face[f + i].x].y);
-                            sphereRadius[i].z = (sphereCenter.z - vertices[face[f + i].x].z);
-                        }
-                        vec4f s;
-                        s.x = std::max(sphereRadius[0].x, std::max(sphereRadius[1].x, sphereRadius[2].x));
-                        s.y = std::max(sphereRadius[0].y, std::max(sphereRadius[1].y, sphereRadius[2].y));
-                        s.z = std::max(sphereRadius[0].z, std::max(sphereRadius[1].z, sphereRadius[2].z));
-
-                        if (isSketchupLightMaterial)
-                            solrVertices.push_back(sphereCenter);
-                        else
-                        {
-                            nbPrimitives = kernel.addPrimitive(ptEllipsoid);
-                            kernel.setPrimitive(nbPrimitives,
-                                                objectPosition.x + objectScale.x * (-objectCenter.x + sphereCenter.x),
-                                                objectPosition.y + objectScale.y * (-objectCenter.y + sphereCenter.y),
-                                                objectPosition.z + objectScale.z * (-objectCenter.z + sphereCenter.z),
-                                                objectScale.x * s.x, objectScale.y * s.y, objectScale.z * s.z,
-                                                material);
-                            kernel.setPrimitiveBellongsToModel(nbPrimitives, true);
+                            const int *corner = &chunk.corners[3 * (face.firstCorner + corners[i][j])];
+                            const float *v = getAttribute(vertices, corner[0], 3);
+                            float *vertex = &batchVertices[9 * t + 3 * j];
+                            vertex[0] = objectPosition.x + objectScale.x * (-objectCenter.x + v[0]);
+                            vertex[1] = objectPosition.y + objectScale.y * (-objectCenter.y + v[1]);
+                            vertex[2] = objectPosition.z + objectScale.z * (-objectCenter.z + v[2]);
+                            memcpy(&batchTextureCoordinates[6 * t + 2 * j],
+                                   getAttribute(textureCoordinates, corner[1], 2), 2 * sizeof(float));
+                            memcpy(&batchNormals[9 * t + 3 * j], getAttribute(normals, corner[2], 3),
+                                   3 * sizeof(float));
                         }
-                    }
-                    else
-                    {
-                        nbPrimitives = kernel.addPrimitive(ptTriangle);
-                        kernel.setPrimitive(
-                            nbPrimitives, objectPosition.x + objectScale.x * (-objectCenter.x + vertices[face[f].x].x),
-                            objectPosition.y + objectScale.y * (-objectCenter.y + vertices[face[f].x].y),
-                            objectPosition.z + objectScale.z * (-objectCenter.z + vertices[face[f].x].z),
-                            objectPosition.x + objectScale.x * (-objectCenter.x + vertices[face[f + 1].x].x),
-                            objectPosition.y + objectScale.y * (-objectCenter.y + vertices[face[f + 1].x].y),
-                            objectPosition.z + objectScale.z * (-objectCenter.z + vertices[face[f + 1].x].z),
-                            objectPosition.x + objectScale.x * (-objectCenter.x + vertices[face[f + 2].x].x),
-                            objectPosition.y + objectScale.y * (-objectCenter.y + vertices[face[f + 2].x].y),
-                            objectPosition.z + objectScale.z * (-objectCenter.z + vertices[face[f + 2].x].z), 0.f, 0.f,
-                            0.f, material);
-                        kernel.setPrimitiveBellongsToModel(nbPrimitives, true);
-                    }
-
-                    // Texture coordinates
-                    kernel.setPrimitiveTextureCoordinates(nbPrimitives, textureCoordinates[face[f].y],
-                                                          textureCoordinates[face[f + 1].y],
-                                                          textureCoordinates[face[f + 2].y]);
-
-                    // Normals
-                    kernel.setPrimitiveNormals(nbPrimitives, normals[face[f].z], normals[face[f + 1].z],
-                                               normals[face[f + 2].z]);
-
-                    if (face.size() == 4)
-                    {
-                        // LOG_ERROR("Only triangles are currently supported");
-                        if (allSpheres)
-                        {
-                            vec4f sphereCenter;
-                            sphereCenter.x =
-                                (vertices[face[f + 3].x].x + vertices[face[f + 2].x].x + vertices[face[f].x].x) / 3.f;
-                            sphereCenter.y =
-                                (vertices[face[f + 3].x].y + vertices[face[f + 2].x].y + vertices[face[f].x].y) / 3.f;
-                            sphereCenter.z =
-                                (vertices[face[f + 3].x].z + vertices[face[f + 2].x].z + vertices[face[f].x].z) / 3.f;
-
-                            vec4f sphereRadius;
-                            sphereRadius.x = sphereCenter.x - vertices[face[f].x].x;
-                            sphereRadius.y = sphereCenter.y - vertices[face[f].x].y;
-                            sphereRadius.z = sphereCenter.z - vertices[face[f].x].z;
-
-                            float radius =
-                                100.f; // objectScale*sqrt(sphereRadius.x*sphereRadius.x+sphereRadius.y*sphereRadius.y+sphereRadius.z*sphereRadius.z);
-
-                            nbPrimitives = kernel.addPrimitive(ptSphere);
-                            kernel.setPrimitive(nbPrimitives,
-                                                objectPosition.x + objectScale.x * (-objectCenter.x + sphereCenter.x),
-                                                objectPosition.y + objectScale.y * (-objectCenter.y + sphereCenter.y),
-                                                objectPosition.z + objectScale.z * (-objectCenter.z + sphereCenter.z),
-                                                radius, 0.f, 0.f, material);
-                            kernel.setPrimitiveBellongsToModel(nbPrimitives, true);
-                        }
-                        else
-                        {
-                            nbPrimitives = kernel.addPrimitive(ptTriangle);
-                            kernel.setPrimitive(
-                                nbPrimitives,
-                                objectPosition.x + objectScale.x * (-objectCenter.x + vertices[face[f + 3].x].x),
-                                objectPosition.y + objectScale.y * (-objectCenter.y + vertices[face[f + 3].x].y),
-                                objectPosition.z + objectScale.z * (-objectCenter.z + vertices[face[f + 3].x].z),
-                                objectPosition.x + objectScale.x * (-objectCenter.x + vertices[face[f + 2].x].x),
-                                objectPosition.y + objectScale.y * (-objectCenter.y + vertices[face[f + 2].x].y),
-                                objectPosition.z + objectScale.z * (-objectCenter.z + vertices[face[f + 2].x].z),
-                                objectPosition.x + objectScale.x * (-objectCenter.x + vertices[face[f].x].x),
-                                objectPosition.y + objectScale.y * (-objectCenter.y + vertices[face[f].x].y),
-                                objectPosition.z + objectScale.z * (-objectCenter.z + vertices[face[f].x].z), 0.f, 0.f,
-                                0.f, material);
-                            kernel.setPrimitiveBellongsToModel(nbPrimitives, true);
-                        }
-                        // Texture coordinates
-                        kernel.setPrimitiveTextureCoordinates(nbPrimitives, textureCoordinates[face[f + 3].y],
-                                                              textureCoordinates[face[f + 2].y],
-                                                              textureCoordinates[face[f].y]);
-                        kernel.setPrimitiveNormals(nbPrimitives, normals[face[f + 3].z], normals[face[f + 2].z],
-                                                   normals[face[f].z]);
+                        batchMaterials[t] = faceState.material;
                     }
                 }
             }
+            if (nbTriangles != 0)
+                kernel.addTriangles(nbTriangles, batchVertices.data(), batchNormals.data(),
+                                    batchTextureCoordinates.data(), batchMaterials.data(), materialId, true);
+            first = last;
         }
-        file.close();
-
-        // Remaining SoL-R lights
-        if (solrVertices.size() != 0)
-            addLightComponent(kernel, solrVertices, objectPosition, objectCenter, objectScale, sketchupMaterial, aabb);
     }
 
     objectSize.x = objectScale.x * (aabb.parameters[1].x - aabb.parameters[0].x);
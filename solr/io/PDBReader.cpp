@@ -233,6 +233,9 @@ struct Atom
 #endif
 #ifdef USE_OPENCL
     vec4f position;
+#endif
+#ifdef USE_CPU
+    vec4f position;
 #endif
     int materialId;
     int chainId;
@@ -568,6 +571,10 @@ vec4f PDBReader::loadAtomsFromFile(const std::string &filename, GPUKernel &cudaK
     vec4f center;
 #endif
 
+#ifdef USE_CPU
+    vec4f center;
+#endif
+
     center.x = (minPos.x + maxPos.x) / 2.f;
     center.y = (minPos.y + maxPos.y) / 2.f;
     center.z = (minPos.z + maxPos.z) / 2.f;
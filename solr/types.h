@@ -22,6 +22,7 @@
 #define TYPES_H
 
 #include <defines.h>
+#include <stddef.h>
 #include "Consts.h"
 #include <vector>
 #include <map>
@@ -51,6 +52,39 @@ inline vec2f make_vec2f(const float x = 0.f, const float y = 0.f) { return{ { x,
 inline vec3f make_vec3f(const float x = 0.f, const float y = 0.f, const float z = 0.f) { return{ { x, y, z } }; }
 inline vec4f make_vec4f(const float x = 0.f, const float y = 0.f, const float z = 0.f, const float w = 0.f) { return{ {x, y, z, w } }; }
 
+#define __ALIGN16__
+#elif defined(USE_CPU)
+// Same layout as the OpenCL types, 3 component vectors are padded to 4
+struct vec2f
+{
+    float x, y;
+};
+struct alignas(16) vec4f
+{
+    float x, y, z, w;
+};
+struct vec2i
+{
+    int x, y;
+};
+struct alignas(16) vec4i
+{
+    int x, y, z, w;
+};
+
+typedef float vec1f;
+typedef vec4f vec3f;
+typedef int vec1i;
+typedef vec4i vec3i;
+typedef vec4i PrimitiveXYIdBuffer;
+
+inline vec2i make_vec2i(const int x = 0, const int y = 0) { return{ x, y }; }
+inline vec3i make_vec3i(const int x = 0, const int y = 0, const int z = 0) { return{ x, y, z, 0 }; }
+inline vec4i make_vec4i(const int x = 0, const int y = 0, const int z = 0, const int w = 0) { return{ x, y, z, w }; }
+inline vec2f make_vec2f(const float x = 0.f, const float y = 0.f) { return{ x, y }; }
+inline vec3f make_vec3f(const float x = 0.f, const float y = 0.f, const float z = 0.f) { return{ x, y, z, 0.f }; }
+inline vec4f make_vec4f(const float x = 0.f, const float y = 0.f, const float z = 0.f, const float w = 0.f) { return{ x, y, z, w }; }
+
 #define __ALIGN16__
 #else
 #include <vector_types.h>
@@ -109,10 +143,28 @@ enum CameraType
 
 enum FrameBufferType
 {
-    ftRGB = 0, // RGB 24bit
-    ftBGR = 1  // BGR 24bit
+    ftRGB = 0,  // RGB 24bit
+    ftBGR = 1,  // BGR 24bit
+    ftRGBA = 2, // RGBA 32bit, one aligned store per pixel
+    ftBGRA = 3  // BGRA 32bit, one aligned store per pixel
 };
 
+// Bytes per pixel of a frame buffer. The 32 bit layouts read back 4/3 of the
+// bytes of the 24 bit ones: they are only meant for hosts consuming 32 bit
+// pixels as they are (GL_RGBA textures, Delphi 32 bit bitmaps), which would
+// otherwise expand every frame on the CPU. RGB remains the default
+inline int frameBufferDepth(const FrameBufferType frameBufferType)
+{
+    return (frameBufferType == ftRGBA || frameBufferType == ftBGRA) ? gMaxColorDepth : gColorDepth;
+}
+
+// Device memory of the frame buffers of a pixel: 32 bit bitmap, post
+// processing buffer and primitive IDs
+inline size_t frameBuffersPixelSize()
+{
+    return gMaxColorDepth * sizeof(BitmapBuffer) + sizeof(PostProcessingBuffer) + sizeof(PrimitiveXYIdBuffer);
+}
+
 enum AdvancedIllumination
 {
     aiNone = 0,
@@ -203,7 +255,8 @@ enum PrimitiveType
     ptEnvironment = 9,
     ptEllipsoid = 10,
     ptQuad = 11,
-    ptCone = 12
+    ptCone = 12,
+    ptInstance = 13 // Instance of a mesh, see GPUKernel::addInstance
 };
 
 // Material structure
@@ -229,7 +282,7 @@ struct __ALIGN16__ Material
     // w: Wireframe Width
     vec4i textureMapping;        // x: U padding
                                  // y: V padding
-                                 // z: Texture ID (Deprecated)
+                                 // z: Number of mip levels of the maps
                                  // w: Texture color depth
     vec4i textureOffset;         // x: Offset in the diffuse map
                                  // y: Offset in the normal map
@@ -242,11 +295,11 @@ struct __ALIGN16__ Material
     vec4i advancedTextureOffset; // x: Reflection map
                                  // y: Transparency map
                                  // z: Ambiant Occulusion
-                                 // w: not used
+                                 // w: Compression of the maps, 2 bits per TextureType
     vec4i advancedTextureIds;    // x: Reflection map
                                  // y: Transparency map
                                  // z: Ambiant Occulusion
-                                 // w: not used
+                                 // w: Color depth of the maps, 4 bits per TextureType
     vec2f mappingOffset;         // Texture mapping offsets based on sceneInfo.timestamp
 };
 
@@ -260,6 +313,27 @@ struct __ALIGN16__ BoundingBox
 };
 typedef std::map<size_t, BoundingBox> BoundingBoxes;
 
+// Quantized Bounding Box Structures (see GPUKernel::setQuantizedBVH)
+// Corners are stored on the grid of a frame of reference, defined by the
+// decoded corners of an ancestor box
+struct QuantizedBoundingBox8
+{
+    unsigned char lower[4]; // w: Frame of reference of the corners
+    unsigned char upper[4]; // w: Frame defined by the box for its descendants
+    vec1i nbPrimitives;
+    vec1i startIndex;
+    vec2i indexForNextBox;
+};
+
+struct QuantizedBoundingBox16
+{
+    unsigned short lower[4]; // w: Frame of reference of the corners
+    unsigned short upper[4]; // w: Frame defined by the box for its descendants
+    vec1i nbPrimitives;
+    vec1i startIndex;
+    vec2i indexForNextBox;
+};
+
 // Primitive Structure
 struct __ALIGN16__ Primitive
 {
@@ -286,6 +360,30 @@ struct __ALIGN16__ Primitive
 };
 typedef std::map<size_t, Primitive> Primitives;
 
+// Primitives are sent to the OpenCL and CPU engines as two streams. The
+// intersection data is the only data read when traversing the scene
+struct __ALIGN16__ CompactPrimitive
+{
+    vec3f p0;         // First vertex, center of spheres
+    vec3f e1;         // p1 - p0, p1 for instances
+    vec3f e2;         // p2 - p0, p2 for instances
+    vec3f size;       // Size( x,y,z ), x is the radius of spheres
+    vec1i type;       // See PrimitiveType
+    vec1i index;      // Index of the primitive in the CPU container
+    vec1i materialId; // Material ID
+};
+
+// Shading data, only read for the closest intersection
+struct __ALIGN16__ ShadingPrimitive
+{
+    vec3f n0;
+    vec3f n1;
+    vec3f n2;
+    vec2f vt0;
+    vec2f vt1;
+    vec2f vt2;
+};
+
 enum TextureType
 {
     tex_diffuse = 0,
@@ -297,16 +395,59 @@ enum TextureType
     tex_transparent
 };
 
+// Texel storage of textures. Compressed textures are made of blocks of 4x4
+// texels: 8 bytes for BC1 (RGB), 16 bytes for BC3 (RGBA)
+enum TextureCompression
+{
+    tc_none = 0,
+    tc_bc1,
+    tc_bc3
+};
+
 // Texture information structure
 struct __ALIGN16__ TextureInfo
 {
-    unsigned char *buffer; // Pointer to the texture
-    vec1i offset;          // Offset of the texture in the global texture buffer (the one
-                           // that will be transfered to the GPU)
-    vec3i size;            // Size of the texture
-    TextureType type;      // Texture type (diffuse, normal, bump, etc.)
+    unsigned char *buffer;          // Pointer to the texture
+    vec1i offset;                   // Offset of the texture in the global texture buffer (the one
+                                    // that will be transfered to the GPU)
+    vec3i size;                     // Size of the texture
+    TextureType type;               // Texture type (diffuse, normal, bump, etc.)
+    vec1i levels;                   // Number of mip levels stored one after the other in
+                                    // the buffer, 0 or 1 when there is no mip chain
+    TextureCompression compression; // Texel storage, see TextureCompression
 };
 
+// Size of a mip level of a texture
+inline size_t textureLevelSize(const int width, const int height, const int depth,
+                               const TextureCompression compression)
+{
+    const size_t blocks = static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4);
+    switch (compression)
+    {
+    case tc_bc1:
+        return blocks * 8;
+    case tc_bc3:
+        return blocks * 16;
+    default:
+        return static_cast<size_t>(width) * height * depth;
+    }
+}
+
+// Size of a texture buffer, mip chain included
+inline size_t textureBufferSize(const TextureInfo &textureInfo)
+{
+    size_t size = 0;
+    int width = textureInfo.size.x;
+    int height = textureInfo.size.y;
+    for (int level = 0; level < textureInfo.levels || level == 0; ++level)
+    {
+        size += textureLevelSize(width, height, textureInfo.size.z, textureInfo.compression);
+        width = (width > 1) ? width / 2 : 1;
+        height = (height > 1) ? height / 2 : 1;
+    }
+    return size;
+}
+
 // Post processing types
 // Effects are based on the PostProcessingBuffer
 enum PostProcessingType
@@ -328,4 +469,64 @@ struct __ALIGN16__ PostProcessingInfo
     vec1i param3; // Parameter role depends on post processing type
 };
 
+// Shading of an intersection, split around the shadow ray cast towards the
+// lamp (wavefront rendering of the OpenCL engine)
+struct __ALIGN16__ ShadingSample
+{
+    vec4f origin;            // Origin of the ray that hit the intersection
+    vec4f intersectionColor; // Color of the primitive at the intersection
+    vec4f specular;          // x: Value, y: Power, z: Transparency (specular map)
+    vec4f lampCenter;        // Location of the lamp, randomized for soft shadows
+    vec4f lightRay;          // Normalized direction of the lamp
+    vec1f lambert;           // Lambert term, before shadows are applied
+    vec1f photonEnergy;      // Attenuation of the light with the distance to the lamp
+    vec1f ambientOcclusion;  // Value of the ambient occlusion map
+    vec1i lamp;              // Lamp lighting the intersection, -1 if none
+    vec1i materialId;        // Material of the intersected primitive
+    vec1i constantColor;     // Wireframes and emitting materials are not shaded
+    vec1i shadows;           // A shadow ray has to be cast towards the lamp
+    vec1i padding;
+};
+
+// State of the path of a pixel, stored in device memory by the wavefront
+// rendering of the OpenCL engine (see GPUKernel::setWavefrontRendering). Must
+// be kept in sync with the kernel structure
+struct __ALIGN16__ WavefrontPath
+{
+    Ray ray;                  // Current ray (origin and target)
+    Ray reflectedRay;         // Reflection of the first transparent and reflective material
+    Ray pathTracingRay;       // Global illumination ray, cast from the first intersection
+    vec4f intersection;       // Closest intersection found by the last extension
+    vec4f normal;             // Normal at the closest intersection
+    vec4f areas;              // Areas at the closest intersection (triangles)
+    vec4f latestIntersection; // Previous intersection of the path
+    vec4f closestColor;       // Color of the closest intersection
+    vec4f blinn;              // Specular term of the current iteration
+    vec4f recursiveBlinn;     // Strongest specular term of the path
+    vec4f colorBox;           // Bounding boxes crossed by the path (renderBoxes)
+    vec4f color;              // Colors of the iterations, composed front to back
+    vec4f sampleColor;        // Sum of the antialiasing samples of the pixel
+    ShadingSample shading;    // Shading of the closest intersection
+    vec1f weight;             // Weight of the color of the next iteration
+    vec1f colorWeight;        // Weight of the color being shaded
+    vec1f firstWeight;        // Weight of the color of the first iteration
+    vec1f reflectedWeight;    // Weight of the color of the iteration that spawned the reflected ray
+    vec1f reflectedRatio;     // Reflection rate of the material that spawned the reflected ray
+    vec1f pathTracingRatio;   // Contribution of the global illumination ray
+    vec1f initialRefraction;  // Refraction index of the medium the ray travels through
+    vec1f rayLength;          // Length of the path, for the opacity of transparent materials
+    vec1f opacity;            // Light absorbed by the transparent material being shaded
+    vec1f depth;              // Distance to the first intersection (depth of field)
+    vec1f coneSpread;         // Spread angle of the ray cone of the pixel (texture mip level)
+    vec1i closestPrimitive;   // Primitive of the closest intersection
+    vec1i closestInstance;    // Instance of the closest intersection, -1 if none
+    vec1i currentMaterialId;  // Material of the closest intersection
+    vec1i iteration;          // Number of iterations of the primary stage
+    vec1i reflectedRays;      // Iteration that spawned the reflected ray, -1 if none
+    vec1i shadedIteration;    // Iteration being shaded, -1 for the reflected ray
+    vec1i stage;              // Primary, reflection, global illumination, or done
+    vec1i hit;                // The last extension found an intersection
+    vec1i active;             // The pixel is rendered in the current frame
+};
+
 #endif // TYPES_H